@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Bvh.h"
+#include "Check.h"
+#include "ThreadPool.h"
+
+namespace va {
+namespace test {
+
+namespace {
+struct Mesh {
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> indices;
+};
+
+// Small triangles scattered through a cube, a few big ones across it
+Mesh makeMesh(uint32_t triangles, std::mt19937& rng){
+  std::uniform_real_distribution<float> pos(-10.0f, 10.0f);
+  std::uniform_real_distribution<float> offset(-0.5f, 0.5f);
+  Mesh mesh;
+  for(uint32_t t = 0; t < triangles; ++t){
+    glm::vec3 center(pos(rng), pos(rng), pos(rng));
+    float size = t % 100 == 0 ? 10.0f : 1.0f;
+    for(uint32_t v = 0; v < 3; ++v){
+      mesh.indices.push_back(static_cast<uint32_t>(mesh.positions.size()));
+      mesh.positions.push_back(center
+        + size*glm::vec3(offset(rng), offset(rng), offset(rng)));
+    }
+  }
+  return mesh;
+}
+
+// Moller-Trumbore against every triangle
+RayHit bruteForce(const Mesh& mesh, const Ray& ray){
+  RayHit best;
+  best.t = ray.t_max;
+  for(uint32_t t = 0; t < mesh.indices.size()/3; ++t){
+    const glm::vec3& v0 = mesh.positions[mesh.indices[3*t]];
+    glm::vec3 e1 = mesh.positions[mesh.indices[3*t + 1]] - v0;
+    glm::vec3 e2 = mesh.positions[mesh.indices[3*t + 2]] - v0;
+    glm::vec3 p = glm::cross(ray.direction, e2);
+    float det = glm::dot(e1, p);
+    if(std::fabs(det) < 1e-12f) continue;
+    float inv = 1.0f/det;
+    glm::vec3 s = ray.origin - v0;
+    float u = glm::dot(s, p)*inv;
+    if(u < 0.0f || u > 1.0f) continue;
+    glm::vec3 q = glm::cross(s, e1);
+    float v = glm::dot(ray.direction, q)*inv;
+    if(v < 0.0f || u + v > 1.0f) continue;
+    float dist = glm::dot(e2, q)*inv;
+    if(dist > 0.0f && dist < best.t){
+      best.t = dist;
+      best.triangle = t;
+    }
+  }
+  return best;
+}
+
+std::vector<Ray> makeRays(const Mesh& mesh, uint32_t count,
+  std::mt19937& rng){
+  std::uniform_real_distribution<float> pos(-15.0f, 15.0f);
+  std::uniform_real_distribution<float> dir(-1.0f, 1.0f);
+  const uint32_t triangles = static_cast<uint32_t>(mesh.indices.size()/3);
+  std::vector<Ray> rays(count);
+  for(uint32_t i = 0; i < count; ++i){
+    rays[i].origin = glm::vec3(pos(rng), pos(rng), pos(rng));
+    // Half aimed at a triangle's center so small meshes get hit too
+    glm::vec3 target(0.3f*pos(rng), 0.3f*pos(rng), 0.3f*pos(rng));
+    if(i % 2 == 0){
+      uint32_t t = rng() % triangles;
+      target = (mesh.positions[mesh.indices[3*t]]
+        + mesh.positions[mesh.indices[3*t + 1]]
+        + mesh.positions[mesh.indices[3*t + 2]])/3.0f;
+    }
+    rays[i].direction = target - rays[i].origin;
+    // Axis aligned rays have zeros in the direction
+    if(i % 10 == 1) rays[i].direction = glm::vec3(0.0f, 0.0f, dir(rng));
+    // Ends before or right around the target
+    if(i % 3 == 0) rays[i].t_max = 0.5f + 0.25f*(i % 4);
+  }
+  return rays;
+}
+
+// Counts rays whose hit differs from brute force. The same triangle isn't
+// required, only the same distance: two triangles can cross at a point.
+size_t mismatches(const Bvh& bvh, const Mesh& mesh,
+  const std::vector<Ray>& rays){
+  size_t count = 0;
+  for(const Ray& ray : rays){
+    RayHit expected = bruteForce(mesh, ray);
+    RayHit hit = bvh.intersect(ray);
+    if(hit.hit() != expected.hit()){
+      ++count;
+    }else if(hit.hit()
+      && std::fabs(hit.t - expected.t) > 1e-4f*std::max(1.0f, expected.t)){
+      ++count;
+    }
+  }
+  return count;
+}
+
+void checkOverlap(const Bvh& bvh, const Mesh& mesh, const glm::vec3& lo,
+  const glm::vec3& hi){
+  std::vector<uint32_t> expected;
+  for(uint32_t t = 0; t < mesh.indices.size()/3; ++t){
+    glm::vec3 t_lo = mesh.positions[mesh.indices[3*t]];
+    glm::vec3 t_hi = t_lo;
+    for(uint32_t v = 1; v < 3; ++v){
+      t_lo = glm::min(t_lo, mesh.positions[mesh.indices[3*t + v]]);
+      t_hi = glm::max(t_hi, mesh.positions[mesh.indices[3*t + v]]);
+    }
+    if(t_lo.x <= hi.x && t_hi.x >= lo.x && t_lo.y <= hi.y && t_hi.y >= lo.y
+      && t_lo.z <= hi.z && t_hi.z >= lo.z){
+      expected.push_back(t);
+    }
+  }
+  std::vector<uint32_t> found;
+  bvh.overlap(lo, hi, found);
+  std::sort(found.begin(), found.end());
+  VA_CHECK(found == expected);
+}
+
+void patchFile(const std::string& path, std::streamoff offset,
+  uint32_t value){
+  std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+  file.seekp(offset);
+  file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void files(const Bvh& bvh, const Mesh& mesh, const std::vector<Ray>& rays){
+  const std::string path =
+    (std::filesystem::temp_directory_path() / "va_bvh_test.bvh").string();
+  bvh.save(path);
+  Bvh loaded;
+  loaded.load(path);
+  VA_CHECK(loaded.nodeCount() == bvh.nodeCount());
+  VA_CHECK(loaded.packCount() == bvh.packCount());
+  VA_CHECK(loaded.triangleCount() == bvh.triangleCount());
+  VA_CHECK(mismatches(loaded, mesh, rays) == 0);
+
+  // Magic, version, triangle count and node count come first, then the
+  // root node
+  const std::streamoff root_child = 16 + offsetof(Bvh::Node, child);
+  uint32_t child = 0;
+  {
+    std::ifstream in(path, std::ios::binary);
+    in.seekg(root_child);
+    in.read(reinterpret_cast<char*>(&child), sizeof(child));
+  }
+  VA_CHECK(child != Bvh::EMPTY && !(child & Bvh::LEAF));
+
+  // A child past the end, one pointing back at its node, a pack past the
+  // end
+  for(uint32_t bad : {static_cast<uint32_t>(bvh.nodeCount()), 0u,
+    Bvh::LEAF | static_cast<uint32_t>(bvh.packCount())}){
+    patchFile(path, root_child, bad);
+    Bvh corrupt;
+    VA_CHECK_THROWS(corrupt.load(path));
+    VA_CHECK(corrupt.empty());
+  }
+  patchFile(path, root_child, child);
+  loaded.load(path);
+
+  // A node count larger than the file
+  patchFile(path, 12, 0x7fffffffu);
+  VA_CHECK_THROWS(loaded.load(path));
+  VA_CHECK(loaded.empty());
+
+  std::remove(path.c_str());
+}
+}  // namespace
+
+void bvhTests(){
+  std::mt19937 rng(11);
+  ThreadPool pool(3);
+
+  // Below and above the size where subtrees go to the pool
+  for(uint32_t triangles : {1u, 3u, 4u, 5u, 100u, 6000u}){
+    Mesh mesh = makeMesh(triangles, rng);
+    std::vector<Ray> rays = makeRays(mesh, 2000, rng);
+
+    Bvh serial;
+    serial.build(mesh.positions, mesh.indices, nullptr);
+    VA_CHECK(serial.triangleCount() == triangles);
+    VA_CHECK(mismatches(serial, mesh, rays) == 0);
+
+    Bvh pooled;
+    pooled.build(mesh.positions, mesh.indices, &pool);
+    VA_CHECK(mismatches(pooled, mesh, rays) == 0);
+
+    checkOverlap(pooled, mesh, glm::vec3(-2.0f), glm::vec3(3.0f));
+    checkOverlap(pooled, mesh, glm::vec3(-20.0f), glm::vec3(20.0f));
+    checkOverlap(pooled, mesh, glm::vec3(30.0f), glm::vec3(31.0f));
+
+    if(triangles == 6000) files(pooled, mesh, rays);
+  }
+}
+
+}  // namespace test
+}  // namespace va
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <exception>
+#include <iostream>
+
+namespace va {
+namespace test {
+
+// Failed checks so far, over every suite.
+inline int& failures(){
+  static int count = 0;
+  return count;
+}
+
+inline void fail(const char* file, int line, const char* what){
+  ++failures();
+  std::cerr << file << ":" << line << ": " << what << std::endl;
+}
+
+}  // namespace test
+}  // namespace va
+
+// A failed check is reported and counted, the test carries on so one run
+// shows every broken check.
+#define VA_CHECK(cond) \
+  do{ \
+    if(!(cond)) va::test::fail(__FILE__, __LINE__, #cond); \
+  }while(0)
+
+#define VA_CHECK_THROWS(expr) \
+  do{ \
+    bool thrown_ = false; \
+    try{ expr; }catch(const std::exception&){ thrown_ = true; } \
+    if(!thrown_) \
+      va::test::fail(__FILE__, __LINE__, "no exception from " #expr); \
+  }while(0)
@@ -0,0 +1,177 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Check.h"
+#include "GeometryCodec.h"
+
+namespace va {
+namespace test {
+
+namespace {
+// Smooth positions and normals like a real mesh, plus words of noise
+// (full 32 bit deltas) in the colors.
+std::vector<Vertex> makeVertices(uint32_t count, std::mt19937& rng){
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+  std::vector<Vertex> vertices(count);
+  for(uint32_t i = 0; i < count; ++i){
+    float t = 0.01f*i;
+    vertices[i].pos = glm::vec3(std::cos(t), std::sin(t), 0.001f*i);
+    vertices[i].normal = glm::normalize(glm::vec3(std::cos(t), std::sin(t),
+      0.5f));
+    vertices[i].texCoord = glm::vec2(0.5f, 0.25f*(i % 4));
+    vertices[i].color = glm::vec3(unit(rng), 1.0f, i % 3 ? 0.0f : -unit(rng));
+  }
+  return vertices;
+}
+
+std::vector<uint32_t> makeIndices(uint32_t count, uint32_t vertex_count,
+  std::mt19937& rng){
+  std::vector<uint32_t> indices(count);
+  for(uint32_t i = 0; i < count; ++i){
+    // Mostly nearby vertices, now and then a jump anywhere
+    indices[i] = i % 7 == 0 ? rng() % vertex_count
+      : (i/3 + i % 3) % vertex_count;
+  }
+  return indices;
+}
+
+bool sameVertices(const std::vector<Vertex>& a, const std::vector<Vertex>& b){
+  return a.size() == b.size()
+    && std::memcmp(a.data(), b.data(), a.size()*sizeof(Vertex)) == 0;
+}
+
+bool sameIndices(const std::vector<uint8_t>& decoded, uint32_t index_size,
+  const std::vector<uint32_t>& indices){
+  for(size_t i = 0; i < indices.size(); ++i){
+    uint32_t value = 0;
+    if(index_size == 2){
+      uint16_t half;
+      std::memcpy(&half, &decoded[2*i], 2);
+      value = half;
+    }else{
+      std::memcpy(&value, &decoded[4*i], 4);
+    }
+    if(value != indices[i]) return false;
+  }
+  return true;
+}
+
+void roundTrip(uint32_t vertex_count, uint32_t index_count, std::mt19937& rng){
+  std::vector<Vertex> vertices = makeVertices(vertex_count, rng);
+  std::vector<uint32_t> indices = makeIndices(index_count, vertex_count, rng);
+  EncodedGeometry geometry = encodeGeometry(vertices, indices);
+  VA_CHECK(geometry.vertex_count == vertex_count);
+  VA_CHECK(geometry.index_count == index_count);
+
+  std::vector<Vertex> decoded(vertex_count);
+  decodeVertices(geometry, decoded.data());
+  VA_CHECK(sameVertices(decoded, vertices));
+  std::vector<Vertex> scalar(vertex_count);
+  decodeVerticesScalar(geometry, scalar.data());
+  VA_CHECK(sameVertices(scalar, vertices));
+
+  // 16 bit indices only while every vertex fits
+  for(uint32_t index_size : {2u, 4u}){
+    if(index_size < geometry.indexSize()) continue;
+    std::vector<uint8_t> out(index_count*index_size);
+    decodeIndices(geometry, out.data(), index_size);
+    VA_CHECK(sameIndices(out, index_size, indices));
+    std::fill(out.begin(), out.end(), 0);
+    decodeIndicesScalar(geometry, out.data(), index_size);
+    VA_CHECK(sameIndices(out, index_size, indices));
+  }
+}
+
+void damagedStreams(std::mt19937& rng){
+  std::vector<Vertex> vertices = makeVertices(40, rng);
+  std::vector<uint32_t> indices = makeIndices(33, 40, rng);
+
+  // One index past the last vertex, in the last, partial block
+  std::vector<uint32_t> out_of_range = indices;
+  out_of_range.back() = 40;
+  EncodedGeometry geometry = encodeGeometry(vertices, out_of_range);
+  std::vector<uint32_t> out(indices.size());
+  VA_CHECK_THROWS(decodeIndices(geometry, out.data(), 4));
+  VA_CHECK_THROWS(decodeIndicesScalar(geometry, out.data(), 4));
+
+  geometry = encodeGeometry(vertices, indices);
+  EncodedGeometry cut = geometry;
+  cut.vertices.pop_back();
+  cut.indices.pop_back();
+  std::vector<Vertex> decoded(vertices.size());
+  VA_CHECK_THROWS(decodeVertices(cut, decoded.data()));
+  VA_CHECK_THROWS(decodeVerticesScalar(cut, decoded.data()));
+  VA_CHECK_THROWS(decodeIndices(cut, out.data(), 4));
+  VA_CHECK_THROWS(decodeIndicesScalar(cut, out.data(), 4));
+}
+
+void patchFile(const std::string& path, std::streamoff offset,
+  uint32_t value){
+  std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+  file.seekp(offset);
+  file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void files(std::mt19937& rng){
+  const std::string path =
+    (std::filesystem::temp_directory_path() / "va_codec_test.geo").string();
+  std::vector<Vertex> vertices = makeVertices(100, rng);
+  std::vector<uint32_t> indices = makeIndices(150, 100, rng);
+  EncodedGeometry geometry = encodeGeometry(vertices, indices);
+
+  writeGeometryFile(path, geometry);
+  EncodedGeometry read = readGeometryFile(path);
+  VA_CHECK(read.vertex_count == geometry.vertex_count);
+  VA_CHECK(read.index_count == geometry.index_count);
+  VA_CHECK(read.center == geometry.center);
+  VA_CHECK(read.radius == geometry.radius);
+  VA_CHECK(read.vertices == geometry.vertices);
+  VA_CHECK(read.indices == geometry.indices);
+
+  // Header fields: vertex_count at 12, index_count at 16, the sizes of the
+  // two streams at 36 and 40
+  const uint32_t vertex_bytes =
+    static_cast<uint32_t>(geometry.vertices.size());
+  patchFile(path, 36, 0xfffffff0u);
+  VA_CHECK_THROWS(readGeometryFile(path));
+  patchFile(path, 36, vertex_bytes + 1);
+  VA_CHECK_THROWS(readGeometryFile(path));
+  patchFile(path, 36, vertex_bytes);
+  patchFile(path, 40, 0x7fffffffu);
+  VA_CHECK_THROWS(readGeometryFile(path));
+  patchFile(path, 40, static_cast<uint32_t>(geometry.indices.size()));
+  // More vertices than the stream can hold blocks for
+  patchFile(path, 12, 1u << 30);
+  VA_CHECK_THROWS(readGeometryFile(path));
+  patchFile(path, 12, geometry.vertex_count);
+  VA_CHECK(readGeometryFile(path).vertices == geometry.vertices);
+
+  // Cut short
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+  VA_CHECK_THROWS(readGeometryFile(path));
+
+  std::remove(path.c_str());
+}
+}  // namespace
+
+void geometryCodecTests(){
+  std::mt19937 rng(7);
+  // Partial last blocks, 16 bit and 32 bit indices
+  for(uint32_t count : {1u, 15u, 16u, 17u, 1000u, 70000u}){
+    roundTrip(count, count, rng);
+    roundTrip(count, 3*count + 2, rng);
+  }
+  roundTrip(10, 0, rng);
+
+  damagedStreams(rng);
+  files(rng);
+}
+
+}  // namespace test
+}  // namespace va
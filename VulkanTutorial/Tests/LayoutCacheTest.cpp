@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "Check.h"
+#include "DescriptorAllocator.h"
+
+namespace va {
+namespace test {
+
+namespace {
+VkDescriptorSetLayoutBinding binding(uint32_t number, VkDescriptorType type,
+  VkShaderStageFlags stages){
+  VkDescriptorSetLayoutBinding b{};
+  b.binding = number;
+  b.descriptorType = type;
+  b.descriptorCount = 1;
+  b.stageFlags = stages;
+  return b;
+}
+
+VkDescriptorSetLayoutCreateInfo layoutInfo(
+  const std::vector<VkDescriptorSetLayoutBinding>& bindings){
+  VkDescriptorSetLayoutCreateInfo info{};
+  info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  info.bindingCount = static_cast<uint32_t>(bindings.size());
+  info.pBindings = bindings.data();
+  return info;
+}
+
+// Any device will do, layouts need nothing beyond core 1.0. Null when
+// there is no Vulkan driver to run on.
+struct TestDevice {
+  VkInstance instance = VK_NULL_HANDLE;
+  VkDevice device = VK_NULL_HANDLE;
+
+  TestDevice(){
+    VkApplicationInfo app_info{};
+    app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    app_info.pApplicationName = "Tests";
+    app_info.apiVersion = VK_API_VERSION_1_0;
+
+    VkInstanceCreateInfo instance_info{};
+    instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    instance_info.pApplicationInfo = &app_info;
+    if(vkCreateInstance(&instance_info, nullptr, &instance) != VK_SUCCESS){
+      instance = VK_NULL_HANDLE;
+      return;
+    }
+
+    uint32_t count = 1;
+    VkPhysicalDevice physical_device = VK_NULL_HANDLE;
+    vkEnumeratePhysicalDevices(instance, &count, &physical_device);
+    if(count == 0 || physical_device == VK_NULL_HANDLE) return;
+
+    // Every device has a queue family 0 with at least one queue
+    float priority = 1.0f;
+    VkDeviceQueueCreateInfo queue_info{};
+    queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_info.queueFamilyIndex = 0;
+    queue_info.queueCount = 1;
+    queue_info.pQueuePriorities = &priority;
+
+    VkDeviceCreateInfo device_info{};
+    device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    device_info.queueCreateInfoCount = 1;
+    device_info.pQueueCreateInfos = &queue_info;
+    if(vkCreateDevice(physical_device, &device_info, nullptr, &device)
+      != VK_SUCCESS){
+      device = VK_NULL_HANDLE;
+    }
+  }
+
+  ~TestDevice(){
+    if(device != VK_NULL_HANDLE) vkDestroyDevice(device, nullptr);
+    if(instance != VK_NULL_HANDLE) vkDestroyInstance(instance, nullptr);
+  }
+};
+
+void signatureTests(){
+  using Signature = DescriptorLayoutCache::LayoutSignature;
+  Signature a;
+  a.bindings = {
+    binding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT)};
+  Signature b = a;
+  VA_CHECK(a == b);
+  VA_CHECK(a.hash() == b.hash());
+
+  // Same bindings, other create flags: not the same layout
+  b.flags = 1;
+  VA_CHECK(!(a == b));
+
+  b = a;
+  b.bindings[0].descriptorCount = 2;
+  VA_CHECK(!(a == b));
+}
+}  // namespace
+
+void layoutCacheTests(){
+  signatureTests();
+
+  TestDevice device;
+  if(device.device == VK_NULL_HANDLE){
+    std::cout << "  No Vulkan device, skipping the layout cache" << std::endl;
+    return;
+  }
+
+  DescriptorLayoutCache cache;
+  cache.init(device.device);
+
+  std::vector<VkDescriptorSetLayoutBinding> bindings = {
+    binding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT),
+    binding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+      VK_SHADER_STAGE_FRAGMENT_BIT),
+    binding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT),
+    binding(5, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT)
+  };
+  VkDescriptorSetLayout layout =
+    cache.createDescriptorLayout(layoutInfo(bindings));
+  VA_CHECK(layout != VK_NULL_HANDLE);
+
+  // Every order of the same bindings is the same layout
+  auto by_binding = [](const VkDescriptorSetLayoutBinding& a,
+                       const VkDescriptorSetLayoutBinding& b){
+    return a.binding < b.binding;
+  };
+  std::vector<VkDescriptorSetLayoutBinding> permuted = bindings;
+  size_t orders = 0;
+  do{
+    VA_CHECK(cache.createDescriptorLayout(layoutInfo(permuted)) == layout);
+    ++orders;
+  }while(std::next_permutation(permuted.begin(), permuted.end(), by_binding));
+  VA_CHECK(orders == 24);
+
+  // Anything else about a binding is a new layout
+  std::vector<VkDescriptorSetLayoutBinding> other_stage = bindings;
+  other_stage[1].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS;
+  VkDescriptorSetLayout other =
+    cache.createDescriptorLayout(layoutInfo(other_stage));
+  VA_CHECK(other != VK_NULL_HANDLE && other != layout);
+  VA_CHECK(cache.createDescriptorLayout(layoutInfo(other_stage)) == other);
+
+  std::vector<VkDescriptorSetLayoutBinding> fewer(bindings.begin(),
+    bindings.end() - 1);
+  VA_CHECK(cache.createDescriptorLayout(layoutInfo(fewer)) != layout);
+
+  // Extension structs aren't part of the key, the cache refuses them
+  VkDescriptorSetLayoutCreateInfo chained = layoutInfo(bindings);
+  VkDescriptorSetLayoutCreateInfo next = layoutInfo(bindings);
+  chained.pNext = &next;
+  VA_CHECK_THROWS(cache.createDescriptorLayout(chained));
+
+  cache.cleanUp();
+}
+
+}  // namespace test
+}  // namespace va
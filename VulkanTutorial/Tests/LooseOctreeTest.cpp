@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "Check.h"
+#include "LooseOctree.h"
+
+namespace va {
+namespace test {
+
+namespace {
+struct Sphere {
+  glm::vec3 center{0.0f};
+  float radius = 0.0f;
+  LooseOctree::Handle handle = LooseOctree::INVALID;
+  bool live = false;
+};
+
+// Mostly small spheres, a few big ones, some centered outside the cube
+Sphere makeSphere(std::mt19937& rng){
+  std::uniform_real_distribution<float> pos(-120.0f, 120.0f);
+  std::uniform_real_distribution<float> size(-4.0f, 1.5f);
+  Sphere sphere;
+  sphere.center = glm::vec3(pos(rng), pos(rng), pos(rng));
+  sphere.radius = std::pow(10.0f, size(rng));
+  return sphere;
+}
+
+// Spheres not entirely behind one of the 6 planes of clip space:
+// -w <= x <= w, -w <= y <= w and 0 <= z <= w
+std::vector<uint32_t> bruteFrustum(const glm::mat4& m,
+  const std::vector<Sphere>& spheres){
+  glm::vec4 planes[6];
+  for(int i = 0; i < 4; ++i){
+    planes[0][i] = m[i][3] + m[i][0];
+    planes[1][i] = m[i][3] - m[i][0];
+    planes[2][i] = m[i][3] + m[i][1];
+    planes[3][i] = m[i][3] - m[i][1];
+    planes[4][i] = m[i][2];
+    planes[5][i] = m[i][3] - m[i][2];
+  }
+  std::vector<uint32_t> values;
+  for(uint32_t s = 0; s < spheres.size(); ++s){
+    if(!spheres[s].live) continue;
+    bool visible = true;
+    for(const auto& plane : planes){
+      float length = glm::length(glm::vec3(plane));
+      float distance = (glm::dot(glm::vec3(plane), spheres[s].center)
+        + plane.w)/length;
+      if(distance < -spheres[s].radius) visible = false;
+    }
+    if(visible) values.push_back(s);
+  }
+  return values;
+}
+
+std::vector<uint32_t> bruteSphere(const glm::vec3& center, float radius,
+  const std::vector<Sphere>& spheres){
+  std::vector<uint32_t> values;
+  for(uint32_t s = 0; s < spheres.size(); ++s){
+    if(!spheres[s].live) continue;
+    float reach = radius + spheres[s].radius;
+    glm::vec3 offset = spheres[s].center - center;
+    if(glm::dot(offset, offset) <= reach*reach) values.push_back(s);
+  }
+  return values;
+}
+
+std::vector<glm::mat4> cameras(){
+  glm::mat4 proj = glm::perspective(glm::radians(60.0f), 16.0f/9.0f, 0.1f,
+    150.0f);
+  // Inside the cube looking out, outside looking in, straight down, and a
+  // narrow one with a short range
+  return {
+    proj*glm::lookAt(glm::vec3(0.0f), glm::vec3(1.0f, 0.2f, 0.3f),
+      glm::vec3(0.0f, 0.0f, 1.0f)),
+    proj*glm::lookAt(glm::vec3(-150.0f, 20.0f, 10.0f), glm::vec3(0.0f),
+      glm::vec3(0.0f, 0.0f, 1.0f)),
+    proj*glm::lookAt(glm::vec3(10.0f, 5.0f, 90.0f),
+      glm::vec3(10.0f, 5.0f, -90.0f), glm::vec3(0.0f, 1.0f, 0.0f)),
+    glm::perspective(glm::radians(20.0f), 1.0f, 1.0f, 40.0f)
+      *glm::lookAt(glm::vec3(30.0f, -60.0f, 0.0f), glm::vec3(30.0f, 0.0f,
+        0.0f), glm::vec3(0.0f, 0.0f, 1.0f))
+  };
+}
+
+void checkQueries(const LooseOctree& octree,
+  const std::vector<Sphere>& spheres){
+  for(const auto& view_proj : cameras()){
+    std::vector<uint32_t> values;
+    octree.queryFrustum(view_proj, values);
+    std::sort(values.begin(), values.end());
+    std::vector<uint32_t> expected = bruteFrustum(view_proj, spheres);
+    VA_CHECK(!expected.empty());
+    VA_CHECK(values == expected);
+  }
+
+  for(const auto& query : {Sphere{glm::vec3(0.0f), 10.0f},
+    Sphere{glm::vec3(50.0f, -20.0f, 70.0f), 35.0f},
+    Sphere{glm::vec3(110.0f), 5.0f}}){
+    std::vector<uint32_t> values;
+    octree.querySphere(query.center, query.radius, values);
+    std::sort(values.begin(), values.end());
+    VA_CHECK(values == bruteSphere(query.center, query.radius, spheres));
+  }
+}
+}  // namespace
+
+void looseOctreeTests(){
+  std::mt19937 rng(13);
+  LooseOctree octree(glm::vec3(0.0f), 100.0f, 8);
+
+  // Values are indices into spheres
+  std::vector<Sphere> spheres(5000);
+  for(uint32_t s = 0; s < spheres.size(); ++s){
+    spheres[s] = makeSphere(rng);
+    spheres[s].handle = octree.insert(spheres[s].center, spheres[s].radius,
+      s);
+    spheres[s].live = true;
+  }
+  VA_CHECK(octree.size() == spheres.size());
+  checkQueries(octree, spheres);
+
+  // Small moves that stay in their cell, jumps across the cube, resizes
+  std::uniform_real_distribution<float> nudge(-0.5f, 0.5f);
+  for(uint32_t s = 0; s < spheres.size(); s += 2){
+    Sphere moved = makeSphere(rng);
+    if(s % 3 == 0){
+      moved.center = spheres[s].center + glm::vec3(nudge(rng));
+      moved.radius = spheres[s].radius;
+    }
+    spheres[s].center = moved.center;
+    spheres[s].radius = moved.radius;
+    octree.move(spheres[s].handle, moved.center, moved.radius);
+  }
+  checkQueries(octree, spheres);
+
+  // Removing leaves empty cells behind to be freed, inserting reuses
+  // handles
+  size_t live = spheres.size();
+  for(uint32_t s = 1; s < spheres.size(); s += 3){
+    octree.remove(spheres[s].handle);
+    spheres[s].live = false;
+    --live;
+  }
+  VA_CHECK(octree.size() == live);
+  checkQueries(octree, spheres);
+
+  for(uint32_t i = 0; i < 500; ++i){
+    Sphere sphere = makeSphere(rng);
+    sphere.handle = octree.insert(sphere.center, sphere.radius,
+      static_cast<uint32_t>(spheres.size()));
+    sphere.live = true;
+    spheres.push_back(sphere);
+  }
+  checkQueries(octree, spheres);
+
+  // Everything gone, only the root is left
+  for(auto& sphere : spheres){
+    if(!sphere.live) continue;
+    octree.remove(sphere.handle);
+    sphere.live = false;
+  }
+  VA_CHECK(octree.size() == 0);
+  VA_CHECK(octree.cellCount() == 1);
+}
+
+}  // namespace test
+}  // namespace va
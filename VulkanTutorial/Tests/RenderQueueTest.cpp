@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "Check.h"
+#include "RenderQueue.h"
+#include "ThreadPool.h"
+
+namespace va {
+namespace test {
+
+namespace {
+// Objects are numbered in the order they were added, so comparing objects
+// against std::stable_sort also checks that equal keys kept their order.
+void checkSorted(const std::vector<uint64_t>& keys, ThreadPool* pool){
+  RenderQueue queue;
+  for(size_t i = 0; i < keys.size(); ++i)
+    queue.add(keys[i], static_cast<uint32_t>(i));
+  queue.sort(pool);
+
+  std::vector<RenderQueue::Draw> expected;
+  for(size_t i = 0; i < keys.size(); ++i)
+    expected.push_back({keys[i], static_cast<uint32_t>(i)});
+  std::stable_sort(expected.begin(), expected.end(),
+    [](const RenderQueue::Draw& a, const RenderQueue::Draw& b){
+      return a.key < b.key;
+    });
+
+  const auto& draws = queue.draws();
+  VA_CHECK(draws.size() == expected.size());
+  if(draws.size() != expected.size()) return;
+  size_t mismatches = 0;
+  for(size_t i = 0; i < draws.size(); ++i){
+    if(draws[i].key != expected[i].key || draws[i].object != expected[i].object)
+      ++mismatches;
+  }
+  VA_CHECK(mismatches == 0);
+}
+
+// A few kinds of queue: every byte random, many duplicates, a single
+// pipeline and material (passes skipped), keys that differ in one byte
+// only (an odd number of passes).
+std::vector<std::vector<uint64_t>> keySets(size_t count, uint32_t seed){
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<float> depth(0.0f, 1.0f);
+  std::vector<std::vector<uint64_t>> sets(4);
+  for(size_t i = 0; i < count; ++i){
+    sets[0].push_back(rng());
+    sets[1].push_back(RenderQueue::makeKey(
+      static_cast<uint32_t>(rng() % 3), static_cast<uint32_t>(rng() % 5),
+      static_cast<uint32_t>(rng() % 7), 0.5f));
+    sets[2].push_back(RenderQueue::makeKey(1, 2,
+      static_cast<uint32_t>(rng() % 300), depth(rng)));
+    sets[3].push_back(RenderQueue::makeKey(4, 4, 4, 0.25f) + rng() % 256);
+  }
+  return sets;
+}
+}  // namespace
+
+void renderQueueTests(){
+  // Single chunk: no pool, or a queue too small to split
+  for(size_t count : {0, 1, 2, 3, 100, 1000, 16383}){
+    for(const auto& keys : keySets(count, static_cast<uint32_t>(count)))
+      checkSorted(keys, nullptr);
+  }
+
+  // Three workers, four chunks, whatever the machine has
+  ThreadPool pool(3);
+  for(const auto& keys : keySets(1000, 1)) checkSorted(keys, &pool);
+  for(size_t count : {16384, 16387, 100003}){
+    for(const auto& keys : keySets(count, static_cast<uint32_t>(count)))
+      checkSorted(keys, &pool);
+  }
+
+  // The queue is reused from frame to frame
+  RenderQueue queue;
+  for(uint32_t frame = 0; frame < 3; ++frame){
+    queue.clear();
+    for(uint32_t i = 0; i < 20000; ++i)
+      queue.add(RenderQueue::makeKey(0, 0, (i*7919 + frame) % 50, 0.0f), i);
+    queue.sort(&pool);
+    const auto& draws = queue.draws();
+    VA_CHECK(draws.size() == 20000);
+    VA_CHECK(std::is_sorted(draws.begin(), draws.end(),
+      [](const RenderQueue::Draw& a, const RenderQueue::Draw& b){
+        return a.key < b.key || (a.key == b.key && a.object < b.object);
+      }));
+  }
+}
+
+}  // namespace test
+}  // namespace va
@@ -0,0 +1,51 @@
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+
+#include "Check.h"
+
+namespace va {
+namespace test {
+void layoutCacheTests();
+void renderQueueTests();
+void geometryCodecTests();
+void bvhTests();
+void looseOctreeTests();
+}  // namespace test
+}  // namespace va
+
+namespace {
+struct Suite {
+  const char* name;
+  void (*run)();
+};
+
+const Suite SUITES[] = {
+  {"DescriptorLayoutCache", va::test::layoutCacheTests},
+  {"RenderQueue", va::test::renderQueueTests},
+  {"GeometryCodec", va::test::geometryCodecTests},
+  {"Bvh", va::test::bvhTests},
+  {"LooseOctree", va::test::looseOctreeTests},
+};
+}  // namespace
+
+int main() {
+  for (const auto& suite : SUITES) {
+    std::cout << suite.name << std::endl;
+    int before = va::test::failures();
+    try {
+      suite.run();
+    } catch (const std::exception& e) {
+      va::test::fail(suite.name, 0, e.what());
+    }
+    if (va::test::failures() != before)
+      std::cout << "  FAILED" << std::endl;
+  }
+
+  if (va::test::failures() > 0) {
+    std::cout << va::test::failures() << " checks failed" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "All checks passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,204 @@
+#include "AsyncQueue.h"
+
+#include <stdexcept>
+
+namespace va {
+
+namespace {
+VkBufferMemoryBarrier ownershipBarrier(VkBuffer buffer, VkDeviceSize offset,
+  VkDeviceSize size, uint32_t src_family, uint32_t dst_family){
+  VkBufferMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcQueueFamilyIndex = src_family;
+  barrier.dstQueueFamilyIndex = dst_family;
+  barrier.buffer = buffer;
+  barrier.offset = offset;
+  barrier.size = size;
+  return barrier;
+}
+}  // namespace
+
+void AsyncQueue::init(VkDevice device, uint32_t family,
+  uint32_t queue_index){
+  device_ = device;
+  family_ = family;
+  vkGetDeviceQueue(device_, family_, queue_index, &queue_);
+
+  VkCommandPoolCreateInfo cp_ci{};
+  cp_ci.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cp_ci.queueFamilyIndex = family_;
+  // Buffers are reset one by one when recycled
+  cp_ci.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT
+    | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  if(vkCreateCommandPool(device_, &cp_ci, nullptr, &command_pool_)
+    != VK_SUCCESS){
+    throw std::runtime_error("Failed to create async queue command pool");
+  }
+
+  VkSemaphoreTypeCreateInfo type_info{};
+  type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  type_info.initialValue = 0;
+
+  VkSemaphoreCreateInfo sem_info{};
+  sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  sem_info.pNext = &type_info;
+  if(vkCreateSemaphore(device_, &sem_info, nullptr, &timeline_)
+    != VK_SUCCESS){
+    throw std::runtime_error("Failed to create async queue timeline");
+  }
+
+  last_signal_value_ = 0;
+  completed_value_ = 0;
+}
+
+void AsyncQueue::cleanUp(){
+  if(device_ == VK_NULL_HANDLE) return;
+
+  wait(last_signal_value_);
+  // Destroying the pool frees its command buffers
+  vkDestroyCommandPool(device_, command_pool_, nullptr);
+  vkDestroySemaphore(device_, timeline_, nullptr);
+  in_flight_.clear();
+  free_buffers_.clear();
+  device_ = VK_NULL_HANDLE;
+}
+
+VkCommandBuffer AsyncQueue::beginCommands(){
+  recycle();
+
+  VkCommandBuffer command_buffer;
+  if(!free_buffers_.empty()){
+    command_buffer = free_buffers_.back();
+    free_buffers_.pop_back();
+    vkResetCommandBuffer(command_buffer, 0);
+  }else{
+    VkCommandBufferAllocateInfo alloc_info{};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandPool = command_pool_;
+    alloc_info.commandBufferCount = 1;
+    if(vkAllocateCommandBuffers(device_, &alloc_info, &command_buffer)
+      != VK_SUCCESS){
+      throw std::runtime_error("Failed to allocate async command buffer");
+    }
+  }
+
+  VkCommandBufferBeginInfo begin_info{};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  if(vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS){
+    throw std::runtime_error("Failed to begin async command buffer");
+  }
+  return command_buffer;
+}
+
+uint64_t AsyncQueue::submit(VkCommandBuffer command_buffer,
+  const std::vector<QueueWait>& waits){
+  if(vkEndCommandBuffer(command_buffer) != VK_SUCCESS){
+    throw std::runtime_error("Failed to record async command buffer");
+  }
+
+  std::vector<VkSemaphore> wait_semaphores;
+  std::vector<uint64_t> wait_values;
+  std::vector<VkPipelineStageFlags> wait_stages;
+  for(const auto& wait : waits){
+    wait_semaphores.push_back(wait.semaphore);
+    wait_values.push_back(wait.value);
+    wait_stages.push_back(wait.stage);
+  }
+
+  const uint64_t signal_value = ++last_signal_value_;
+
+  VkTimelineSemaphoreSubmitInfo timeline_info{};
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.waitSemaphoreValueCount =
+    static_cast<uint32_t>(wait_values.size());
+  timeline_info.pWaitSemaphoreValues = wait_values.data();
+  timeline_info.signalSemaphoreValueCount = 1;
+  timeline_info.pSignalSemaphoreValues = &signal_value;
+
+  VkSubmitInfo submit_info{};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.pNext = &timeline_info;
+  submit_info.waitSemaphoreCount =
+    static_cast<uint32_t>(wait_semaphores.size());
+  submit_info.pWaitSemaphores = wait_semaphores.data();
+  submit_info.pWaitDstStageMask = wait_stages.data();
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &command_buffer;
+  submit_info.signalSemaphoreCount = 1;
+  submit_info.pSignalSemaphores = &timeline_;
+
+  if(vkQueueSubmit(queue_, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS){
+    throw std::runtime_error("Failed to submit to async queue");
+  }
+
+  in_flight_.emplace_back(signal_value, command_buffer);
+  return signal_value;
+}
+
+void AsyncQueue::wait(uint64_t value){
+  if(value <= completed_value_) return;
+
+  VkSemaphoreWaitInfo wait_info{};
+  wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  wait_info.semaphoreCount = 1;
+  wait_info.pSemaphores = &timeline_;
+  wait_info.pValues = &value;
+
+  if(vkWaitSemaphores(device_, &wait_info, UINT64_MAX) != VK_SUCCESS){
+    throw std::runtime_error("Failed waiting on async queue timeline");
+  }
+  completed_value_ = value;
+}
+
+uint64_t AsyncQueue::completedValue(){
+  uint64_t value = 0;
+  if(vkGetSemaphoreCounterValue(device_, timeline_, &value) == VK_SUCCESS
+    && value > completed_value_){
+    completed_value_ = value;
+  }
+  return completed_value_;
+}
+
+void AsyncQueue::recycle(){
+  if(in_flight_.empty()) return;
+
+  uint64_t completed = completedValue();
+  while(!in_flight_.empty() && in_flight_.front().first <= completed){
+    free_buffers_.push_back(in_flight_.front().second);
+    in_flight_.pop_front();
+  }
+}
+
+void releaseBuffer(VkCommandBuffer cb, VkBuffer buffer, VkDeviceSize offset,
+  VkDeviceSize size, uint32_t src_family, uint32_t dst_family,
+  VkPipelineStageFlags src_stage, VkAccessFlags src_access){
+  if(src_family == dst_family) return;
+
+  // Destination half of the release is ignored, the acquire provides it
+  VkBufferMemoryBarrier barrier =
+    ownershipBarrier(buffer, offset, size, src_family, dst_family);
+  barrier.srcAccessMask = src_access;
+  barrier.dstAccessMask = 0;
+  vkCmdPipelineBarrier(cb, src_stage, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+    0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void acquireBuffer(VkCommandBuffer cb, VkBuffer buffer, VkDeviceSize offset,
+  VkDeviceSize size, uint32_t src_family, uint32_t dst_family,
+  VkPipelineStageFlags dst_stage, VkAccessFlags dst_access){
+  if(src_family == dst_family) return;
+
+  // Source access is ignored, the semaphore wait orders it after the
+  // release. Starting at the stage the semaphore waits in chains the two.
+  VkBufferMemoryBarrier barrier =
+    ownershipBarrier(buffer, offset, size, src_family, dst_family);
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = dst_access;
+  vkCmdPipelineBarrier(cb, dst_stage, dst_stage, 0, 0, nullptr, 1, &barrier,
+    0, nullptr);
+}
+
+}  // namespace va
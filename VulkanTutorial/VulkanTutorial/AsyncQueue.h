@@ -0,0 +1,101 @@
+#pragma once
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+#define GLFW_INCLUDE_VULKAN
+#include "GLFW/glfw3.h"
+
+namespace va {
+
+/* A submission waits until semaphore reaches value before stage. */
+struct QueueWait {
+  VkSemaphore semaphore;
+  uint64_t value;
+  VkPipelineStageFlags stage;
+};
+
+/*
+ * A queue besides the graphics one (async compute, transfer) with its own
+ * command pool and timeline semaphore.
+ *
+ * Every submit signals the next value of the queue's timeline. Other queues
+ * depend on the work by waiting for that value, eg. the graphics submit
+ * waits on compute.after(value, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT), and
+ * this queue's submits take the waits it needs in turn.
+ *
+ * Command buffers come from beginCommands() and go back to the pool by
+ * themselves once the submission that used them is done.
+ *
+ * Several AsyncQueues may share a VkQueue (eg. when the device has no
+ * dedicated family), they just get separate timelines. Submits must come
+ * from one thread at a time.
+ */
+class AsyncQueue {
+ public:
+  void init(VkDevice device, uint32_t family, uint32_t queue_index);
+
+  void cleanUp();
+
+  uint32_t family() const { return family_; }
+  VkQueue queue() const { return queue_; }
+  VkSemaphore timeline() const { return timeline_; }
+
+  // One time submit command buffer, recording already begun.
+  VkCommandBuffer beginCommands();
+
+  /* End and submit command_buffer after waits. Returns the timeline value
+  * signalled when it's done.
+  */
+  uint64_t submit(VkCommandBuffer command_buffer,
+    const std::vector<QueueWait>& waits = {});
+
+  // Dependency of another submission on this queue reaching value.
+  QueueWait after(uint64_t value, VkPipelineStageFlags stage) const {
+    return {timeline_, value, stage};
+  }
+
+  // Host wait until the timeline reaches value.
+  void wait(uint64_t value);
+
+  uint64_t completedValue();
+
+ private:
+  // Return command buffers of finished submissions to free_buffers_.
+  void recycle();
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  uint32_t family_ = 0;
+  VkQueue queue_ = VK_NULL_HANDLE;
+  VkCommandPool command_pool_ = VK_NULL_HANDLE;
+  VkSemaphore timeline_ = VK_NULL_HANDLE;
+
+  uint64_t last_signal_value_ = 0;
+  uint64_t completed_value_ = 0;
+
+  // Submitted command buffers and the value that frees them, in order
+  std::deque<std::pair<uint64_t, VkCommandBuffer>> in_flight_;
+  std::vector<VkCommandBuffer> free_buffers_;
+};
+
+/*
+ * Queue family ownership transfer of a buffer range, for buffers in
+ * VK_SHARING_MODE_EXCLUSIVE used by queues of different families.
+ *
+ * The release is recorded on the source queue after its last use, the
+ * acquire on the destination queue before its first use, with matching
+ * arguments, and the acquiring submission has to wait on the releasing one
+ * in dst_stage.
+ * Within one family the semaphore wait alone orders the accesses, both
+ * calls record nothing.
+ */
+void releaseBuffer(VkCommandBuffer cb, VkBuffer buffer, VkDeviceSize offset,
+  VkDeviceSize size, uint32_t src_family, uint32_t dst_family,
+  VkPipelineStageFlags src_stage, VkAccessFlags src_access);
+
+void acquireBuffer(VkCommandBuffer cb, VkBuffer buffer, VkDeviceSize offset,
+  VkDeviceSize size, uint32_t src_family, uint32_t dst_family,
+  VkPipelineStageFlags dst_stage, VkAccessFlags dst_access);
+
+}  // namespace va
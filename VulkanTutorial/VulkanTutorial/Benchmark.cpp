@@ -0,0 +1,385 @@
+#include "Benchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "Bvh.h"
+#include "ChromeTrace.h"
+#include "ThreadPool.h"
+#include "TransformHierarchy.h"
+
+namespace va {
+
+namespace {
+double percentile(std::vector<double> samples, double p){
+  if(samples.empty()) return 0.0;
+  std::sort(samples.begin(), samples.end());
+  size_t idx = static_cast<size_t>(p * (samples.size()-1) + 0.5);
+  return samples[std::min(idx, samples.size()-1)];
+}
+
+double mean(const std::vector<double>& samples){
+  if(samples.empty()) return 0.0;
+  double sum = 0.0;
+  for(double v : samples) sum += v;
+  return sum / samples.size();
+}
+
+void writeStats(std::ostream& out, const std::vector<double>& samples){
+  out << "{\"mean\":" << mean(samples)
+      << ",\"p50\":" << percentile(samples, 0.5)
+      << ",\"p90\":" << percentile(samples, 0.9)
+      << ",\"p99\":" << percentile(samples, 0.99)
+      << ",\"max\":" << percentile(samples, 1.0) << "}";
+}
+
+BenchmarkConfig makeConfig(const std::string& name,
+  const RenderSettings& settings, uint32_t measured_frames){
+  BenchmarkConfig config;
+  config.name = name;
+  config.settings = settings;
+  config.measured_frames = measured_frames;
+  return config;
+}
+}  // namespace
+
+glm::quat ScriptedCamera::model(uint64_t frame){
+  float time = frame / FRAMES_PER_SECOND;
+  return glm::angleAxis(time*glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+}
+
+glm::mat4 ScriptedCamera::view(uint64_t frame, float scene_scale){
+  float time = frame / FRAMES_PER_SECOND;
+
+  // Orbit once every 20 seconds, bobbing up and down a little.
+  float angle = glm::radians(45.0f) + time*glm::radians(18.0f);
+  float radius = 2.0f*std::sqrt(2.0f)*scene_scale;
+  float height = (2.0f + 0.5f*std::sin(time*0.5f))*scene_scale;
+
+  glm::vec3 eye(radius*std::cos(angle), radius*std::sin(angle), height);
+  return glm::lookAt(eye, glm::vec3(0.0f,0.0f,0.0f),
+    glm::vec3(0.0f,0.0f,1.0f));
+}
+
+std::vector<BenchmarkConfig> defaultBenchmarkSuite(
+  const RenderSettings& base, uint32_t measured_frames){
+  RenderSettings defaults = base;
+  defaults.scripted_camera = true;
+  defaults.hidden_window = true;
+  // Uncapped and nothing sleeping, we want the cost of a frame not vsync.
+  defaults.present_policy = PresentPolicy::LowLatency;
+  defaults.late_input_sampling = false;
+  if(defaults.mesh_triangles == 0) defaults.mesh_triangles = 20000;
+  if(defaults.texture_size == 0) defaults.texture_size = 1024;
+  if(defaults.msaa_samples == 0) defaults.msaa_samples = 4;
+
+  std::vector<BenchmarkConfig> suite;
+  suite.push_back(makeConfig("baseline", defaults, measured_frames));
+
+  for(uint32_t count : {16u, 256u, 1024u}){
+    RenderSettings s = defaults;
+    s.object_count = count;
+    suite.push_back(makeConfig("objects_" + std::to_string(count), s,
+      measured_frames));
+  }
+  for(uint32_t triangles : {2000u, 200000u, 1000000u}){
+    RenderSettings s = defaults;
+    s.mesh_triangles = triangles;
+    suite.push_back(makeConfig("triangles_" + std::to_string(triangles), s,
+      measured_frames));
+  }
+  for(uint32_t size : {256u, 4096u}){
+    RenderSettings s = defaults;
+    s.texture_size = size;
+    suite.push_back(makeConfig("texture_" + std::to_string(size), s,
+      measured_frames));
+  }
+  for(uint32_t samples : {1u, 2u, 8u}){
+    RenderSettings s = defaults;
+    s.msaa_samples = samples;
+    suite.push_back(makeConfig("msaa_" + std::to_string(samples), s,
+      measured_frames));
+  }
+  {
+    // Same as msaa_8 with the render targets committed up front
+    RenderSettings s = defaults;
+    s.msaa_samples = 8;
+    s.lazy_attachments = false;
+    suite.push_back(makeConfig("msaa_8_eager", s, measured_frames));
+  }
+  {
+    // Baseline drawn at half resolution and upscaled
+    RenderSettings s = defaults;
+    s.render_scale = 0.5f;
+    suite.push_back(makeConfig("render_scale_50", s, measured_frames));
+  }
+  {
+    // Heavy scene with msaa and resolution following the gpu time, aiming
+    // at 60 fps
+    RenderSettings s = defaults;
+    s.object_count = 1024;
+    s.target_frame_ms = 1000.0/60.0;
+    suite.push_back(makeConfig("adaptive_msaa", s, measured_frames));
+  }
+  {
+    // Same as objects_256 shading each pixel once
+    RenderSettings s = defaults;
+    s.object_count = 256;
+    s.depth_prepass = true;
+    suite.push_back(makeConfig("depth_prepass", s, measured_frames));
+  }
+  {
+    // Big grid, objects culled against the hi-z pyramid
+    RenderSettings s = defaults;
+    s.object_count = 1024;
+    s.occlusion_culling = true;
+    suite.push_back(makeConfig("occlusion_culling", s, measured_frames));
+  }
+  for(uint32_t lights : {1024u, 4096u}){
+    // Clustered lighting, the cost should follow lights per cluster
+    RenderSettings s = defaults;
+    s.object_count = 256;
+    s.light_count = lights;
+    suite.push_back(makeConfig("lights_" + std::to_string(lights), s,
+      measured_frames));
+  }
+  {
+    // Same as depth_prepass with vertices fetched by the shader, the
+    // pre-pass reading positions only
+    RenderSettings s = defaults;
+    s.object_count = 256;
+    s.depth_prepass = true;
+    s.vertex_pulling = true;
+    suite.push_back(makeConfig("vertex_pulling", s, measured_frames));
+  }
+  {
+    // Same as objects_1024 with distant objects on lower detail variants
+    RenderSettings s = defaults;
+    s.object_count = 1024;
+    s.mesh_variants = 4;
+    s.lod = true;
+    suite.push_back(makeConfig("lod", s, measured_frames));
+  }
+  return suite;
+}
+
+void writeBenchmarkJson(const std::string& path,
+  const std::vector<BenchmarkResult>& results){
+  std::ofstream out(path);
+  if(!out.is_open())
+    throw std::runtime_error("Failed to open benchmark output " + path);
+
+  out.precision(4);
+  out << std::fixed;
+  out << "{\"benchmarks\":[\n";
+
+  for(size_t i = 0; i < results.size(); ++i){
+    const auto& r = results[i];
+    const auto& s = r.config.settings;
+
+    // The driver reports the device name, anything could be in it
+    out << "{\"name\":\"" << r.config.name << "\",\"device\":\"";
+    writeJsonEscaped(out, r.device_name);
+    out << "\""
+        << ",\"scene\":{\"objects\":" << s.object_count
+        << ",\"triangles\":" << s.mesh_triangles
+        << ",\"texture_size\":" << s.texture_size
+        << ",\"msaa_samples\":" << r.msaa_samples
+        << ",\"sample_shading\":" << (r.sample_shading ? "true" : "false")
+        << ",\"render_scale\":" << r.render_scale
+        << ",\"target_frame_ms\":" << s.target_frame_ms
+        << ",\"quality_switches\":" << r.quality_switches
+        << ",\"occlusion_culling\":"
+        << (r.occlusion_culling ? "true" : "false")
+        << ",\"visible_objects\":" << r.visible_objects
+        << ",\"depth_prepass\":" << (s.depth_prepass ? "true" : "false")
+        << ",\"lights\":" << s.light_count
+        << ",\"vertex_pulling\":" << (s.vertex_pulling ? "true" : "false")
+        << ",\"lod\":" << (s.lod ? "true" : "false")
+        << ",\"lazy_attachments\":" << (s.lazy_attachments ? "true" : "false")
+        << ",\"frames_in_flight\":" << s.frames_in_flight << "}"
+        << ",\"frames\":" << r.frame_ms.size()
+        << ",\"frame_ms\":";
+    writeStats(out, r.frame_ms);
+    out << ",\"cpu_submit_ms\":";
+    writeStats(out, r.submit_ms);
+    out << ",\"gpu_frame_ms\":" << r.gpu_frame_mean_ms
+        << ",\"pipeline\":{\"vertex_invocations\":" << r.vertex_invocations
+        << ",\"fragment_invocations\":" << r.fragment_invocations
+        << ",\"fragments_per_pixel\":" << r.fragments_per_pixel << "}"
+        << ",\"binds\":{\"requested\":" << r.binds_requested
+        << ",\"recorded\":" << r.binds_recorded
+        << ",\"skipped\":" << r.binds_requested - r.binds_recorded << "}"
+        << ",\"init_ms\":" << r.init_ms
+        << ",\"time_to_first_frame_ms\":" << r.time_to_first_frame_ms
+        << ",\"memory\":{\"device_bytes\":" << r.device_memory_bytes
+        << ",\"device_peak_bytes\":" << r.device_memory_peak_bytes
+        << ",\"device_allocations\":" << r.device_allocations
+        << ",\"transient_bytes\":" << r.transient_bytes
+        << ",\"lazy_bytes\":" << r.lazy_bytes
+        << ",\"lazy_committed_bytes\":" << r.lazy_committed_bytes << "}}";
+    out << (i+1 < results.size() ? ",\n" : "\n");
+  }
+  out << "]}\n";
+
+  if(!out)
+    throw std::runtime_error("Failed to write benchmark output " + path);
+}
+
+std::string benchmarkTransforms(size_t node_count, uint32_t iterations){
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+
+  TransformHierarchy hierarchy;
+  std::vector<TransformHierarchy::NodeId> nodes;
+  nodes.reserve(node_count);
+  for(size_t i = 0; i < node_count; ++i){
+    auto parent = i == 0 ? TransformHierarchy::NO_PARENT : nodes[(i-1)/8];
+    nodes.push_back(hierarchy.add(parent,
+      glm::vec3(offset(rng), offset(rng), offset(rng))));
+  }
+
+  ThreadPool pool;
+  std::ostringstream out;
+  out.precision(3);
+  out << std::fixed << node_count << " nodes, " << pool.size()+1
+      << " threads\n";
+
+  struct Case { const char* name; size_t stride; };
+  for(Case c : {Case{"all dirty", 1}, Case{"1% dirty", 100},
+    Case{"clean", 0}}){
+    for(ThreadPool* p : {static_cast<ThreadPool*>(nullptr), &pool}){
+      hierarchy.update(p);
+
+      double total_ms = 0.0;
+      size_t updated = 0;
+      for(uint32_t it = 0; it < iterations; ++it){
+        auto rotation = glm::angleAxis(glm::radians(1.0f*it),
+          glm::vec3(0.0f, 0.0f, 1.0f));
+        for(size_t i = it % 100; c.stride && i < node_count; i += c.stride)
+          hierarchy.setRotation(nodes[i], rotation);
+
+        auto start = std::chrono::steady_clock::now();
+        hierarchy.update(p);
+        total_ms += std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - start).count();
+        updated += hierarchy.lastUpdatedCount();
+      }
+
+      out << "\t" << c.name << (p ? " parallel " : " serial   ")
+          << total_ms/iterations << " ms, "
+          << updated/std::max(iterations, 1u) << " nodes updated\n";
+    }
+  }
+  return out.str();
+}
+
+std::string benchmarkBvh(uint32_t triangle_count, uint32_t ray_count){
+  // Uv sphere with ridges, rings x 2*rings quads of 2 triangles
+  const uint32_t rings = std::max(2u, static_cast<uint32_t>(
+    std::round(std::sqrt(triangle_count/4.0))));
+  const uint32_t segments = 2*rings;
+  const float pi = glm::radians(180.0f);
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> indices;
+  for(uint32_t r = 0; r <= rings; ++r){
+    for(uint32_t s = 0; s <= segments; ++s){
+      float phi = pi*r/rings;
+      float theta = 2.0f*pi*s/segments;
+      float radius = 1.0f + 0.05f*std::sin(13.0f*phi)*std::sin(7.0f*theta);
+      positions.push_back(radius*glm::vec3(std::sin(phi)*std::cos(theta),
+        std::sin(phi)*std::sin(theta), std::cos(phi)));
+    }
+  }
+  for(uint32_t r = 0; r < rings; ++r){
+    for(uint32_t s = 0; s < segments; ++s){
+      uint32_t a = r*(segments+1) + s;
+      uint32_t b = a + segments + 1;
+      indices.insert(indices.end(), {a, b, a+1, a+1, b, b+1});
+    }
+  }
+
+  ThreadPool pool;
+  std::ostringstream out;
+  out.precision(3);
+  out << std::fixed << indices.size()/3 << " triangles, " << ray_count
+      << " rays, " << pool.size()+1 << " threads\n";
+
+  Bvh bvh;
+  for(ThreadPool* p : {static_cast<ThreadPool*>(nullptr), &pool}){
+    auto start = std::chrono::steady_clock::now();
+    bvh.build(positions, indices, p);
+    double ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+    out << "\tbuild" << (p ? " parallel " : " serial   ") << ms << " ms, "
+        << bvh.nodeCount() << " nodes, " << bvh.packCount() << " leaves\n";
+  }
+
+  // From a shell around the sphere towards points inside it, some miss
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+  std::vector<Ray> rays(ray_count);
+  for(Ray& ray : rays){
+    glm::vec3 from(unit(rng), unit(rng), unit(rng));
+    glm::vec3 to(unit(rng), unit(rng), unit(rng));
+    ray.origin = 3.0f*glm::normalize(from + glm::vec3(1e-3f));
+    ray.direction = 1.2f*to - ray.origin;
+  }
+
+  std::vector<RayHit> hits(ray_count);
+  for(ThreadPool* p : {static_cast<ThreadPool*>(nullptr), &pool}){
+    auto trace = [&](size_t begin, size_t end){
+      for(size_t i = begin; i < end; ++i) hits[i] = bvh.intersect(rays[i]);
+    };
+    auto start = std::chrono::steady_clock::now();
+    if(p) p->parallelFor(rays.size(), 1024, trace);
+    else trace(0, rays.size());
+    double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+    size_t hit_count = std::count_if(hits.begin(), hits.end(),
+      [](const RayHit& hit){ return hit.hit(); });
+    out << "\ttrace" << (p ? " parallel " : " serial   ")
+        << ray_count/std::max(seconds, 1e-9)/1e6 << " Mrays/s, "
+        << hit_count << " hits\n";
+  }
+
+  // Closest hit of every triangle for a few rays
+  const size_t checked = std::min<size_t>(rays.size(), 200);
+  size_t mismatches = 0;
+  for(size_t i = 0; i < checked; ++i){
+    const Ray& ray = rays[i];
+    float best = ray.t_max;
+    for(size_t t = 0; t + 2 < indices.size(); t += 3){
+      glm::vec3 v0 = positions[indices[t]];
+      glm::vec3 e1 = positions[indices[t+1]] - v0;
+      glm::vec3 e2 = positions[indices[t+2]] - v0;
+      glm::vec3 p = glm::cross(ray.direction, e2);
+      float det = glm::dot(e1, p);
+      if(det == 0.0f) continue;
+      glm::vec3 s = ray.origin - v0;
+      float u = glm::dot(s, p)/det;
+      glm::vec3 q = glm::cross(s, e1);
+      float v = glm::dot(ray.direction, q)/det;
+      float hit_t = glm::dot(e2, q)/det;
+      if(u >= 0.0f && v >= 0.0f && u + v <= 1.0f && hit_t > 0.0f)
+        best = std::min(best, hit_t);
+    }
+    bool hit = best < ray.t_max;
+    if(hit != hits[i].hit()
+      || (hit && std::abs(best - hits[i].t) > 1e-4f*best))
+      ++mismatches;
+  }
+  out << "\t" << mismatches << " of " << checked
+      << " rays differ from brute force\n";
+  return out.str();
+}
+
+}  // namespace va
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "RenderSettings.h"
+
+namespace va {
+
+struct BenchmarkConfig {
+  std::string name;
+  RenderSettings settings;
+  uint32_t warmup_frames = 60;
+  uint32_t measured_frames = 600;
+};
+
+struct BenchmarkResult {
+  BenchmarkConfig config;
+  std::string device_name;
+  uint32_t msaa_samples = 1;  // what the device actually used
+  // Level the quality controller ended on and how often it switched
+  bool sample_shading = false;
+  float render_scale = 1.0f;
+  uint32_t quality_switches = 0;
+  // Occlusion culling was on, objects drawn in the last measured frame
+  bool occlusion_culling = false;
+  uint32_t visible_objects = 0;
+  // Mean per frame over the whole run of the scene passes, 0 without
+  // pipeline statistics queries
+  double vertex_invocations = 0.0;
+  double fragment_invocations = 0.0;
+  double fragments_per_pixel = 0.0;
+  // Mean per frame of the scene's binds: asked for by every draw, and
+  // recorded once redundant ones were skipped
+  double binds_requested = 0.0;
+  double binds_recorded = 0.0;
+
+  // Wall time between consecutive frames
+  std::vector<double> frame_ms;
+  // CPU time to record and submit the frame's command buffer
+  std::vector<double> submit_ms;
+  // From the gpu profiler's "frame" scope, 0 without timestamps
+  double gpu_frame_mean_ms = 0.0;
+
+  // Startup: initVulkan alone, and from run start to the first present
+  double init_ms = 0.0;
+  double time_to_first_frame_ms = 0.0;
+
+  uint64_t device_memory_bytes = 0;
+  uint64_t device_memory_peak_bytes = 0;
+  uint32_t device_allocations = 0;
+
+  // Render targets of every quality level. Lazily allocated ones count fully
+  // in device_memory_bytes, committed is what the driver really backed.
+  uint64_t transient_bytes = 0;
+  uint64_t lazy_bytes = 0;
+  uint64_t lazy_committed_bytes = 0;
+};
+
+/* Camera and model animation driven only by the frame number. Matches the
+ * interactive view (model turning 90 deg/s at 60 fps, camera at (2,2,2))
+ * with a slow orbit added so coverage changes over the run.
+ * scene_scale pushes the camera back to fit bigger object grids.
+ */
+class ScriptedCamera {
+ public:
+  static constexpr float FRAMES_PER_SECOND = 60.0f;
+
+  // Rotation of every object
+  static glm::quat model(uint64_t frame);
+  static glm::mat4 view(uint64_t frame, float scene_scale);
+};
+
+/* One run per scaling axis (objects, triangles, texture size, msaa) around
+ * base, each axis swept while the others keep base's values.
+ */
+std::vector<BenchmarkConfig> defaultBenchmarkSuite(
+  const RenderSettings& base, uint32_t measured_frames);
+
+// Throws if the file can't be written.
+void writeBenchmarkJson(const std::string& path,
+  const std::vector<BenchmarkResult>& results);
+
+/* Cpu only: world matrix update of a node_count node hierarchy (8 children
+ * per node) with every node, 1% of nodes and no node changed per iteration,
+ * serial and on a thread pool. Returns a readable table of mean times.
+ */
+std::string benchmarkTransforms(size_t node_count, uint32_t iterations);
+
+/* Cpu only: Bvh build of a bumpy sphere of about triangle_count triangles,
+ * serial and on a thread pool, then ray_count rays from around it traced on
+ * one thread and on the pool. The first rays are checked against testing
+ * every triangle. Returns a readable table.
+ */
+std::string benchmarkBvh(uint32_t triangle_count, uint32_t ray_count);
+
+}  // namespace va
@@ -0,0 +1,606 @@
+#include "Bvh.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__SSE__) || defined(_M_X64) \
+  || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define VA_BVH_SSE 1
+#include <xmmintrin.h>
+#endif
+
+#include "ThreadPool.h"
+
+namespace va {
+
+namespace {
+// 4 floats, one per child box or pack triangle. Comparisons return a bit
+// per lane.
+#ifdef VA_BVH_SSE
+struct Float4 { __m128 v; };
+
+Float4 load4(const float* p){ return {_mm_loadu_ps(p)}; }
+Float4 splat(float f){ return {_mm_set1_ps(f)}; }
+void store4(Float4 a, float* p){ _mm_storeu_ps(p, a.v); }
+Float4 operator+(Float4 a, Float4 b){ return {_mm_add_ps(a.v, b.v)}; }
+Float4 operator-(Float4 a, Float4 b){ return {_mm_sub_ps(a.v, b.v)}; }
+Float4 operator*(Float4 a, Float4 b){ return {_mm_mul_ps(a.v, b.v)}; }
+Float4 operator/(Float4 a, Float4 b){ return {_mm_div_ps(a.v, b.v)}; }
+Float4 min4(Float4 a, Float4 b){ return {_mm_min_ps(a.v, b.v)}; }
+Float4 max4(Float4 a, Float4 b){ return {_mm_max_ps(a.v, b.v)}; }
+uint32_t less(Float4 a, Float4 b){
+  return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)));
+}
+uint32_t lessEqual(Float4 a, Float4 b){
+  return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(a.v, b.v)));
+}
+#else
+struct Float4 { float v[4]; };
+
+template <typename Op>
+Float4 lanes(Float4 a, Float4 b, Op op){
+  Float4 r;
+  for(int i = 0; i < 4; ++i) r.v[i] = op(a.v[i], b.v[i]);
+  return r;
+}
+template <typename Op>
+uint32_t mask(Float4 a, Float4 b, Op op){
+  uint32_t bits = 0;
+  for(int i = 0; i < 4; ++i) bits |= op(a.v[i], b.v[i]) ? 1u << i : 0u;
+  return bits;
+}
+
+Float4 load4(const float* p){ return {{p[0], p[1], p[2], p[3]}}; }
+Float4 splat(float f){ return {{f, f, f, f}}; }
+void store4(Float4 a, float* p){ std::memcpy(p, a.v, sizeof(a.v)); }
+Float4 operator+(Float4 a, Float4 b){
+  return lanes(a, b, [](float x, float y){ return x + y; });
+}
+Float4 operator-(Float4 a, Float4 b){
+  return lanes(a, b, [](float x, float y){ return x - y; });
+}
+Float4 operator*(Float4 a, Float4 b){
+  return lanes(a, b, [](float x, float y){ return x * y; });
+}
+Float4 operator/(Float4 a, Float4 b){
+  return lanes(a, b, [](float x, float y){ return x / y; });
+}
+// Second operand when either is nan, like minps/maxps
+Float4 min4(Float4 a, Float4 b){
+  return lanes(a, b, [](float x, float y){ return x < y ? x : y; });
+}
+Float4 max4(Float4 a, Float4 b){
+  return lanes(a, b, [](float x, float y){ return x > y ? x : y; });
+}
+uint32_t less(Float4 a, Float4 b){
+  return mask(a, b, [](float x, float y){ return x < y; });
+}
+uint32_t lessEqual(Float4 a, Float4 b){
+  return mask(a, b, [](float x, float y){ return x <= y; });
+}
+#endif
+
+// Binary tree depth where binned sah gives way to median splits, keeps
+// the traversal stack bounded on degenerate meshes
+constexpr uint32_t MAX_SAH_DEPTH = 48;
+constexpr uint32_t STACK_SIZE = 256;
+
+constexpr char MAGIC[4] = {'V', 'A', 'B', 'V'};
+constexpr uint32_t VERSION = 1;
+
+float halfArea(const glm::vec3& lo, const glm::vec3& hi){
+  glm::vec3 d = hi - lo;
+  return d.x*d.y + d.y*d.z + d.z*d.x;
+}
+
+float component(const glm::vec3& v, uint32_t axis){
+  return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+// Box of nothing, grows to the first thing added
+void resetBounds(glm::vec3& lo, glm::vec3& hi){
+  lo = glm::vec3(std::numeric_limits<float>::max());
+  hi = glm::vec3(-std::numeric_limits<float>::max());
+}
+
+template <typename T>
+void writeArray(std::ofstream& out, const std::vector<T>& values){
+  uint32_t count = static_cast<uint32_t>(values.size());
+  out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+  out.write(reinterpret_cast<const char*>(values.data()),
+    sizeof(T)*values.size());
+}
+
+template <typename T>
+void readArray(std::ifstream& in, std::vector<T>& values){
+  uint32_t count = 0;
+  in.read(reinterpret_cast<char*>(&count), sizeof(count));
+  if(!in) return;
+
+  // A damaged count isn't allowed to allocate more than the file holds
+  const std::streampos at = in.tellg();
+  in.seekg(0, std::ios::end);
+  const std::streamoff left = in.tellg() - at;
+  in.seekg(at);
+  if(static_cast<uint64_t>(left) < uint64_t{sizeof(T)}*count){
+    in.setstate(std::ios::failbit);
+    return;
+  }
+  values.resize(count);
+  in.read(reinterpret_cast<char*>(values.data()), sizeof(T)*values.size());
+}
+}  // namespace
+
+struct Bvh::BuildState {
+  BuildState(const std::vector<glm::vec3>& positions,
+    const std::vector<uint32_t>& indices)
+    : positions(positions), indices(indices) {}
+
+  const std::vector<glm::vec3>& positions;
+  const std::vector<uint32_t>& indices;
+
+  // A triangle and its box, each node's range partitioned in place. The
+  // bounds travel with the triangle so the passes over a range stay
+  // sequential.
+  struct Ref {
+    glm::vec3 lo;
+    glm::vec3 hi;
+    glm::vec3 centroid;
+    uint32_t triangle;
+  };
+  std::vector<Ref> refs;
+  // Sized for the worst case up front, tasks take nodes two at a time
+  std::vector<BuildNode> nodes;
+  std::atomic<uint32_t> node_count{0};
+};
+
+void Bvh::build(const std::vector<glm::vec3>& positions,
+  const std::vector<uint32_t>& indices, ThreadPool* pool){
+  nodes_.clear();
+  packs_.clear();
+  triangle_count_ = static_cast<uint32_t>(indices.size()/3);
+  if(triangle_count_ == 0) return;
+
+  BuildState state(positions, indices);
+  state.refs.resize(triangle_count_);
+  auto bound = [&](size_t begin, size_t end){
+    for(size_t t = begin; t < end; ++t){
+      const glm::vec3& a = positions[indices[3*t]];
+      const glm::vec3& b = positions[indices[3*t + 1]];
+      const glm::vec3& c = positions[indices[3*t + 2]];
+      BuildState::Ref& ref = state.refs[t];
+      ref.lo = glm::min(a, glm::min(b, c));
+      ref.hi = glm::max(a, glm::max(b, c));
+      ref.centroid = 0.5f*(ref.lo + ref.hi);
+      ref.triangle = static_cast<uint32_t>(t);
+    }
+  };
+  if(pool) pool->parallelFor(triangle_count_, PARALLEL_TRIANGLES, bound);
+  else bound(0, triangle_count_);
+
+  state.nodes.resize(2*triangle_count_);
+  state.nodes[0].first = 0;
+  state.nodes[0].count = triangle_count_;
+  state.node_count = 1;
+  buildRange(state, 0, 0, pool);
+
+  nodes_.reserve(state.node_count/2 + 1);
+  packs_.reserve(triangle_count_/2 + 1);
+  collapse(state, 0);
+}
+
+void Bvh::buildRange(BuildState& state, uint32_t index, uint32_t depth,
+  ThreadPool* pool){
+  // Nodes never move, the vector was sized up front
+  BuildNode& node = state.nodes[index];
+  const uint32_t first = node.first;
+  const uint32_t count = node.count;
+
+  glm::vec3 centroid_lo, centroid_hi;
+  resetBounds(node.lo, node.hi);
+  resetBounds(centroid_lo, centroid_hi);
+  for(uint32_t i = first; i < first + count; ++i){
+    const BuildState::Ref& ref = state.refs[i];
+    node.lo = glm::min(node.lo, ref.lo);
+    node.hi = glm::max(node.hi, ref.hi);
+    centroid_lo = glm::min(centroid_lo, ref.centroid);
+    centroid_hi = glm::max(centroid_hi, ref.centroid);
+  }
+  // A pack's worth, tested all at once anyway
+  if(count <= WIDTH) return;
+
+  // Cheapest split between bins along any axis: triangles times area on
+  // either side
+  struct Bin {
+    uint32_t count = 0;
+    glm::vec3 lo, hi;
+  };
+  float scale[3];
+  bool sah = false;
+  for(uint32_t axis = 0; axis < 3; ++axis){
+    const float extent = component(centroid_hi, axis)
+      - component(centroid_lo, axis);
+    scale[axis] = depth < MAX_SAH_DEPTH && extent > 0.0f ? BINS/extent : 0.0f;
+    sah = sah || scale[axis] > 0.0f;
+  }
+  auto binOf = [&](const BuildState::Ref& ref, uint32_t axis){
+    return std::min(BINS - 1, static_cast<uint32_t>(
+      (component(ref.centroid, axis) - component(centroid_lo, axis))
+      *scale[axis]));
+  };
+
+  // All 3 axes binned in one pass over the triangles
+  Bin bins[3][BINS];
+  if(sah){
+    for(auto& axis_bins : bins){
+      for(auto& bin : axis_bins) resetBounds(bin.lo, bin.hi);
+    }
+    for(uint32_t i = first; i < first + count; ++i){
+      const BuildState::Ref& ref = state.refs[i];
+      for(uint32_t axis = 0; axis < 3; ++axis){
+        Bin& bin = bins[axis][binOf(ref, axis)];
+        ++bin.count;
+        bin.lo = glm::min(bin.lo, ref.lo);
+        bin.hi = glm::max(bin.hi, ref.hi);
+      }
+    }
+  }
+
+  float best_cost = std::numeric_limits<float>::max();
+  uint32_t best_axis = 3;
+  uint32_t best_split = 0;
+  for(uint32_t axis = 0; sah && axis < 3; ++axis){
+    if(scale[axis] == 0.0f) continue;
+
+    // Right side of every split, then sweep the left side across
+    float right_cost[BINS] = {};
+    Bin right;
+    resetBounds(right.lo, right.hi);
+    for(uint32_t b = BINS - 1; b > 0; --b){
+      right.count += bins[axis][b].count;
+      right.lo = glm::min(right.lo, bins[axis][b].lo);
+      right.hi = glm::max(right.hi, bins[axis][b].hi);
+      right_cost[b] = right.count ? right.count*halfArea(right.lo, right.hi)
+        : 0.0f;
+    }
+    Bin left;
+    resetBounds(left.lo, left.hi);
+    for(uint32_t b = 0; b + 1 < BINS; ++b){
+      left.count += bins[axis][b].count;
+      left.lo = glm::min(left.lo, bins[axis][b].lo);
+      left.hi = glm::max(left.hi, bins[axis][b].hi);
+      if(left.count == 0 || left.count == count) continue;
+      float cost = left.count*halfArea(left.lo, left.hi) + right_cost[b + 1];
+      if(cost < best_cost){
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b + 1;
+      }
+    }
+  }
+
+  uint32_t middle = count/2;
+  if(best_axis < 3){
+    auto begin = state.refs.begin() + first;
+    auto split = std::partition(begin, begin + count,
+      [&](const BuildState::Ref& ref){
+        return binOf(ref, best_axis) < best_split;
+      });
+    middle = static_cast<uint32_t>(split - begin);
+  }
+  // Every centroid in one place (or too deep), halves in whatever order
+  if(middle == 0 || middle == count) middle = count/2;
+
+  const uint32_t left = state.node_count.fetch_add(2);
+  node.left = left;
+  node.count = 0;
+  state.nodes[left].first = first;
+  state.nodes[left].count = middle;
+  state.nodes[left + 1].first = first + middle;
+  state.nodes[left + 1].count = count - middle;
+
+  if(pool && count > PARALLEL_TRIANGLES){
+    auto right = pool->submit([&state, left, depth, pool, this]{
+      buildRange(state, left + 1, depth + 1, pool);
+    });
+    buildRange(state, left, depth + 1, pool);
+    pool->wait(right);
+    right.get();
+  }else{
+    buildRange(state, left, depth + 1, pool);
+    buildRange(state, left + 1, depth + 1, pool);
+  }
+}
+
+uint32_t Bvh::collapse(const BuildState& state, uint32_t index){
+  // A lone leaf (tiny mesh) gets a node of its own
+  uint32_t children[WIDTH];
+  uint32_t count = 0;
+  const BuildNode& root = state.nodes[index];
+  if(root.count > 0){
+    children[count++] = index;
+  }else{
+    children[count++] = root.left;
+    children[count++] = root.left + 1;
+  }
+
+  // Open up the biggest inner child until the node is full
+  while(count < WIDTH){
+    int best = -1;
+    float best_area = -1.0f;
+    for(uint32_t i = 0; i < count; ++i){
+      const BuildNode& child = state.nodes[children[i]];
+      float area = halfArea(child.lo, child.hi);
+      if(child.count == 0 && area > best_area){
+        best = static_cast<int>(i);
+        best_area = area;
+      }
+    }
+    if(best < 0) break;
+    const uint32_t left = state.nodes[children[best]].left;
+    children[best] = left;
+    children[count++] = left + 1;
+  }
+
+  // Filled in once the children have their indices
+  const uint32_t out = static_cast<uint32_t>(nodes_.size());
+  nodes_.emplace_back();
+  Node node{};
+  for(uint32_t i = 0; i < WIDTH; ++i){
+    if(i >= count){
+      node.child[i] = EMPTY;
+      continue;
+    }
+    const BuildNode& child = state.nodes[children[i]];
+    node.min_x[i] = child.lo.x;
+    node.min_y[i] = child.lo.y;
+    node.min_z[i] = child.lo.z;
+    node.max_x[i] = child.hi.x;
+    node.max_y[i] = child.hi.y;
+    node.max_z[i] = child.hi.z;
+    node.child[i] = child.count > 0 ? LEAF | addPack(state, child)
+      : collapse(state, children[i]);
+  }
+  nodes_[out] = node;
+  return out;
+}
+
+uint32_t Bvh::addPack(const BuildState& state, const BuildNode& leaf){
+  TrianglePack pack{};
+  for(uint32_t i = 0; i < WIDTH; ++i){
+    if(i >= leaf.count){
+      pack.triangle[i] = RayHit::NO_HIT;
+      continue;
+    }
+    const uint32_t t = state.refs[leaf.first + i].triangle;
+    const glm::vec3& a = state.positions[state.indices[3*t]];
+    const glm::vec3& b = state.positions[state.indices[3*t + 1]];
+    const glm::vec3& c = state.positions[state.indices[3*t + 2]];
+    for(uint32_t axis = 0; axis < 3; ++axis){
+      pack.v0[axis][i] = component(a, axis);
+      pack.e1[axis][i] = component(b, axis) - component(a, axis);
+      pack.e2[axis][i] = component(c, axis) - component(a, axis);
+    }
+    pack.triangle[i] = t;
+  }
+  packs_.push_back(pack);
+  return static_cast<uint32_t>(packs_.size() - 1);
+}
+
+RayHit Bvh::intersect(const Ray& ray) const{
+  RayHit hit;
+  hit.t = ray.t_max;
+  if(nodes_.empty()) return hit;
+
+  // Zero direction components get a huge finite inverse instead of inf,
+  // no 0*inf nans in the slab test
+  auto inverse = [](float d){
+    return 1.0f/(std::abs(d) > 1e-30f ? d : std::copysign(1e-30f, d));
+  };
+  const Float4 ox = splat(ray.origin.x);
+  const Float4 oy = splat(ray.origin.y);
+  const Float4 oz = splat(ray.origin.z);
+  const Float4 dx = splat(ray.direction.x);
+  const Float4 dy = splat(ray.direction.y);
+  const Float4 dz = splat(ray.direction.z);
+  const Float4 ix = splat(inverse(ray.direction.x));
+  const Float4 iy = splat(inverse(ray.direction.y));
+  const Float4 iz = splat(inverse(ray.direction.z));
+  const Float4 zero = splat(0.0f);
+  const Float4 one = splat(1.0f);
+
+  uint32_t stack[STACK_SIZE];
+  uint32_t size = 0;
+  stack[size++] = 0;
+  while(size > 0){
+    const uint32_t index = stack[--size];
+
+    if(index & LEAF){
+      // Moller-Trumbore, 4 triangles at once
+      const TrianglePack& pack = packs_[index & ~LEAF];
+      const Float4 e1x = load4(pack.e1[0]);
+      const Float4 e1y = load4(pack.e1[1]);
+      const Float4 e1z = load4(pack.e1[2]);
+      const Float4 e2x = load4(pack.e2[0]);
+      const Float4 e2y = load4(pack.e2[1]);
+      const Float4 e2z = load4(pack.e2[2]);
+
+      const Float4 px = dy*e2z - dz*e2y;
+      const Float4 py = dz*e2x - dx*e2z;
+      const Float4 pz = dx*e2y - dy*e2x;
+      const Float4 det = e1x*px + e1y*py + e1z*pz;
+      const Float4 inv_det = one/det;
+
+      const Float4 sx = ox - load4(pack.v0[0]);
+      const Float4 sy = oy - load4(pack.v0[1]);
+      const Float4 sz = oz - load4(pack.v0[2]);
+      const Float4 u = (sx*px + sy*py + sz*pz)*inv_det;
+
+      const Float4 qx = sy*e1z - sz*e1y;
+      const Float4 qy = sz*e1x - sx*e1z;
+      const Float4 qz = sx*e1y - sy*e1x;
+      const Float4 v = (dx*qx + dy*qy + dz*qz)*inv_det;
+      const Float4 t = (e2x*qx + e2y*qy + e2z*qz)*inv_det;
+
+      // Degenerate lanes (padding) have det 0, their nans fail every test
+      uint32_t mask = less(zero, det*det) & lessEqual(zero, u)
+        & lessEqual(zero, v) & lessEqual(u + v, one) & less(zero, t)
+        & less(t, splat(hit.t));
+      if(!mask) continue;
+
+      float ts[4], us[4], vs[4];
+      store4(t, ts);
+      store4(u, us);
+      store4(v, vs);
+      for(uint32_t i = 0; i < WIDTH; ++i){
+        if(!(mask & (1u << i)) || ts[i] >= hit.t) continue;
+        hit.triangle = pack.triangle[i];
+        hit.t = ts[i];
+        hit.u = us[i];
+        hit.v = vs[i];
+      }
+      continue;
+    }
+
+    // Slab test of the 4 child boxes, clipped to what's left of the ray
+    const Node& node = nodes_[index];
+    const Float4 t0x = (load4(node.min_x) - ox)*ix;
+    const Float4 t1x = (load4(node.max_x) - ox)*ix;
+    const Float4 t0y = (load4(node.min_y) - oy)*iy;
+    const Float4 t1y = (load4(node.max_y) - oy)*iy;
+    const Float4 t0z = (load4(node.min_z) - oz)*iz;
+    const Float4 t1z = (load4(node.max_z) - oz)*iz;
+    const Float4 t_near = max4(max4(min4(t0x, t1x), min4(t0y, t1y)),
+      max4(min4(t0z, t1z), zero));
+    const Float4 t_far = min4(min4(max4(t0x, t1x), max4(t0y, t1y)),
+      min4(max4(t0z, t1z), splat(hit.t)));
+    const uint32_t mask = lessEqual(t_near, t_far);
+    if(!mask) continue;
+
+    // Farthest pushed first, the nearest is visited next
+    float near[4];
+    store4(t_near, near);
+    uint32_t hits[WIDTH];
+    uint32_t hit_count = 0;
+    for(uint32_t i = 0; i < WIDTH; ++i){
+      if(!(mask & (1u << i)) || node.child[i] == EMPTY) continue;
+      uint32_t j = hit_count++;
+      for(; j > 0 && near[hits[j - 1]] < near[i]; --j) hits[j] = hits[j - 1];
+      hits[j] = i;
+    }
+    for(uint32_t j = 0; j < hit_count; ++j)
+      stack[size++] = node.child[hits[j]];
+  }
+  return hit;
+}
+
+void Bvh::overlap(const glm::vec3& lo, const glm::vec3& hi,
+  std::vector<uint32_t>& triangles) const{
+  if(nodes_.empty()) return;
+
+  const Float4 lo_x = splat(lo.x), lo_y = splat(lo.y), lo_z = splat(lo.z);
+  const Float4 hi_x = splat(hi.x), hi_y = splat(hi.y), hi_z = splat(hi.z);
+
+  uint32_t stack[STACK_SIZE];
+  uint32_t size = 0;
+  stack[size++] = 0;
+  while(size > 0){
+    const uint32_t index = stack[--size];
+
+    if(index & LEAF){
+      const TrianglePack& pack = packs_[index & ~LEAF];
+      for(uint32_t i = 0; i < WIDTH; ++i){
+        if(pack.triangle[i] == RayHit::NO_HIT) continue;
+        bool overlaps = true;
+        for(uint32_t axis = 0; axis < 3; ++axis){
+          float v0 = pack.v0[axis][i];
+          float v1 = v0 + pack.e1[axis][i];
+          float v2 = v0 + pack.e2[axis][i];
+          overlaps = overlaps
+            && std::min({v0, v1, v2}) <= component(hi, axis)
+            && std::max({v0, v1, v2}) >= component(lo, axis);
+        }
+        if(overlaps) triangles.push_back(pack.triangle[i]);
+      }
+      continue;
+    }
+
+    const Node& node = nodes_[index];
+    const uint32_t mask = lessEqual(load4(node.min_x), hi_x)
+      & lessEqual(load4(node.min_y), hi_y) & lessEqual(load4(node.min_z), hi_z)
+      & lessEqual(lo_x, load4(node.max_x)) & lessEqual(lo_y, load4(node.max_y))
+      & lessEqual(lo_z, load4(node.max_z));
+    for(uint32_t i = 0; i < WIDTH; ++i){
+      if((mask & (1u << i)) && node.child[i] != EMPTY)
+        stack[size++] = node.child[i];
+    }
+  }
+}
+
+void Bvh::save(const std::string& path) const{
+  std::ofstream out(path, std::ios::binary);
+  if(!out.is_open())
+    throw std::runtime_error("Failed to open bvh file " + path);
+
+  out.write(MAGIC, sizeof(MAGIC));
+  out.write(reinterpret_cast<const char*>(&VERSION), sizeof(VERSION));
+  out.write(reinterpret_cast<const char*>(&triangle_count_),
+    sizeof(triangle_count_));
+  writeArray(out, nodes_);
+  writeArray(out, packs_);
+
+  if(!out)
+    throw std::runtime_error("Failed to write bvh file " + path);
+}
+
+void Bvh::load(const std::string& path){
+  std::ifstream in(path, std::ios::binary);
+  if(!in.is_open())
+    throw std::runtime_error("Failed to open bvh file " + path);
+
+  char magic[sizeof(MAGIC)] = {};
+  uint32_t version = 0;
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char*>(&version), sizeof(version));
+  if(!in || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+    || version != VERSION){
+    throw std::runtime_error("Not a bvh file " + path);
+  }
+
+  in.read(reinterpret_cast<char*>(&triangle_count_), sizeof(triangle_count_));
+  readArray(in, nodes_);
+  readArray(in, packs_);
+  if(!in){
+    nodes_.clear();
+    packs_.clear();
+    throw std::runtime_error("Failed to read bvh file " + path);
+  }
+
+  // Traversal follows these without checking. Children come after their
+  // node, which also rules out cycles.
+  bool valid = true;
+  for(uint32_t n = 0; n < nodes_.size() && valid; ++n){
+    for(uint32_t child : nodes_[n].child){
+      if(child == EMPTY) continue;
+      if(child & LEAF) valid &= (child & ~LEAF) < packs_.size();
+      else valid &= child > n && child < nodes_.size();
+    }
+  }
+  for(const auto& pack : packs_){
+    for(uint32_t triangle : pack.triangle){
+      valid &= triangle == RayHit::NO_HIT || triangle < triangle_count_;
+    }
+  }
+  if(!valid){
+    nodes_.clear();
+    packs_.clear();
+    triangle_count_ = 0;
+    throw std::runtime_error("Corrupt bvh file " + path);
+  }
+}
+
+}  // namespace va
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+namespace va {
+
+class ThreadPool;
+
+struct Ray {
+  glm::vec3 origin{0.0f};
+  // Need not be normalized, t is in multiples of it
+  glm::vec3 direction{0.0f, 0.0f, 1.0f};
+  float t_max = std::numeric_limits<float>::infinity();
+};
+
+struct RayHit {
+  static constexpr uint32_t NO_HIT = 0xffffffff;
+
+  uint32_t triangle = NO_HIT;  // index of the triangle's first index / 3
+  float t = std::numeric_limits<float>::infinity();
+  // Barycentrics of the hit, weights of the triangle's 2nd and 3rd vertex
+  float u = 0.0f;
+  float v = 0.0f;
+
+  bool hit() const { return triangle != NO_HIT; }
+};
+
+/*
+ * Bounding volume hierarchy over a triangle mesh, for ray picking and
+ * overlap queries on the cpu.
+ *
+ * Built as a binary tree with a binned surface area heuristic, subtrees
+ * over PARALLEL_TRIANGLES triangles going to the thread pool. Then
+ * collapsed into 4 wide nodes: the 4 child boxes of a node are stored as
+ * structures of arrays and the triangles of a leaf as one pack of up to 4,
+ * so a ray tests 4 boxes or 4 triangles at a time with sse (plain c++
+ * where sse isn't available).
+ *
+ * The nodes and packs are plain data, save() and load() cache them on
+ * disk next to the mesh.
+ *
+ * eg.
+ * Bvh bvh;
+ * bvh.build(positions, indices, &pool);
+ * RayHit hit = bvh.intersect(ray);
+ * if(hit.hit()) ...
+ */
+class Bvh {
+ public:
+  // Leaf packs hold this many triangles, nodes this many children
+  static constexpr uint32_t WIDTH = 4;
+  // Child slots: a node index, LEAF | pack index, or EMPTY
+  static constexpr uint32_t LEAF = 0x80000000;
+  static constexpr uint32_t EMPTY = 0xffffffff;
+
+  struct alignas(16) Node {
+    float min_x[WIDTH], min_y[WIDTH], min_z[WIDTH];
+    float max_x[WIDTH], max_y[WIDTH], max_z[WIDTH];
+    uint32_t child[WIDTH];
+  };
+
+  // Moller-Trumbore ready: first vertex and the two edges from it. Unused
+  // lanes are degenerate and never hit.
+  struct alignas(16) TrianglePack {
+    float v0[3][WIDTH];
+    float e1[3][WIDTH];
+    float e2[3][WIDTH];
+    uint32_t triangle[WIDTH];
+  };
+
+  // Runs on the calling thread when pool is null.
+  void build(const std::vector<glm::vec3>& positions,
+    const std::vector<uint32_t>& indices, ThreadPool* pool);
+
+  // Closest hit within (0, ray.t_max)
+  RayHit intersect(const Ray& ray) const;
+
+  // Triangles whose bounding box overlaps [lo, hi], a broad phase for
+  // collisions. Appended to triangles.
+  void overlap(const glm::vec3& lo, const glm::vec3& hi,
+    std::vector<uint32_t>& triangles) const;
+
+  bool empty() const { return nodes_.empty(); }
+  uint32_t triangleCount() const { return triangle_count_; }
+  size_t nodeCount() const { return nodes_.size(); }
+  size_t packCount() const { return packs_.size(); }
+
+  // Both throw std::runtime_error on failure
+  void save(const std::string& path) const;
+  void load(const std::string& path);
+
+ private:
+  static constexpr uint32_t BINS = 16;
+  static constexpr uint32_t PARALLEL_TRIANGLES = 4096;
+
+  // Binary tree of the build, collapsed into nodes_ and packs_ after
+  struct BuildNode {
+    glm::vec3 lo;
+    glm::vec3 hi;
+    uint32_t left = 0;  // right is left + 1, none for a leaf
+    uint32_t first = 0;
+    uint32_t count = 0;  // triangles, 0 for an inner node
+  };
+  struct BuildState;
+
+  void buildRange(BuildState& state, uint32_t node, uint32_t depth,
+    ThreadPool* pool);
+  uint32_t collapse(const BuildState& state, uint32_t node);
+  uint32_t addPack(const BuildState& state, const BuildNode& leaf);
+
+  std::vector<Node> nodes_;
+  std::vector<TrianglePack> packs_;
+  uint32_t triangle_count_ = 0;
+};
+
+}  // namespace va
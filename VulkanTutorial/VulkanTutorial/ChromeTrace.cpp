@@ -0,0 +1,83 @@
+#include "ChromeTrace.h"
+
+#include <fstream>
+#include <stdexcept>
+
+namespace va {
+
+void writeJsonEscaped(std::ostream& out, const std::string& s){
+  for(char c : s){
+    switch(c){
+      case '"': out << "\\\""; break;
+      case '\\': out << "\\\\"; break;
+      case '\n': out << "\\n"; break;
+      case '\t': out << "\\t"; break;
+      default:
+        if(static_cast<unsigned char>(c) >= 0x20) out << c;
+        break;
+    }
+  }
+}
+
+ChromeTrace::ChromeTrace(size_t max_events) : max_events_(max_events) {}
+
+void ChromeTrace::addComplete(const std::string& name, const char* category,
+  uint32_t pid, uint32_t tid, double ts_us, double dur_us){
+  if(full()) return;
+  events_.push_back({name, category, 'X', pid, tid, ts_us, dur_us});
+}
+
+void ChromeTrace::setProcessName(uint32_t pid, const std::string& name){
+  metadata_.push_back({name, "process_name", 'M', pid, 0, 0.0, 0.0});
+}
+
+void ChromeTrace::setThreadName(uint32_t pid, uint32_t tid,
+  const std::string& name){
+  metadata_.push_back({name, "thread_name", 'M', pid, tid, 0.0, 0.0});
+}
+
+void ChromeTrace::append(const ChromeTrace& other){
+  for(const auto& event : other.events_){
+    if(full()) break;
+    events_.push_back(event);
+  }
+  metadata_.insert(metadata_.end(), other.metadata_.begin(),
+    other.metadata_.end());
+}
+
+void ChromeTrace::write(const std::string& path) const{
+  std::ofstream out(path);
+  if(!out.is_open())
+    throw std::runtime_error("Failed to open trace file " + path);
+
+  out.precision(3);
+  out << std::fixed;
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+  bool first = true;
+  for(const auto& m : metadata_){
+    if(!first) out << ",\n";
+    first = false;
+    // Metadata events carry the label in args, the event name is the kind
+    out << "{\"name\":\"" << m.category << "\",\"ph\":\"M\",\"pid\":" << m.pid
+        << ",\"tid\":" << m.tid << ",\"args\":{\"name\":\"";
+    writeJsonEscaped(out, m.name);
+    out << "\"}}";
+  }
+
+  for(const auto& e : events_){
+    if(!first) out << ",\n";
+    first = false;
+    out << "{\"name\":\"";
+    writeJsonEscaped(out, e.name);
+    out << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\",\"pid\":"
+        << e.pid << ",\"tid\":" << e.tid << ",\"ts\":" << e.ts_us
+        << ",\"dur\":" << e.dur_us << "}";
+  }
+  out << "\n]}\n";
+
+  if(!out)
+    throw std::runtime_error("Failed to write trace file " + path);
+}
+
+}  // namespace va
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace va {
+
+/*
+ * Collects events in the Chrome trace event format and writes them out as
+ * JSON. Open the file in chrome://tracing or ui.perfetto.dev.
+ *
+ * Only complete events ("ph":"X") are used, each scope is recorded once it
+ * has both a start and a duration. Timestamps are in microseconds, processes
+ * and threads are just ids to group rows, eg. pid 1 for the GPU queue.
+ */
+class ChromeTrace {
+ public:
+  // Events past max_events are dropped so a long run can't grow unbounded.
+  explicit ChromeTrace(size_t max_events = 200000);
+
+  void addComplete(const std::string& name, const char* category,
+    uint32_t pid, uint32_t tid, double ts_us, double dur_us);
+
+  // Label a process or thread row in the viewer.
+  void setProcessName(uint32_t pid, const std::string& name);
+  void setThreadName(uint32_t pid, uint32_t tid, const std::string& name);
+
+  // Append every event of other, eg. to merge cpu and gpu traces.
+  void append(const ChromeTrace& other);
+
+  size_t size() const { return events_.size(); }
+  bool full() const { return events_.size() >= max_events_; }
+  void clear() { events_.clear(); }
+
+  // Throws if the file can't be written.
+  void write(const std::string& path) const;
+
+ private:
+  struct Event {
+    std::string name;
+    const char* category;
+    char phase;
+    uint32_t pid;
+    uint32_t tid;
+    double ts_us;
+    double dur_us;
+  };
+
+  size_t max_events_;
+  std::vector<Event> events_;
+  std::vector<Event> metadata_;
+};
+
+// Writes s escaped for the inside of a JSON string, control chars dropped.
+void writeJsonEscaped(std::ostream& out, const std::string& s);
+
+}  // namespace va
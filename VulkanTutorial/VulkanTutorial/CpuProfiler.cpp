@@ -0,0 +1,223 @@
+#include "CpuProfiler.h"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+namespace va {
+
+void DurationHistogram::add(double ms){
+  size_t bucket = static_cast<size_t>(std::max(ms, 0.0) / BUCKET_MS);
+  ++buckets_[std::min(bucket, BUCKET_COUNT-1)];
+  ++count_;
+  sum_ms_ += ms;
+  max_ms_ = std::max(max_ms_, ms);
+}
+
+void DurationHistogram::clear(){
+  buckets_.fill(0);
+  count_ = 0;
+  sum_ms_ = 0.0;
+  max_ms_ = 0.0;
+}
+
+double DurationHistogram::percentile(double p) const{
+  if(count_ == 0) return 0.0;
+
+  uint64_t target = static_cast<uint64_t>(p * (count_-1)) + 1;
+  uint64_t seen = 0;
+  for(size_t i = 0; i < BUCKET_COUNT; ++i){
+    seen += buckets_[i];
+    if(seen >= target)
+      return std::min((i+1) * BUCKET_MS, max_ms_);
+  }
+  return max_ms_;
+}
+
+CpuProfiler& CpuProfiler::instance(){
+  static CpuProfiler profiler;
+  return profiler;
+}
+
+CpuProfiler::CpuProfiler() : origin_(Clock::now()) {}
+
+uint64_t CpuProfiler::now() const{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    Clock::now() - origin_).count();
+}
+
+void CpuProfiler::record(const char* name, uint64_t start_ns,
+  uint64_t end_ns){
+  ThreadRing& ring = threadRing();
+
+  uint64_t pos = ring.written.load(std::memory_order_relaxed);
+  ring.events[pos % RING_SIZE] = {name, start_ns, end_ns};
+  ring.written.store(pos+1, std::memory_order_release);
+}
+
+void CpuProfiler::setThreadName(const std::string& name){
+  ThreadRing& ring = threadRing();
+  std::lock_guard<std::mutex> lock(rings_mutex_);
+  ring.name = name;
+}
+
+CpuProfiler::RingOwner::~RingOwner(){
+  // Thread locals go before statics, the profiler is still there
+  if(ring) CpuProfiler::instance().releaseRing(*ring);
+}
+
+CpuProfiler::ThreadRing& CpuProfiler::threadRing(){
+  thread_local RingOwner owner;
+  if(owner.ring) return *owner.ring;
+
+  std::lock_guard<std::mutex> lock(rings_mutex_);
+  ThreadRing* ring;
+  if(!free_rings_.empty()){
+    // written keeps counting so the read cursor stays valid
+    ring = free_rings_.back();
+    free_rings_.pop_back();
+    ring->owner_start = ring->written.load(std::memory_order_relaxed);
+    ring->alive = true;
+  }else{
+    rings_.push_back(std::make_unique<ThreadRing>());
+    ring = rings_.back().get();
+    ring->tid = static_cast<uint32_t>(rings_.size() - 1);
+  }
+  ring->name = "thread " + std::to_string(ring->tid);
+  owner.ring = ring;
+  return *ring;
+}
+
+void CpuProfiler::releaseRing(ThreadRing& ring){
+  std::lock_guard<std::mutex> lock(rings_mutex_);
+  ring.alive = false;
+  free_rings_.push_back(&ring);
+}
+
+void CpuProfiler::endFrame(){
+  uint64_t now_ns = now();
+
+  // Drain new events into the per scope histograms
+  {
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    for(auto& ring : rings_){
+      uint64_t written = ring->written.load(std::memory_order_acquire);
+      // A dead ring is drained once, after that it has nothing new
+      if(!ring->alive && ring->read_cursor == written) continue;
+      uint64_t begin = std::max(ring->read_cursor,
+        written > RING_SIZE ? written - RING_SIZE : 0);
+
+      for(uint64_t i = begin; i < written; ++i){
+        const Event& e = ring->events[i % RING_SIZE];
+        scope_times_[e.name].add((e.end_ns - e.start_ns) / 1e6);
+      }
+      ring->read_cursor = written;
+    }
+  }
+
+  if(frame_number_ > 0){
+    double frame_ms = (now_ns - frame_start_ns_) / 1e6;
+
+    if(skip_next_frame_){
+      // This frame paid for writing the last spike trace
+      skip_next_frame_ = false;
+    }else{
+      if(spike_captures_left_ > 0
+        && frame_times_.count() >= SPIKE_WARMUP_FRAMES){
+        double threshold = spike_threshold_ms_ > 0.0 ?
+          spike_threshold_ms_ : 3.0 * frame_times_.percentile(0.5);
+        if(frame_ms > threshold){
+          writeSpikeTrace(frame_number_, frame_ms);
+          skip_next_frame_ = true;
+        }
+      }
+      frame_times_.add(frame_ms);
+    }
+  }
+
+  recent_frame_starts_.push_back(frame_start_ns_);
+  while(recent_frame_starts_.size() > SPIKE_CONTEXT_FRAMES)
+    recent_frame_starts_.pop_front();
+
+  frame_start_ns_ = now_ns;
+  ++frame_number_;
+}
+
+void CpuProfiler::enableSpikeCapture(const std::string& prefix,
+  double threshold_ms, uint32_t max_captures){
+  spike_prefix_ = prefix;
+  spike_threshold_ms_ = threshold_ms;
+  spike_captures_left_ = max_captures;
+}
+
+std::string CpuProfiler::report() const{
+  std::ostringstream out;
+  out.precision(3);
+  out << std::fixed;
+
+  auto line = [&out](const std::string& name, const DurationHistogram& h){
+    out << name << ": p50 " << h.percentile(0.5) << " ms, p99 "
+        << h.percentile(0.99) << " ms, max " << h.max() << " ms, mean "
+        << h.mean() << " ms (" << h.count() << ")\n";
+  };
+
+  line("frame", frame_times_);
+  for(const auto& entry : scope_times_)
+    line("  " + entry.first, entry.second);
+  return out.str();
+}
+
+ChromeTrace CpuProfiler::captureTrace(uint64_t since_ns) const{
+  ChromeTrace trace;
+  trace.setProcessName(TRACE_PID, "CPU");
+
+  std::lock_guard<std::mutex> lock(rings_mutex_);
+  std::vector<Event> events;
+
+  for(const auto& ring : rings_){
+    if(!ring->alive) continue;
+    trace.setThreadName(TRACE_PID, ring->tid, ring->name);
+
+    uint64_t written = ring->written.load(std::memory_order_acquire);
+    uint64_t begin = std::max(ring->owner_start,
+      written > RING_SIZE ? written - RING_SIZE : 0);
+
+    events.clear();
+    for(uint64_t i = begin; i < written; ++i)
+      events.push_back(ring->events[i % RING_SIZE]);
+
+    // The owning thread kept writing, anything it wrapped over is garbage.
+    uint64_t after = ring->written.load(std::memory_order_acquire);
+    uint64_t valid_from = after > RING_SIZE ? after - RING_SIZE : 0;
+    size_t skip = valid_from > begin ?
+      static_cast<size_t>(std::min<uint64_t>(valid_from - begin,
+        events.size())) : 0;
+
+    for(size_t i = skip; i < events.size(); ++i){
+      const Event& e = events[i];
+      if(e.end_ns < since_ns) continue;
+      trace.addComplete(e.name, "cpu", TRACE_PID, ring->tid,
+        e.start_ns / 1000.0, (e.end_ns - e.start_ns) / 1000.0);
+    }
+  }
+  return trace;
+}
+
+void CpuProfiler::writeSpikeTrace(uint64_t frame, double frame_ms){
+  uint64_t since = recent_frame_starts_.empty() ?
+    frame_start_ns_ : recent_frame_starts_.front();
+
+  std::string path = spike_prefix_ + "_" + std::to_string(frame) + ".json";
+  try{
+    captureTrace(since).write(path);
+    --spike_captures_left_;
+    std::cout << "Frame " << frame << " took " << frame_ms
+              << " ms, trace written to " << path << std::endl;
+  }catch(const std::exception& e){
+    // Don't take the app down over a diagnostic
+    std::cerr << e.what() << std::endl;
+    spike_captures_left_ = 0;
+  }
+}
+
+}  // namespace va
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ChromeTrace.h"
+
+namespace va {
+
+/* Histogram of durations with fixed 50us buckets up to 250ms, anything
+ * longer lands in the last bucket (the exact max is kept separately).
+ * Cheap enough to add to every frame and gives percentiles without storing
+ * samples.
+ */
+class DurationHistogram {
+ public:
+  void add(double ms);
+  void clear();
+
+  // p in [0, 1], eg. 0.99. Returns the upper edge of the bucket.
+  double percentile(double p) const;
+  double max() const { return max_ms_; }
+  double mean() const { return count_ ? sum_ms_ / count_ : 0.0; }
+  uint64_t count() const { return count_; }
+
+ private:
+  static constexpr double BUCKET_MS = 0.05;
+  static constexpr size_t BUCKET_COUNT = 5000;
+
+  std::array<uint32_t, BUCKET_COUNT> buckets_{};
+  uint64_t count_ = 0;
+  double sum_ms_ = 0.0;
+  double max_ms_ = 0.0;
+};
+
+/*
+ * Low overhead CPU instrumentation.
+ *
+ * VA_TRACE_SCOPE("name") times the rest of the enclosing block. Every thread
+ * writes into its own ring buffer, so recording an event is a clock read and
+ * a store, no lock and no allocation. Names must be string literals (only
+ * the pointer is stored).
+ *
+ * The main thread calls endFrame() once per frame. It drains every ring into
+ * per scope histograms and the frame time histogram. The rings keep the last
+ * RING_SIZE events of each thread, so when a frame takes too long the
+ * surrounding frames can still be written out as a trace (spike capture).
+ * A thread's ring goes back to a free list when it exits and the next new
+ * thread takes it over, so threads coming and going don't pile up rings.
+ */
+class CpuProfiler {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  static CpuProfiler& instance();
+
+  // Nanoseconds since the profiler was created.
+  uint64_t now() const;
+
+  void record(const char* name, uint64_t start_ns, uint64_t end_ns);
+
+  // Label the calling thread's row in traces.
+  void setThreadName(const std::string& name);
+
+  /* Close the frame, drain events and check for a spike. threshold_ms of 0
+   * means 3x the median frame time.
+   */
+  void endFrame();
+
+  /* Write a trace of the frames around any frame slower than threshold_ms to
+   * <prefix>_<frame>.json. At most max_captures files are written.
+   */
+  void enableSpikeCapture(const std::string& prefix, double threshold_ms = 0.0,
+    uint32_t max_captures = 8);
+
+  const DurationHistogram& frameTimes() const { return frame_times_; }
+
+  // Frame time and per scope p50/p99/max.
+  std::string report() const;
+
+  // Everything still held in the rings as a trace.
+  ChromeTrace captureTrace() const { return captureTrace(0); }
+
+ private:
+  static constexpr size_t RING_SIZE = 1 << 14;
+  static constexpr uint32_t TRACE_PID = 0;
+  static constexpr size_t SPIKE_CONTEXT_FRAMES = 3;
+  static constexpr uint64_t SPIKE_WARMUP_FRAMES = 60;
+
+  struct Event {
+    const char* name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+  };
+
+  /* Single producer ring. Only the owning thread writes, written is
+   * published with release so a reader sees complete events up to it.
+   * Events older than written - RING_SIZE may be overwritten while being
+   * read, readers re-check written afterwards and drop those.
+   */
+  struct ThreadRing {
+    std::array<Event, RING_SIZE> events;
+    std::atomic<uint64_t> written{0};
+    uint64_t read_cursor = 0;  // main thread only
+    // Rest under rings_mutex_. Events before owner_start belong to a
+    // previous owner.
+    uint64_t owner_start = 0;
+    bool alive = true;
+    uint32_t tid = 0;
+    std::string name;
+  };
+
+  // Hands the ring back when its thread exits
+  struct RingOwner {
+    ThreadRing* ring = nullptr;
+    ~RingOwner();
+  };
+
+  CpuProfiler();
+
+  ThreadRing& threadRing();
+  void releaseRing(ThreadRing& ring);
+
+  // Copy the events that ended after since_ns from every ring.
+  ChromeTrace captureTrace(uint64_t since_ns) const;
+  void writeSpikeTrace(uint64_t frame, double frame_ms);
+
+  const Clock::time_point origin_;
+
+  // Registration only, recording never takes this lock.
+  mutable std::mutex rings_mutex_;
+  std::vector<std::unique_ptr<ThreadRing>> rings_;
+  std::vector<ThreadRing*> free_rings_;
+
+  // Main thread state
+  uint64_t frame_number_ = 0;
+  uint64_t frame_start_ns_ = 0;
+  std::deque<uint64_t> recent_frame_starts_;
+  bool skip_next_frame_ = false;
+  DurationHistogram frame_times_;
+  std::map<std::string, DurationHistogram> scope_times_;
+
+  std::string spike_prefix_;
+  double spike_threshold_ms_ = 0.0;
+  uint32_t spike_captures_left_ = 0;
+};
+
+/* Records the time between construction and destruction.
+ */
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(const char* name)
+    : name_(name), start_(CpuProfiler::instance().now()) {}
+  ~ScopedTimer() {
+    CpuProfiler::instance().record(name_, start_,
+      CpuProfiler::instance().now());
+  }
+
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+ private:
+  const char* name_;
+  uint64_t start_;
+};
+
+}  // namespace va
+
+#define VA_TRACE_CONCAT_INNER(a, b) a##b
+#define VA_TRACE_CONCAT(a, b) VA_TRACE_CONCAT_INNER(a, b)
+#define VA_TRACE_SCOPE(name) \
+  ::va::ScopedTimer VA_TRACE_CONCAT(va_trace_scope_, __LINE__)(name)
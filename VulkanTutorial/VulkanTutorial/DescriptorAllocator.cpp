@@ -0,0 +1,179 @@
+#include "DescriptorAllocator.h"
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+namespace va {
+
+void DescriptorAllocator::init(VkDevice device, uint32_t sets_per_pool,
+  DescriptorPoolSizes sizes){
+  device_ = device;
+  next_pool_sets_ = sets_per_pool;
+  sizes_ = std::move(sizes);
+}
+
+void DescriptorAllocator::cleanUp(){
+  for(auto pool : used_pools_)
+    vkDestroyDescriptorPool(device_, pool, nullptr);
+  for(auto pool : free_pools_)
+    vkDestroyDescriptorPool(device_, pool, nullptr);
+
+  used_pools_.clear();
+  free_pools_.clear();
+  current_pool_ = VK_NULL_HANDLE;
+}
+
+void DescriptorAllocator::resetPools(){
+  for(auto pool : used_pools_){
+    vkResetDescriptorPool(device_, pool, 0);
+    free_pools_.push_back(pool);
+  }
+
+  used_pools_.clear();
+  current_pool_ = VK_NULL_HANDLE;
+}
+
+bool DescriptorAllocator::allocate(VkDescriptorSetLayout layout,
+  VkDescriptorSet& set){
+  if(current_pool_ == VK_NULL_HANDLE){
+    current_pool_ = grabPool();
+    used_pools_.push_back(current_pool_);
+  }
+
+  VkDescriptorSetAllocateInfo alloc_info{};
+  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  alloc_info.descriptorPool = current_pool_;
+  alloc_info.descriptorSetCount = 1;
+  alloc_info.pSetLayouts = &layout;
+
+  // Common case, the current pool still has room.
+  VkResult result = vkAllocateDescriptorSets(device_, &alloc_info, &set);
+  if(result == VK_SUCCESS) return true;
+
+  if(result != VK_ERROR_FRAGMENTED_POOL
+    && result != VK_ERROR_OUT_OF_POOL_MEMORY){
+    throw std::runtime_error("Failed to allocate descriptor set");
+  }
+
+  // Pool is full, chain on another one and try once more.
+  current_pool_ = grabPool();
+  used_pools_.push_back(current_pool_);
+  alloc_info.descriptorPool = current_pool_;
+
+  return vkAllocateDescriptorSets(device_, &alloc_info, &set) == VK_SUCCESS;
+}
+
+VkDescriptorPool DescriptorAllocator::grabPool(){
+  if(!free_pools_.empty()){
+    VkDescriptorPool pool = free_pools_.back();
+    free_pools_.pop_back();
+    return pool;
+  }
+
+  VkDescriptorPool pool = createPool(next_pool_sets_);
+
+  // Each new pool is twice as big as the last so the chain stays short.
+  next_pool_sets_ = std::min(next_pool_sets_*2, MAX_SETS_PER_POOL);
+  return pool;
+}
+
+VkDescriptorPool DescriptorAllocator::createPool(uint32_t set_count){
+  std::vector<VkDescriptorPoolSize> dp_sizes;
+  dp_sizes.reserve(sizes_.ratios.size());
+
+  for(const auto& ratio : sizes_.ratios){
+    VkDescriptorPoolSize size{};
+    size.type = ratio.first;
+    size.descriptorCount = std::max(1u,
+      static_cast<uint32_t>(ratio.second * set_count));
+    dp_sizes.push_back(size);
+  }
+
+  VkDescriptorPoolCreateInfo dp_info{};
+  dp_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  // No FREE_DESCRIPTOR_SET_BIT, sets are only ever released with a reset.
+  dp_info.flags = 0;
+  dp_info.maxSets = set_count;
+  dp_info.poolSizeCount = static_cast<uint32_t>(dp_sizes.size());
+  dp_info.pPoolSizes = dp_sizes.data();
+
+  VkDescriptorPool pool;
+  if(vkCreateDescriptorPool(device_, &dp_info, nullptr, &pool) != VK_SUCCESS){
+    throw std::runtime_error("Failed to create descriptor pool");
+  }
+  return pool;
+}
+
+void DescriptorLayoutCache::cleanUp(){
+  for(const auto& entry : layouts_)
+    vkDestroyDescriptorSetLayout(device_, entry.second, nullptr);
+  layouts_.clear();
+}
+
+VkDescriptorSetLayout DescriptorLayoutCache::createDescriptorLayout(
+  const VkDescriptorSetLayoutCreateInfo& info){
+  if(info.pNext != nullptr)
+    throw std::runtime_error("Descriptor set layout pNext is not supported");
+
+  LayoutSignature sig;
+  sig.flags = info.flags;
+  sig.bindings.assign(info.pBindings, info.pBindings + info.bindingCount);
+
+  // Sort by binding number so the same bindings given in a different order
+  // map to the same layout.
+  std::sort(sig.bindings.begin(), sig.bindings.end(),
+    [](const VkDescriptorSetLayoutBinding& a,
+       const VkDescriptorSetLayoutBinding& b){
+      return a.binding < b.binding;
+    });
+
+  auto it = layouts_.find(sig);
+  if(it != layouts_.end()) return it->second;
+
+  VkDescriptorSetLayout layout;
+  if(vkCreateDescriptorSetLayout(device_, &info, nullptr, &layout)
+    != VK_SUCCESS){
+    throw std::runtime_error("Failed to create descriptor set layout");
+  }
+
+  layouts_.emplace(std::move(sig), layout);
+  return layout;
+}
+
+bool DescriptorLayoutCache::LayoutSignature::operator==(
+  const LayoutSignature& other) const{
+  if(flags != other.flags || bindings.size() != other.bindings.size())
+    return false;
+
+  for(size_t i = 0; i < bindings.size(); ++i){
+    const auto& a = bindings[i];
+    const auto& b = other.bindings[i];
+    if(a.binding != b.binding
+      || a.descriptorType != b.descriptorType
+      || a.descriptorCount != b.descriptorCount
+      || a.stageFlags != b.stageFlags
+      || a.pImmutableSamplers != b.pImmutableSamplers){
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t DescriptorLayoutCache::LayoutSignature::hash() const{
+  size_t result = std::hash<size_t>()(bindings.size())
+    ^ std::hash<uint32_t>()(flags) << 1;
+
+  for(const auto& b : bindings){
+    // Pack binding, type, count and stages into one word per binding.
+    size_t word = static_cast<size_t>(b.binding)
+      | static_cast<size_t>(b.descriptorType) << 8
+      | static_cast<size_t>(b.descriptorCount) << 16
+      | static_cast<size_t>(b.stageFlags) << 24;
+    result ^= std::hash<size_t>()(word) + 0x9e3779b9
+      + (result << 6) + (result >> 2);
+  }
+  return result;
+}
+
+}  // namespace va
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define GLFW_INCLUDE_VULKAN
+#include "GLFW/glfw3.h"
+
+namespace va {
+
+/* Relative number of descriptors of each type per descriptor set. A pool
+ * created for N sets holds ratio*N descriptors of each type.
+ */
+struct DescriptorPoolSizes {
+  std::vector<std::pair<VkDescriptorType, float>> ratios = {
+    {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2.0f},
+    {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1.0f},
+    {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2.0f},
+    {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2.0f},
+    {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1.0f}
+  };
+};
+
+/*
+ * Hands out descriptor sets from a chain of descriptor pools. When the
+ * current pool runs out, a new (bigger) one is chained on instead of failing.
+ * Sets are never freed one by one, resetPools() recycles every set allocated
+ * so far with a single vkResetDescriptorPool per pool. Pools are kept around
+ * after a reset so steady state allocation never creates a pool.
+ *
+ * eg. one allocator per frame in flight, reset at the start of the frame
+ * for transient sets, and one long lived allocator for persistent sets.
+ */
+class DescriptorAllocator {
+ public:
+  void init(VkDevice device, uint32_t sets_per_pool = 64,
+    DescriptorPoolSizes sizes = {});
+
+  // Destroys every pool. Sets allocated from this allocator become invalid.
+  void cleanUp();
+
+  // Recycle all sets allocated since the last reset.
+  void resetPools();
+
+  /* Allocate one set with the given layout. Returns false only if a freshly
+   * created pool can't hold the set either (layout needs a descriptor type
+   * missing from the pool sizes).
+   */
+  bool allocate(VkDescriptorSetLayout layout, VkDescriptorSet& set);
+
+  // Number of pools created so far, used and free.
+  size_t poolCount() const { return used_pools_.size() + free_pools_.size(); }
+
+ private:
+  VkDescriptorPool grabPool();
+  VkDescriptorPool createPool(uint32_t set_count);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  DescriptorPoolSizes sizes_;
+
+  // Pool currently allocated from, also the last element of used_pools_
+  VkDescriptorPool current_pool_ = VK_NULL_HANDLE;
+  std::vector<VkDescriptorPool> used_pools_;
+  std::vector<VkDescriptorPool> free_pools_;
+
+  // Size of the next pool to create, grows with every new pool.
+  uint32_t next_pool_sets_ = 64;
+  static constexpr uint32_t MAX_SETS_PER_POOL = 4096;
+};
+
+/*
+ * Creates descriptor set layouts and hands back the same handle for layouts
+ * with identical flags and bindings, so systems describing the same binding
+ * signature share one layout (and compatible pipeline layouts).
+ */
+class DescriptorLayoutCache {
+ public:
+  void init(VkDevice device) { device_ = device; }
+
+  void cleanUp();
+
+  /* Binding order in the create info doesn't matter. Throws
+   * std::runtime_error for a pNext chain, binding flags aren't part of the
+   * signature yet.
+   */
+  VkDescriptorSetLayout createDescriptorLayout(
+    const VkDescriptorSetLayoutCreateInfo& info);
+
+  struct LayoutSignature {
+    VkDescriptorSetLayoutCreateFlags flags = 0;
+    std::vector<VkDescriptorSetLayoutBinding> bindings;
+
+    bool operator==(const LayoutSignature& other) const;
+    size_t hash() const;
+  };
+
+ private:
+  struct SignatureHash {
+    size_t operator()(const LayoutSignature& sig) const { return sig.hash(); }
+  };
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  std::unordered_map<LayoutSignature, VkDescriptorSetLayout, SignatureHash>
+    layouts_;
+};
+
+}  // namespace va
@@ -0,0 +1,200 @@
+#include "FramePacer.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace va {
+
+namespace {
+double elapsedMs(FramePacer::Clock::time_point from,
+  FramePacer::Clock::time_point to){
+  return std::chrono::duration<double, std::milli>(to - from).count();
+}
+}  // namespace
+
+const char* presentPolicyName(PresentPolicy policy){
+  switch(policy){
+    case PresentPolicy::LowLatency: return "low latency";
+    case PresentPolicy::PowerSaving: return "power saving (fifo)";
+    case PresentPolicy::FifoRelaxed: return "fifo relaxed";
+    default: return "unknown";
+  }
+}
+
+VkPresentModeKHR choosePresentMode(PresentPolicy policy,
+  const std::vector<VkPresentModeKHR>& available_present_modes){
+  if(available_present_modes.empty())
+    throw std::runtime_error("No available present mode");
+
+  auto has_mode = [&](VkPresentModeKHR mode){
+    return std::find(available_present_modes.begin(),
+      available_present_modes.end(), mode) != available_present_modes.end();
+  };
+
+  switch(policy){
+    case PresentPolicy::LowLatency:
+      // Immediate shows the frame right away, mailbox at the next refresh
+      // but never waits.
+      if(has_mode(VK_PRESENT_MODE_IMMEDIATE_KHR))
+        return VK_PRESENT_MODE_IMMEDIATE_KHR;
+      if(has_mode(VK_PRESENT_MODE_MAILBOX_KHR))
+        return VK_PRESENT_MODE_MAILBOX_KHR;
+      break;
+    case PresentPolicy::FifoRelaxed:
+      if(has_mode(VK_PRESENT_MODE_FIFO_RELAXED_KHR))
+        return VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+      break;
+    default:
+      break;
+  }
+
+  // This is guaranteed to be available.
+  return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+uint32_t chooseSwapImageCount(VkPresentModeKHR present_mode,
+  const VkSurfaceCapabilitiesKHR& capabilities){
+  uint32_t count = capabilities.minImageCount;
+
+  if(present_mode == VK_PRESENT_MODE_MAILBOX_KHR){
+    // One displayed, one queued, one to render into.
+    count = std::max(count, 3u);
+  }else if(present_mode != VK_PRESENT_MODE_IMMEDIATE_KHR){
+    // Fifo modes: 1 more than minimum so the CPU isn't stalled on acquire.
+    ++count;
+  }
+
+  if(capabilities.maxImageCount > 0 && count > capabilities.maxImageCount){
+    count = capabilities.maxImageCount;
+  }
+  return count;
+}
+
+uint32_t policyFramesInFlight(PresentPolicy policy, uint32_t configured){
+  return policy == PresentPolicy::LowLatency ? 1 : configured;
+}
+
+void FramePacer::resetEstimates(){
+  has_frame_start_ = false;
+  period_ms_ = 0.0;
+  work_ms_ = 0.0;
+}
+
+void FramePacer::frameStart(){
+  auto now = Clock::now();
+
+  if(has_frame_start_){
+    double period = elapsedMs(frame_start_, now);
+    period_ms_ = period_ms_ == 0.0 ?
+      period : period_ms_ + EMA_WEIGHT * (period - period_ms_);
+  }
+  frame_start_ = now;
+  has_frame_start_ = true;
+}
+
+void FramePacer::waitForInputDeadline(){
+  if(!late_input_sampling_ || period_ms_ == 0.0) return;
+
+  // Latest point input can be read and the frame still make its present.
+  double spent_ms = elapsedMs(frame_start_, Clock::now());
+  double slack_ms = period_ms_ - spent_ms - work_ms_ - SAFETY_MARGIN_MS;
+  if(slack_ms <= 0.0) return;
+
+  std::this_thread::sleep_for(
+    std::chrono::duration<double, std::milli>(slack_ms));
+}
+
+void FramePacer::inputSampled(){
+  input_time_ = Clock::now();
+}
+
+void FramePacer::presented(uint64_t timeline_value){
+  auto now = Clock::now();
+  auto policy_idx = static_cast<size_t>(policy_);
+
+  double latency = elapsedMs(input_time_, now);
+  pushSample(present_latency_ms_[policy_idx], latency);
+
+  pending_.push_back({timeline_value, policy_, input_time_});
+
+  // Cap growth if the timeline is never polled
+  while(pending_.size() > MAX_SAMPLES) pending_.pop_front();
+}
+
+void FramePacer::gpuCompleted(uint64_t completed_value){
+  auto now = Clock::now();
+
+  while(!pending_.empty() && pending_.front().timeline_value
+    <= completed_value){
+    const auto& frame = pending_.front();
+    double latency = elapsedMs(frame.input_time, now);
+    pushSample(gpu_latency_ms_[static_cast<size_t>(frame.policy)], latency);
+
+    // Learn how long the work after input sampling takes, so the next frames
+    // don't sleep past their deadline.
+    if(frame.policy == policy_){
+      work_ms_ = work_ms_ == 0.0 ?
+        latency : work_ms_ + EMA_WEIGHT * (latency - work_ms_);
+    }
+    pending_.pop_front();
+  }
+}
+
+FramePacer::LatencyStats FramePacer::presentLatency(
+  PresentPolicy policy) const{
+  return computeStats(present_latency_ms_[static_cast<size_t>(policy)]);
+}
+
+FramePacer::LatencyStats FramePacer::gpuLatency(PresentPolicy policy) const{
+  return computeStats(gpu_latency_ms_[static_cast<size_t>(policy)]);
+}
+
+std::string FramePacer::report() const{
+  std::ostringstream out;
+  out.precision(3);
+  out << std::fixed;
+
+  for(size_t i = 0; i < POLICY_COUNT; ++i){
+    auto policy = static_cast<PresentPolicy>(i);
+    auto present = presentLatency(policy);
+    if(present.count == 0) continue;
+    auto gpu = gpuLatency(policy);
+
+    out << presentPolicyName(policy) << " (" << present.count << " frames)\n"
+        << "\tinput->present  mean " << present.mean_ms
+        << " ms, p50 " << present.p50_ms << " ms, p99 " << present.p99_ms
+        << " ms, max " << present.max_ms << " ms\n"
+        << "\tinput->gpu done mean " << gpu.mean_ms
+        << " ms, p50 " << gpu.p50_ms << " ms, p99 " << gpu.p99_ms
+        << " ms, max " << gpu.max_ms << " ms\n";
+  }
+  return out.str();
+}
+
+FramePacer::LatencyStats FramePacer::computeStats(
+  const std::deque<double>& samples_ms){
+  LatencyStats stats;
+  if(samples_ms.empty()) return stats;
+
+  std::vector<double> sorted(samples_ms.begin(), samples_ms.end());
+  std::sort(sorted.begin(), sorted.end());
+
+  double sum = 0.0;
+  for(double v : sorted) sum += v;
+
+  stats.count = sorted.size();
+  stats.mean_ms = sum / sorted.size();
+  stats.p50_ms = sorted[sorted.size()/2];
+  stats.p99_ms = sorted[std::min(sorted.size()-1, sorted.size()*99/100)];
+  stats.max_ms = sorted.back();
+  return stats;
+}
+
+void FramePacer::pushSample(std::deque<double>& samples, double value_ms){
+  samples.push_back(value_ms);
+  if(samples.size() > MAX_SAMPLES) samples.pop_front();
+}
+
+}  // namespace va
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define GLFW_INCLUDE_VULKAN
+#include "GLFW/glfw3.h"
+
+namespace va {
+
+/* How frames are handed to the display.
+ * LowLatency:  IMMEDIATE (or MAILBOX), 1 frame in flight, may tear.
+ * PowerSaving: FIFO, vsync'd and always available, frames in flight from
+ *              the render settings.
+ * FifoRelaxed: FIFO_RELAXED, vsync'd unless a frame is late, then it tears
+ *              instead of waiting another refresh.
+ */
+enum class PresentPolicy { LowLatency = 0, PowerSaving, FifoRelaxed, Count };
+
+const char* presentPolicyName(PresentPolicy policy);
+
+/* Pick the best supported present mode for the policy. FIFO is the fallback
+ * since it's guaranteed to be available.
+ */
+VkPresentModeKHR choosePresentMode(PresentPolicy policy,
+  const std::vector<VkPresentModeKHR>& available_present_modes);
+
+/* Number of swap chain images for the mode. Fewer images means less
+ * queueing (latency), mailbox needs 3 to never block.
+ */
+uint32_t chooseSwapImageCount(VkPresentModeKHR present_mode,
+  const VkSurfaceCapabilitiesKHR& capabilities);
+
+/* Frames in flight the policy wants, low latency always uses 1. */
+uint32_t policyFramesInFlight(PresentPolicy policy, uint32_t configured);
+
+/*
+ * Delays input sampling to just before the CPU needs it, and measures
+ * input-to-present latency for each present policy.
+ *
+ * The frame period is learned from how often frames start. Work after input
+ * sampling (uniform update, recording, submit, gpu) is learned from past
+ * frames. The pacer then sleeps for period - work - margin so input is
+ * sampled as late as possible without missing the next present.
+ *
+ * Each frame:
+ *   frameStart(); ...acquire...; waitForInputDeadline(); poll input;
+ *   inputSampled(); ...update/record/submit...; presented(timeline_value);
+ *   gpuCompleted(timeline completed value) whenever known.
+ */
+class FramePacer {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  void setPolicy(PresentPolicy policy) { policy_ = policy; }
+  PresentPolicy policy() const { return policy_; }
+
+  void setLateInputSampling(bool enable) { late_input_sampling_ = enable; }
+
+  // Discard learned period and work estimates, eg. after a present mode change
+  void resetEstimates();
+
+  void frameStart();
+
+  // Sleep until the predicted latest point input can be sampled.
+  void waitForInputDeadline();
+
+  void inputSampled();
+
+  // Frame was handed to present, it signals timeline_value when the GPU is done
+  void presented(uint64_t timeline_value);
+
+  // Timeline counter observed to have reached completed_value
+  void gpuCompleted(uint64_t completed_value);
+
+  struct LatencyStats {
+    size_t count = 0;
+    double mean_ms = 0.0;
+    double p50_ms = 0.0;
+    double p99_ms = 0.0;
+    double max_ms = 0.0;
+  };
+
+  /* Input sample -> vkQueuePresentKHR returned, and input sample -> GPU
+   * finished rendering the frame (upper bound of when it can be shown).
+   */
+  LatencyStats presentLatency(PresentPolicy policy) const;
+  LatencyStats gpuLatency(PresentPolicy policy) const;
+
+  // Human readable summary of every policy that rendered frames
+  std::string report() const;
+
+ private:
+  static LatencyStats computeStats(const std::deque<double>& samples_ms);
+  static void pushSample(std::deque<double>& samples, double value_ms);
+
+  PresentPolicy policy_ = PresentPolicy::PowerSaving;
+  bool late_input_sampling_ = true;
+
+  Clock::time_point frame_start_{};
+  Clock::time_point input_time_{};
+  bool has_frame_start_ = false;
+
+  // Exponential moving averages in milliseconds
+  double period_ms_ = 0.0;
+  double work_ms_ = 0.0;
+
+  // Never sleep closer than this to the predicted deadline
+  static constexpr double SAFETY_MARGIN_MS = 1.5;
+  static constexpr double EMA_WEIGHT = 0.1;
+  static constexpr size_t MAX_SAMPLES = 2048;
+
+  struct PendingFrame {
+    uint64_t timeline_value;
+    PresentPolicy policy;
+    Clock::time_point input_time;
+  };
+  std::deque<PendingFrame> pending_;
+
+  static constexpr size_t POLICY_COUNT =
+    static_cast<size_t>(PresentPolicy::Count);
+  std::array<std::deque<double>, POLICY_COUNT> present_latency_ms_;
+  std::array<std::deque<double>, POLICY_COUNT> gpu_latency_ms_;
+};
+
+}  // namespace va
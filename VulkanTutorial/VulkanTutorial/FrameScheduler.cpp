@@ -0,0 +1,112 @@
+#include "FrameScheduler.h"
+
+#include <stdexcept>
+
+namespace va {
+
+void FrameScheduler::init(VkDevice device, uint32_t frames_in_flight){
+  device_ = device;
+
+  VkSemaphoreTypeCreateInfo type_info{};
+  type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  type_info.initialValue = 0;
+
+  VkSemaphoreCreateInfo sem_info{};
+  sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  sem_info.pNext = &type_info;
+
+  if(vkCreateSemaphore(device_, &sem_info, nullptr, &timeline_)
+    != VK_SUCCESS){
+    throw std::runtime_error("Failed to create timeline semaphore");
+  }
+
+  last_signal_value_ = 0;
+  completed_value_ = 0;
+  createSlotSemaphores(frames_in_flight);
+}
+
+void FrameScheduler::cleanUp(){
+  destroySlotSemaphores();
+  vkDestroySemaphore(device_, timeline_, nullptr);
+  timeline_ = VK_NULL_HANDLE;
+}
+
+void FrameScheduler::setFramesInFlight(uint32_t frames_in_flight){
+  if(frames_in_flight == framesInFlight()) return;
+
+  // Binary semaphores may still be pending in a submit or present.
+  wait(last_signal_value_);
+  vkDeviceWaitIdle(device_);
+
+  destroySlotSemaphores();
+  createSlotSemaphores(frames_in_flight);
+}
+
+void FrameScheduler::beginFrame(){
+  wait(slot_values_[frame_idx_]);
+}
+
+void FrameScheduler::endFrame(uint64_t submitted_value){
+  slot_values_[frame_idx_] = submitted_value;
+  frame_idx_ = (frame_idx_+1) % framesInFlight();
+}
+
+void FrameScheduler::wait(uint64_t value){
+  // Nothing submitted yet, or already known to be done.
+  if(value <= completed_value_) return;
+
+  VkSemaphoreWaitInfo wait_info{};
+  wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  wait_info.semaphoreCount = 1;
+  wait_info.pSemaphores = &timeline_;
+  wait_info.pValues = &value;
+
+  if(vkWaitSemaphores(device_, &wait_info, UINT64_MAX) != VK_SUCCESS){
+    throw std::runtime_error("Failed waiting on timeline semaphore");
+  }
+  ++blocking_waits_;
+  completed_value_ = value;
+}
+
+uint64_t FrameScheduler::completedValue(){
+  uint64_t value = 0;
+  if(vkGetSemaphoreCounterValue(device_, timeline_, &value) == VK_SUCCESS
+    && value > completed_value_){
+    completed_value_ = value;
+  }
+  return completed_value_;
+}
+
+void FrameScheduler::createSlotSemaphores(uint32_t count){
+  if(count == 0)
+    throw std::invalid_argument("Need at least 1 frame in flight");
+
+  img_available_sems_.resize(count);
+  render_finish_sems_.resize(count);
+  slot_values_.assign(count, 0);
+  frame_idx_ = 0;
+
+  VkSemaphoreCreateInfo sem_info{};
+  sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+  for(uint32_t i = 0; i < count; ++i){
+    if(vkCreateSemaphore(device_, &sem_info, nullptr,
+                         &img_available_sems_[i]) != VK_SUCCESS ||
+       vkCreateSemaphore(device_, &sem_info, nullptr,
+                         &render_finish_sems_[i]) != VK_SUCCESS){
+      throw std::runtime_error("Failed to create sync objects for frame");
+    }
+  }
+}
+
+void FrameScheduler::destroySlotSemaphores(){
+  for(size_t i = 0; i < img_available_sems_.size(); ++i){
+    vkDestroySemaphore(device_, img_available_sems_[i], nullptr);
+    vkDestroySemaphore(device_, render_finish_sems_[i], nullptr);
+  }
+  img_available_sems_.clear();
+  render_finish_sems_.clear();
+}
+
+}  // namespace va
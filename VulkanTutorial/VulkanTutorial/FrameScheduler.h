@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vector>
+
+#define GLFW_INCLUDE_VULKAN
+#include "GLFW/glfw3.h"
+
+namespace va {
+
+/*
+ * Paces the CPU against the GPU with a single timeline semaphore
+ * (VK_KHR_timeline_semaphore, core in Vulkan 1.2).
+ *
+ * Every submission to the graphics queue, frames and uploads alike, signals
+ * the next value of one monotonically increasing counter. Waiting for a value
+ * means waiting for that submission and everything submitted before it.
+ *
+ * Each frame slot remembers the value its last submission signalled, so
+ * starting a frame is a single host wait on that value instead of a fence
+ * wait plus a fence reset plus a wait on the swap chain image's fence.
+ *
+ * Binary semaphores are still needed for the swap chain (acquire and present
+ * don't take timeline semaphores), one pair per frame slot.
+ */
+class FrameScheduler {
+ public:
+  void init(VkDevice device, uint32_t frames_in_flight);
+
+  void cleanUp();
+
+  /* Change the number of frames in flight. Waits for the GPU to finish all
+  * submitted work first.
+  */
+  void setFramesInFlight(uint32_t frames_in_flight);
+
+  uint32_t framesInFlight() const {
+    return static_cast<uint32_t>(slot_values_.size());
+  }
+
+  /* Block until the GPU is done with the work last submitted from the
+  * current frame slot. After this the slot's command buffer, uniform buffer
+  * and semaphores can be reused.
+  */
+  void beginFrame();
+
+  /* Reserve the value the next queue submission will signal. Values must be
+  * submitted to the queue in the order they were reserved.
+  */
+  uint64_t nextSignalValue() { return ++last_signal_value_; }
+
+  // Record what the current slot submitted and move to the next slot.
+  void endFrame(uint64_t submitted_value);
+
+  // Host wait until the counter reaches value.
+  void wait(uint64_t value);
+
+  // Reached once everything submitted so far is done.
+  uint64_t lastSignalValue() const { return last_signal_value_; }
+
+  // Highest value the GPU has finished, queried without blocking.
+  uint64_t completedValue();
+
+  uint32_t frameIndex() const { return frame_idx_; }
+
+  // Value the current slot's previous submission signals, 0 for none.
+  uint64_t slotValue() const { return slot_values_[frame_idx_]; }
+  VkSemaphore timeline() const { return timeline_; }
+  VkSemaphore imageAvailable() const { return img_available_sems_[frame_idx_]; }
+  VkSemaphore renderFinished() const { return render_finish_sems_[frame_idx_]; }
+
+  // Host waits that had to go to the driver, for tracking sync overhead.
+  uint64_t blockingWaitCount() const { return blocking_waits_; }
+
+ private:
+  void createSlotSemaphores(uint32_t count);
+  void destroySlotSemaphores();
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkSemaphore timeline_ = VK_NULL_HANDLE;
+
+  uint64_t last_signal_value_ = 0;
+  // Last value known to be reached, avoids a driver call for old values
+  uint64_t completed_value_ = 0;
+
+  uint32_t frame_idx_ = 0;
+  std::vector<uint64_t> slot_values_;  // per frame slot
+
+  std::vector<VkSemaphore> img_available_sems_;
+  std::vector<VkSemaphore> render_finish_sems_;
+
+  uint64_t blocking_waits_ = 0;
+};
+
+}  // namespace va
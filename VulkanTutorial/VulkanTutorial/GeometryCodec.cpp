@@ -0,0 +1,327 @@
+#include "GeometryCodec.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) \
+  || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VA_GEOMETRY_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "MeshRegistry.h"
+
+namespace va {
+
+namespace {
+constexpr uint32_t BLOCK_SIZE = 16;
+constexpr uint32_t VERTEX_WORDS = sizeof(Vertex)/sizeof(uint32_t);
+static_assert(sizeof(Vertex) == VERTEX_WORDS*sizeof(uint32_t),
+  "Vertex is encoded as whole 32 bit words");
+
+constexpr char MAGIC[4] = {'V', 'A', 'G', 'M'};
+constexpr uint32_t VERSION = 2;
+
+// Appends the 16 values of a block, previous is the value before it
+void encodeBlock(const uint32_t* values, uint32_t& previous,
+  std::vector<uint8_t>& out){
+  uint8_t planes[4][BLOCK_SIZE];
+  uint8_t mask = 0;
+  for(uint32_t i = 0; i < BLOCK_SIZE; ++i){
+    uint32_t delta = values[i] - previous;
+    previous = values[i];
+    uint32_t zigzag = (delta << 1)
+      ^ static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+    for(uint32_t p = 0; p < 4; ++p){
+      planes[p][i] = static_cast<uint8_t>(zigzag >> (8*p));
+      if(planes[p][i]) mask |= 1 << p;
+    }
+  }
+
+  out.push_back(mask);
+  for(uint32_t p = 0; p < 4; ++p){
+    if(mask & (1 << p))
+      out.insert(out.end(), planes[p], planes[p] + BLOCK_SIZE);
+  }
+}
+
+#ifdef VA_GEOMETRY_SSE2
+constexpr bool HAS_SSE2 = true;
+
+// Zigzag decodes and sums the 16 values of a block's byte planes, missing
+// planes are null
+void unpackBlockSse2(const uint8_t* const planes[4], uint32_t& previous,
+  uint32_t* values){
+  __m128i bytes[4];
+  for(uint32_t p = 0; p < 4; ++p){
+    bytes[p] = planes[p]
+      ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[p]))
+      : _mm_setzero_si128();
+  }
+  // Planes back to words, 4 at a time
+  __m128i low_lo = _mm_unpacklo_epi8(bytes[0], bytes[1]);
+  __m128i low_hi = _mm_unpackhi_epi8(bytes[0], bytes[1]);
+  __m128i high_lo = _mm_unpacklo_epi8(bytes[2], bytes[3]);
+  __m128i high_hi = _mm_unpackhi_epi8(bytes[2], bytes[3]);
+  __m128i words[4] = {
+    _mm_unpacklo_epi16(low_lo, high_lo), _mm_unpackhi_epi16(low_lo, high_lo),
+    _mm_unpacklo_epi16(low_hi, high_hi), _mm_unpackhi_epi16(low_hi, high_hi)
+  };
+
+  const __m128i one = _mm_set1_epi32(1);
+  __m128i carry = _mm_set1_epi32(static_cast<int>(previous));
+  for(uint32_t i = 0; i < 4; ++i){
+    // (z >> 1) ^ -(z & 1)
+    __m128i x = _mm_xor_si128(_mm_srli_epi32(words[i], 1),
+      _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(words[i], one)));
+    // Prefix sum over the 4 lanes, then on top of the block so far
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi32(x, carry);
+    carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(values + 4*i), x);
+  }
+  previous = values[BLOCK_SIZE - 1];
+}
+#else
+constexpr bool HAS_SSE2 = false;
+#endif
+
+// Same as unpackBlockSse2
+void unpackBlockScalar(const uint8_t* const planes[4], uint32_t& previous,
+  uint32_t* values){
+  for(uint32_t i = 0; i < BLOCK_SIZE; ++i){
+    uint32_t zigzag = 0;
+    for(uint32_t p = 0; p < 4; ++p){
+      if(planes[p]) zigzag |= static_cast<uint32_t>(planes[p][i]) << (8*p);
+    }
+    previous += (zigzag >> 1) ^ (0u - (zigzag & 1));
+    values[i] = previous;
+  }
+}
+
+// Inverse of encodeBlock, returns where the next block starts
+template <bool Sse2>
+const uint8_t* decodeBlock(const uint8_t* in, const uint8_t* end,
+  uint32_t& previous, uint32_t* values){
+  if(in == end) throw std::runtime_error("Geometry stream is cut short");
+  const uint8_t mask = *in++;
+  const uint8_t* planes[4] = {};
+  for(uint32_t p = 0; p < 4; ++p){
+    if(!(mask & (1 << p))) continue;
+    if(end - in < static_cast<ptrdiff_t>(BLOCK_SIZE))
+      throw std::runtime_error("Geometry stream is cut short");
+    planes[p] = in;
+    in += BLOCK_SIZE;
+  }
+
+#ifdef VA_GEOMETRY_SSE2
+  if constexpr(Sse2){
+    unpackBlockSse2(planes, previous, values);
+    return in;
+  }
+#endif
+  unpackBlockScalar(planes, previous, values);
+  return in;
+}
+
+template <bool Sse2>
+void decodeVerticesWith(const EncodedGeometry& geometry, Vertex* out){
+  const uint8_t* in = geometry.vertices.data();
+  const uint8_t* end = in + geometry.vertices.size();
+
+  uint32_t previous[VERTEX_WORDS] = {};
+  uint32_t block[VERTEX_WORDS][BLOCK_SIZE];
+  for(uint32_t first = 0; first < geometry.vertex_count; first += BLOCK_SIZE){
+    for(uint32_t w = 0; w < VERTEX_WORDS; ++w)
+      in = decodeBlock<Sse2>(in, end, previous[w], block[w]);
+
+    // Words back into vertices
+    const uint32_t count = std::min(BLOCK_SIZE, geometry.vertex_count - first);
+    for(uint32_t i = 0; i < count; ++i){
+      uint32_t words[VERTEX_WORDS];
+      for(uint32_t w = 0; w < VERTEX_WORDS; ++w) words[w] = block[w][i];
+      std::memcpy(&out[first + i], words, sizeof(Vertex));
+    }
+  }
+}
+
+template <bool Sse2>
+void decodeIndicesWith(const EncodedGeometry& geometry, void* out,
+  uint32_t index_size){
+  const uint8_t* in = geometry.indices.data();
+  const uint8_t* end = in + geometry.indices.size();
+
+  uint32_t previous = 0;
+  uint32_t block[BLOCK_SIZE];
+  for(uint32_t first = 0; first < geometry.index_count; first += BLOCK_SIZE){
+    in = decodeBlock<Sse2>(in, end, previous, block);
+
+    // The indices go to the gpu and the bvh build as they are
+    const uint32_t count = std::min(BLOCK_SIZE, geometry.index_count - first);
+    for(uint32_t i = 0; i < count; ++i){
+      if(block[i] >= geometry.vertex_count)
+        throw std::runtime_error("Geometry index out of range");
+    }
+
+    if(index_size == 2){
+      uint16_t narrow[BLOCK_SIZE];
+      for(uint32_t i = 0; i < count; ++i)
+        narrow[i] = static_cast<uint16_t>(block[i]);
+      std::memcpy(static_cast<uint16_t*>(out) + first, narrow,
+        count*sizeof(uint16_t));
+    }else{
+      std::memcpy(static_cast<uint32_t*>(out) + first, block,
+        count*sizeof(uint32_t));
+    }
+  }
+}
+
+template <typename T>
+void writeValue(std::ofstream& out, const T& value){
+  out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+void readValue(std::ifstream& in, T& value){
+  in.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+}  // namespace
+
+EncodedGeometry encodeGeometry(const std::vector<Vertex>& vertices,
+  const std::vector<uint32_t>& indices){
+  EncodedGeometry geometry;
+  geometry.vertex_count = static_cast<uint32_t>(vertices.size());
+  geometry.index_count = static_cast<uint32_t>(indices.size());
+  if(!vertices.empty())
+    MeshRegistry::boundingSphere(vertices, geometry.center, geometry.radius);
+
+  // Word by word within a block, padded with the last vertex so the padding
+  // deltas are 0
+  uint32_t previous[VERTEX_WORDS] = {};
+  uint32_t values[BLOCK_SIZE];
+  for(size_t first = 0; first < vertices.size(); first += BLOCK_SIZE){
+    const size_t count = std::min<size_t>(BLOCK_SIZE, vertices.size() - first);
+    for(uint32_t w = 0; w < VERTEX_WORDS; ++w){
+      for(uint32_t i = 0; i < BLOCK_SIZE; ++i){
+        const Vertex& v = vertices[first + std::min<size_t>(i, count - 1)];
+        std::memcpy(&values[i],
+          reinterpret_cast<const char*>(&v) + w*sizeof(uint32_t),
+          sizeof(uint32_t));
+      }
+      encodeBlock(values, previous[w], geometry.vertices);
+    }
+  }
+
+  uint32_t previous_index = 0;
+  for(size_t first = 0; first < indices.size(); first += BLOCK_SIZE){
+    const size_t count = std::min<size_t>(BLOCK_SIZE, indices.size() - first);
+    for(uint32_t i = 0; i < BLOCK_SIZE; ++i)
+      values[i] = indices[first + std::min<size_t>(i, count - 1)];
+    encodeBlock(values, previous_index, geometry.indices);
+  }
+  return geometry;
+}
+
+void decodeVertices(const EncodedGeometry& geometry, Vertex* out){
+  decodeVerticesWith<HAS_SSE2>(geometry, out);
+}
+
+void decodeIndices(const EncodedGeometry& geometry, void* out,
+  uint32_t index_size){
+  decodeIndicesWith<HAS_SSE2>(geometry, out, index_size);
+}
+
+void decodeVerticesScalar(const EncodedGeometry& geometry, Vertex* out){
+  decodeVerticesWith<false>(geometry, out);
+}
+
+void decodeIndicesScalar(const EncodedGeometry& geometry, void* out,
+  uint32_t index_size){
+  decodeIndicesWith<false>(geometry, out, index_size);
+}
+
+void writeGeometryFile(const std::string& path,
+  const EncodedGeometry& geometry){
+  std::ofstream out(path, std::ios::binary);
+  if(!out.is_open())
+    throw std::runtime_error("Failed to open geometry file " + path);
+
+  out.write(MAGIC, sizeof(MAGIC));
+  writeValue(out, VERSION);
+  writeValue(out, static_cast<uint32_t>(sizeof(Vertex)));
+  writeValue(out, geometry.vertex_count);
+  writeValue(out, geometry.index_count);
+  writeValue(out, geometry.center);
+  writeValue(out, geometry.radius);
+  writeValue(out, static_cast<uint32_t>(geometry.vertices.size()));
+  writeValue(out, static_cast<uint32_t>(geometry.indices.size()));
+  out.write(reinterpret_cast<const char*>(geometry.vertices.data()),
+    geometry.vertices.size());
+  out.write(reinterpret_cast<const char*>(geometry.indices.data()),
+    geometry.indices.size());
+
+  if(!out)
+    throw std::runtime_error("Failed to write geometry file " + path);
+}
+
+EncodedGeometry readGeometryFile(const std::string& path){
+  std::ifstream in(path, std::ios::binary);
+  if(!in.is_open())
+    throw std::runtime_error("Failed to open geometry file " + path);
+
+  char magic[sizeof(MAGIC)] = {};
+  uint32_t version = 0;
+  uint32_t vertex_size = 0;
+  in.read(magic, sizeof(magic));
+  readValue(in, version);
+  readValue(in, vertex_size);
+  if(!in || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+    || version != VERSION){
+    throw std::runtime_error("Not a geometry file " + path);
+  }
+  // Decoding would go through fine and the vertices come out garbled
+  if(vertex_size != sizeof(Vertex))
+    throw std::runtime_error("Geometry file of another vertex layout " + path);
+
+  EncodedGeometry geometry;
+  uint32_t vertex_bytes = 0;
+  uint32_t index_bytes = 0;
+  readValue(in, geometry.vertex_count);
+  readValue(in, geometry.index_count);
+  readValue(in, geometry.center);
+  readValue(in, geometry.radius);
+  readValue(in, vertex_bytes);
+  readValue(in, index_bytes);
+  if(!in)
+    throw std::runtime_error("Failed to read geometry file " + path);
+
+  // Sizes are checked before anything is allocated for them. Every block
+  // takes at least its mask byte, so the counts are bounded too.
+  const std::streampos data = in.tellg();
+  in.seekg(0, std::ios::end);
+  const uint64_t left = static_cast<uint64_t>(in.tellg() - data);
+  in.seekg(data);
+  const uint64_t vertex_blocks =
+    (uint64_t{geometry.vertex_count} + BLOCK_SIZE - 1)/BLOCK_SIZE;
+  const uint64_t index_blocks =
+    (uint64_t{geometry.index_count} + BLOCK_SIZE - 1)/BLOCK_SIZE;
+  if(uint64_t{vertex_bytes} + index_bytes > left
+    || vertex_bytes < vertex_blocks*VERTEX_WORDS
+    || index_bytes < index_blocks){
+    throw std::runtime_error("Damaged geometry file " + path);
+  }
+
+  geometry.vertices.resize(vertex_bytes);
+  geometry.indices.resize(index_bytes);
+  in.read(reinterpret_cast<char*>(geometry.vertices.data()), vertex_bytes);
+  in.read(reinterpret_cast<char*>(geometry.indices.data()), index_bytes);
+
+  if(!in)
+    throw std::runtime_error("Failed to read geometry file " + path);
+  return geometry;
+}
+
+}  // namespace va
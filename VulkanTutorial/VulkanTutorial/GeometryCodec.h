@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Vertex.h"
+
+namespace va {
+
+/*
+ * A mesh in encoded form, a fraction of the size of the raw vertices and
+ * indices, for files on disk and meshes waiting to be uploaded.
+ *
+ * Both streams are columns of 32 bit words: the 11 words of va::Vertex,
+ * and the indices. Each word is delta coded against the same word of the
+ * previous vertex (index), zigzag coded so small negative deltas stay
+ * small, then split into blocks of 16 whose 4 byte planes are stored one
+ * after the other. A mask byte before each block says which planes are
+ * there, a plane of zeros (the high bytes of small deltas, a constant
+ * color) takes no space. What's left groups similar bytes, so it also
+ * compresses well with a general purpose compressor on top.
+ *
+ * Decoding undoes a block with a handful of sse2 instructions (byte
+ * interleave, zigzag, prefix sum) and writes straight to the destination,
+ * eg. mapped staging memory. Plain c++ where sse2 isn't available.
+ *
+ * eg.
+ * EncodedGeometry geometry = encodeGeometry(vertices, indices);
+ * decodeVertices(geometry, static_cast<Vertex*>(mapped));
+ * decodeIndices(geometry, index_data, geometry.indexSize());
+ */
+struct EncodedGeometry {
+  uint32_t vertex_count = 0;
+  uint32_t index_count = 0;
+  // Bounding sphere, so the mesh can be registered without decoding it
+  glm::vec3 center{0.0f};
+  float radius = 0.0f;
+
+  std::vector<uint8_t> vertices;
+  std::vector<uint8_t> indices;
+
+  // Smallest index that fits every vertex: 16 bit under 65536 vertices
+  uint32_t indexSize() const { return vertex_count < 65536 ? 2 : 4; }
+};
+
+EncodedGeometry encodeGeometry(const std::vector<Vertex>& vertices,
+  const std::vector<uint32_t>& indices);
+
+// out holds vertex_count vertices. Throws if the stream is cut short.
+void decodeVertices(const EncodedGeometry& geometry, Vertex* out);
+
+// out holds index_count indices of index_size (2 or 4) bytes. Throws if
+// the stream is cut short or an index isn't below vertex_count.
+void decodeIndices(const EncodedGeometry& geometry, void* out,
+  uint32_t index_size);
+
+// The plain c++ decoders, also where sse2 is available. Same results as
+// the ones above.
+void decodeVerticesScalar(const EncodedGeometry& geometry, Vertex* out);
+void decodeIndicesScalar(const EncodedGeometry& geometry, void* out,
+  uint32_t index_size);
+
+// Little endian files, the layout of EncodedGeometry after a small header.
+// The header records sizeof(Vertex), reading a file written with another
+// vertex layout fails, so do sizes that don't fit the file. Both throw
+// std::runtime_error on failure.
+void writeGeometryFile(const std::string& path,
+  const EncodedGeometry& geometry);
+EncodedGeometry readGeometryFile(const std::string& path);
+
+}  // namespace va
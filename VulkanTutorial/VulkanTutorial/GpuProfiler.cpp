@@ -0,0 +1,259 @@
+#include "GpuProfiler.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+namespace va {
+
+namespace {
+// Trace rows on the gpu process
+constexpr uint32_t TRACE_PID = 1;
+constexpr uint32_t FRAME_TID = 0;
+constexpr uint32_t UPLOAD_TID = 1;
+}  // namespace
+
+void GpuProfiler::init(VkPhysicalDevice physical_device, VkDevice device,
+  uint32_t queue_family, uint32_t frames_in_flight,
+  uint32_t max_scopes_per_frame){
+  device_ = device;
+  max_scopes_ = max_scopes_per_frame;
+
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(physical_device, &props);
+
+  uint32_t family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count,
+    nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count,
+    families.data());
+
+  // 0 valid bits means timestamps aren't supported on this queue.
+  uint32_t valid_bits = queue_family < family_count ?
+    families[queue_family].timestampValidBits : 0;
+  enabled_ = valid_bits > 0 && props.limits.timestampPeriod > 0.0f;
+  if(!enabled_) return;
+
+  ns_per_tick_ = props.limits.timestampPeriod;
+  timestamp_mask_ = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+
+  createFramePools(frames_in_flight);
+  immediate_.pool = createPool(2);
+
+  trace_.setProcessName(TRACE_PID, "GPU");
+  trace_.setThreadName(TRACE_PID, FRAME_TID, "graphics queue: frames");
+  trace_.setThreadName(TRACE_PID, UPLOAD_TID, "graphics queue: uploads");
+}
+
+void GpuProfiler::cleanUp(){
+  destroyFramePools();
+  if(immediate_.pool != VK_NULL_HANDLE){
+    vkDestroyQueryPool(device_, immediate_.pool, nullptr);
+    immediate_.pool = VK_NULL_HANDLE;
+  }
+}
+
+void GpuProfiler::setFramesInFlight(uint32_t frames_in_flight){
+  if(!enabled_ || frames_in_flight == frames_.size()) return;
+
+  // Pick up whatever the old pools finished before they go away.
+  for(const auto& frame : frames_){
+    if(!frame.scopes.empty() && readTimestamps(frame.pool, frame.next_query))
+      resolveScopes(frame, FRAME_TID);
+  }
+
+  destroyFramePools();
+  createFramePools(frames_in_flight);
+}
+
+void GpuProfiler::beginFrame(VkCommandBuffer cb, uint32_t frame_idx){
+  if(!enabled_) return;
+
+  current_frame_ = frame_idx;
+  auto& frame = frames_[frame_idx];
+
+  // The GPU finished this slot's previous submission before the CPU got
+  // here, the results are available without waiting.
+  if(!frame.scopes.empty()){
+    readTimestamps(frame.pool, frame.next_query);
+    resolveScopes(frame, FRAME_TID);
+  }
+
+  frame.scopes.clear();
+  frame.next_query = 0;
+
+  vkCmdResetQueryPool(cb, frame.pool, 0, max_scopes_*2);
+}
+
+uint32_t GpuProfiler::beginScope(VkCommandBuffer cb, const char* name,
+  VkPipelineStageFlagBits stage){
+  if(!enabled_) return INVALID_SCOPE;
+
+  auto& frame = frames_[current_frame_];
+  if(frame.next_query + 2 > max_scopes_*2) return INVALID_SCOPE;
+
+  Scope scope{name, frame.next_query, frame.next_query + 1};
+  frame.next_query += 2;
+
+  vkCmdWriteTimestamp(cb, stage, frame.pool, scope.begin_query);
+  frame.scopes.push_back(scope);
+  return static_cast<uint32_t>(frame.scopes.size() - 1);
+}
+
+void GpuProfiler::endScope(VkCommandBuffer cb, uint32_t scope,
+  VkPipelineStageFlagBits stage){
+  if(!enabled_ || scope == INVALID_SCOPE) return;
+
+  auto& frame = frames_[current_frame_];
+  vkCmdWriteTimestamp(cb, stage, frame.pool, frame.scopes[scope].end_query);
+}
+
+void GpuProfiler::beginImmediate(VkCommandBuffer cb, const char* name){
+  if(!enabled_) return;
+
+  immediate_.scopes.assign(1, Scope{name, 0, 1});
+  immediate_.next_query = 2;
+
+  vkCmdResetQueryPool(cb, immediate_.pool, 0, 2);
+  vkCmdWriteTimestamp(cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, immediate_.pool,
+    0);
+}
+
+void GpuProfiler::endImmediate(VkCommandBuffer cb){
+  if(!enabled_ || immediate_.scopes.empty()) return;
+
+  vkCmdWriteTimestamp(cb, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+    immediate_.pool, 1);
+}
+
+void GpuProfiler::collectImmediate(){
+  if(!enabled_ || immediate_.scopes.empty()) return;
+
+  readTimestamps(immediate_.pool, immediate_.next_query);
+  resolveScopes(immediate_, UPLOAD_TID);
+  immediate_.scopes.clear();
+}
+
+std::vector<GpuProfiler::ScopeStats> GpuProfiler::stats() const{
+  std::vector<ScopeStats> all;
+  all.reserve(history_.size());
+  for(const auto& entry : history_)
+    all.push_back(stats(entry.first));
+  return all;
+}
+
+GpuProfiler::ScopeStats GpuProfiler::stats(const std::string& name) const{
+  ScopeStats s;
+  s.name = name;
+
+  auto it = history_.find(name);
+  if(it == history_.end() || it->second.empty()) return s;
+
+  const auto& samples = it->second;
+  s.count = samples.size();
+  s.total = totals_.at(name);
+  s.last_ms = samples.back();
+  s.min_ms = *std::min_element(samples.begin(), samples.end());
+  s.max_ms = *std::max_element(samples.begin(), samples.end());
+
+  double sum = 0.0;
+  for(double v : samples) sum += v;
+  s.mean_ms = sum / samples.size();
+  return s;
+}
+
+std::string GpuProfiler::report() const{
+  std::ostringstream out;
+  if(!enabled_){
+    out << "GPU timestamps not supported on the graphics queue\n";
+    return out.str();
+  }
+
+  out.precision(3);
+  out << std::fixed;
+  for(const auto& s : stats()){
+    out << s.name << ": mean " << s.mean_ms << " ms, min " << s.min_ms
+        << " ms, max " << s.max_ms << " ms (last " << s.count << ")\n";
+  }
+  return out.str();
+}
+
+VkQueryPool GpuProfiler::createPool(uint32_t query_count){
+  VkQueryPoolCreateInfo qp_info{};
+  qp_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  qp_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  qp_info.queryCount = query_count;
+
+  VkQueryPool pool;
+  if(vkCreateQueryPool(device_, &qp_info, nullptr, &pool) != VK_SUCCESS){
+    throw std::runtime_error("Failed to create timestamp query pool");
+  }
+  return pool;
+}
+
+void GpuProfiler::createFramePools(uint32_t frames_in_flight){
+  frames_.resize(frames_in_flight);
+  for(auto& frame : frames_){
+    frame = FrameQueries{};
+    frame.pool = createPool(max_scopes_*2);
+  }
+  current_frame_ = 0;
+}
+
+void GpuProfiler::destroyFramePools(){
+  for(auto& frame : frames_)
+    vkDestroyQueryPool(device_, frame.pool, nullptr);
+  frames_.clear();
+}
+
+bool GpuProfiler::readTimestamps(VkQueryPool pool, uint32_t count){
+  if(count == 0) return false;
+  results_.assign(count*2, 0);
+
+  // No wait bit, queries that aren't done report 0 availability and are
+  // skipped instead of blocking.
+  VkResult result = vkGetQueryPoolResults(device_, pool, 0, count,
+    results_.size()*sizeof(uint64_t), results_.data(), 2*sizeof(uint64_t),
+    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+  return result == VK_SUCCESS;
+}
+
+void GpuProfiler::resolveScopes(const FrameQueries& frame, uint32_t tid){
+  for(const auto& scope : frame.scopes){
+    const uint64_t* begin = &results_[scope.begin_query*2];
+    const uint64_t* end = &results_[scope.end_query*2];
+    // Second value of each pair is the availability
+    if(begin[1] == 0 || end[1] == 0) continue;
+
+    uint64_t begin_ticks = begin[0] & timestamp_mask_;
+    uint64_t end_ticks = end[0] & timestamp_mask_;
+    double ms = ticksToMs(begin_ticks, end_ticks);
+    addSample(scope.name, ms);
+
+    if(capture_trace_){
+      if(!has_trace_origin_){
+        trace_origin_ = begin_ticks;
+        has_trace_origin_ = true;
+      }
+      double ts_us = ticksToMs(trace_origin_, begin_ticks) * 1000.0;
+      trace_.addComplete(scope.name, "gpu", TRACE_PID, tid, ts_us,
+        ms * 1000.0);
+    }
+  }
+}
+
+void GpuProfiler::addSample(const std::string& name, double ms){
+  auto& samples = history_[name];
+  samples.push_back(ms);
+  if(samples.size() > HISTORY_SIZE) samples.pop_front();
+  ++totals_[name];
+}
+
+double GpuProfiler::ticksToMs(uint64_t begin, uint64_t end) const{
+  // Counter may wrap when it has fewer than 64 valid bits.
+  uint64_t ticks = (end - begin) & timestamp_mask_;
+  return ticks * ns_per_tick_ / 1e6;
+}
+
+}  // namespace va
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#define GLFW_INCLUDE_VULKAN
+#include "GLFW/glfw3.h"
+
+#include "ChromeTrace.h"
+
+namespace va {
+
+/*
+ * Times GPU work with vkCmdWriteTimestamp.
+ *
+ * Each frame in flight owns a timestamp query pool. A scope writes one
+ * timestamp when it begins and one when it ends. The results of a frame slot
+ * are read when the slot comes around again: by then FrameScheduler has
+ * already waited for that submission, so vkGetQueryPoolResults never has to
+ * wait (no VK_QUERY_RESULT_WAIT_BIT) and profiling adds no stall.
+ *
+ * One shot command buffers (uploads) use their own small pool, read right
+ * after the CPU has waited for the upload anyway.
+ *
+ * Ticks are converted to milliseconds with timestampPeriod. If the graphics
+ * queue has no valid timestamp bits (some software drivers) the profiler
+ * disables itself and every call is a no-op.
+ *
+ * eg.
+ * profiler.beginFrame(cb, frame_idx);
+ * auto scope = profiler.beginScope(cb, "render pass");
+ * ...
+ * profiler.endScope(cb, scope);
+ */
+class GpuProfiler {
+ public:
+  static constexpr uint32_t INVALID_SCOPE = UINT32_MAX;
+
+  void init(VkPhysicalDevice physical_device, VkDevice device,
+    uint32_t queue_family, uint32_t frames_in_flight,
+    uint32_t max_scopes_per_frame = 32);
+
+  void cleanUp();
+
+  // Recreate the per frame pools, the GPU must be idle.
+  void setFramesInFlight(uint32_t frames_in_flight);
+
+  bool enabled() const { return enabled_; }
+
+  /* Collect the results the slot recorded last time, then reset its queries.
+   * Record before any scope, outside of a render pass.
+   */
+  void beginFrame(VkCommandBuffer cb, uint32_t frame_idx);
+
+  /* Timestamps are written once all previous commands reach stage. Scopes
+   * may nest. Returns INVALID_SCOPE when out of queries or disabled.
+   */
+  uint32_t beginScope(VkCommandBuffer cb, const char* name,
+    VkPipelineStageFlagBits stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+  void endScope(VkCommandBuffer cb, uint32_t scope,
+    VkPipelineStageFlagBits stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+
+  /* Time a whole one shot command buffer. collectImmediate() must be called
+   * after the submission is known to be finished.
+   */
+  void beginImmediate(VkCommandBuffer cb, const char* name);
+  void endImmediate(VkCommandBuffer cb);
+  void collectImmediate();
+
+  struct ScopeStats {
+    std::string name;
+    size_t count = 0;
+    // Samples ever added, tells a new sample from the last one
+    uint64_t total = 0;
+    double last_ms = 0.0;
+    double mean_ms = 0.0;
+    double min_ms = 0.0;
+    double max_ms = 0.0;
+  };
+
+  // Statistics over the last HISTORY_SIZE samples of every scope.
+  std::vector<ScopeStats> stats() const;
+  ScopeStats stats(const std::string& name) const;
+
+  std::string report() const;
+
+  // Record every resolved scope for a trace dump.
+  void setTraceCapture(bool enable) { capture_trace_ = enable; }
+  const ChromeTrace& trace() const { return trace_; }
+
+ private:
+  struct Scope {
+    const char* name;
+    uint32_t begin_query;
+    uint32_t end_query;
+  };
+
+  struct FrameQueries {
+    VkQueryPool pool = VK_NULL_HANDLE;
+    uint32_t next_query = 0;
+    std::vector<Scope> scopes;
+  };
+
+  VkQueryPool createPool(uint32_t query_count);
+  void createFramePools(uint32_t frames_in_flight);
+  void destroyFramePools();
+
+  // Read timestamps without waiting, false if any of them isn't ready.
+  bool readTimestamps(VkQueryPool pool, uint32_t count);
+  void resolveScopes(const FrameQueries& frame, uint32_t tid);
+  void addSample(const std::string& name, double ms);
+  double ticksToMs(uint64_t begin, uint64_t end) const;
+
+  bool enabled_ = false;
+  VkDevice device_ = VK_NULL_HANDLE;
+
+  double ns_per_tick_ = 1.0;
+  uint64_t timestamp_mask_ = ~0ull;
+  uint32_t max_scopes_ = 0;
+
+  std::vector<FrameQueries> frames_;
+  uint32_t current_frame_ = 0;
+
+  FrameQueries immediate_;
+
+  // Scratch space for results, pairs of (value, availability)
+  std::vector<uint64_t> results_;
+
+  static constexpr size_t HISTORY_SIZE = 256;
+  std::map<std::string, std::deque<double>> history_;
+  std::map<std::string, uint64_t> totals_;
+
+  bool capture_trace_ = false;
+  bool has_trace_origin_ = false;
+  uint64_t trace_origin_ = 0;
+  ChromeTrace trace_;
+};
+
+}  // namespace va
@@ -0,0 +1,139 @@
+#include "InitGraph.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+#include "CpuProfiler.h"
+#include "ThreadPool.h"
+
+namespace va {
+
+InitGraph::StepId InitGraph::add(const char* name, std::function<void()> fn,
+  std::initializer_list<StepId> deps, Affinity affinity){
+  for(StepId dep : deps){
+    if(dep >= steps_.size())
+      throw std::invalid_argument("Init step depends on an unknown step");
+  }
+  steps_.push_back({name, std::move(fn), deps, affinity});
+  return static_cast<StepId>(steps_.size() - 1);
+}
+
+void InitGraph::run(ThreadPool* pool){
+  auto& profiler = CpuProfiler::instance();
+  const uint64_t run_start = profiler.now();
+  const size_t count = steps_.size();
+
+  timings_.assign(count, StepTiming{});
+  std::vector<uint32_t> pending(count);
+  std::vector<std::vector<StepId>> dependents(count);
+  for(StepId id = 0; id < count; ++id){
+    pending[id] = static_cast<uint32_t>(steps_[id].deps.size());
+    for(StepId dep : steps_[id].deps)
+      dependents[dep].push_back(id);
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<StepId> ready_main;
+  size_t finished = 0;
+  size_t running_workers = 0;
+  std::exception_ptr error;
+
+  // Runs the step and reports back, on whichever thread it was given to.
+  std::function<void(StepId)> launch;
+  auto execute = [&](StepId id, bool on_main){
+    uint64_t start = profiler.now();
+    std::exception_ptr step_error;
+    try{
+      ScopedTimer timer(steps_[id].name);
+      steps_[id].fn();
+    }catch(...){
+      step_error = std::current_exception();
+    }
+    uint64_t end = profiler.now();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    timings_[id] = {steps_[id].name, (start - run_start) / 1e6,
+      (end - start) / 1e6, on_main};
+    ++finished;
+    if(!on_main) --running_workers;
+
+    if(step_error){
+      if(!error) error = step_error;
+      // Stop here, only wait for the steps already running
+      ready_main.clear();
+    }else if(!error){
+      for(StepId next : dependents[id]){
+        if(--pending[next] == 0) launch(next);
+      }
+    }
+    cv.notify_all();
+  };
+
+  // Called with the mutex held
+  launch = [&](StepId id){
+    if(pool && steps_[id].affinity == Worker){
+      ++running_workers;
+      pool->submit([&execute, id]{ execute(id, false); });
+    }else{
+      ready_main.push_back(id);
+    }
+  };
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(StepId id = 0; id < count; ++id){
+      if(pending[id] == 0) launch(id);
+    }
+  }
+
+  for(;;){
+    StepId id;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]{
+        return !ready_main.empty() || running_workers == 0;
+      });
+      // Nothing left to run here and nothing running elsewhere: done, failed
+      // or stuck on a cycle.
+      if(ready_main.empty()) break;
+
+      id = ready_main.front();
+      ready_main.pop_front();
+    }
+    execute(id, true);
+  }
+
+  wall_ms_ = (profiler.now() - run_start) / 1e6;
+
+  if(error) std::rethrow_exception(error);
+  if(finished != count)
+    throw std::runtime_error("Init graph has a dependency cycle");
+}
+
+double InitGraph::serialMs() const{
+  double sum = 0.0;
+  for(const auto& timing : timings_) sum += timing.duration_ms;
+  return sum;
+}
+
+std::string InitGraph::report() const{
+  std::ostringstream out;
+  out.precision(2);
+  out << std::fixed;
+
+  for(const auto& t : timings_){
+    if(!t.name) continue;  // never ran
+    out << "  " << t.name << ": " << t.duration_ms << " ms (at "
+        << t.start_ms << " ms, " << (t.on_main ? "main" : "worker") << ")\n";
+  }
+  out << "  total " << wall_ms_ << " ms, " << serialMs()
+      << " ms if run serially\n";
+  return out.str();
+}
+
+}  // namespace va
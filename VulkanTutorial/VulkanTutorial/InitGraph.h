@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+namespace va {
+
+class ThreadPool;
+
+/*
+ * Startup steps and what they depend on. Steps run as soon as their
+ * dependencies are done: Worker steps on the thread pool, Main steps on the
+ * thread calling run(). Anything touching the queue or the command pool has
+ * to be a Main step, pure cpu work (file reads, decoding, parsing) and
+ * object creation that doesn't need external synchronization can be Worker.
+ *
+ * Every step is timed and shows up in the cpu trace.
+ *
+ * eg.
+ * InitGraph graph;
+ * auto file = graph.add("readFile", [&]{ ... }, {}, InitGraph::Worker);
+ * auto device = graph.add("createDevice", [&]{ ... });
+ * graph.add("upload", [&]{ ... }, {file, device});
+ * graph.run(&pool);
+ */
+class InitGraph {
+ public:
+  using StepId = uint32_t;
+  enum Affinity { Main, Worker };
+
+  // name must be a string literal, the profiler keeps the pointer.
+  StepId add(const char* name, std::function<void()> fn,
+    std::initializer_list<StepId> deps = {}, Affinity affinity = Main);
+
+  /* Run every step, returns when all are done. Without a pool everything
+   * runs in order on the calling thread. If a step throws, no new steps are
+   * started and the first exception is rethrown once running ones finish.
+   */
+  void run(ThreadPool* pool);
+
+  struct StepTiming {
+    const char* name;
+    double start_ms;  // since run() started
+    double duration_ms;
+    bool on_main;
+  };
+
+  const std::vector<StepTiming>& timings() const { return timings_; }
+
+  double wallMs() const { return wall_ms_; }
+
+  // Sum of every step, ie. the time it would take one thread.
+  double serialMs() const;
+
+  std::string report() const;
+
+ private:
+  struct Step {
+    const char* name;
+    std::function<void()> fn;
+    std::vector<StepId> deps;
+    Affinity affinity;
+  };
+
+  std::vector<Step> steps_;
+  std::vector<StepTiming> timings_;
+  double wall_ms_ = 0.0;
+};
+
+}  // namespace va
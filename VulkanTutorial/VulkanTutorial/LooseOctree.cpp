@@ -0,0 +1,278 @@
+#include "LooseOctree.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace va {
+
+namespace {
+// Children pushed per level plus the cell being visited
+constexpr uint32_t STACK_SIZE = 8*(LooseOctree::MAX_DEPTH + 1);
+
+// Distance from p to the plane, positive on the inside
+float planeDistance(const glm::vec4& plane, const glm::vec3& p){
+  return plane.x*p.x + plane.y*p.y + plane.z*p.z + plane.w;
+}
+}  // namespace
+
+LooseOctree::LooseOctree(const glm::vec3& center, float half_extent,
+  uint32_t max_depth)
+  : max_depth_(std::min(max_depth, MAX_DEPTH)) {
+  reset(center, half_extent);
+}
+
+void LooseOctree::reset(const glm::vec3& center, float half_extent){
+  half_extent_ = half_extent;
+  cells_.clear();
+  free_cells_.clear();
+  objects_.clear();
+  free_objects_.clear();
+
+  Cell root;
+  root.center = center;
+  root.half = half_extent;
+  cells_.push_back(root);
+}
+
+LooseOctree::Handle LooseOctree::insert(const glm::vec3& center, float radius,
+  uint32_t value){
+  Handle handle;
+  if(!free_objects_.empty()){
+    handle = free_objects_.back();
+    free_objects_.pop_back();
+  }else{
+    handle = static_cast<Handle>(objects_.size());
+    objects_.emplace_back();
+  }
+
+  Object& object = objects_[handle];
+  object.center = center;
+  object.radius = radius;
+  object.value = value;
+  link(handle, findCell(center, radius));
+  return handle;
+}
+
+void LooseOctree::move(Handle handle, const glm::vec3& center, float radius){
+  Object& object = objects_[handle];
+  object.center = center;
+  object.radius = radius;
+
+  // Where insert would put it anyway
+  const uint32_t old_cell = object.cell;
+  const Cell& cell = cells_[old_cell];
+  if(old_cell == ROOT && !inCell(cell, center)) return;
+  if(cell.depth == depthFor(radius) && inCell(cell, center)) return;
+
+  unlink(handle);
+  link(handle, findCell(center, radius));
+  prune(old_cell);
+}
+
+void LooseOctree::remove(Handle handle){
+  const uint32_t cell = objects_[handle].cell;
+  unlink(handle);
+  objects_[handle].cell = NONE;
+  free_objects_.push_back(handle);
+  prune(cell);
+}
+
+size_t LooseOctree::queryFrustum(const glm::mat4& view_proj,
+  std::vector<uint32_t>& values) const{
+  // Planes from the rows of the matrix, 0 <= z <= w for depth. Normalized
+  // so plane distances are real distances to compare radii to.
+  auto row = [&](int r){
+    return glm::vec4(view_proj[0][r], view_proj[1][r], view_proj[2][r],
+      view_proj[3][r]);
+  };
+  glm::vec4 planes[6] = {row(3) + row(0), row(3) - row(0), row(3) + row(1),
+    row(3) - row(1), row(2), row(3) - row(2)};
+  for(auto& plane : planes)
+    plane = plane*(1.0f/glm::length(glm::vec3(plane)));
+
+  size_t visited = 0;
+  uint32_t stack[STACK_SIZE];
+  uint32_t size = 0;
+  stack[size++] = ROOT;
+  while(size > 0){
+    const uint32_t index = stack[--size];
+    const Cell& cell = cells_[index];
+
+    // The root holds whatever lies outside the cube, it has no bounds
+    if(index != ROOT){
+      const float extent = 2.0f*cell.half;
+      bool outside = false;
+      bool inside = true;
+      for(const auto& plane : planes){
+        float distance = planeDistance(plane, cell.center);
+        float reach = extent*(std::abs(plane.x) + std::abs(plane.y)
+          + std::abs(plane.z));
+        if(distance < -reach){
+          outside = true;
+          break;
+        }
+        if(distance < reach) inside = false;
+      }
+      if(outside){
+        ++visited;
+        continue;
+      }
+      if(inside){
+        visited += collect(index, values);
+        continue;
+      }
+    }
+
+    ++visited;
+    for(uint32_t o = cell.first_object; o != NONE; o = objects_[o].next){
+      const Object& object = objects_[o];
+      bool visible = true;
+      for(const auto& plane : planes){
+        if(planeDistance(plane, object.center) < -object.radius){
+          visible = false;
+          break;
+        }
+      }
+      if(visible) values.push_back(object.value);
+    }
+    for(uint32_t child : cell.children){
+      if(child != NONE) stack[size++] = child;
+    }
+  }
+  return visited;
+}
+
+size_t LooseOctree::querySphere(const glm::vec3& center, float radius,
+  std::vector<uint32_t>& values) const{
+  size_t visited = 0;
+  uint32_t stack[STACK_SIZE];
+  uint32_t size = 0;
+  stack[size++] = ROOT;
+  while(size > 0){
+    const uint32_t index = stack[--size];
+    const Cell& cell = cells_[index];
+    ++visited;
+
+    if(index != ROOT){
+      // Closest point of the loose bounds
+      glm::vec3 offset = glm::max(glm::abs(center - cell.center)
+        - glm::vec3(2.0f*cell.half), glm::vec3(0.0f));
+      if(glm::dot(offset, offset) > radius*radius) continue;
+    }
+
+    for(uint32_t o = cell.first_object; o != NONE; o = objects_[o].next){
+      const Object& object = objects_[o];
+      glm::vec3 d = object.center - center;
+      float reach = radius + object.radius;
+      if(glm::dot(d, d) <= reach*reach) values.push_back(object.value);
+    }
+    for(uint32_t child : cell.children){
+      if(child != NONE) stack[size++] = child;
+    }
+  }
+  return visited;
+}
+
+uint32_t LooseOctree::depthFor(float radius) const{
+  // A sphere centered in a cell stays within its loose bounds when the
+  // radius is at most the cell's half size
+  uint32_t depth = 0;
+  float half = half_extent_;
+  while(depth < max_depth_ && radius <= 0.5f*half){
+    half *= 0.5f;
+    ++depth;
+  }
+  return depth;
+}
+
+uint32_t LooseOctree::findCell(const glm::vec3& center, float radius){
+  if(!inCell(cells_[ROOT], center)) return ROOT;
+
+  const uint32_t depth = depthFor(radius);
+  uint32_t index = ROOT;
+  while(cells_[index].depth < depth){
+    const Cell& cell = cells_[index];
+    const uint32_t octant = (center.x >= cell.center.x ? 1 : 0)
+      | (center.y >= cell.center.y ? 2 : 0)
+      | (center.z >= cell.center.z ? 4 : 0);
+    uint32_t child = cell.children[octant];
+    // cells_ may grow, cell is not used past here
+    if(child == NONE) child = allocateCell(index, octant);
+    index = child;
+  }
+  return index;
+}
+
+bool LooseOctree::inCell(const Cell& cell, const glm::vec3& point) const{
+  glm::vec3 d = glm::abs(point - cell.center);
+  return d.x <= cell.half && d.y <= cell.half && d.z <= cell.half;
+}
+
+void LooseOctree::link(Handle handle, uint32_t cell){
+  Object& object = objects_[handle];
+  object.cell = cell;
+  object.prev = NONE;
+  object.next = cells_[cell].first_object;
+  if(object.next != NONE) objects_[object.next].prev = handle;
+  cells_[cell].first_object = handle;
+}
+
+void LooseOctree::unlink(Handle handle){
+  const Object& object = objects_[handle];
+  if(object.prev != NONE) objects_[object.prev].next = object.next;
+  else cells_[object.cell].first_object = object.next;
+  if(object.next != NONE) objects_[object.next].prev = object.prev;
+}
+
+void LooseOctree::prune(uint32_t index){
+  while(index != ROOT){
+    const Cell& cell = cells_[index];
+    if(cell.first_object != NONE) return;
+    for(uint32_t child : cell.children){
+      if(child != NONE) return;
+    }
+
+    const uint32_t parent = cell.parent;
+    for(uint32_t& child : cells_[parent].children){
+      if(child == index) child = NONE;
+    }
+    free_cells_.push_back(index);
+    index = parent;
+  }
+}
+
+uint32_t LooseOctree::allocateCell(uint32_t parent, uint32_t octant){
+  uint32_t index;
+  if(!free_cells_.empty()){
+    index = free_cells_.back();
+    free_cells_.pop_back();
+  }else{
+    index = static_cast<uint32_t>(cells_.size());
+    cells_.emplace_back();
+  }
+
+  const Cell& up = cells_[parent];
+  Cell cell;
+  cell.half = 0.5f*up.half;
+  cell.center = up.center + cell.half*glm::vec3(octant & 1 ? 1.0f : -1.0f,
+    octant & 2 ? 1.0f : -1.0f, octant & 4 ? 1.0f : -1.0f);
+  cell.depth = up.depth + 1;
+  cell.parent = parent;
+  cells_[index] = cell;
+  cells_[parent].children[octant] = index;
+  return index;
+}
+
+size_t LooseOctree::collect(uint32_t index,
+  std::vector<uint32_t>& values) const{
+  size_t visited = 1;
+  const Cell& cell = cells_[index];
+  for(uint32_t o = cell.first_object; o != NONE; o = objects_[o].next)
+    values.push_back(objects_[o].value);
+  for(uint32_t child : cell.children){
+    if(child != NONE) visited += collect(child, values);
+  }
+  return visited;
+}
+
+}  // namespace va
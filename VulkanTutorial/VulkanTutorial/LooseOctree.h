@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+namespace va {
+
+/*
+ * Loose octree of bounding spheres, the spatial index of the scene.
+ *
+ * A cube around the world is split into octants down to max_depth. Each
+ * cell's bounds are loosened to twice its size, so a sphere always goes in
+ * the cell holding its center at the depth its radius fits: no splitting
+ * and no searching for a node that contains it. Insert walks at most
+ * max_depth levels down, creating cells on the way. A move that stays in
+ * its cell only rewrites the sphere. Remove unlinks the object and frees
+ * cells left empty on the way up.
+ *
+ * Cells and objects live in pools (arrays with free lists), objects of a
+ * cell form a linked list through the object pool, so nothing is allocated
+ * once the pools have grown to the scene. Handles stay valid until removed.
+ *
+ * Queries visit only the cells their volume touches. Cells fully inside a
+ * frustum hand over their whole subtree without testing it further, so a
+ * large static world costs the visible part and the cells on the edge.
+ *
+ * eg.
+ * LooseOctree octree(glm::vec3(0.0f), 100.0f);
+ * auto handle = octree.insert(center, radius, object_id);
+ * octree.move(handle, new_center, radius);
+ * octree.queryFrustum(view_proj, visible);
+ */
+class LooseOctree {
+ public:
+  using Handle = uint32_t;
+  static constexpr Handle INVALID = UINT32_MAX;
+
+  static constexpr uint32_t MAX_DEPTH = 16;
+
+  // Spheres centered outside the cube are kept in the root cell. max_depth
+  // is capped at MAX_DEPTH.
+  explicit LooseOctree(const glm::vec3& center = glm::vec3(0.0f),
+    float half_extent = 1.0f, uint32_t max_depth = 8);
+
+  // Empties the tree and moves it, the pools keep their memory.
+  void reset(const glm::vec3& center, float half_extent);
+
+  // value comes back from the queries.
+  Handle insert(const glm::vec3& center, float radius, uint32_t value);
+  void move(Handle handle, const glm::vec3& center, float radius);
+  void remove(Handle handle);
+
+  /* Values of the spheres touching the frustum of view_proj (depth 0 to
+   * 1), appended. Returns the number of cells visited.
+   */
+  size_t queryFrustum(const glm::mat4& view_proj,
+    std::vector<uint32_t>& values) const;
+
+  // Values of the spheres touching the sphere, appended.
+  size_t querySphere(const glm::vec3& center, float radius,
+    std::vector<uint32_t>& values) const;
+
+  size_t size() const { return objects_.size() - free_objects_.size(); }
+  size_t cellCount() const { return cells_.size() - free_cells_.size(); }
+
+ private:
+  static constexpr uint32_t NONE = UINT32_MAX;
+  static constexpr uint32_t ROOT = 0;
+
+  struct Cell {
+    glm::vec3 center{0.0f};
+    float half = 0.0f;  // of the cell, its loose bounds are twice that
+    uint32_t depth = 0;
+    uint32_t parent = NONE;
+    uint32_t children[8] = {NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE};
+    uint32_t first_object = NONE;
+  };
+
+  struct Object {
+    glm::vec3 center{0.0f};
+    float radius = 0.0f;
+    uint32_t value = 0;
+    uint32_t cell = NONE;  // NONE while free
+    uint32_t prev = NONE;
+    uint32_t next = NONE;
+  };
+
+  // Deepest depth whose cells fit radius
+  uint32_t depthFor(float radius) const;
+  // Cell the sphere belongs in, created if it doesn't exist yet
+  uint32_t findCell(const glm::vec3& center, float radius);
+  bool inCell(const Cell& cell, const glm::vec3& point) const;
+
+  void link(Handle handle, uint32_t cell);
+  void unlink(Handle handle);
+  // Frees cell and its ancestors while they're empty
+  void prune(uint32_t cell);
+
+  uint32_t allocateCell(uint32_t parent, uint32_t octant);
+
+  // Every value of the cell and its subtree, appended. Returns the cells.
+  size_t collect(uint32_t cell, std::vector<uint32_t>& values) const;
+
+  float half_extent_;
+  uint32_t max_depth_;
+
+  std::vector<Cell> cells_;
+  std::vector<uint32_t> free_cells_;
+  std::vector<Object> objects_;
+  std::vector<Handle> free_objects_;
+};
+
+}  // namespace va
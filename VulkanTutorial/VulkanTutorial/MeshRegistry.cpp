@@ -0,0 +1,91 @@
+#include "MeshRegistry.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace va {
+
+MeshRegistry::MeshId MeshRegistry::add(const std::vector<Vertex>& vertices,
+  const std::vector<uint32_t>& indices){
+  if(vertices.empty() || indices.empty())
+    throw std::invalid_argument("Mesh needs vertices and indices");
+
+  glm::vec3 center;
+  float radius;
+  boundingSphere(vertices, center, radius);
+  MeshId id = addEntry(static_cast<uint32_t>(vertices.size()),
+    static_cast<uint32_t>(indices.size()), center, radius);
+
+  PendingMesh mesh;
+  mesh.id = id;
+  mesh.vertices = vertices;
+  mesh.indices = indices;
+  pending_.push_back(std::move(mesh));
+  return id;
+}
+
+MeshRegistry::MeshId MeshRegistry::add(EncodedGeometry geometry){
+  if(geometry.vertex_count == 0 || geometry.index_count == 0)
+    throw std::invalid_argument("Mesh needs vertices and indices");
+
+  // Bounds come with the encoded mesh, nothing to decode yet
+  MeshId id = addEntry(geometry.vertex_count, geometry.index_count,
+    geometry.center, geometry.radius);
+
+  PendingMesh mesh;
+  mesh.id = id;
+  mesh.encoded = std::move(geometry);
+  pending_.push_back(std::move(mesh));
+  return id;
+}
+
+MeshRegistry::MeshId MeshRegistry::addEntry(uint32_t vertex_count,
+  uint32_t index_count, const glm::vec3& center, float radius){
+  MeshEntry entry;
+  entry.first_index = index_count_;
+  entry.vertex_offset = static_cast<int32_t>(vertex_count_);
+  entry.index_count = index_count;
+  entry.vertex_count = vertex_count;
+  entry.center = center;
+  entry.radius = radius;
+
+  vertex_count_ += vertex_count;
+  index_count_ += index_count;
+  pending_vertex_count_ += vertex_count;
+  pending_index_count_ += index_count;
+  max_vertex_count_ = std::max(max_vertex_count_, vertex_count);
+
+  meshes_.push_back(entry);
+  return static_cast<MeshId>(meshes_.size() - 1);
+}
+
+void MeshRegistry::boundingSphere(const std::vector<Vertex>& vertices,
+  glm::vec3& center, float& radius){
+  glm::vec3 lo = vertices[0].pos;
+  glm::vec3 hi = vertices[0].pos;
+  for(const auto& v : vertices){
+    lo = glm::min(lo, v.pos);
+    hi = glm::max(hi, v.pos);
+  }
+  center = 0.5f*(lo + hi);
+  radius = 0.0f;
+  for(const auto& v : vertices)
+    radius = std::max(radius, glm::length(v.pos - center));
+}
+
+void MeshRegistry::clearPending(){
+  pending_.clear();
+  pending_.shrink_to_fit();
+  pending_vertex_count_ = 0;
+  pending_index_count_ = 0;
+}
+
+void MeshRegistry::clear(){
+  meshes_.clear();
+  vertex_count_ = 0;
+  index_count_ = 0;
+  max_vertex_count_ = 0;
+  clearPending();
+}
+
+}  // namespace va
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "GeometryCodec.h"
+#include "Vertex.h"
+
+namespace va {
+
+/* Where a mesh lives in the shared buffers, maps straight onto
+ * vkCmdDrawIndexed(cb, index_count, 1, first_index, vertex_offset, 0).
+ * Indices are local to the mesh, vertex_offset is added to each of them.
+ */
+struct MeshEntry {
+  uint32_t first_index = 0;
+  int32_t vertex_offset = 0;
+  uint32_t index_count = 0;
+  uint32_t vertex_count = 0;
+  // Bounding sphere in model space, for culling
+  glm::vec3 center{0.0f};
+  float radius = 0.0f;
+};
+
+/* A mesh added since the last upload, as given: vertices and indices, or
+ * encoded (then the vectors are empty) to be decoded straight into the
+ * upload's staging memory.
+ */
+struct PendingMesh {
+  uint32_t id = 0;
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;
+  std::optional<EncodedGeometry> encoded;
+};
+
+/*
+ * Packs every mesh into one vertex range and one index range, so a scene of
+ * different meshes binds one vertex buffer and one index buffer and picks the
+ * mesh per draw.
+ *
+ * The registry only does the bookkeeping. Meshes are appended on the cpu,
+ * whatever was added since the last upload is kept as pending meshes which
+ * the owner copies into its gpu buffers at their entry's offsets, then calls
+ * clearPending(). Entries never move, so meshes can be added while earlier
+ * ones are being drawn.
+ */
+class MeshRegistry {
+ public:
+  using MeshId = uint32_t;
+
+  MeshId add(const std::vector<Vertex>& vertices,
+    const std::vector<uint32_t>& indices);
+  // Kept encoded until it's uploaded
+  MeshId add(EncodedGeometry geometry);
+
+  const MeshEntry& mesh(MeshId id) const { return meshes_[id]; }
+  uint32_t meshCount() const { return static_cast<uint32_t>(meshes_.size()); }
+
+  // Totals over every mesh, uploaded or not
+  uint32_t vertexCount() const { return vertex_count_; }
+  uint32_t indexCount() const { return index_count_; }
+
+  // Every mesh has fewer than 65536 vertices, its indices fit in 16 bits
+  bool fitsShortIndices() const { return max_vertex_count_ < 65536; }
+
+  bool hasPending() const { return !pending_.empty(); }
+  const std::vector<PendingMesh>& pending() const { return pending_; }
+  // Start and size of the pending ranges, everything before is uploaded
+  uint32_t pendingFirstVertex() const {
+    return vertex_count_ - pending_vertex_count_;
+  }
+  uint32_t pendingFirstIndex() const {
+    return index_count_ - pending_index_count_;
+  }
+  uint32_t pendingVertexCount() const { return pending_vertex_count_; }
+  uint32_t pendingIndexCount() const { return pending_index_count_; }
+
+  // The pending data is on the gpu, drop the cpu copy.
+  void clearPending();
+
+  // Forget every mesh, eg. when the gpu buffers are destroyed.
+  void clear();
+
+  // Centered on the bounding box, not the tightest sphere but close enough
+  static void boundingSphere(const std::vector<Vertex>& vertices,
+    glm::vec3& center, float& radius);
+
+ private:
+  MeshId addEntry(uint32_t vertex_count, uint32_t index_count,
+    const glm::vec3& center, float radius);
+
+  std::vector<MeshEntry> meshes_;
+  uint32_t vertex_count_ = 0;
+  uint32_t index_count_ = 0;
+  uint32_t max_vertex_count_ = 0;
+
+  std::vector<PendingMesh> pending_;
+  uint32_t pending_vertex_count_ = 0;
+  uint32_t pending_index_count_ = 0;
+};
+
+}  // namespace va
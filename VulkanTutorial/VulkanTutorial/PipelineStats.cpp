@@ -0,0 +1,172 @@
+#include "PipelineStats.h"
+
+#include <sstream>
+#include <stdexcept>
+
+namespace va {
+
+namespace {
+// In the order results are written, lowest bit first
+constexpr VkQueryPipelineStatisticFlags STATISTICS =
+  VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT
+  | VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT
+  | VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+constexpr uint32_t STATISTIC_COUNT = 3;
+}  // namespace
+
+bool PipelineStats::supported(VkPhysicalDevice physical_device){
+  VkPhysicalDeviceFeatures features;
+  vkGetPhysicalDeviceFeatures(physical_device, &features);
+  return features.pipelineStatisticsQuery == VK_TRUE;
+}
+
+void PipelineStats::init(VkPhysicalDevice physical_device, VkDevice device,
+  uint32_t frames_in_flight, uint32_t max_ranges_per_frame){
+  device_ = device;
+  max_ranges_ = max_ranges_per_frame;
+  enabled_ = supported(physical_device);
+  if(!enabled_) return;
+
+  createFramePools(frames_in_flight);
+}
+
+void PipelineStats::cleanUp(){
+  destroyFramePools();
+}
+
+void PipelineStats::setFramesInFlight(uint32_t frames_in_flight){
+  if(!enabled_ || frames_in_flight == frames_.size()) return;
+
+  // Pick up whatever the old pools finished before they go away.
+  for(auto& frame : frames_) collect(frame);
+
+  destroyFramePools();
+  createFramePools(frames_in_flight);
+}
+
+void PipelineStats::beginFrame(VkCommandBuffer cb, uint32_t frame_idx,
+  uint64_t pixels){
+  if(!enabled_) return;
+
+  current_frame_ = frame_idx;
+  auto& frame = frames_[frame_idx];
+
+  // The GPU finished this slot's previous submission, no waiting
+  collect(frame);
+
+  frame.ranges = 0;
+  frame.open = false;
+  frame.pixels = pixels;
+  vkCmdResetQueryPool(cb, frame.pool, 0, max_ranges_);
+}
+
+void PipelineStats::begin(VkCommandBuffer cb){
+  if(!enabled_) return;
+
+  auto& frame = frames_[current_frame_];
+  if(frame.open || frame.ranges >= max_ranges_) return;
+
+  vkCmdBeginQuery(cb, frame.pool, frame.ranges, 0);
+  frame.open = true;
+}
+
+void PipelineStats::end(VkCommandBuffer cb){
+  if(!enabled_) return;
+
+  auto& frame = frames_[current_frame_];
+  if(!frame.open) return;
+
+  vkCmdEndQuery(cb, frame.pool, frame.ranges);
+  frame.open = false;
+  ++frame.ranges;
+}
+
+PipelineStats::Counters PipelineStats::mean() const{
+  Counters c;
+  c.frames = frame_count_;
+  if(frame_count_ == 0) return c;
+
+  c.vertex_invocations =
+    static_cast<double>(vertex_invocations_)/frame_count_;
+  c.primitives = static_cast<double>(primitives_)/frame_count_;
+  c.fragment_invocations =
+    static_cast<double>(fragment_invocations_)/frame_count_;
+  if(pixels_ > 0){
+    c.fragments_per_pixel =
+      static_cast<double>(fragment_invocations_)/pixels_;
+  }
+  return c;
+}
+
+std::string PipelineStats::report() const{
+  std::ostringstream out;
+  if(!enabled_){
+    out << "Pipeline statistics queries not supported\n";
+    return out.str();
+  }
+
+  Counters c = mean();
+  out.precision(3);
+  out << std::fixed << "Per frame over " << c.frames << " frames: "
+      << c.vertex_invocations << " vertex invocations, " << c.primitives
+      << " primitives, " << c.fragment_invocations
+      << " fragment invocations, " << c.fragments_per_pixel
+      << " fragments per pixel\n";
+  return out.str();
+}
+
+void PipelineStats::createFramePools(uint32_t frames_in_flight){
+  frames_.resize(frames_in_flight);
+  for(auto& frame : frames_){
+    frame = FrameQueries{};
+
+    VkQueryPoolCreateInfo qp_info{};
+    qp_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    qp_info.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+    qp_info.queryCount = max_ranges_;
+    qp_info.pipelineStatistics = STATISTICS;
+
+    if(vkCreateQueryPool(device_, &qp_info, nullptr, &frame.pool)
+      != VK_SUCCESS){
+      throw std::runtime_error("Failed to create pipeline statistics pool");
+    }
+  }
+  current_frame_ = 0;
+}
+
+void PipelineStats::destroyFramePools(){
+  for(auto& frame : frames_)
+    vkDestroyQueryPool(device_, frame.pool, nullptr);
+  frames_.clear();
+}
+
+void PipelineStats::collect(FrameQueries& frame){
+  if(frame.ranges == 0) return;
+
+  // The statistics then the availability of every range. No wait bit,
+  // a frame with a range that isn't done is skipped.
+  const uint32_t stride = STATISTIC_COUNT + 1;
+  std::vector<uint64_t> results(frame.ranges*stride, 0);
+  VkResult result = vkGetQueryPoolResults(device_, frame.pool, 0,
+    frame.ranges, results.size()*sizeof(uint64_t), results.data(),
+    stride*sizeof(uint64_t),
+    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+  const uint32_t ranges = frame.ranges;
+  frame.ranges = 0;
+  if(result != VK_SUCCESS) return;
+
+  uint64_t sums[STATISTIC_COUNT] = {};
+  for(uint32_t r = 0; r < ranges; ++r){
+    const uint64_t* range = &results[r*stride];
+    if(range[STATISTIC_COUNT] == 0) return;
+    for(uint32_t i = 0; i < STATISTIC_COUNT; ++i) sums[i] += range[i];
+  }
+
+  ++frame_count_;
+  vertex_invocations_ += sums[0];
+  primitives_ += sums[1];
+  fragment_invocations_ += sums[2];
+  pixels_ += frame.pixels;
+}
+
+}  // namespace va
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define GLFW_INCLUDE_VULKAN
+#include "GLFW/glfw3.h"
+
+namespace va {
+
+/*
+ * Counts the vertex and fragment work of a frame with pipeline statistics
+ * queries, to see how much overdraw shading pays for.
+ *
+ * Like GpuProfiler each frame in flight owns a query pool, read without
+ * waiting when the slot comes around again. A frame may have several
+ * ranges (eg. one per render pass), their counts are summed. Ranges are
+ * begun and ended outside render passes.
+ *
+ * Fragments per pixel divides fragment shader invocations by the pixels
+ * the frame rendered: 1 means every pixel was shaded once, more is
+ * overdraw (or per sample shading).
+ *
+ * Disabled, every call a no-op, when the device doesn't support pipeline
+ * statistics queries. The feature has to be enabled on the device.
+ *
+ * eg.
+ * stats.beginFrame(cb, frame_idx, width*height);
+ * stats.begin(cb);
+ * ...render pass...
+ * stats.end(cb);
+ */
+class PipelineStats {
+ public:
+  static bool supported(VkPhysicalDevice physical_device);
+
+  void init(VkPhysicalDevice physical_device, VkDevice device,
+    uint32_t frames_in_flight, uint32_t max_ranges_per_frame = 4);
+
+  void cleanUp();
+
+  // Recreate the per frame pools, the GPU must be idle.
+  void setFramesInFlight(uint32_t frames_in_flight);
+
+  bool enabled() const { return enabled_; }
+
+  /* Collect what the slot counted last time, then reset its queries.
+   * pixels is what this frame renders. Outside of a render pass.
+   */
+  void beginFrame(VkCommandBuffer cb, uint32_t frame_idx, uint64_t pixels);
+
+  void begin(VkCommandBuffer cb);
+  void end(VkCommandBuffer cb);
+
+  // Per frame, over every frame collected so far
+  struct Counters {
+    uint64_t frames = 0;
+    double vertex_invocations = 0.0;
+    double primitives = 0.0;  // reaching the rasterizer
+    double fragment_invocations = 0.0;
+    double fragments_per_pixel = 0.0;
+  };
+  Counters mean() const;
+
+  std::string report() const;
+
+ private:
+  struct FrameQueries {
+    VkQueryPool pool = VK_NULL_HANDLE;
+    uint32_t ranges = 0;
+    bool open = false;
+    uint64_t pixels = 0;
+  };
+
+  void createFramePools(uint32_t frames_in_flight);
+  void destroyFramePools();
+  void collect(FrameQueries& frame);
+
+  bool enabled_ = false;
+  VkDevice device_ = VK_NULL_HANDLE;
+  uint32_t max_ranges_ = 0;
+
+  std::vector<FrameQueries> frames_;
+  uint32_t current_frame_ = 0;
+
+  // Sums over the collected frames
+  uint64_t frame_count_ = 0;
+  uint64_t vertex_invocations_ = 0;
+  uint64_t primitives_ = 0;
+  uint64_t fragment_invocations_ = 0;
+  uint64_t pixels_ = 0;
+};
+
+}  // namespace va
@@ -0,0 +1,90 @@
+#include "QualityController.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace va {
+
+namespace {
+// Weight of the newest sample in the moving average
+const double SMOOTHING = 0.1;
+// Longest wait before trying a level that was too slow again
+const uint32_t MAX_UPGRADE_FRAMES = 120*16;
+}  // namespace
+
+std::string qualityLevelName(const QualityLevel& level){
+  std::string name = std::to_string(level.msaa_samples) + "x msaa";
+  if(level.sample_shading) name += " + sample shading";
+  if(level.render_scale < 1.0f){
+    name += " at " + std::to_string(
+      static_cast<int>(level.render_scale*100.0f + 0.5f)) + "%";
+  }
+  return name;
+}
+
+void QualityController::init(std::vector<QualityLevel> levels,
+  uint32_t start_level, double target_ms){
+  if(levels.empty())
+    throw std::invalid_argument("Quality controller needs a level");
+
+  levels_ = std::move(levels);
+  level_ = std::min(start_level, static_cast<uint32_t>(levels_.size() - 1));
+  target_ms_ = target_ms;
+  upgrade_frames_.assign(levels_.size(), UPGRADE_FRAMES);
+  has_sample_ = false;
+  settle_ = 0;
+  over_frames_ = 0;
+  under_frames_ = 0;
+  upgraded_ = false;
+  switch_count_ = 0;
+}
+
+bool QualityController::addSample(double gpu_ms){
+  if(!enabled()) return false;
+  if(settle_ > 0){
+    --settle_;
+    return false;
+  }
+
+  if(!has_sample_){
+    smoothed_ms_ = gpu_ms;
+    has_sample_ = true;
+  }else{
+    smoothed_ms_ += SMOOTHING*(gpu_ms - smoothed_ms_);
+  }
+
+  over_frames_ = smoothed_ms_ > target_ms_*DOWNGRADE_MARGIN
+    ? over_frames_ + 1 : 0;
+  under_frames_ = smoothed_ms_ < target_ms_*UPGRADE_HEADROOM
+    ? under_frames_ + 1 : 0;
+
+  if(over_frames_ >= DOWNGRADE_FRAMES && level_ > 0){
+    // Stepping up to here didn't work out, be slower to try it again
+    if(upgraded_){
+      upgrade_frames_[level_ - 1] =
+        std::min(upgrade_frames_[level_ - 1]*2, MAX_UPGRADE_FRAMES);
+    }
+    switchTo(level_ - 1);
+    upgraded_ = false;
+    return true;
+  }
+  if(under_frames_ >= upgrade_frames_[level_]
+    && level_ + 1 < levels_.size()){
+    switchTo(level_ + 1);
+    upgraded_ = true;
+    return true;
+  }
+  return false;
+}
+
+void QualityController::switchTo(uint32_t level){
+  level_ = level;
+  ++switch_count_;
+  over_frames_ = 0;
+  under_frames_ = 0;
+  settle_ = SETTLE_FRAMES;
+  // The new level's cost is unknown, start averaging over
+  has_sample_ = false;
+}
+
+}  // namespace va
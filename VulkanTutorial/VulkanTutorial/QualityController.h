@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace va {
+
+/* One step of the quality ladder. */
+struct QualityLevel {
+  uint32_t msaa_samples = 1;
+  // Fragment shader per sample instead of per pixel, on top of msaa
+  bool sample_shading = false;
+  // Scene resolution relative to the output, upscaled to it afterwards
+  float render_scale = 1.0f;
+};
+
+std::string qualityLevelName(const QualityLevel& level);
+
+/*
+ * Picks a quality level from measured GPU frame times so the frame fits a
+ * target time. Levels are ordered cheapest first, every switch is to a
+ * neighbour.
+ *
+ * GPU times are smoothed (exponential moving average). The controller
+ * steps down as soon as the average stays above the target for a few
+ * frames, and steps up only after a long stretch well below it, so it
+ * doesn't oscillate between two levels. A step up that has to be undone
+ * right away makes the next step up to that level wait twice as long.
+ *
+ * The caller owns whatever each level needs (pipelines, render targets)
+ * and keeps all of them alive, a switch is only an index change.
+ *
+ * Each frame with a new GPU time:
+ *   if(controller.addSample(gpu_ms)) use(controller.level());
+ */
+class QualityController {
+ public:
+  void init(std::vector<QualityLevel> levels, uint32_t start_level,
+    double target_ms);
+
+  bool enabled() const { return target_ms_ > 0.0 && levels_.size() > 1; }
+
+  /* One GPU frame time, of a frame rendered at the current level. Returns
+   * true when the level changed.
+   */
+  bool addSample(double gpu_ms);
+
+  uint32_t level() const { return level_; }
+  const QualityLevel& current() const { return levels_[level_]; }
+  const std::vector<QualityLevel>& levels() const { return levels_; }
+
+  double smoothedMs() const { return smoothed_ms_; }
+  uint32_t switchCount() const { return switch_count_; }
+
+  // Over budget above the target, headroom below target*UPGRADE_HEADROOM.
+  static constexpr double DOWNGRADE_MARGIN = 1.05;
+  static constexpr double UPGRADE_HEADROOM = 0.7;
+  static constexpr uint32_t DOWNGRADE_FRAMES = 8;
+  static constexpr uint32_t UPGRADE_FRAMES = 120;
+  // Frames ignored after a switch, still in flight at the old level
+  static constexpr uint32_t SETTLE_FRAMES = 4;
+
+ private:
+  void switchTo(uint32_t level);
+
+  std::vector<QualityLevel> levels_;
+  uint32_t level_ = 0;
+  double target_ms_ = 0.0;
+
+  double smoothed_ms_ = 0.0;
+  bool has_sample_ = false;
+  uint32_t settle_ = 0;
+  uint32_t over_frames_ = 0;
+  uint32_t under_frames_ = 0;
+  // Frames of headroom needed to step up from each level
+  std::vector<uint32_t> upgrade_frames_;
+  // Level was just entered by stepping up
+  bool upgraded_ = false;
+  uint32_t switch_count_ = 0;
+};
+
+}  // namespace va
@@ -0,0 +1,481 @@
+#include "RenderGraph.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+namespace va {
+
+namespace {
+// Move state on to a use. Returns false when it takes no barrier: reads
+// after reads in the same layout pile up, so the next write waits for all
+// of them.
+bool advance(ImageState& state, const ImageState& to){
+  if(state.layout == to.layout && !state.write && !to.write){
+    state.stage |= to.stage;
+    state.access |= to.access;
+    return false;
+  }
+  state = to;
+  return true;
+}
+}  // namespace
+
+ImageState usageState(ImageUsage usage){
+  switch(usage){
+    case ImageUsage::Undefined:
+      return {VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0,
+        false};
+    case ImageUsage::ColorAttachment:
+      return {VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+        VK_ACCESS_COLOR_ATTACHMENT_READ_BIT
+        | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, true};
+    case ImageUsage::DepthAttachment:
+      return {VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+        | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+        | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, true};
+    case ImageUsage::DepthRead:
+      return {VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+        | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, false};
+    case ImageUsage::SampledFragment:
+      return {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+        false};
+    case ImageUsage::SampledCompute:
+      return {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+        false};
+    case ImageUsage::StorageCompute:
+      return {VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, true};
+    case ImageUsage::TransferSrc:
+      return {VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, false};
+    case ImageUsage::TransferDst:
+      return {VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, true};
+    case ImageUsage::Present:
+      // Presentation engine waits on a semaphore, nothing to make visible
+      return {VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, false};
+  }
+  throw std::invalid_argument("Unknown image usage");
+}
+
+bool BarrierBatch::add(VkImage image, const VkImageSubresourceRange& range,
+  const ImageState& from, const ImageState& to){
+  // Read after read in the same layout, nothing to wait for
+  if(from.layout == to.layout && !from.write && !to.write) return false;
+
+  VkImageMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.oldLayout = from.layout;
+  barrier.newLayout = to.layout;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange = range;
+  // Only writes have to be made available, write after read only needs the
+  // execution dependency.
+  barrier.srcAccessMask = from.write ? from.access : 0;
+  barrier.dstAccessMask = to.access;
+  barriers_.push_back(barrier);
+
+  src_stage_ |= from.stage;
+  dst_stage_ |= to.stage;
+  return true;
+}
+
+void BarrierBatch::addMemory(const ImageState& from, const ImageState& to){
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = from.write ? from.access : 0;
+  barrier.dstAccessMask = to.access;
+  memory_barriers_.push_back(barrier);
+
+  src_stage_ |= from.stage;
+  dst_stage_ |= to.stage;
+}
+
+void BarrierBatch::flush(VkCommandBuffer cb){
+  if(empty()) return;
+
+  vkCmdPipelineBarrier(cb, src_stage_, dst_stage_, 0,
+    static_cast<uint32_t>(memory_barriers_.size()), memory_barriers_.data(),
+    0, nullptr, static_cast<uint32_t>(barriers_.size()), barriers_.data());
+  barriers_.clear();
+  memory_barriers_.clear();
+  src_stage_ = 0;
+  dst_stage_ = 0;
+}
+
+RenderGraph::ResourceId RenderGraph::addTransient(const TransientDesc& desc){
+  if(compiled_) throw std::logic_error("Render graph is already compiled");
+  if(desc.lazy && !(desc.usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT)){
+    throw std::invalid_argument(
+      "Lazily allocated images need transient attachment usage");
+  }
+
+  Resource resource{};
+  resource.name = desc.name;
+  resource.imported = false;
+  resource.desc = desc;
+  resource.aspect = desc.aspect;
+  resources_.push_back(resource);
+  return static_cast<ResourceId>(resources_.size() - 1);
+}
+
+RenderGraph::ResourceId RenderGraph::addImported(const char* name,
+  ImageUsage initial, ImageUsage final_usage, VkImageAspectFlags aspect,
+  VkPipelineStageFlags initial_stage){
+  if(compiled_) throw std::logic_error("Render graph is already compiled");
+
+  Resource resource{};
+  resource.name = name;
+  resource.imported = true;
+  resource.aspect = aspect;
+  resource.initial_state = usageState(initial);
+  if(initial_stage != 0) resource.initial_state.stage = initial_stage;
+  resource.final_state = usageState(final_usage);
+  resources_.push_back(resource);
+  return static_cast<ResourceId>(resources_.size() - 1);
+}
+
+void RenderGraph::addPass(const char* name, std::initializer_list<Use> uses,
+  std::function<void(VkCommandBuffer)> record){
+  if(compiled_) throw std::logic_error("Render graph is already compiled");
+
+  const int32_t pass = static_cast<int32_t>(passes_.size());
+  for(const auto& use : uses){
+    Resource& resource = resources_.at(use.resource);
+    if(resource.first_pass < 0) resource.first_pass = pass;
+    resource.last_pass = pass;
+  }
+  passes_.push_back({name, uses, std::move(record)});
+}
+
+void RenderGraph::compile(VkDevice device, AllocateFn allocate,
+  FreeFn free){
+  if(compiled_) throw std::logic_error("Render graph is already compiled");
+  device_ = device;
+  free_ = std::move(free);
+
+  createTransients();
+  assignBlocks();
+
+  // One allocation per block, every image in it bound at offset 0
+  for(auto& block : blocks_){
+    VkMemoryRequirements requirements{};
+    requirements.size = block.size;
+    requirements.memoryTypeBits = block.memory_type_bits;
+    Allocation allocation = allocate(requirements, block.lazy_requested);
+    block.memory = allocation.memory;
+    block.lazy = allocation.lazy;
+    allocated_bytes_ += block.size;
+    if(block.lazy) lazy_bytes_ += block.size;
+  }
+
+  for(size_t i = 0; i < resources_.size(); ++i){
+    Resource& resource = resources_[i];
+    if(resource.imported) continue;
+
+    vkBindImageMemory(device_, resource.image,
+      blocks_[resource.block].memory, 0);
+
+    VkImageViewCreateInfo view_ci{};
+    view_ci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_ci.image = resource.image;
+    view_ci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_ci.format = resource.desc.format;
+    view_ci.subresourceRange = fullRange(resource);
+    if(vkCreateImageView(device_, &view_ci, nullptr, &resource.view)
+      != VK_SUCCESS){
+      throw std::runtime_error("Failed to create render graph image view");
+    }
+  }
+
+  planBarriers();
+  compiled_ = true;
+}
+
+void RenderGraph::createTransients(){
+  for(auto& resource : resources_){
+    if(resource.imported) continue;
+    const TransientDesc& desc = resource.desc;
+
+    VkImageCreateInfo image_ci{};
+    image_ci.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_ci.imageType = VK_IMAGE_TYPE_2D;
+    image_ci.format = desc.format;
+    image_ci.extent = {desc.extent.width, desc.extent.height, 1};
+    image_ci.mipLevels = 1;
+    image_ci.arrayLayers = 1;
+    image_ci.samples = desc.samples;
+    image_ci.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_ci.usage = desc.usage;
+    image_ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_ci.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    if(vkCreateImage(device_, &image_ci, nullptr, &resource.image)
+      != VK_SUCCESS){
+      throw std::runtime_error("Failed to create render graph image");
+    }
+    vkGetImageMemoryRequirements(device_, resource.image,
+      &resource.requirements);
+    required_bytes_ += resource.requirements.size;
+  }
+}
+
+void RenderGraph::assignBlocks(){
+  // Biggest first, smaller images then fit into the gaps of bigger ones'
+  std::vector<ResourceId> order;
+  for(ResourceId id = 0; id < resources_.size(); ++id){
+    if(!resources_[id].imported) order.push_back(id);
+  }
+  std::stable_sort(order.begin(), order.end(), [&](ResourceId a, ResourceId b){
+    return resources_[a].requirements.size > resources_[b].requirements.size;
+  });
+
+  auto overlaps = [&](const Resource& a, const Resource& b){
+    // Never used, keep it apart rather than guess
+    if(a.first_pass < 0 || b.first_pass < 0) return true;
+    return a.first_pass <= b.last_pass && b.first_pass <= a.last_pass;
+  };
+
+  for(ResourceId id : order){
+    Resource& resource = resources_[id];
+    for(size_t b = 0; b < blocks_.size() && resource.block < 0; ++b){
+      Block& block = blocks_[b];
+      if(!(block.memory_type_bits & resource.requirements.memoryTypeBits)
+        || block.lazy_requested != resource.desc.lazy)
+        continue;
+      bool free = std::none_of(block.resources.begin(), block.resources.end(),
+        [&](ResourceId other){ return overlaps(resource, resources_[other]); });
+      if(free) resource.block = static_cast<int32_t>(b);
+    }
+    if(resource.block < 0){
+      blocks_.emplace_back();
+      blocks_.back().lazy_requested = resource.desc.lazy;
+      resource.block = static_cast<int32_t>(blocks_.size() - 1);
+    }
+
+    Block& block = blocks_[resource.block];
+    block.resources.push_back(id);
+    block.memory_type_bits &= resource.requirements.memoryTypeBits;
+    // Offset 0 for all, the block has to satisfy the strictest alignment
+    VkDeviceSize alignment = resource.requirements.alignment;
+    block.size = std::max(block.size,
+      (resource.requirements.size + alignment - 1) / alignment * alignment);
+  }
+
+  // Lifetime order within each block, for the hand over between them
+  for(auto& block : blocks_){
+    std::sort(block.resources.begin(), block.resources.end(),
+      [&](ResourceId a, ResourceId b){
+        return resources_[a].first_pass < resources_[b].first_pass;
+      });
+  }
+}
+
+void RenderGraph::planBarriers(){
+  barriers_.assign(passes_.size() + 1, {});
+
+  // State of every resource after its last use, to find the transient that
+  // used a block's memory right before another one.
+  std::vector<ImageState> states(resources_.size());
+  std::vector<ImageState> last_states(resources_.size());
+  for(ResourceId id = 0; id < resources_.size(); ++id){
+    states[id] = resources_[id].initial_state;
+  }
+  for(size_t p = 0; p < passes_.size(); ++p){
+    for(const auto& use : passes_[p].uses){
+      advance(states[use.resource], usageState(use.usage));
+      last_states[use.resource] = states[use.resource];
+    }
+  }
+
+  // A transient starts with undefined contents, but only once whatever
+  // held its memory before is done with it. The first one in a block
+  // follows the last one of the previous frame.
+  std::vector<bool> aliased(resources_.size(), false);
+  for(ResourceId id = 0; id < resources_.size(); ++id){
+    Resource& resource = resources_[id];
+    if(resource.imported) continue;
+
+    const auto& members = blocks_[resource.block].resources;
+    size_t idx = std::find(members.begin(), members.end(), id)
+      - members.begin();
+    ResourceId previous = members[(idx + members.size() - 1) % members.size()];
+    resource.initial_state = last_states[previous];
+    resource.initial_state.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    aliased[id] = previous != id;
+  }
+
+  for(ResourceId id = 0; id < resources_.size(); ++id){
+    states[id] = resources_[id].initial_state;
+  }
+  std::vector<bool> used(resources_.size(), false);
+  for(size_t p = 0; p < passes_.size(); ++p){
+    for(const auto& use : passes_[p].uses){
+      ImageState from = states[use.resource];
+      ImageState to = usageState(use.usage);
+      if(advance(states[use.resource], to)){
+        barriers_[p].push_back({use.resource, from, to,
+          aliased[use.resource] && !used[use.resource]});
+      }
+      used[use.resource] = true;
+    }
+  }
+
+  // Imported images are left how the next user expects them
+  for(ResourceId id = 0; id < resources_.size(); ++id){
+    const Resource& resource = resources_[id];
+    if(!resource.imported || resource.final_state.layout == VK_IMAGE_LAYOUT_UNDEFINED)
+      continue;
+    const ImageState& state = states[id];
+    if(state.layout == resource.final_state.layout && !state.write) continue;
+    barriers_[passes_.size()].push_back({id, state, resource.final_state});
+  }
+
+  barrier_batch_count_ = 0;
+  barrier_count_ = 0;
+  for(const auto& batch : barriers_){
+    if(batch.empty()) continue;
+    ++barrier_batch_count_;
+    barrier_count_ += static_cast<uint32_t>(batch.size());
+  }
+}
+
+void RenderGraph::cleanUp(){
+  for(auto& resource : resources_){
+    if(resource.imported) continue;
+    if(resource.view != VK_NULL_HANDLE)
+      vkDestroyImageView(device_, resource.view, nullptr);
+    if(resource.image != VK_NULL_HANDLE)
+      vkDestroyImage(device_, resource.image, nullptr);
+  }
+  for(auto& block : blocks_){
+    if(block.memory != VK_NULL_HANDLE) free_(block.memory);
+  }
+
+  resources_.clear();
+  passes_.clear();
+  blocks_.clear();
+  barriers_.clear();
+  required_bytes_ = 0;
+  allocated_bytes_ = 0;
+  lazy_bytes_ = 0;
+  barrier_batch_count_ = 0;
+  barrier_count_ = 0;
+  compiled_ = false;
+}
+
+void RenderGraph::setImage(ResourceId resource, VkImage image){
+  Resource& r = resources_.at(resource);
+  if(!r.imported) throw std::logic_error("Only imported images can be set");
+  r.image = image;
+}
+
+VkImage RenderGraph::image(ResourceId resource) const{
+  return resources_.at(resource).image;
+}
+
+VkImageView RenderGraph::view(ResourceId resource) const{
+  return resources_.at(resource).view;
+}
+
+void RenderGraph::execute(VkCommandBuffer cb){
+  if(!compiled_) throw std::logic_error("Render graph is not compiled");
+
+  BarrierBatch batch;
+  auto record_barriers = [&](size_t p){
+    for(const auto& planned : barriers_[p]){
+      const Resource& resource = resources_[planned.resource];
+      if(planned.aliased){
+        // The previous image's writes, then the new one's layout from
+        // undefined with nothing left to wait for
+        batch.addMemory(planned.from, planned.to);
+        ImageState from = planned.from;
+        from.stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        from.access = 0;
+        from.write = false;
+        batch.add(resource.image, fullRange(resource), from, planned.to);
+      }else{
+        batch.add(resource.image, fullRange(resource), planned.from,
+          planned.to);
+      }
+    }
+    batch.flush(cb);
+  };
+
+  for(size_t p = 0; p < passes_.size(); ++p){
+    record_barriers(p);
+    passes_[p].record(cb);
+  }
+  record_barriers(passes_.size());
+}
+
+VkDeviceSize RenderGraph::lazyCommittedBytes() const{
+  VkDeviceSize committed = 0;
+  for(const auto& block : blocks_){
+    if(!block.lazy) continue;
+    VkDeviceSize bytes = 0;
+    vkGetDeviceMemoryCommitment(device_, block.memory, &bytes);
+    committed += bytes;
+  }
+  return committed;
+}
+
+VkImageSubresourceRange RenderGraph::fullRange(
+  const Resource& resource) const{
+  VkImageSubresourceRange range{};
+  range.aspectMask = resource.aspect;
+  range.baseMipLevel = 0;
+  // Every mip, imported images may have more than one
+  range.levelCount = VK_REMAINING_MIP_LEVELS;
+  range.baseArrayLayer = 0;
+  range.layerCount = 1;
+  return range;
+}
+
+std::string RenderGraph::report() const{
+  std::ostringstream out;
+  out.precision(2);
+  out << std::fixed;
+  const double mb = 1024.0*1024.0;
+
+  for(size_t p = 0; p < passes_.size(); ++p){
+    out << "  pass " << passes_[p].name << ": " << passes_[p].uses.size()
+        << " images, " << barriers_[p].size() << " barriers\n";
+  }
+  for(size_t b = 0; b < blocks_.size(); ++b){
+    out << "  memory block " << b << ": " << blocks_[b].size / mb << " MB"
+        << (blocks_[b].lazy ? " lazily allocated," : ",");
+    for(ResourceId id : blocks_[b].resources){
+      const Resource& resource = resources_[id];
+      out << " " << resource.name << " [" << resource.first_pass << ", "
+          << resource.last_pass << "]";
+    }
+    out << "\n";
+  }
+  out << "  transients " << required_bytes_ / mb << " MB, allocated "
+      << allocated_bytes_ / mb << " MB, aliasing saved "
+      << savedBytes() / mb << " MB\n";
+  if(lazy_bytes_ > 0){
+    out << "  lazily allocated " << lazy_bytes_ / mb << " MB, committed "
+        << lazyCommittedBytes() / mb << " MB\n";
+  }else if(std::any_of(blocks_.begin(), blocks_.end(),
+    [](const Block& block){ return block.lazy_requested; })){
+    out << "  no lazily allocated memory type, transients are device local\n";
+  }
+  out << "  " << barrier_count_ << " barriers in " << barrier_batch_count_
+      << " batches per frame\n";
+  return out.str();
+}
+
+}  // namespace va
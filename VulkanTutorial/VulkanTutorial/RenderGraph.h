@@ -0,0 +1,253 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#define GLFW_INCLUDE_VULKAN
+#include "GLFW/glfw3.h"
+
+namespace va {
+
+/* How a pass uses an image. Each one implies the layout, the stages and the
+ * accesses, see usageState().
+ */
+enum class ImageUsage {
+  Undefined,        // contents don't matter
+  ColorAttachment,  // written by a render pass, includes msaa resolve targets
+  DepthAttachment,  // depth test and write
+  DepthRead,        // depth test only
+  SampledFragment,
+  SampledCompute,
+  StorageCompute,   // read and written by a compute shader
+  TransferSrc,
+  TransferDst,
+  Present
+};
+
+/* Where an image is after (or before) a use. */
+struct ImageState {
+  VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkPipelineStageFlags stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+  VkAccessFlags access = 0;
+  bool write = false;
+};
+
+ImageState usageState(ImageUsage usage);
+
+/*
+ * Image barriers collected and issued with one vkCmdPipelineBarrier, stage
+ * masks are the union of every barrier's.
+ */
+class BarrierBatch {
+ public:
+  /* Barrier taking range of image from state from to state to. Returns
+   * false and adds nothing when the two don't need one (same layout, both
+   * reads).
+   */
+  bool add(VkImage image, const VkImageSubresourceRange& range,
+    const ImageState& from, const ImageState& to);
+
+  /* Global memory barrier, for memory handed from one image to another:
+   * an image barrier only covers accesses to its own image.
+   */
+  void addMemory(const ImageState& from, const ImageState& to);
+
+  bool empty() const {
+    return barriers_.empty() && memory_barriers_.empty();
+  }
+
+  // Record the batch if there's anything in it and start over.
+  void flush(VkCommandBuffer cb);
+
+ private:
+  std::vector<VkImageMemoryBarrier> barriers_;
+  std::vector<VkMemoryBarrier> memory_barriers_;
+  VkPipelineStageFlags src_stage_ = 0;
+  VkPipelineStageFlags dst_stage_ = 0;
+};
+
+/*
+ * Passes of a frame and the images they use. From what each pass declares
+ * the graph works out
+ * - the barriers and layout transitions in front of every pass, batched
+ *   into one vkCmdPipelineBarrier per pass, none where nothing changes,
+ * - the lifetime of every transient image (first to last pass using it).
+ *   Transients whose lifetimes don't overlap share memory.
+ *
+ * Transient images are created by the graph and their contents don't
+ * survive the frame, imported ones (eg. the swap chain image) are owned
+ * outside and handed back in their final state.
+ * Render passes keep their attachments in the layout the graph put them
+ * in (initialLayout == finalLayout == the subpass layout).
+ *
+ * eg.
+ * RenderGraph graph;
+ * auto depth = graph.addTransient({"depth", format, extent, ...});
+ * auto target = graph.addImported("swapchain", ImageUsage::Undefined,
+ *   ImageUsage::Present, aspect);
+ * graph.addPass("scene", {{depth, ImageUsage::DepthAttachment},
+ *   {target, ImageUsage::ColorAttachment}}, [&](VkCommandBuffer cb){ ... });
+ * graph.compile(device, allocate, free);
+ * ...
+ * graph.setImage(target, image);
+ * graph.execute(cb);
+ *
+ * Not thread safe. A resource is used at most once per pass.
+ */
+class RenderGraph {
+ public:
+  using ResourceId = uint32_t;
+
+  struct TransientDesc {
+    const char* name;
+    VkFormat format;
+    VkExtent2D extent;
+    VkSampleCountFlagBits samples;
+    VkImageUsageFlags usage;
+    VkImageAspectFlags aspect;
+    // Contents never leave the render pass (no load, no store). Needs
+    // TRANSIENT_ATTACHMENT usage, backed by lazily allocated memory when
+    // the device has it, so tilers don't have to commit any.
+    bool lazy = false;
+  };
+
+  struct Use {
+    ResourceId resource;
+    ImageUsage usage;
+  };
+
+  struct Allocation {
+    VkDeviceMemory memory;
+    bool lazy;  // memory type is LAZILY_ALLOCATED
+  };
+
+  /* Device local memory for the requirements, lazily allocated if asked
+   * for and the device has it. And its release.
+   */
+  using AllocateFn =
+    std::function<Allocation(const VkMemoryRequirements&, bool lazy)>;
+  using FreeFn = std::function<void(VkDeviceMemory)>;
+
+  ResourceId addTransient(const TransientDesc& desc);
+
+  /* Image created elsewhere, set with setImage() before every execute().
+   * It starts each frame in the state of initial and ends in the state of
+   * final_usage. initial_stage overrides the stage the first barrier waits
+   * for, eg. a swap chain image starts Undefined, waited for at color
+   * attachment output.
+   */
+  ResourceId addImported(const char* name, ImageUsage initial,
+    ImageUsage final_usage, VkImageAspectFlags aspect,
+    VkPipelineStageFlags initial_stage = 0);
+
+  // name must be a string literal, it's used in the report.
+  void addPass(const char* name, std::initializer_list<Use> uses,
+    std::function<void(VkCommandBuffer)> record);
+
+  /* Create the transient images and their (shared) memory, and precompute
+   * every pass's barriers. Passes and resources can't be added afterwards.
+   */
+  void compile(VkDevice device, AllocateFn allocate, FreeFn free);
+
+  // Destroys the transients and forgets every pass and resource.
+  void cleanUp();
+
+  void setImage(ResourceId resource, VkImage image);
+
+  VkImage image(ResourceId resource) const;
+  // Whole image view, transients only.
+  VkImageView view(ResourceId resource) const;
+
+  // Barriers then recording of every pass, in the order they were added.
+  void execute(VkCommandBuffer cb);
+
+  // Memory of the transients, unaliased and as allocated.
+  VkDeviceSize requiredBytes() const { return required_bytes_; }
+  VkDeviceSize allocatedBytes() const { return allocated_bytes_; }
+  VkDeviceSize savedBytes() const {
+    return required_bytes_ > allocated_bytes_
+      ? required_bytes_ - allocated_bytes_ : 0;
+  }
+
+  /* Part of allocatedBytes() in lazily allocated memory, and how much of
+   * that the driver actually committed so far.
+   */
+  VkDeviceSize lazyBytes() const { return lazy_bytes_; }
+  VkDeviceSize lazyCommittedBytes() const;
+
+  // Barrier commands recorded per execute(), and the barriers in them.
+  uint32_t barrierBatchCount() const { return barrier_batch_count_; }
+  uint32_t barrierCount() const { return barrier_count_; }
+
+  // Passes, lifetimes, memory blocks and the VRAM aliasing saved.
+  std::string report() const;
+
+ private:
+  struct Resource {
+    const char* name;
+    bool imported;
+    TransientDesc desc;
+    VkImageAspectFlags aspect;
+    ImageState initial_state;
+    ImageState final_state;
+
+    VkImage image = VK_NULL_HANDLE;
+    VkImageView view = VK_NULL_HANDLE;
+    VkMemoryRequirements requirements{};
+    int32_t block = -1;
+    int32_t first_pass = -1;
+    int32_t last_pass = -1;
+  };
+
+  struct Pass {
+    const char* name;
+    std::vector<Use> uses;
+    std::function<void(VkCommandBuffer)> record;
+  };
+
+  // Transient memory, shared by resources whose lifetimes don't overlap
+  struct Block {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    uint32_t memory_type_bits = ~0u;
+    bool lazy_requested = false;
+    bool lazy = false;
+    std::vector<ResourceId> resources;
+  };
+
+  // Barrier in front of a pass (or after the last one, pass == passes_.size())
+  struct PlannedBarrier {
+    ResourceId resource;
+    ImageState from;
+    ImageState to;
+    // First use of memory another image had before, from is that image's
+    bool aliased = false;
+  };
+
+  void createTransients();
+  void assignBlocks();
+  void planBarriers();
+
+  VkImageSubresourceRange fullRange(const Resource& resource) const;
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  FreeFn free_;
+  bool compiled_ = false;
+
+  std::vector<Resource> resources_;
+  std::vector<Pass> passes_;
+  std::vector<Block> blocks_;
+  // Index is the pass, one past the last pass for the final transitions
+  std::vector<std::vector<PlannedBarrier>> barriers_;
+
+  VkDeviceSize required_bytes_ = 0;
+  VkDeviceSize allocated_bytes_ = 0;
+  VkDeviceSize lazy_bytes_ = 0;
+  uint32_t barrier_batch_count_ = 0;
+  uint32_t barrier_count_ = 0;
+};
+
+}  // namespace va
@@ -0,0 +1,178 @@
+#include "RenderQueue.h"
+
+#include <algorithm>
+#include <functional>
+#include <sstream>
+
+#include "CpuProfiler.h"
+#include "ThreadPool.h"
+
+namespace va {
+
+uint64_t RenderQueue::makeKey(uint32_t pipeline, uint32_t material,
+  uint32_t mesh, float depth){
+  constexpr uint32_t DEPTH_MAX = (1u << 24) - 1;
+  uint32_t quantized = static_cast<uint32_t>(
+    std::clamp(depth, 0.0f, 1.0f)*DEPTH_MAX);
+  return (static_cast<uint64_t>(pipeline & 0xff) << 56)
+    | (static_cast<uint64_t>(material & 0xffff) << 40)
+    | (static_cast<uint64_t>(mesh & 0xffff) << 24)
+    | quantized;
+}
+
+void RenderQueue::sort(ThreadPool* pool){
+  VA_TRACE_SCOPE("RenderQueue::sort");
+  const size_t count = draws_.size();
+  if(count < 2) return;
+  scratch_.resize(count);
+
+  // Fixed chunks, the histogram and scatter of a chunk must see the same
+  // draws
+  const size_t chunks = pool && count >= MIN_PARALLEL_DRAWS
+    ? pool->size() + 1 : 1;
+  const size_t chunk_size = (count + chunks - 1)/chunks;
+  auto for_chunks = [&](const std::function<void(size_t, size_t, size_t)>&
+    fn){
+    auto run = [&](size_t chunk){
+      size_t begin = chunk*chunk_size;
+      fn(chunk, begin, std::min(begin + chunk_size, count));
+    };
+    if(chunks == 1){
+      run(0);
+      return;
+    }
+    pool->parallelFor(chunks, 1, [&](size_t begin, size_t end){
+      for(size_t chunk = begin; chunk < end; ++chunk) run(chunk);
+    });
+  };
+
+  histograms_.resize(chunks*RADIX);
+  Draw* src = draws_.data();
+  Draw* dst = scratch_.data();
+  for(uint32_t shift = 0; shift < 64; shift += 8){
+    std::fill(histograms_.begin(), histograms_.end(), 0);
+    for_chunks([&](size_t chunk, size_t begin, size_t end){
+      size_t* histogram = &histograms_[chunk*RADIX];
+      for(size_t i = begin; i < end; ++i)
+        ++histogram[(src[i].key >> shift) & 0xff];
+    });
+
+    // Every key has this digit, the pass wouldn't move anything
+    const size_t first_digit = (src[0].key >> shift) & 0xff;
+    size_t same = 0;
+    for(size_t chunk = 0; chunk < chunks; ++chunk)
+      same += histograms_[chunk*RADIX + first_digit];
+    if(same == count) continue;
+
+    // Where each chunk's draws of each digit go. Digit major, then chunk,
+    // so equal digits keep their order.
+    size_t offset = 0;
+    for(size_t digit = 0; digit < RADIX; ++digit){
+      for(size_t chunk = 0; chunk < chunks; ++chunk){
+        size_t& slot = histograms_[chunk*RADIX + digit];
+        size_t digit_count = slot;
+        slot = offset;
+        offset += digit_count;
+      }
+    }
+
+    for_chunks([&](size_t chunk, size_t begin, size_t end){
+      size_t* next = &histograms_[chunk*RADIX];
+      for(size_t i = begin; i < end; ++i)
+        dst[next[(src[i].key >> shift) & 0xff]++] = src[i];
+    });
+    std::swap(src, dst);
+  }
+
+  // An odd number of passes ran, the result is in scratch
+  if(src != draws_.data()) draws_.swap(scratch_);
+}
+
+void StateTracker::reset(VkCommandBuffer cb){
+  cb_ = cb;
+  pipeline_ = VK_NULL_HANDLE;
+  vertex_buffer_ = VK_NULL_HANDLE;
+  vertex_offset_ = 0;
+  index_buffer_ = VK_NULL_HANDLE;
+  index_type_ = VK_INDEX_TYPE_UINT32;
+  layout_ = VK_NULL_HANDLE;
+  set_ = VK_NULL_HANDLE;
+}
+
+void StateTracker::bindPipeline(VkPipeline pipeline){
+  ++frame_.requested;
+  if(pipeline == pipeline_) return;
+
+  vkCmdBindPipeline(cb_, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+  pipeline_ = pipeline;
+  ++frame_.recorded;
+}
+
+void StateTracker::bindVertexBuffer(VkBuffer buffer, VkDeviceSize offset){
+  ++frame_.requested;
+  if(buffer == vertex_buffer_ && offset == vertex_offset_) return;
+
+  vkCmdBindVertexBuffers(cb_, 0, 1, &buffer, &offset);
+  vertex_buffer_ = buffer;
+  vertex_offset_ = offset;
+  ++frame_.recorded;
+}
+
+void StateTracker::bindIndexBuffer(VkBuffer buffer, VkIndexType type){
+  ++frame_.requested;
+  if(buffer == index_buffer_ && type == index_type_) return;
+
+  vkCmdBindIndexBuffer(cb_, buffer, 0, type);
+  index_buffer_ = buffer;
+  index_type_ = type;
+  ++frame_.recorded;
+}
+
+void StateTracker::bindDescriptorSet(VkPipelineLayout layout,
+  VkDescriptorSet set){
+  ++frame_.requested;
+  // Sets stay bound across pipelines of a compatible layout
+  if(layout == layout_ && set == set_) return;
+
+  vkCmdBindDescriptorSets(cb_, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1,
+    &set, 0, nullptr);
+  layout_ = layout;
+  set_ = set;
+  ++frame_.recorded;
+}
+
+StateTracker::Counts StateTracker::takeFrame(){
+  Counts counts = frame_;
+  frame_ = Counts{};
+
+  ++frame_count_;
+  requested_ += counts.requested;
+  recorded_ += counts.recorded;
+  return counts;
+}
+
+StateTracker::Stats StateTracker::mean() const{
+  Stats stats;
+  stats.frames = frame_count_;
+  if(frame_count_ == 0) return stats;
+
+  stats.requested = static_cast<double>(requested_)/frame_count_;
+  stats.recorded = static_cast<double>(recorded_)/frame_count_;
+  stats.skipped = stats.requested - stats.recorded;
+  return stats;
+}
+
+std::string StateTracker::report() const{
+  Stats s = mean();
+  std::ostringstream out;
+  out.precision(1);
+  out << std::fixed << "Per frame over " << s.frames << " frames: "
+      << s.requested << " binds requested, " << s.recorded << " recorded, "
+      << s.skipped << " redundant skipped";
+  if(s.requested > 0.0)
+    out << " (" << 100.0*s.skipped/s.requested << "%)";
+  out << "\n";
+  return out.str();
+}
+
+}  // namespace va
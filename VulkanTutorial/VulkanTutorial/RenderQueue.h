@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define GLFW_INCLUDE_VULKAN
+#include "GLFW/glfw3.h"
+
+namespace va {
+
+class ThreadPool;
+
+/*
+ * Draws of a frame ordered by a 64 bit sort key, most significant first:
+ *
+ *   63..56 pipeline   55..40 material   39..24 mesh   23..0 depth
+ *
+ * Draws sharing a pipeline, then a material, then a mesh end up next to
+ * each other, and within the same state they go front to back so early
+ * depth testing rejects more. Depth is quantized from [0, 1].
+ *
+ * Sorted with an lsd radix sort, 8 bits a pass. Passes where every key has
+ * the same digit (eg. a single pipeline) are skipped. Big queues split the
+ * histograms and the scatter of each pass over the thread pool, every chunk
+ * scattering into its own precomputed ranges so the sort stays stable.
+ *
+ * eg.
+ * queue.clear();
+ * queue.add(RenderQueue::makeKey(0, 0, mesh, depth), obj);
+ * queue.sort(&pool);
+ * for(const auto& draw : queue.draws()) ...
+ */
+class RenderQueue {
+ public:
+  struct Draw {
+    uint64_t key;
+    uint32_t object;
+  };
+
+  static uint64_t makeKey(uint32_t pipeline, uint32_t material,
+    uint32_t mesh, float depth);
+
+  static uint32_t pipeline(uint64_t key) {
+    return static_cast<uint32_t>(key >> 56);
+  }
+  static uint32_t material(uint64_t key) {
+    return static_cast<uint32_t>(key >> 40) & 0xffff;
+  }
+  static uint32_t mesh(uint64_t key) {
+    return static_cast<uint32_t>(key >> 24) & 0xffff;
+  }
+
+  void clear() { draws_.clear(); }
+  void add(uint64_t key, uint32_t object) { draws_.push_back({key, object}); }
+
+  // Runs on the calling thread when pool is null.
+  void sort(ThreadPool* pool);
+
+  const std::vector<Draw>& draws() const { return draws_; }
+  size_t size() const { return draws_.size(); }
+
+ private:
+  // Queues smaller than this are sorted on one thread
+  static constexpr size_t MIN_PARALLEL_DRAWS = 16384;
+  static constexpr size_t RADIX = 256;
+
+  std::vector<Draw> draws_;
+  std::vector<Draw> scratch_;
+  // One histogram per chunk, reused between frames
+  std::vector<size_t> histograms_;
+};
+
+/*
+ * Binds through this skip whatever is already bound, so a sorted queue
+ * only pays for state that actually changes. Counts the binds asked for and
+ * the ones recorded, the difference is what sorting and tracking saved over
+ * binding everything for every draw.
+ *
+ * Tracks one command buffer at a time, reset() whenever recording moves to
+ * another one or anything else may have bound state.
+ *
+ * eg.
+ * state.reset(cb);
+ * for(const auto& draw : queue.draws()){
+ *   state.bindPipeline(pipeline);
+ *   state.bindDescriptorSet(layout, set);
+ *   vkCmdDraw...
+ * }
+ */
+class StateTracker {
+ public:
+  void reset(VkCommandBuffer cb);
+
+  void bindPipeline(VkPipeline pipeline);
+  void bindVertexBuffer(VkBuffer buffer, VkDeviceSize offset);
+  void bindIndexBuffer(VkBuffer buffer, VkIndexType type);
+  // Set 0 of the graphics bind point
+  void bindDescriptorSet(VkPipelineLayout layout, VkDescriptorSet set);
+
+  // Sums since the last takeFrame(), then starts over
+  struct Counts {
+    uint64_t requested = 0;
+    uint64_t recorded = 0;
+  };
+  Counts takeFrame();
+
+  // Per frame, over every frame taken so far
+  struct Stats {
+    uint64_t frames = 0;
+    double requested = 0.0;
+    double recorded = 0.0;
+    double skipped = 0.0;
+  };
+  Stats mean() const;
+
+  std::string report() const;
+
+ private:
+  VkCommandBuffer cb_ = VK_NULL_HANDLE;
+  VkPipeline pipeline_ = VK_NULL_HANDLE;
+  VkBuffer vertex_buffer_ = VK_NULL_HANDLE;
+  VkDeviceSize vertex_offset_ = 0;
+  VkBuffer index_buffer_ = VK_NULL_HANDLE;
+  VkIndexType index_type_ = VK_INDEX_TYPE_UINT32;
+  VkPipelineLayout layout_ = VK_NULL_HANDLE;
+  VkDescriptorSet set_ = VK_NULL_HANDLE;
+
+  Counts frame_;
+  uint64_t frame_count_ = 0;
+  uint64_t requested_ = 0;
+  uint64_t recorded_ = 0;
+};
+
+}  // namespace va
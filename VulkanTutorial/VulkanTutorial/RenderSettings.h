@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "FramePacer.h"
+
+namespace va {
+
+// Renderer options chosen before the app starts.
+struct RenderSettings {
+  // How many frames the CPU may record ahead of the GPU. The low latency
+  // present policy overrides this with 1.
+  uint32_t frames_in_flight = 2;
+
+  // Present mode and swap chain size, switchable at runtime with F1-F3.
+  PresentPolicy present_policy = PresentPolicy::PowerSaving;
+
+  // Sleep before polling input so it's sampled as late as possible.
+  bool late_input_sampling = true;
+
+  // Write gpu timestamps as a chrome trace here on exit, empty to disable.
+  std::string gpu_trace_path;
+
+  // Write the last cpu trace events here on exit, empty to disable.
+  std::string cpu_trace_path;
+
+  // Frames slower than spike_threshold_ms (0: 3x the median) write a cpu
+  // trace to <spike_trace_prefix>_<frame>.json, empty prefix to disable.
+  std::string spike_trace_prefix;
+  double spike_threshold_ms = 0.0;
+
+  /* Scene scaling, mostly for benchmarks.
+   * object_count:   copies of the mesh laid out on a grid.
+   * mesh_triangles: 0 loads the model, otherwise a sphere with about this
+   *                 many triangles.
+   * texture_size:   0 loads the texture, otherwise a generated checkerboard
+   *                 texture_size x texture_size.
+   * msaa_samples:   0 uses the highest supported count, otherwise the
+   *                 highest supported count not above it.
+   */
+  uint32_t object_count = 1;
+  uint32_t mesh_triangles = 0;
+  // Distinct meshes, objects cycle through them. Meshes after the first
+  // are spheres, each with half the triangles of the one before.
+  uint32_t mesh_variants = 1;
+  // Animated tubes skinned by a compute shader, drawn after the objects
+  uint32_t skinned_instances = 0;
+  uint32_t skinned_joints = 8;
+  // Skinning on its own queue when the device has one, overlapping the
+  // graphics work. Off: same queue as graphics.
+  bool async_compute = true;
+  uint32_t texture_size = 0;
+  uint32_t msaa_samples = 0;
+  // Msaa color and depth in lazily allocated memory when the device has
+  // it. Their contents never leave the render pass.
+  bool lazy_attachments = true;
+  // Above 0 the quality follows the gpu frame time to stay under this.
+  // From the cheapest: render scale from min_render_scale up to 1 without
+  // msaa, then every msaa count up to the device maximum (plus sample
+  // shading). Starts at msaa_samples and full resolution.
+  // 0 keeps msaa_samples and render_scale fixed.
+  double target_frame_ms = 0.0;
+  // Scene resolution relative to the window, upscaled and sharpened to it
+  float render_scale = 1.0f;
+  float min_render_scale = 0.5f;
+  // Strength of the sharpening after upscaling, 0 is plain bilinear
+  float upscale_sharpness = 0.5f;
+  // Skip objects hidden behind others: tested on the gpu against a depth
+  // pyramid (hi-z) of the previous frame, then again against this frame's.
+  // Needs sampleable depth, ignored on devices without it.
+  bool occlusion_culling = false;
+  // Lay down depth with a position only pass first, then shade with an
+  // equal depth test so every pixel runs the fragment shader once.
+  bool depth_prepass = false;
+  // Moving point lights, binned into view space clusters every frame so
+  // each pixel only shades with the lights near it. 0 draws the texture
+  // unlit.
+  uint32_t light_count = 0;
+  // Fetch vertices in the vertex shader from storage buffers instead of
+  // the vertex input stage. Meshes are stored de-interleaved and
+  // compressed, and every vertex format draws with the same pipeline.
+  bool vertex_pulling = false;
+  // Static objects far from the camera draw a lower detail mesh variant,
+  // one per halving of their size on screen. Only for procedural meshes
+  // (mesh_triangles > 0), whose variants are the same sphere.
+  bool lod = false;
+
+  // Animate from the frame number instead of the wall clock, so every run
+  // renders the same sequence of frames.
+  bool scripted_camera = false;
+
+  // Don't show the window (still needs a display for the surface).
+  bool hidden_window = false;
+
+  // Run independent startup steps on worker threads.
+  bool parallel_init = true;
+};
+
+}  // namespace va
@@ -0,0 +1,45 @@
+#include "ShaderVariant.h"
+
+namespace va {
+
+std::string ShaderVariant::name() const{
+  static const char* FEATURE_NAMES[FEATURE_COUNT] = {"texture", "lighting"};
+
+  std::string out;
+  for(uint32_t bit = 0; bit < FEATURE_COUNT; ++bit){
+    if((features & (1u << bit)) == 0) continue;
+    if(!out.empty()) out += "+";
+    out += FEATURE_NAMES[bit];
+  }
+  return out.empty() ? "plain" : out;
+}
+
+ShaderSpecialization::ShaderSpecialization(ShaderVariant variant){
+  for(uint32_t bit = 0; bit < ShaderVariant::FEATURE_COUNT; ++bit){
+    values_[bit] = (variant.features & (1u << bit)) ? VK_TRUE : VK_FALSE;
+    entries_[bit].constantID = bit;
+    entries_[bit].offset = bit*sizeof(VkBool32);
+    entries_[bit].size = sizeof(VkBool32);
+  }
+  info_.mapEntryCount = static_cast<uint32_t>(entries_.size());
+  info_.pMapEntries = entries_.data();
+  info_.dataSize = sizeof(values_);
+  info_.pData = values_.data();
+}
+
+uint32_t ShaderVariantCache::add(ShaderVariant variant){
+  auto found = index_of_.find(variant.key());
+  if(found != index_of_.end()) return found->second;
+
+  uint32_t index = static_cast<uint32_t>(variants_.size());
+  variants_.push_back(variant);
+  index_of_.emplace(variant.key(), index);
+  return index;
+}
+
+void ShaderVariantCache::clear(){
+  variants_.clear();
+  index_of_.clear();
+}
+
+}  // namespace va
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define GLFW_INCLUDE_VULKAN
+#include "GLFW/glfw3.h"
+
+namespace va {
+
+/*
+ * Optional features of the scene shaders. Each is a boolean specialization
+ * constant of shader.frag whose constant_id is the feature's bit index, so
+ * every combination is compiled by the driver into its own branch free
+ * code and a feature that's off costs nothing on the gpu. The bit set is
+ * the variant's key.
+ *
+ * eg.
+ * ShaderVariant variant{ShaderVariant::TEXTURE | ShaderVariant::LIGHTING};
+ * ShaderSpecialization specialization(variant);
+ * frag_shader_ci.pSpecializationInfo = specialization.info();
+ */
+struct ShaderVariant {
+  enum Feature : uint32_t {
+    TEXTURE = 1u << 0,   // sampled texture, otherwise the vertex color
+    LIGHTING = 1u << 1,  // clustered point lights
+  };
+  static constexpr uint32_t FEATURE_COUNT = 2;
+
+  uint32_t features = TEXTURE;
+
+  uint32_t key() const { return features; }
+  bool has(Feature feature) const { return (features & feature) != 0; }
+
+  // Enabled features joined by '+', eg. "texture+lighting"
+  std::string name() const;
+};
+
+/*
+ * Specialization info setting every feature constant of a variant. Points
+ * into itself, so it can't be copied or moved: keep it alive (and in
+ * place) until the pipeline using it is created.
+ */
+class ShaderSpecialization {
+ public:
+  explicit ShaderSpecialization(ShaderVariant variant);
+
+  ShaderSpecialization(const ShaderSpecialization&) = delete;
+  ShaderSpecialization& operator=(const ShaderSpecialization&) = delete;
+
+  const VkSpecializationInfo* info() const { return &info_; }
+
+ private:
+  std::array<VkBool32, ShaderVariant::FEATURE_COUNT> values_{};
+  std::array<VkSpecializationMapEntry, ShaderVariant::FEATURE_COUNT>
+    entries_{};
+  VkSpecializationInfo info_{};
+};
+
+/*
+ * The distinct variants in use, each with a small index: where every
+ * render level keeps the variant's pipeline, and the pipeline part of the
+ * draw sort keys. Materials asking for the same variant share it.
+ *
+ * eg.
+ * uint32_t textured = cache.add({ShaderVariant::TEXTURE});
+ * for(const auto& variant : cache.variants()) ...build a pipeline...
+ */
+class ShaderVariantCache {
+ public:
+  // Index of the variant, added if it's new.
+  uint32_t add(ShaderVariant variant);
+
+  const std::vector<ShaderVariant>& variants() const { return variants_; }
+  size_t size() const { return variants_.size(); }
+
+  void clear();
+
+ private:
+  std::vector<ShaderVariant> variants_;
+  std::unordered_map<uint32_t, uint32_t> index_of_;
+};
+
+}  // namespace va
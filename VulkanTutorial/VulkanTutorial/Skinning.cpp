@@ -0,0 +1,103 @@
+#include "Skinning.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+namespace va {
+
+namespace {
+const float TUBE_LENGTH = 1.6f;
+const float TUBE_RADIUS = 0.2f;
+
+// Max bend of each joint and how fast the sway goes around, radians
+const float SWAY_ANGLE = glm::radians(20.0f);
+const float SWAY_SPEED = 2.0f;
+// Phase difference between neighbouring joints, makes the bend travel up
+const float SWAY_JOINT_LAG = 0.6f;
+}  // namespace
+
+SkinnedMesh createSkinnedTube(uint32_t joint_count, uint32_t rings_per_joint,
+  uint32_t segments){
+  if(joint_count < 2 || rings_per_joint == 0 || segments < 3)
+    throw std::invalid_argument("Skinned tube needs 2 joints and 3 segments");
+
+  SkinnedMesh mesh;
+  const float bottom = -TUBE_LENGTH/2.0f;
+  const float joint_spacing = TUBE_LENGTH/(joint_count-1);
+
+  // Joints evenly spaced from the bottom to the top of the tube
+  auto& skeleton = mesh.skeleton;
+  for(uint32_t j = 0; j < joint_count; ++j){
+    float z = bottom + j*joint_spacing;
+    skeleton.parents.push_back(static_cast<int32_t>(j) - 1);
+    skeleton.bind_local.push_back(glm::translate(glm::mat4(1.0f),
+      glm::vec3(0.0f, 0.0f, j == 0 ? bottom : joint_spacing)));
+    skeleton.inverse_bind.push_back(glm::translate(glm::mat4(1.0f),
+      glm::vec3(0.0f, 0.0f, -z)));
+  }
+
+  const float pi = glm::radians(180.0f);
+  const uint32_t rings = (joint_count-1)*rings_per_joint;
+  mesh.vertices.reserve((rings+1)*(segments+1));
+  mesh.skin.reserve((rings+1)*(segments+1));
+
+  for(uint32_t r = 0; r <= rings; ++r){
+    float height = r/(float)rings;
+    float z = bottom + height*TUBE_LENGTH;
+
+    // Blend between the joint below and the one above
+    float along = height*(joint_count-1);
+    uint32_t joint = std::min(static_cast<uint32_t>(along), joint_count-2);
+    float t = along - joint;
+
+    for(uint32_t s = 0; s <= segments; ++s){
+      float theta = 2.0f*pi*s/segments;
+      Vertex vertex{};
+      vertex.pos = {TUBE_RADIUS*std::cos(theta), TUBE_RADIUS*std::sin(theta),
+        z};
+      vertex.texCoord = {s/(float)segments, height};
+      vertex.color = {1.0f, 0.6f + 0.4f*height, 0.4f};
+      vertex.normal = {std::cos(theta), std::sin(theta), 0.0f};
+      mesh.vertices.push_back(vertex);
+
+      SkinWeights skin{};
+      skin.joints = glm::uvec4(joint, joint+1, 0, 0);
+      skin.weights = glm::vec4(1.0f-t, t, 0.0f, 0.0f);
+      mesh.skin.push_back(skin);
+    }
+  }
+
+  // Counter clockwise seen from outside, open at both ends
+  for(uint32_t r = 0; r < rings; ++r){
+    for(uint32_t s = 0; s < segments; ++s){
+      uint32_t a = r*(segments+1) + s;
+      uint32_t b = a + segments + 1;
+      mesh.indices.insert(mesh.indices.end(), {a, a+1, b, b, a+1, b+1});
+    }
+  }
+  return mesh;
+}
+
+void poseSway(const Skeleton& skeleton, float time, float phase,
+  glm::mat4* palette){
+  const uint32_t joint_count = skeleton.jointCount();
+
+  // World transforms first, parents are always done before children
+  for(uint32_t j = 0; j < joint_count; ++j){
+    float angle = SWAY_ANGLE*std::sin(time*SWAY_SPEED + phase
+      - j*SWAY_JOINT_LAG);
+    glm::mat4 local = glm::rotate(skeleton.bind_local[j], angle,
+      glm::vec3(1.0f, 0.0f, 0.0f));
+
+    int32_t parent = skeleton.parents[j];
+    palette[j] = parent < 0 ? local : palette[parent]*local;
+  }
+
+  for(uint32_t j = 0; j < joint_count; ++j)
+    palette[j] = palette[j]*skeleton.inverse_bind[j];
+}
+
+}  // namespace va
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+#include "Vertex.h"
+
+namespace va {
+
+/* Up to 4 joints per vertex. Same layout as SkinWeights in skinning.comp
+ * (std430), weights sum to 1.
+ */
+struct SkinWeights {
+  glm::uvec4 joints;
+  glm::vec4 weights;
+};
+
+/* Joint hierarchy in bind pose. Parents come before their children. */
+struct Skeleton {
+  std::vector<int32_t> parents;        // -1 for the root
+  std::vector<glm::mat4> bind_local;   // joint relative to its parent
+  std::vector<glm::mat4> inverse_bind; // model space -> joint space
+
+  uint32_t jointCount() const { return static_cast<uint32_t>(parents.size()); }
+};
+
+/* Bind pose mesh and what skins it. vertices and skin are parallel. */
+struct SkinnedMesh {
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;
+  std::vector<SkinWeights> skin;
+  Skeleton skeleton;
+};
+
+/* Upright tube centered on the origin, a chain of joint_count joints along
+ * z. Each vertex is weighted to the joint below and above it.
+ */
+SkinnedMesh createSkinnedTube(uint32_t joint_count, uint32_t rings_per_joint,
+  uint32_t segments);
+
+/* Joint palette (world * inverse bind, what the shader multiplies vertices
+ * by) of the skeleton swaying at time seconds. phase shifts the motion so
+ * instances don't move in lockstep. palette holds jointCount() matrices.
+ */
+void poseSway(const Skeleton& skeleton, float time, float phase,
+  glm::mat4* palette);
+
+}  // namespace va
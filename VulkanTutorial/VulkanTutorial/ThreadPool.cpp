@@ -0,0 +1,106 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <string>
+
+#include "CpuProfiler.h"
+
+namespace va {
+
+ThreadPool::ThreadPool(size_t thread_count){
+  if(thread_count == 0){
+    size_t hw = std::thread::hardware_concurrency();
+    thread_count = hw > 1 ? hw - 1 : 1;
+  }
+
+  workers_.reserve(thread_count);
+  for(size_t i = 0; i < thread_count; ++i)
+    workers_.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool(){
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+
+  for(auto& worker : workers_)
+    worker.join();
+}
+
+void ThreadPool::parallelFor(size_t count, size_t min_chunk,
+  const std::function<void(size_t, size_t)>& fn){
+  if(count == 0) return;
+
+  size_t max_chunks = (count + std::max<size_t>(min_chunk, 1) - 1)
+    / std::max<size_t>(min_chunk, 1);
+  size_t chunks = std::min(max_chunks, size() + 1);
+  size_t chunk_size = (count + chunks - 1) / chunks;
+
+  std::vector<std::future<void>> futures;
+  futures.reserve(chunks);
+  for(size_t begin = chunk_size; begin < count; begin += chunk_size){
+    size_t end = std::min(begin + chunk_size, count);
+    futures.push_back(submit([&fn, begin, end]{ fn(begin, end); }));
+  }
+
+  // The caller does the first chunk itself
+  std::exception_ptr error;
+  try{
+    fn(0, std::min(chunk_size, count));
+  }catch(...){
+    error = std::current_exception();
+  }
+
+  // Wait for every chunk even after a failure, they reference fn.
+  for(auto& future : futures){
+    wait(future);
+    try{
+      future.get();
+    }catch(...){
+      if(!error) error = std::current_exception();
+    }
+  }
+  if(error) std::rethrow_exception(error);
+}
+
+void ThreadPool::enqueue(std::function<void()> task){
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  cv_.notify_one();
+}
+
+void ThreadPool::workerLoop(size_t idx){
+  CpuProfiler::instance().setThreadName("worker " + std::to_string(idx));
+
+  for(;;){
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]{ return stopping_ || !tasks_.empty(); });
+      if(stopping_ && tasks_.empty()) return;
+
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    // Exceptions are stored in the task's future
+    task();
+  }
+}
+
+bool ThreadPool::runPendingTask(){
+  std::function<void()> task;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(tasks_.empty()) return false;
+    task = std::move(tasks_.front());
+    tasks_.pop_front();
+  }
+  task();
+  return true;
+}
+
+}  // namespace va
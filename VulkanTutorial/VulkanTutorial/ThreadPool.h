@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace va {
+
+/*
+ * Fixed set of worker threads pulling tasks from one queue.
+ *
+ * eg.
+ * ThreadPool pool;
+ * auto result = pool.submit([]{ return decode(); });
+ * pool.parallelFor(items.size(), 64, [&](size_t begin, size_t end){...});
+ *
+ * Threads waiting on work they submitted help run queued tasks instead of
+ * sleeping, so parallelFor can be called from inside a task.
+ */
+class ThreadPool {
+ public:
+  // 0 threads: one less than the hardware threads (the caller is one too),
+  // at least 1.
+  explicit ThreadPool(size_t thread_count = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t size() const { return workers_.size(); }
+
+  template <typename F>
+  auto submit(F&& fn) -> std::future<decltype(fn())> {
+    using Result = decltype(fn());
+    auto task = std::make_shared<std::packaged_task<Result()>>(
+      std::forward<F>(fn));
+    std::future<Result> future = task->get_future();
+    enqueue([task]{ (*task)(); });
+    return future;
+  }
+
+  /* Call fn(begin, end) over [0, count) in chunks of at least min_chunk,
+   * spread over the workers and the calling thread. Returns once every chunk
+   * is done, rethrows the first exception thrown by a chunk.
+   */
+  void parallelFor(size_t count, size_t min_chunk,
+    const std::function<void(size_t, size_t)>& fn);
+
+  // Block until the future is ready, running queued tasks meanwhile.
+  template <typename T>
+  void wait(std::future<T>& future) {
+    while(future.wait_for(std::chrono::seconds(0))
+      != std::future_status::ready){
+      if(!runPendingTask())
+        future.wait_for(std::chrono::microseconds(100));
+    }
+  }
+
+ private:
+  void enqueue(std::function<void()> task);
+  void workerLoop(size_t idx);
+
+  // Run one queued task on the calling thread, false if none was queued.
+  bool runPendingTask();
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+};
+
+}  // namespace va
@@ -0,0 +1,220 @@
+#include "TransformHierarchy.h"
+
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <stdexcept>
+
+#include "CpuProfiler.h"
+#include "ThreadPool.h"
+
+namespace va {
+
+namespace {
+/* translate * rotate * scale without the matrix products. Same layout as
+ * glm::mat4_cast, columns scaled.
+ */
+glm::mat4 composeTrs(const glm::vec3& t, const glm::quat& q,
+  const glm::vec3& s){
+  float xx = q.x*q.x, yy = q.y*q.y, zz = q.z*q.z;
+  float xy = q.x*q.y, xz = q.x*q.z, yz = q.y*q.z;
+  float wx = q.w*q.x, wy = q.w*q.y, wz = q.w*q.z;
+
+  glm::mat4 m;
+  m[0] = glm::vec4(1.0f-2.0f*(yy+zz), 2.0f*(xy+wz), 2.0f*(xz-wy), 0.0f)*s.x;
+  m[1] = glm::vec4(2.0f*(xy-wz), 1.0f-2.0f*(xx+zz), 2.0f*(yz+wx), 0.0f)*s.y;
+  m[2] = glm::vec4(2.0f*(xz+wy), 2.0f*(yz-wx), 1.0f-2.0f*(xx+yy), 0.0f)*s.z;
+  m[3] = glm::vec4(t, 1.0f);
+  return m;
+}
+
+/* parent * local for affine matrices (last row 0 0 0 1), 36 multiplies
+ * instead of 64. Column at a time so it maps onto 4 wide vector math.
+ */
+glm::mat4 mulAffine(const glm::mat4& p, const glm::mat4& l){
+  glm::mat4 m;
+  m[0] = p[0]*l[0].x + p[1]*l[0].y + p[2]*l[0].z;
+  m[1] = p[0]*l[1].x + p[1]*l[1].y + p[2]*l[1].z;
+  m[2] = p[0]*l[2].x + p[1]*l[2].y + p[2]*l[2].z;
+  m[3] = p[0]*l[3].x + p[1]*l[3].y + p[2]*l[3].z + p[3];
+  return m;
+}
+
+template <typename T>
+void permute(std::vector<T>& values, const std::vector<uint32_t>& order){
+  std::vector<T> sorted;
+  sorted.reserve(values.size());
+  for(uint32_t old_slot : order) sorted.push_back(values[old_slot]);
+  values.swap(sorted);
+}
+}  // namespace
+
+TransformHierarchy::NodeId TransformHierarchy::add(NodeId parent,
+  const glm::vec3& translation, const glm::quat& rotation,
+  const glm::vec3& scale){
+  NodeId id = static_cast<NodeId>(node_of_.size());
+  uint32_t slot = static_cast<uint32_t>(parents_.size());
+
+  uint32_t parent_slot = NO_PARENT;
+  uint32_t depth = 0;
+  if(parent != NO_PARENT){
+    if(parent >= id)
+      throw std::out_of_range("Transform parent doesn't exist");
+    parent_slot = slot_of_[parent];
+    depth = depths_[parent_slot] + 1;
+  }
+
+  // Appending keeps depth order unless deeper nodes are already there
+  if(!depths_.empty() && depth < depths_.back()) sorted_ = false;
+
+  parents_.push_back(parent_slot);
+  depths_.push_back(depth);
+  translations_.push_back(translation);
+  rotations_.push_back(rotation);
+  scales_.push_back(scale);
+  worlds_.push_back(glm::mat4(1.0f));
+  local_dirty_.push_back(0);
+  world_dirty_.push_back(0);
+
+  slot_of_.push_back(slot);
+  node_of_.push_back(id);
+
+  if(level_dirty_count_.size() <= depth) level_dirty_count_.resize(depth+1, 0);
+  // Level ranges are rebuilt on the next update
+  level_begin_.clear();
+
+  markDirty(slot);
+  return id;
+}
+
+void TransformHierarchy::setTranslation(NodeId id,
+  const glm::vec3& translation){
+  uint32_t slot = slot_of_[id];
+  translations_[slot] = translation;
+  markDirty(slot);
+}
+
+void TransformHierarchy::setRotation(NodeId id, const glm::quat& rotation){
+  uint32_t slot = slot_of_[id];
+  rotations_[slot] = rotation;
+  markDirty(slot);
+}
+
+void TransformHierarchy::setScale(NodeId id, const glm::vec3& scale){
+  uint32_t slot = slot_of_[id];
+  scales_[slot] = scale;
+  markDirty(slot);
+}
+
+void TransformHierarchy::markDirty(uint32_t slot){
+  if(local_dirty_[slot]) return;
+  local_dirty_[slot] = 1;
+  ++level_dirty_count_[depths_[slot]];
+}
+
+void TransformHierarchy::update(ThreadPool* pool){
+  VA_TRACE_SCOPE("TransformHierarchy::update");
+  last_updated_ = 0;
+  if(parents_.empty()) return;
+
+  if(!sorted_) sortByDepth();
+
+  if(level_begin_.empty()){
+    level_begin_.assign(depths_.back() + 2, 0);
+    for(uint32_t depth : depths_) ++level_begin_[depth+1];
+    std::partial_sum(level_begin_.begin(), level_begin_.end(),
+      level_begin_.begin());
+  }
+
+  // Nodes of the level above whose world matrix changed
+  size_t parents_changed = 0;
+  for(size_t level = 0; level + 1 < level_begin_.size(); ++level){
+    if(level_dirty_count_[level] == 0 && parents_changed == 0) continue;
+
+    size_t begin = level_begin_[level];
+    size_t end = level_begin_[level+1];
+    // World dirty flags of a skipped level are stale, don't read them
+    bool check_parents = parents_changed > 0;
+
+    if(pool && end - begin >= 2*MIN_PARALLEL_CHUNK){
+      std::atomic<size_t> updated{0};
+      pool->parallelFor(end - begin, MIN_PARALLEL_CHUNK,
+        [&](size_t chunk_begin, size_t chunk_end){
+          updated += updateRange(begin + chunk_begin, begin + chunk_end,
+            check_parents);
+        });
+      parents_changed = updated;
+    }else{
+      parents_changed = updateRange(begin, end, check_parents);
+    }
+
+    level_dirty_count_[level] = 0;
+    last_updated_ += parents_changed;
+  }
+}
+
+size_t TransformHierarchy::updateRange(size_t begin, size_t end,
+  bool check_parents){
+  size_t updated = 0;
+  for(size_t i = begin; i < end; ++i){
+    uint32_t parent = parents_[i];
+    bool dirty = local_dirty_[i] ||
+      (check_parents && parent != NO_PARENT && world_dirty_[parent]);
+    world_dirty_[i] = dirty;
+    if(!dirty) continue;
+
+    local_dirty_[i] = 0;
+    glm::mat4 local = composeTrs(translations_[i], rotations_[i], scales_[i]);
+    worlds_[i] = parent == NO_PARENT ? local : mulAffine(worlds_[parent], local);
+    ++updated;
+  }
+  return updated;
+}
+
+void TransformHierarchy::sortByDepth(){
+  std::vector<uint32_t> order(parents_.size());
+  std::iota(order.begin(), order.end(), 0u);
+  std::stable_sort(order.begin(), order.end(),
+    [this](uint32_t a, uint32_t b){ return depths_[a] < depths_[b]; });
+
+  std::vector<uint32_t> new_slot(order.size());
+  for(uint32_t slot = 0; slot < order.size(); ++slot)
+    new_slot[order[slot]] = slot;
+
+  permute(parents_, order);
+  for(auto& parent : parents_)
+    if(parent != NO_PARENT) parent = new_slot[parent];
+
+  permute(depths_, order);
+  permute(translations_, order);
+  permute(rotations_, order);
+  permute(scales_, order);
+  permute(worlds_, order);
+  permute(local_dirty_, order);
+  permute(world_dirty_, order);
+  permute(node_of_, order);
+  for(uint32_t slot = 0; slot < node_of_.size(); ++slot)
+    slot_of_[node_of_[slot]] = slot;
+
+  level_begin_.clear();
+  sorted_ = true;
+}
+
+void TransformHierarchy::clear(){
+  parents_.clear();
+  depths_.clear();
+  translations_.clear();
+  rotations_.clear();
+  scales_.clear();
+  worlds_.clear();
+  local_dirty_.clear();
+  world_dirty_.clear();
+  slot_of_.clear();
+  node_of_.clear();
+  level_begin_.clear();
+  level_dirty_count_.clear();
+  sorted_ = true;
+  last_updated_ = 0;
+}
+
+}  // namespace va
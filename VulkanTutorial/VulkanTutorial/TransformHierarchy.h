@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+namespace va {
+
+class ThreadPool;
+
+/*
+ * Scene graph of translation/rotation/scale nodes stored as parallel arrays.
+ *
+ * Nodes are kept sorted by depth, so every parent comes before its children
+ * and each depth is one contiguous range (a level). Updating world matrices
+ * is then a linear walk, level by level, where every node of a level can be
+ * computed independently: the levels are split into chunks over the thread
+ * pool.
+ *
+ * Changing a local transform sets the node's dirty flag. A node's world
+ * matrix is only recomputed if it or one of its ancestors is dirty, and
+ * levels with nothing dirty in or above them are skipped entirely, so static
+ * parts of the scene cost close to nothing.
+ *
+ * NodeIds are stable, the slot a node occupies in the arrays is not (adding
+ * a node shallower than existing ones re-sorts on the next update).
+ */
+class TransformHierarchy {
+ public:
+  using NodeId = uint32_t;
+  static constexpr NodeId NO_PARENT = UINT32_MAX;
+
+  // Parent must already exist, NO_PARENT for a root.
+  NodeId add(NodeId parent, const glm::vec3& translation = glm::vec3(0.0f),
+    const glm::quat& rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f),
+    const glm::vec3& scale = glm::vec3(1.0f));
+
+  void setTranslation(NodeId id, const glm::vec3& translation);
+  void setRotation(NodeId id, const glm::quat& rotation);
+  void setScale(NodeId id, const glm::vec3& scale);
+
+  const glm::vec3& translation(NodeId id) const {
+    return translations_[slot_of_[id]];
+  }
+  const glm::quat& rotation(NodeId id) const {
+    return rotations_[slot_of_[id]];
+  }
+
+  // Valid after update() for every node added before it.
+  const glm::mat4& world(NodeId id) const { return worlds_[slot_of_[id]]; }
+
+  size_t size() const { return parents_.size(); }
+
+  /* Recompute world matrices of dirty nodes and their descendants.
+   * Runs on the calling thread when pool is null.
+   */
+  void update(ThreadPool* pool);
+
+  void clear();
+
+  // Nodes recomputed by the last update, for stats.
+  size_t lastUpdatedCount() const { return last_updated_; }
+
+ private:
+  // Sort slots by depth, keeping insertion order within a depth.
+  void sortByDepth();
+
+  /* World matrices of slots [begin, end), all of one level. Parents' world
+   * dirty flags are only valid if the level above was updated. Returns the
+   * number of nodes recomputed.
+   */
+  size_t updateRange(size_t begin, size_t end, bool check_parents);
+
+  void markDirty(uint32_t slot);
+
+  // Levels smaller than this are done on one thread
+  static constexpr size_t MIN_PARALLEL_CHUNK = 4096;
+
+  // Per slot, in depth order. Parents are slots too.
+  std::vector<uint32_t> parents_;
+  std::vector<uint32_t> depths_;
+  std::vector<glm::vec3> translations_;
+  std::vector<glm::quat> rotations_;
+  std::vector<glm::vec3> scales_;
+  std::vector<glm::mat4> worlds_;
+  // 1 if the local transform changed, then 1 if the world one did.
+  // Bytes rather than vector<bool> so threads can write neighbours.
+  std::vector<uint8_t> local_dirty_;
+  std::vector<uint8_t> world_dirty_;
+
+  std::vector<uint32_t> slot_of_;  // by NodeId
+  std::vector<NodeId> node_of_;    // by slot
+
+  // Slot range [level_begin_[d], level_begin_[d+1]) holds depth d.
+  std::vector<uint32_t> level_begin_;
+  // Local dirty nodes per level
+  std::vector<uint32_t> level_dirty_count_;
+  bool sorted_ = true;
+
+  size_t last_updated_ = 0;
+};
+
+}  // namespace va
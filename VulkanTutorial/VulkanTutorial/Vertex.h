@@ -0,0 +1,63 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+#define GLFW_INCLUDE_VULKAN
+#include "GLFW/glfw3.h"
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+namespace va {
+
+struct Vertex {
+  glm::vec3 pos;
+  glm::vec3 color;
+  glm::vec2 texCoord;
+  glm::vec3 normal;
+
+  bool operator==(const Vertex&other) const{
+    return pos == other.pos
+      && color == other.color
+      && texCoord == other.texCoord
+      && normal == other.normal;
+  }
+
+  static VkVertexInputBindingDescription getBindingDescription() {
+    VkVertexInputBindingDescription bd{};
+
+    bd.binding = 0;
+    bd.stride = sizeof(Vertex);
+    bd.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    return bd;
+  }
+
+  static std::array<VkVertexInputAttributeDescription, 4>
+  getAttributeDescription() {
+    std::array<VkVertexInputAttributeDescription, 4> ads{};
+    ads[0].binding = 0;   // from which binding does vertex data come from?
+    ads[0].location = 0;  // location directive in vertex shader
+    ads[0].format = VK_FORMAT_R32G32B32_SFLOAT;  // bytesize of attribute data
+    ads[0].offset = offsetof(Vertex, pos);    // # bytes from start of vertex
+
+    ads[1].binding = 0;
+    ads[1].location = 1;
+    ads[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+    ads[1].offset = offsetof(Vertex, color);
+
+    ads[2].binding = 0;
+    ads[2].location = 2;
+    ads[2].format = VK_FORMAT_R32G32_SFLOAT;
+    ads[2].offset = offsetof(Vertex, texCoord);
+
+    ads[3].binding = 0;
+    ads[3].location = 3;
+    ads[3].format = VK_FORMAT_R32G32B32_SFLOAT;
+    ads[3].offset = offsetof(Vertex, normal);
+    return ads;
+  }
+};
+
+}  // namespace va
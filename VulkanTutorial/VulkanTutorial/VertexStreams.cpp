@@ -0,0 +1,97 @@
+#include "VertexStreams.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace va {
+
+namespace {
+uint32_t floatToHalf(float value){
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const uint32_t float_exponent = (bits >> 23) & 0xff;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  // Inf stays inf, nan stays (a quiet) nan
+  if(float_exponent == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+  const int32_t exponent = static_cast<int32_t>(float_exponent) - 127 + 15;
+  if(exponent >= 31) return sign | 0x7c00;  // too big, inf
+  if(exponent <= 0){
+    // Subnormal half, or too small for one
+    if(exponent < -10) return sign;
+    mantissa |= 0x800000;
+    const uint32_t shift = static_cast<uint32_t>(14 - exponent);
+    uint32_t half = mantissa >> shift;
+    // Round to nearest, ties to even
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if(rest > halfway || (rest == halfway && (half & 1))) ++half;
+    return sign | half;
+  }
+
+  // Rounding may carry into the exponent, which is still the right value
+  uint32_t half = sign | (static_cast<uint32_t>(exponent) << 10)
+    | (mantissa >> 13);
+  const uint32_t rest = mantissa & 0x1fff;
+  if(rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+  return half;
+}
+
+uint32_t toSnorm16(float value){
+  float scaled = std::round(std::clamp(value, -1.0f, 1.0f)*32767.0f);
+  return static_cast<uint32_t>(static_cast<int32_t>(scaled)) & 0xffff;
+}
+
+uint32_t toUnorm8(float value){
+  return static_cast<uint32_t>(
+    std::round(std::clamp(value, 0.0f, 1.0f)*255.0f));
+}
+}  // namespace
+
+uint32_t packHalf2x16(float x, float y){
+  return floatToHalf(x) | (floatToHalf(y) << 16);
+}
+
+uint32_t packOctahedral(const glm::vec3& normal){
+  float sum = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+  if(sum == 0.0f) return 0;
+  float x = normal.x/sum;
+  float y = normal.y/sum;
+
+  // Lower half folded over the diagonals onto the upper one
+  if(normal.z < 0.0f){
+    float folded_x = (1.0f - std::abs(y))*(x >= 0.0f ? 1.0f : -1.0f);
+    float folded_y = (1.0f - std::abs(x))*(y >= 0.0f ? 1.0f : -1.0f);
+    x = folded_x;
+    y = folded_y;
+  }
+  return toSnorm16(x) | (toSnorm16(y) << 16);
+}
+
+PackedAttributes packAttributes(const Vertex& vertex){
+  PackedAttributes packed;
+  packed.color = toUnorm8(vertex.color.x) | (toUnorm8(vertex.color.y) << 8)
+    | (toUnorm8(vertex.color.z) << 16) | (255u << 24);
+  packed.tex_coord = packHalf2x16(vertex.texCoord.x, vertex.texCoord.y);
+  packed.normal = packOctahedral(vertex.normal);
+  return packed;
+}
+
+void VertexStreams::append(const std::vector<Vertex>& vertices){
+  positions.reserve(positions.size() + vertices.size());
+  attributes.reserve(attributes.size() + vertices.size());
+  for(const auto& v : vertices){
+    positions.push_back(v.pos);
+    attributes.push_back(packAttributes(v));
+  }
+}
+
+void VertexStreams::clear(){
+  positions.clear();
+  attributes.clear();
+}
+
+}  // namespace va
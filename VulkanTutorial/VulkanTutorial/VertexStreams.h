@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Vertex.h"
+
+namespace va {
+
+/* How the pulling vertex shader reads a draw's vertices, pushed with the
+ * draw. Values match pull.vert.
+ */
+enum class VertexFormat : uint32_t {
+  Interleaved = 0,  // va::Vertex as is, eg. the skinning shader's output
+  Compressed = 1,   // split into VertexStreams
+};
+
+/* Every attribute but the position in 12 bytes:
+ *   color      rgb unorm8, alpha unused
+ *   tex_coord  two halfs, coordinates may tile past [0, 1]
+ *   normal     octahedral, two snorm16
+ */
+struct PackedAttributes {
+  uint32_t color;
+  uint32_t tex_coord;
+  uint32_t normal;
+};
+
+/*
+ * De-interleaved, compressed copy of vertices for vertex pulling, where
+ * the vertex shader fetches them from storage buffers by gl_VertexIndex
+ * instead of going through the vertex input stage. Positions stay full
+ * floats in a stream of their own so position only passes (eg. the depth
+ * pre-pass) read nothing else. 24 bytes a vertex instead of 44.
+ *
+ * eg.
+ * VertexStreams streams;
+ * streams.append(registry.pendingVertices());
+ * upload streams.positions and streams.attributes at pendingFirstVertex()
+ */
+struct VertexStreams {
+  std::vector<glm::vec3> positions;
+  std::vector<PackedAttributes> attributes;
+
+  void append(const std::vector<Vertex>& vertices);
+  void clear();
+};
+
+PackedAttributes packAttributes(const Vertex& vertex);
+
+// Both into one uint, x in the low half, like glsl's packHalf2x16
+uint32_t packHalf2x16(float x, float y);
+// Unit vector folded onto an octahedron, two snorm16 like packSnorm2x16
+uint32_t packOctahedral(const glm::vec3& normal);
+
+}  // namespace va
@@ -1,8 +1,15 @@
 #include "VulkanApp.h"
 
 #include <algorithm>
+#include <array>
 #include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <iostream>
+#include <map>
+#include <random>
 #include <unordered_map>
 #include <set>
 
@@ -16,14 +23,24 @@ namespace std{
   template<>
   struct hash<va::Vertex>{
     size_t operator()(va::Vertex const& vertex) const {
-      return ((hash<glm::vec3>()(vertex.pos) ^
+      return ((((hash<glm::vec3>()(vertex.pos) ^
         (hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^
-        (hash<glm::vec2>()(vertex.texCoord) << 1);
+        (hash<glm::vec2>()(vertex.texCoord) << 1)) >> 1) ^
+        (hash<glm::vec3>()(vertex.normal) << 1);
     }
   };
 }
 
 namespace va{
+VulkanApp::VulkanApp(RenderSettings settings)
+  : settings_(settings),
+    configured_frames_in_flight_(settings.frames_in_flight) {
+  settings_.frames_in_flight = policyFramesInFlight(settings_.present_policy,
+    configured_frames_in_flight_);
+  frame_pacer_.setPolicy(settings_.present_policy);
+  frame_pacer_.setLateInputSampling(settings_.late_input_sampling);
+}
+
 VkResult VulkanApp::CreateDebugUtilsMessengerEXT(
   VkInstance instance,
   const VkDebugUtilsMessengerCreateInfoEXT* pCreateInfo,
@@ -51,6 +68,13 @@ void VulkanApp::DestroyDebugUtilsMessengerEXT(
 }
 
 void VulkanApp::run() {
+  run_start_ns_ = CpuProfiler::instance().now();
+  CpuProfiler::instance().setThreadName("main");
+  if(!settings_.spike_trace_prefix.empty()){
+    CpuProfiler::instance().enableSpikeCapture(settings_.spike_trace_prefix,
+      settings_.spike_threshold_ms);
+  }
+
   initWindow(); // Empty rectangular container
   initVulkan(); // Main interface between vulkan and this application
   mainLoop();
@@ -61,48 +85,252 @@ void VulkanApp::initWindow() {
   glfwInit();
   glfwWindowHint(GLFW_CLIENT_API,
                  GLFW_NO_API);  // don't create an opengl context
+  if(settings_.hidden_window) glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
   window_ = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
   glfwSetWindowUserPointer(window_, this);
 
   glfwSetFramebufferSizeCallback(window_, frameBufferResizeCallback);
+  glfwSetKeyCallback(window_, keyCallback);
+  glfwSetMouseButtonCallback(window_, mouseButtonCallback);
 }
 
 void VulkanApp::initVulkan() {
-  createInstance();
-  setupDebugMessenger();
-  createSurface(); // The platform specific 'thing' to draw on
-  pickPhysicalDevice();
-  createLogicalDevice();
-  createSwapChain();
-  createImageViews();
-  createRenderPass();
-  createDescriptorSetLayout();
-  createGraphicsPipeline();
-  createCommandPool();
-  createColorResources(); // Msaa color render target
-  createDepthResources(); // Depth buffer with msaa
-  createFrameBuffers(); // After pipeline , color, depth
-  createTextureImage();
-  createTextureImageView();
-  createTextureSampler();
-  loadModel();
-  createVertexBuffer();
-  createIndexBuffer();
-  createUniformBuffers();
-  createDescriptorPool();
-  createDescriptorSets();
-  createCommandBuffers();
-  createSyncObjects();
+  InitGraph graph;
+  const auto W = InitGraph::Worker;
+
+  // Cpu only, nothing to wait for
+  auto decode_texture = graph.add("decodeTexture",
+    [this]{ decodeTexture(); }, {}, W);
+  auto load_model = graph.add("loadModel", [this]{ loadModel(); }, {}, W);
+  auto scene = graph.add("createScene", [this]{ createScene(); }, {}, W);
+  graph.add("createSceneIndex", [this]{ createSceneIndex(); },
+    {load_model, scene}, W);
+  graph.add("createLights", [this]{ createLights(); }, {}, W);
+  auto skinned_mesh = graph.add("createSkinnedMesh",
+    [this]{ createSkinnedMesh(); }, {}, W);
+  auto load_shaders = graph.add("loadShaders", [this]{ loadShaders(); }, {},
+    W);
+
+  auto instance = graph.add("createInstance", [this]{ createInstance(); });
+  auto debug = graph.add("setupDebugMessenger",
+    [this]{ setupDebugMessenger(); }, {instance});
+  // The platform specific 'thing' to draw on
+  auto surface = graph.add("createSurface", [this]{ createSurface(); },
+    {debug});
+  auto physical = graph.add("pickPhysicalDevice",
+    [this]{ pickPhysicalDevice(); }, {surface});
+  auto device = graph.add("createLogicalDevice",
+    [this]{ createLogicalDevice(); }, {physical});
+  auto swap_chain = graph.add("createSwapChain",
+    [this]{ createSwapChain(); createImageViews(); }, {device});
+  auto render_pass = graph.add("createRenderPass",
+    [this]{ createRenderPass(); }, {swap_chain});
+  auto layout = graph.add("createDescriptorSetLayout",
+    [this]{ createDescriptorAllocators(); createDescriptorSetLayout(); },
+    {device});
+  // Pipeline creation needs no queue, it overlaps the uploads below
+  auto pipeline = graph.add("createGraphicsPipeline",
+    [this]{ createMaterials(); createGraphicsPipeline(); },
+    {load_shaders, render_pass, layout}, W);
+  auto upscale_layout = graph.add("createUpscaleLayout",
+    [this]{ createUpscaleLayout(); }, {layout});
+  auto upscale = graph.add("createUpscalePipeline",
+    [this]{ createUpscalePipeline(); },
+    {load_shaders, swap_chain, upscale_layout}, W);
+  auto command_pool = graph.add("createCommandPool",
+    [this]{ createCommandPool(); createSyncObjects(); createGpuProfiler(); },
+    {device});
+  // Msaa color render target and depth buffer with msaa
+  auto targets = graph.add("createRenderGraph",
+    [this]{ createRenderGraph(); }, {swap_chain});
+  auto frame_buffers = graph.add("createFrameBuffers",
+    [this]{ createFrameBuffers(); }, {render_pass, targets, upscale});
+  auto texture = graph.add("createTextureImage",
+    [this]{
+      createTextureImage();
+      createTextureImageView();
+      createTextureSampler();
+    }, {decode_texture, command_pool});
+  auto geometry = graph.add("createGeometryBuffers",
+    [this]{ uploadMeshes(); },
+    {load_model, command_pool});
+  auto uniforms = graph.add("createUniformBuffers",
+    [this]{ createUniformBuffers(); createLightBuffers(); }, {device});
+  auto sets = graph.add("createDescriptorSets",
+    [this]{ createDescriptorSets(); }, {layout, uniforms, texture});
+  auto skinning = graph.add("createSkinningResources",
+    [this]{ createSkinningResources(); },
+    {skinned_mesh, load_shaders, layout, command_pool});
+  auto culling = graph.add("createCullResources",
+    [this]{ createCullResources(); }, {load_shaders, layout});
+  auto clustering = graph.add("createClusterPipeline",
+    [this]{ createClusterPipeline(); }, {load_shaders, layout});
+  graph.add("createCommandBuffers", [this]{ createCommandBuffers(); },
+    {command_pool, sets, geometry, skinning, culling, clustering, pipeline,
+    frame_buffers});
+
+  graph.run(settings_.parallel_init ? &thread_pool_ : nullptr);
+
+  init_ms_ = graph.wallMs();
+  std::cout << "Init steps\n" << graph.report();
 }
 
 void VulkanApp::mainLoop() {
+  auto& cpu_profiler = CpuProfiler::instance();
+
   while (!glfwWindowShouldClose(window_)) {
+    {
+      VA_TRACE_SCOPE("frame");
+      // Requested last frame. It may recreate the swap chain, so it goes
+      // before an image is acquired.
+      if (requested_present_policy_) {
+        applyPresentPolicy(*requested_present_policy_);
+        requested_present_policy_.reset();
+      }
+
+      // Input is sampled late, once acquireFrame() has done the waiting
+      const bool acquired = acquireFrame();
+      {
+        VA_TRACE_SCOPE("glfwPollEvents");
+        glfwPollEvents();
+      }
+
+      if (requested_pick_) {
+        pick(*requested_pick_);
+        requested_pick_.reset();
+      }
+
+      if (acquired) drawFrame();
+    }
+    cpu_profiler.endFrame();
+
+    if(frame_number_ == 1 && time_to_first_frame_ms_ == 0.0){
+      time_to_first_frame_ms_ = (cpu_profiler.now() - run_start_ns_) / 1e6;
+      std::cout << "Time to first frame " << time_to_first_frame_ms_
+                << " ms (init " << init_ms_ << " ms)" << std::endl;
+    }
+  }
+
+  vkDeviceWaitIdle(logical_device_);
+
+  std::cout << "CPU frame times\n" << cpu_profiler.report();
+  if(!settings_.cpu_trace_path.empty()){
+    cpu_profiler.captureTrace().write(settings_.cpu_trace_path);
+    std::cout << "CPU trace written to " << settings_.cpu_trace_path
+              << std::endl;
+  }
+
+  std::cout << "Input latency by present policy\n" << frame_pacer_.report();
+  // Where the async work ran says what its timings overlapped with
+  auto describe = [&](uint32_t family, uint32_t queue_index){
+    if(family != queue_families_.graphics_family.value())
+      return "dedicated family";
+    return queue_index > 0 ? "second graphics queue" : "graphics queue";
+  };
+  std::cout << "GPU timings (compute on "
+            << describe(queue_families_.compute_family.value(),
+                 queue_families_.compute_queue_index)
+            << ", transfer on "
+            << describe(queue_families_.transfer_family.value(),
+                 queue_families_.transfer_queue_index)
+            << ")\n" << gpu_profiler_.report();
+  std::cout << "Scene pipeline statistics\n" << pipeline_stats_.report();
+  std::cout << "Scene binds\n" << state_tracker_.report();
+  std::cout << "Frustum culling kept " << visible_objects_.size() << " of "
+            << settings_.object_count << " objects, visiting "
+            << frustum_cells_visited_ << " of " << scene_index_.cellCount()
+            << " cells" << std::endl;
+  if(occlusion_culling_){
+    std::cout << "Occlusion culling drew " << cull_drawn_early_ << " early + "
+              << cull_drawn_late_ << " late of " << settings_.object_count
+              << " objects" << std::endl;
+  }
+
+  if(!settings_.gpu_trace_path.empty()){
+    gpu_profiler_.trace().write(settings_.gpu_trace_path);
+    std::cout << "GPU trace written to " << settings_.gpu_trace_path
+              << std::endl;
+  }
+}
+
+BenchmarkResult VulkanApp::runBenchmark(uint32_t warmup_frames,
+  uint32_t measured_frames){
+  run_start_ns_ = CpuProfiler::instance().now();
+  initWindow();
+  initVulkan();
+
+  BenchmarkResult result;
+  result.config.settings = settings_;
+
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(physical_device_, &props);
+  result.device_name = props.deviceName;
+
+  auto& cpu_profiler = CpuProfiler::instance();
+  for(uint32_t i = 0; i < warmup_frames && !glfwWindowShouldClose(window_);
+    ++i){
+    const bool acquired = acquireFrame();
+    glfwPollEvents();
+    if(acquired) drawFrame();
+    cpu_profiler.endFrame();
+
+    if(i == 0){
+      result.time_to_first_frame_ms =
+        (cpu_profiler.now() - run_start_ns_) / 1e6;
+    }
+  }
+  result.init_ms = init_ms_;
+
+  result.frame_ms.reserve(measured_frames);
+  result.submit_ms.reserve(measured_frames);
+  uint64_t last_ns = cpu_profiler.now();
+
+  for(uint32_t i = 0; i < measured_frames && !glfwWindowShouldClose(window_);
+    ++i){
+    const bool acquired = acquireFrame();
     glfwPollEvents();
-    drawFrame();
+    if(acquired) drawFrame();
+    cpu_profiler.endFrame();
+
+    uint64_t now_ns = cpu_profiler.now();
+    result.frame_ms.push_back((now_ns - last_ns) / 1e6);
+    result.submit_ms.push_back(last_submit_ms_);
+    last_ns = now_ns;
   }
 
   vkDeviceWaitIdle(logical_device_);
+
+  result.gpu_frame_mean_ms = gpu_profiler_.stats("frame").mean_ms;
+  result.device_memory_bytes = allocated_bytes_;
+  result.device_memory_peak_bytes = peak_allocated_bytes_;
+  result.device_allocations =
+    static_cast<uint32_t>(allocation_sizes_.size());
+  // Every level keeps its render targets, they all count
+  for(const auto& level : render_levels_){
+    result.transient_bytes += level.graph.allocatedBytes();
+    result.lazy_bytes += level.graph.lazyBytes();
+    result.lazy_committed_bytes += level.graph.lazyCommittedBytes();
+  }
+  // Level it ended on, the controller may have moved since the start
+  result.msaa_samples = quality_controller_.current().msaa_samples;
+  result.sample_shading = quality_controller_.current().sample_shading;
+  result.render_scale = quality_controller_.current().render_scale;
+  result.quality_switches = quality_controller_.switchCount();
+  PipelineStats::Counters counters = pipeline_stats_.mean();
+  result.vertex_invocations = counters.vertex_invocations;
+  result.fragment_invocations = counters.fragment_invocations;
+  result.fragments_per_pixel = counters.fragments_per_pixel;
+  StateTracker::Stats binds = state_tracker_.mean();
+  result.binds_requested = binds.requested;
+  result.binds_recorded = binds.recorded;
+  result.occlusion_culling = occlusion_culling_;
+  result.visible_objects = occlusion_culling_
+    ? cull_drawn_early_ + cull_drawn_late_
+    : static_cast<uint32_t>(visible_objects_.size());
+
+  cleanUp();
+  return result;
 }
 
 void VulkanApp::cleanUp() {
@@ -111,32 +339,65 @@ void VulkanApp::cleanUp() {
   // Texture sampler
   vkDestroySampler(logical_device_, texture_sampler_, nullptr);
 
+  // Upscale sampler and layout, the set layout belongs to the cache
+  vkDestroySampler(logical_device_, upscale_sampler_, nullptr);
+  vkDestroyPipelineLayout(logical_device_, upscale_pipeline_layout_, nullptr);
+
   // Texture image
   vkDestroyImageView(logical_device_, texture_img_view_, nullptr);
   vkDestroyImage(logical_device_, texture_image_, nullptr);
-  vkFreeMemory(logical_device_, texture_image_memory_, nullptr);
+  freeMemory(texture_image_memory_);
 
-  // Descriptor set
-  vkDestroyDescriptorSetLayout(logical_device_, descriptor_layout_, nullptr);
+  // Uniform buffers, command buffers, transient descriptor pools
+  cleanUpFrameResources();
 
-  // Vertex index buffer
-  vkDestroyBuffer(logical_device_, index_buffer_, nullptr);
-  vkFreeMemory(logical_device_, index_buffer_memory_, nullptr);
+  // Descriptor pools and set layouts
+  descriptor_allocator_.cleanUp();
+  descriptor_layout_cache_.cleanUp();
 
-  // Vertex buffer
-  vkDestroyBuffer(logical_device_, vertex_buffer_, nullptr);
-  vkFreeMemory(logical_device_, vertex_buffer_memory_, nullptr);
+  // Skinning buffers, palette ring and compute pipeline
+  cleanUpSkinning();
 
-  // Semaphores and fences
-  for(size_t i = 0; i < img_available_sems_.size(); ++i){
-    vkDestroySemaphore(logical_device_, img_available_sems_[i], nullptr);
-    vkDestroySemaphore(logical_device_, render_finish_sems_[i], nullptr);
-    vkDestroyFence(logical_device_, inflight_fences_[i], nullptr);
+  // Culling buffers, culling and hi-z pipelines
+  cleanUpCulling();
+
+  // Light binning pipeline, its buffers went with the frame resources
+  vkDestroyPipeline(logical_device_, cluster_pipeline_, nullptr);
+  vkDestroyPipelineLayout(logical_device_, cluster_pipeline_layout_, nullptr);
+
+  // Shared vertex and index buffers of every mesh
+  destroyRetiredBuffers(UINT64_MAX);
+  if(index_buffer_ != VK_NULL_HANDLE){
+    vkDestroyBuffer(logical_device_, index_buffer_, nullptr);
+    freeMemory(index_buffer_memory_);
+  }
+  if(vertex_buffer_ != VK_NULL_HANDLE){
+    vkDestroyBuffer(logical_device_, vertex_buffer_, nullptr);
+    freeMemory(vertex_buffer_memory_);
+  }
+  if(position_buffer_ != VK_NULL_HANDLE){
+    vkDestroyBuffer(logical_device_, position_buffer_, nullptr);
+    freeMemory(position_buffer_memory_);
   }
+  if(attribute_buffer_ != VK_NULL_HANDLE){
+    vkDestroyBuffer(logical_device_, attribute_buffer_, nullptr);
+    freeMemory(attribute_buffer_memory_);
+  }
+
+  // Semaphores
+  frame_scheduler_.cleanUp();
+
+  // Timestamp and pipeline statistics query pools
+  gpu_profiler_.cleanUp();
+  pipeline_stats_.cleanUp();
 
   // Command pool (also destroys command buffers allocated from this pool)
   vkDestroyCommandPool(logical_device_, command_pool_, nullptr);
 
+  // Async compute and transfer pools and timelines
+  compute_queue_.cleanUp();
+  transfer_queue_.cleanUp();
+
   // Logical device 
   vkDestroyDevice(logical_device_, nullptr);
 
@@ -316,18 +577,39 @@ void VulkanApp::pickPhysicalDevice() {
   vkEnumeratePhysicalDevices(
     instance_, &device_count, devices.data());
 
+  // Prefer discrete over integrated over anything else (eg. software
+  // drivers), first suitable device of the best kind wins.
+  auto rank = [](VkPhysicalDevice device){
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(device, &props);
+    switch(props.deviceType){
+      case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return 3;
+      case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return 2;
+      case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return 1;
+      default: return 0;
+    }
+  };
+
   // Check each card to see if they support operations we need
+  int best_rank = -1;
   for(const auto &device:devices){
-    if(isDeviceSuitable(device)){
-      // Just select the first device
+    if(rank(device) > best_rank && isDeviceSuitable(device)){
       physical_device_ = device;
-      msaa_samples_ = getMaxUsableSampleCount();
-      break;
+      best_rank = rank(device);
     }
   }
 
   if(physical_device_ == VK_NULL_HANDLE)
     throw std::runtime_error("Failed to find a suitable GPU");
+
+  createQualityLevels();
+
+  occlusion_culling_ =
+    settings_.occlusion_culling && supportsOcclusionCulling();
+  if(settings_.occlusion_culling && !occlusion_culling_){
+    std::cout << "Occlusion culling needs sampleable depth, disabled"
+              << std::endl;
+  }
 }
 
 bool VulkanApp::isDeviceSuitable(VkPhysicalDevice device){
@@ -340,8 +622,6 @@ bool VulkanApp::isDeviceSuitable(VkPhysicalDevice device){
   // Get optional features
   vkGetPhysicalDeviceFeatures(device, &deviceFeatures);
 
-  if(deviceProperties.deviceType != VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) return false;
-  if(!deviceFeatures.geometryShader) return false;
 
   // Check if device has queue family we need
   QueueFamilyIndices indices = findQueueFamilies(device);
@@ -363,15 +643,22 @@ bool VulkanApp::isDeviceSuitable(VkPhysicalDevice device){
   // Check if device supports texture sampler anisotropy
   if(!deviceFeatures.samplerAnisotropy) return false;
 
+  // Frame pacing is built on timeline semaphores (core in vulkan 1.2)
+  VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features{};
+  timeline_features.sType =
+    VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+  VkPhysicalDeviceFeatures2 features2{};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features2.pNext = &timeline_features;
+  vkGetPhysicalDeviceFeatures2(device, &features2);
+  if(!timeline_features.timelineSemaphore) return false;
+
   return true;
 }
 
 QueueFamilyIndices VulkanApp::findQueueFamilies(VkPhysicalDevice device){
   QueueFamilyIndices indices;
 
-  // For finding queue family that supports presenting on a surface.
-  VkBool32 present_support = false;
-
   uint32_t queue_family_count = 0;
   vkGetPhysicalDeviceQueueFamilyProperties(
     device, &queue_family_count, nullptr);
@@ -381,59 +668,119 @@ QueueFamilyIndices VulkanApp::findQueueFamilies(VkPhysicalDevice device){
     device, &queue_family_count, queue_families.data());
   
   // Identify queue families that support graphics
-  int i = 0;
+  uint32_t i = 0;
   for(const auto& queue_family : queue_families){
+    const VkQueueFlags flags = queue_family.queueFlags;
+
+    // The graphics queue can also run compute, there is always a family
+    // with both if there's one with graphics.
+    bool graphics = (flags & VK_QUEUE_GRAPHICS_BIT)
+      && (flags & VK_QUEUE_COMPUTE_BIT);
+    if(graphics && !indices.graphics_family.has_value()){
+      indices.graphics_family = i;
+    }
 
-    // Present queue family and graphics queue family need not be the same.
+    // Present queue family and graphics queue family need not be the same,
+    // but the same one is preferred.
+    VkBool32 present_support = false;
     vkGetPhysicalDeviceSurfaceSupportKHR(
       device, i, surface_, &present_support);
-    if(present_support){
+    if(present_support && (!indices.present_family.has_value()
+      || indices.graphics_family == i)){
       indices.present_family = i;
     }
 
-    if(queue_family.queueFlags & VK_QUEUE_GRAPHICS_BIT){
-      indices.graphics_family = i;
-      break;
+    // Dedicated families: compute without graphics, transfer only
+    if((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT)
+      && !indices.compute_family.has_value()){
+      indices.compute_family = i;
+    }
+    if((flags & VK_QUEUE_TRANSFER_BIT)
+      && !(flags & (VK_QUEUE_GRAPHICS_BIT|VK_QUEUE_COMPUTE_BIT))
+      && !indices.transfer_family.has_value()){
+      indices.transfer_family = i;
     }
     ++i;
   }
+
+  if(!indices.graphics_family.has_value()) return indices;
+  const uint32_t graphics_family = indices.graphics_family.value();
+
+  // No dedicated compute family: a second graphics family queue still runs
+  // alongside the first one.
+  if(!settings_.async_compute){
+    indices.compute_family = graphics_family;
+    indices.compute_queue_index = 0;
+  }else if(!indices.compute_family.has_value()){
+    indices.compute_family = graphics_family;
+    indices.compute_queue_index =
+      queue_families[graphics_family].queueCount > 1 ? 1 : 0;
+  }
+  if(!indices.transfer_family.has_value()){
+    indices.transfer_family = indices.compute_family;
+    indices.transfer_queue_index = indices.compute_queue_index;
+  }
   return indices;
 }
 
 void VulkanApp::createLogicalDevice(){
   if(physical_device_ == VK_NULL_HANDLE){
-    std::runtime_error("Physical device is null, find physical device first.");
+    throw std::runtime_error(
+      "Physical device is null, find physical device first.");
   }
   auto indices = findQueueFamilies(physical_device_);
 
-  std::set<uint32_t> unique_queue_families{
-    indices.graphics_family.value(), indices.present_family.value()};
+  // Number of queues needed from each family
+  std::map<uint32_t, uint32_t> family_queue_counts;
+  auto need_queue = [&](uint32_t family, uint32_t queue_index){
+    auto& count = family_queue_counts[family];
+    count = std::max(count, queue_index + 1);
+  };
+  need_queue(indices.graphics_family.value(), 0);
+  need_queue(indices.present_family.value(), 0);
+  need_queue(indices.compute_family.value(), indices.compute_queue_index);
+  need_queue(indices.transfer_family.value(), indices.transfer_queue_index);
+
+  // Priority lets vulkan prioritize multiple command buffers. It's required
+  // even if there is only 1 queue. Has to live until the device is created.
+  std::vector<float> queue_priorities(4, 1.0f);
 
   std::vector<VkDeviceQueueCreateInfo> queue_create_infos{}; 
 
-  for(const auto& queuefamily : unique_queue_families){
+  for(const auto& family_count : family_queue_counts){
     VkDeviceQueueCreateInfo queue_create_info{};
 
     queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_create_info.queueFamilyIndex = queuefamily;
-    queue_create_info.queueCount = 1;
-
-    // Priority lets vulkan prioritize multiple command buffers. It's required
-    // even if there is only 1 queue.
-    float queue_priority = 1.0;
-    queue_create_info.pQueuePriorities = &queue_priority;
+    queue_create_info.queueFamilyIndex = family_count.first;
+    queue_create_info.queueCount = family_count.second;
+    queue_create_info.pQueuePriorities = queue_priorities.data();
     queue_create_infos.push_back(queue_create_info);
   }
 
   // Specify device features that we'll use.
   VkPhysicalDeviceFeatures device_features{};
   device_features.samplerAnisotropy = VK_TRUE;
+  // Overdraw measurements, optional
+  device_features.pipelineStatisticsQuery =
+    PipelineStats::supported(physical_device_) ? VK_TRUE : VK_FALSE;
+  // Only the top quality level shades per sample
+  for(const auto& level : render_levels_){
+    if(level.sample_shading)
+      device_features.sampleRateShading = VK_TRUE;
+  }
+
+  VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features{};
+  timeline_features.sType =
+    VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+  timeline_features.timelineSemaphore = VK_TRUE;
 
   VkDeviceCreateInfo logical_device_info{};
 
   logical_device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  logical_device_info.pNext = &timeline_features;
   logical_device_info.pQueueCreateInfos = queue_create_infos.data();
-  logical_device_info.queueCreateInfoCount = 1;
+  logical_device_info.queueCreateInfoCount =
+    static_cast<uint32_t>(queue_create_infos.size());
   logical_device_info.pEnabledFeatures = &device_features;
 
   // Similarly to instance creation, specify extensions and validation layers
@@ -470,6 +817,12 @@ void VulkanApp::createLogicalDevice(){
     &graphics_queue_);
   vkGetDeviceQueue(logical_device_, indices.present_family.value(), 0,
     &present_queue_);
+
+  queue_families_ = indices;
+  compute_queue_.init(logical_device_, indices.compute_family.value(),
+    indices.compute_queue_index);
+  transfer_queue_.init(logical_device_, indices.transfer_family.value(),
+    indices.transfer_queue_index);
 }
 
 void VulkanApp::createSurface() {
@@ -558,17 +911,8 @@ VkSurfaceFormatKHR VulkanApp::chooseSwapSurfaceFormat(
 
 VkPresentModeKHR VulkanApp::chooseSwapPresentMode(
 const std::vector<VkPresentModeKHR> &available_present_modes){
-  if(available_present_modes.empty())
-    throw std::runtime_error("No available present mode");
-
-  for(const auto& present_mode : available_present_modes){
-    // Look for triple buffering
-    if(present_mode == VK_PRESENT_MODE_MAILBOX_KHR)
-      return present_mode;
-  }
-
-  // This is guaranteed to be available.
-  return VK_PRESENT_MODE_FIFO_KHR;
+  // Falls back to fifo if the policy's modes aren't supported
+  return choosePresentMode(settings_.present_policy, available_present_modes);
 }
 
 VkExtent2D VulkanApp::chooseSwapExtent(
@@ -607,15 +951,10 @@ void VulkanApp::createSwapChain(){
 
   VkExtent2D extent = chooseSwapExtent(swap_chain_support.capabilities);
 
-  // Minimum number of images in the swap chain
-  uint32_t min_img_count = swap_chain_support.capabilities.minImageCount;
-  // Request at least 1 more image than minimum for good luck
-  ++min_img_count;
-
-  if(swap_chain_support.capabilities.maxImageCount > 0 &&
-    min_img_count > swap_chain_support.capabilities.maxImageCount){
-    min_img_count = swap_chain_support.capabilities.maxImageCount;
-  }
+  // Fewer images queue up fewer frames (less latency), the count depends on
+  // the present mode.
+  uint32_t min_img_count = chooseSwapImageCount(present_mode,
+    swap_chain_support.capabilities);
 
   // Create the struct for creating a swap chain
   VkSwapchainCreateInfoKHR sc_create_info{};
@@ -696,12 +1035,34 @@ void VulkanApp::createImageViews(){
   }
 }
 
-void VulkanApp::createGraphicsPipeline(){
-  auto vert_shader_code = readFile("shader/vert.spv");
-  auto frag_shader_code = readFile("shader/frag.spv");
+void VulkanApp::loadShaders(){
+  if(settings_.vertex_pulling)
+    pull_vert_code_ = readFile("shader/pull_vert.spv");
+  else
+    vert_shader_code_ = readFile("shader/vert.spv");
+  frag_shader_code_ = readFile("shader/frag.spv");
+  if(settings_.skinned_instances > 0)
+    skinning_shader_code_ = readFile("shader/skinning.spv");
+  if(upscaling()){
+    upscale_vert_code_ = readFile("shader/upscale_vert.spv");
+    upscale_frag_code_ = readFile("shader/upscale_frag.spv");
+  }
+  if(settings_.depth_prepass && !settings_.vertex_pulling)
+    depth_vert_code_ = readFile("shader/depth_vert.spv");
+  if(settings_.occlusion_culling){
+    cull_shader_code_ = readFile("shader/cull.spv");
+    hiz_depth_code_ = readFile("shader/hiz_depth.spv");
+    hiz_depth_ms_code_ = readFile("shader/hiz_depth_ms.spv");
+    hiz_reduce_code_ = readFile("shader/hiz_reduce.spv");
+  }
+  if(settings_.light_count > 0)
+    cluster_shader_code_ = readFile("shader/cluster.spv");
+}
 
-  VkShaderModule vert_shader_module = createShaderModule(vert_shader_code);
-  VkShaderModule frag_shader_module = createShaderModule(frag_shader_code);
+void VulkanApp::createGraphicsPipeline(){
+  VkShaderModule vert_shader_module = createShaderModule(
+    settings_.vertex_pulling ? pull_vert_code_ : vert_shader_code_);
+  VkShaderModule frag_shader_module = createShaderModule(frag_shader_code_);
 
   VkPipelineShaderStageCreateInfo vert_shader_ci{};
   vert_shader_ci.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -721,6 +1082,7 @@ void VulkanApp::createGraphicsPipeline(){
 
   frag_shader_ci.module = frag_shader_module;
   frag_shader_ci.pName = "main"; // The function to invoke (entrypoint)
+  // Features of the variant, set per pipeline below
 
   VkPipelineShaderStageCreateInfo shader_stages[]=
   {vert_shader_ci, frag_shader_ci};
@@ -736,6 +1098,11 @@ void VulkanApp::createGraphicsPipeline(){
   vertex_ci.vertexAttributeDescriptionCount =
     static_cast<uint32_t>(attribute_desc.size());
   vertex_ci.pVertexAttributeDescriptions = attribute_desc.data();
+  // Pulled vertices skip vertex input, every format uses the same pipeline
+  if(settings_.vertex_pulling){
+    vertex_ci.vertexBindingDescriptionCount = 0;
+    vertex_ci.vertexAttributeDescriptionCount = 0;
+  }
 
   VkPipelineInputAssemblyStateCreateInfo input_assembly_ci{};
   
@@ -790,15 +1157,20 @@ void VulkanApp::createGraphicsPipeline(){
   rasterizer.depthBiasClamp = 0.0f; // Optional
   rasterizer.depthBiasSlopeFactor = 0.0f; // Optional
 
-  VkPipelineMultisampleStateCreateInfo multisampling{};
-  multisampling.sType = 
-    VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-  multisampling.sampleShadingEnable = VK_FALSE;
-  multisampling.rasterizationSamples = msaa_samples_;
-  multisampling.minSampleShading = 1.0f; // Optional
-  multisampling.pSampleMask = nullptr; // optional
-  multisampling.alphaToCoverageEnable = VK_FALSE; // optional
-  multisampling.alphaToOneEnable = VK_FALSE; // optional
+  // One per quality level, the only state that differs between them
+  std::vector<VkPipelineMultisampleStateCreateInfo> multisampling(
+    render_levels_.size());
+  for(size_t i = 0; i < render_levels_.size(); ++i){
+    const RenderLevel& level = render_levels_[i];
+    multisampling[i].sType =
+      VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling[i].rasterizationSamples = level.samples;
+    multisampling[i].sampleShadingEnable = VK_FALSE;
+    multisampling[i].minSampleShading = 1.0f;
+    multisampling[i].pSampleMask = nullptr; // optional
+    multisampling[i].alphaToCoverageEnable = VK_FALSE; // optional
+    multisampling[i].alphaToOneEnable = VK_FALSE; // optional
+  }
 
   // Depth/stencil buffers don't have one right now.
   //VkPipelineDepthStencilStateCreateInfo depthstencil{};
@@ -830,9 +1202,11 @@ void VulkanApp::createGraphicsPipeline(){
   colorBlending.blendConstants[2] = 0.0f; // Optional
   colorBlending.blendConstants[3] = 0.0f; // Optional
 
+  // The scene is drawn at the render scale, which can change every frame.
+  // Viewport and scissor are set when recording.
   VkDynamicState dynamic_states[]={
     VK_DYNAMIC_STATE_VIEWPORT,
-    VK_DYNAMIC_STATE_LINE_WIDTH
+    VK_DYNAMIC_STATE_SCISSOR
   };
 
   // Some configs can be changed at runtime, put them here if you want.
@@ -845,10 +1219,21 @@ void VulkanApp::createGraphicsPipeline(){
   VkPipelineLayoutCreateInfo pipeline_layout_ci{};
   pipeline_layout_ci.sType =
     VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  pipeline_layout_ci.setLayoutCount = 1;
-  pipeline_layout_ci.pSetLayouts = &descriptor_layout_;
-  pipeline_layout_ci.pushConstantRangeCount = 0;
-  pipeline_layout_ci.pPushConstantRanges = nullptr;
+  // The vertex streams are set 1 when vertices are pulled
+  std::array<VkDescriptorSetLayout, 2> set_layouts = {descriptor_layout_,
+    vertex_stream_layout_};
+  pipeline_layout_ci.setLayoutCount = settings_.vertex_pulling ? 2 : 1;
+  pipeline_layout_ci.pSetLayouts = set_layouts.data();
+
+  // Model matrix and material of each draw, no buffer write or descriptor
+  // bind per object
+  VkPushConstantRange draw_range{};
+  draw_range.stageFlags =
+    VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+  draw_range.offset = 0;
+  draw_range.size = sizeof(DrawConstants);
+  pipeline_layout_ci.pushConstantRangeCount = 1;
+  pipeline_layout_ci.pPushConstantRanges = &draw_range;
 
   if(vkCreatePipelineLayout(logical_device_, &pipeline_layout_ci, nullptr,
     &pipeline_layout_) != VK_SUCCESS){
@@ -865,6 +1250,14 @@ void VulkanApp::createGraphicsPipeline(){
   depth_stencil.depthWriteEnable = VK_TRUE;
   // Depth of fragments that are close is less.
   depth_stencil.depthCompareOp = VK_COMPARE_OP_LESS;
+
+  // After a depth pre-pass only the front most fragment of every pixel
+  // matches, everything behind it is rejected before shading.
+  VkPipelineDepthStencilStateCreateInfo prepass_depth_stencil = depth_stencil;
+  if(settings_.depth_prepass){
+    depth_stencil.depthWriteEnable = VK_FALSE;
+    depth_stencil.depthCompareOp = VK_COMPARE_OP_EQUAL;
+  }
   depth_stencil.depthBoundsTestEnable = VK_FALSE;
   depth_stencil.minDepthBounds = 0.0f; // Optional
   depth_stencil.maxDepthBounds = 1.0f; // Optional
@@ -885,26 +1278,134 @@ void VulkanApp::createGraphicsPipeline(){
   pipeline_ci.pInputAssemblyState = &input_assembly_ci;
   pipeline_ci.pViewportState = &viewport_state_ci;
   pipeline_ci.pRasterizationState = &rasterizer;
-  pipeline_ci.pMultisampleState = &multisampling;
   pipeline_ci.pDepthStencilState = &depth_stencil;
   pipeline_ci.pColorBlendState = &colorBlending;
-  pipeline_ci.pDynamicState = nullptr;
+  pipeline_ci.pDynamicState = &dynamic_state_ci;
 
   // Layout
   pipeline_ci.layout = pipeline_layout_;
-  pipeline_ci.renderPass = render_pass_;
   pipeline_ci.subpass = 0; // Index of subpass where graphics pipeline is used
 
   pipeline_ci.basePipelineHandle = VK_NULL_HANDLE;
   pipeline_ci.basePipelineIndex = -1;
 
-  if(vkCreateGraphicsPipelines(logical_device_, VK_NULL_HANDLE, 1, &pipeline_ci,
-    nullptr, &graphics_pipeline_) != VK_SUCCESS){
+  // Fragment stage specialized for each variant. Deque, specializations
+  // point into themselves and can't move.
+  const auto& variants = shader_variants_.variants();
+  std::deque<ShaderSpecialization> specializations;
+  std::vector<std::array<VkPipelineShaderStageCreateInfo, 2>> variant_stages;
+  for(const auto& variant : variants){
+    specializations.emplace_back(variant);
+    VkPipelineShaderStageCreateInfo frag = frag_shader_ci;
+    frag.pSpecializationInfo = specializations.back().info();
+    variant_stages.push_back({vert_shader_ci, frag});
+  }
+
+  // Shade every sample, not just every pixel, smooths aliasing inside
+  // triangles (texture) too
+  std::vector<VkPipelineMultisampleStateCreateInfo> shaded_multisampling =
+    multisampling;
+  for(auto& ms : shaded_multisampling) ms.sampleShadingEnable = VK_TRUE;
+
+  // Every level's pipeline of every variant up front and in one call,
+  // switching levels never waits for a pipeline compile. A level's sample
+  // shading pipelines follow its plain ones.
+  std::vector<VkGraphicsPipelineCreateInfo> pipeline_cis;
+  for(size_t i = 0; i < render_levels_.size(); ++i){
+    const uint32_t sets = render_levels_[i].sample_shading ? 2 : 1;
+    for(uint32_t set = 0; set < sets; ++set){
+      for(size_t v = 0; v < variants.size(); ++v){
+        VkGraphicsPipelineCreateInfo ci = pipeline_ci;
+        ci.pStages = variant_stages[v].data();
+        ci.pMultisampleState =
+          set == 0 ? &multisampling[i] : &shaded_multisampling[i];
+        ci.renderPass = render_levels_[i].render_pass;
+        pipeline_cis.push_back(ci);
+      }
+    }
+  }
+
+  std::vector<VkPipeline> pipelines(pipeline_cis.size());
+  if(vkCreateGraphicsPipelines(logical_device_, VK_NULL_HANDLE,
+    static_cast<uint32_t>(pipeline_cis.size()), pipeline_cis.data(),
+    nullptr, pipelines.data()) != VK_SUCCESS){
     throw std::runtime_error("Failed to create graphics pipeline");
   }
+  auto next = pipelines.begin();
+  for(auto& level : render_levels_){
+    level.pipelines.assign(next, next + variants.size());
+    next += variants.size();
+    if(level.sample_shading){
+      level.sample_shading_pipelines.assign(next, next + variants.size());
+      next += variants.size();
+    }
+  }
 
   vkDestroyShaderModule(logical_device_, vert_shader_module, nullptr);
   vkDestroyShaderModule(logical_device_, frag_shader_module, nullptr);
+
+  if(!settings_.depth_prepass) return;
+
+  // Depth pre-pass: positions only, no fragment shader, no color writes.
+  // One per level, whatever the variant.
+  pipeline_cis.resize(render_levels_.size());
+  pipelines.resize(render_levels_.size());
+  for(size_t i = 0; i < render_levels_.size(); ++i){
+    pipeline_cis[i] = pipeline_ci;
+    pipeline_cis[i].renderPass = render_levels_[i].render_pass;
+  }
+  VkShaderModule depth_shader_module = createShaderModule(
+    settings_.vertex_pulling ? pull_vert_code_ : depth_vert_code_);
+  VkPipelineShaderStageCreateInfo depth_shader_ci = vert_shader_ci;
+  depth_shader_ci.module = depth_shader_module;
+
+  // The pulling shader fetches the position and nothing else
+  VkBool32 position_only = VK_TRUE;
+  VkSpecializationMapEntry position_only_entry{0, 0, sizeof(VkBool32)};
+  VkSpecializationInfo position_only_info{1, &position_only_entry,
+    sizeof(VkBool32), &position_only};
+  if(settings_.vertex_pulling)
+    depth_shader_ci.pSpecializationInfo = &position_only_info;
+
+  VkPipelineVertexInputStateCreateInfo position_ci = vertex_ci;
+  position_ci.vertexAttributeDescriptionCount =
+    settings_.vertex_pulling ? 0 : 1;
+  position_ci.pVertexAttributeDescriptions = &attribute_desc[0];
+
+  VkPipelineColorBlendAttachmentState no_color = colorblend_attach;
+  no_color.colorWriteMask = 0;
+  VkPipelineColorBlendStateCreateInfo no_color_blending = colorBlending;
+  no_color_blending.pAttachments = &no_color;
+
+  for(size_t i = 0; i < render_levels_.size(); ++i){
+    pipeline_cis[i].stageCount = 1;
+    pipeline_cis[i].pStages = &depth_shader_ci;
+    pipeline_cis[i].pVertexInputState = &position_ci;
+    pipeline_cis[i].pDepthStencilState = &prepass_depth_stencil;
+    pipeline_cis[i].pColorBlendState = &no_color_blending;
+    pipeline_cis[i].pMultisampleState = &multisampling[i];
+  }
+  if(vkCreateGraphicsPipelines(logical_device_, VK_NULL_HANDLE,
+    static_cast<uint32_t>(pipeline_cis.size()), pipeline_cis.data(),
+    nullptr, pipelines.data()) != VK_SUCCESS){
+    throw std::runtime_error("Failed to create depth pre-pass pipeline");
+  }
+  for(size_t i = 0; i < render_levels_.size(); ++i)
+    render_levels_[i].depth_pipeline = pipelines[i];
+
+  vkDestroyShaderModule(logical_device_, depth_shader_module, nullptr);
+}
+
+void VulkanApp::createMaterials(){
+  const uint32_t lighting = settings_.light_count > 0
+    ? static_cast<uint32_t>(ShaderVariant::LIGHTING) : 0u;
+
+  shader_variants_.clear();
+  material_variants_.clear();
+  material_variants_.push_back(shader_variants_.add(
+    {ShaderVariant::TEXTURE | lighting}));           // MATERIAL_TEXTURED
+  material_variants_.push_back(shader_variants_.add(
+    {lighting}));                                    // MATERIAL_VERTEX_COLOR
 }
 
 std::vector<char> VulkanApp::readFile(const std::string& filename){
@@ -950,29 +1451,53 @@ VkShaderModule VulkanApp::createShaderModule(
 }
 
 void VulkanApp::createRenderPass(){
+  for(auto& level : render_levels_){
+    if(!occlusion_culling_){
+      level.render_pass = createScenePass(level.samples);
+      continue;
+    }
+    level.early_render_pass =
+      createScenePass(level.samples, ScenePhase::Early);
+    level.render_pass = createScenePass(level.samples, ScenePhase::Late);
+  }
+}
+
+VkRenderPass VulkanApp::createScenePass(VkSampleCountFlagBits samples,
+  ScenePhase phase){
+  // A single sample is drawn straight into the scene color target. The
+  // early phase leaves resolving to the late one.
+  const bool resolve = samples != VK_SAMPLE_COUNT_1_BIT
+    && phase != ScenePhase::Early;
+  // Early phase keeps everything for the late one, which picks it up
+  const bool keep = phase == ScenePhase::Early;
+  const VkAttachmentLoadOp load_op = phase == ScenePhase::Late
+    ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+
   VkAttachmentDescription color_attachment{};
 
   // Single color buffer
   color_attachment.format = swapchain_img_format_;
-  color_attachment.samples = msaa_samples_;
+  color_attachment.samples = samples;
 
   // What to do with data in attachment before and after rendering.
   // Applies to color and depth data, not stencil data.
 
   // Clear the values to a constant at the start (we'll clear to black)
-  color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  color_attachment.loadOp = load_op;
 
-  // Rendered content stored to memory, can be read later on.
-  color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  // Only the resolved image is kept, the msaa samples are thrown away at
+  // the end of the pass. They never have to leave tile memory.
+  color_attachment.storeOp = resolve ? VK_ATTACHMENT_STORE_OP_DONT_CARE
+    : VK_ATTACHMENT_STORE_OP_STORE;
 
   // Applies to stencil data, we don't have a stencil buffer
   color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
   
-  // Which layout the image will have before render pass begins
-  color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  // Which layout to automatically transition to when render pass finishes.
-  // MSAA image cannot be presented directly. Need to resolve before present
+  // Which layout the image will have before render pass begins, and which
+  // to transition to when it finishes. The render graph transitions every
+  // attachment before the pass, the pass leaves them as they are.
+  color_attachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
   color_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
   VkAttachmentReference colorattachmentref{};
@@ -985,12 +1510,15 @@ void VulkanApp::createRenderPass(){
   // Depth attachment
   VkAttachmentDescription depth_attach{};
   depth_attach.format = findDepthFormat();
-  depth_attach.samples = msaa_samples_;
-  depth_attach.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  depth_attach.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  depth_attach.samples = samples;
+  depth_attach.loadOp = load_op;
+  // Early depth builds the hi-z pyramid and is tested against later
+  depth_attach.storeOp = keep ? VK_ATTACHMENT_STORE_OP_STORE
+    : VK_ATTACHMENT_STORE_OP_DONT_CARE;
   depth_attach.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE; 
   depth_attach.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  depth_attach.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  depth_attach.initialLayout =
+    VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
   depth_attach.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
   VkAttachmentReference depth_ref{};
@@ -1000,8 +1528,10 @@ void VulkanApp::createRenderPass(){
 
   VkAttachmentDescription color_attach_resolve{};
   color_attach_resolve.format = swapchain_img_format_;
-  color_attach_resolve.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  color_attach_resolve.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  // MSAA image cannot be sampled by the upscale pass directly, it's
+  // resolved into the scene color target first.
+  color_attach_resolve.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  color_attach_resolve.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
   color_attach_resolve.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   color_attach_resolve.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
   color_attach_resolve.samples = VK_SAMPLE_COUNT_1_BIT;
@@ -1018,10 +1548,11 @@ void VulkanApp::createRenderPass(){
   subpass_desc.colorAttachmentCount = 1;
   subpass_desc.pColorAttachments = &colorattachmentref;
   subpass_desc.pDepthStencilAttachment = &depth_ref; // Only one allowed.
-  subpass_desc.pResolveAttachments = &color_resolve_ref;
+  subpass_desc.pResolveAttachments = resolve ? &color_resolve_ref : nullptr;
 
-  std::array<VkAttachmentDescription,3> attachments{color_attachment,
-  depth_attach, color_attach_resolve};
+  std::vector<VkAttachmentDescription> attachments{color_attachment,
+  depth_attach};
+  if(resolve) attachments.push_back(color_attach_resolve);
 
   // We have attachment and basic subpass referencing. Create render pass
   VkRenderPassCreateInfo rp_ci{};
@@ -1034,65 +1565,294 @@ void VulkanApp::createRenderPass(){
 
   /* Subpass transitions are controlled by dependencies.
   * We have a single subpass, operations before and after count as 2 implicit
-  * subpasses.
+  * subpasses. No external dependencies: the render graph's barriers right
+  * before and after the pass already order it against the rest of the
+  * frame, the implicit ones are enough.
   */
-  VkSubpassDependency subpass_dependency{};
-  subpass_dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-  subpass_dependency.dstSubpass = 0; // Our subpass
-  // Wait till the implicit subpass before ours has the color attachment bit set
-  subpass_dependency.srcStageMask =
-    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
-    | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-  subpass_dependency.srcAccessMask = 0;
-
-  // The operations that should wait for the color output bit in the next subpass
-  // are writing color.
-  subpass_dependency.dstStageMask =
-    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
-    | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-  subpass_dependency.dstAccessMask = 
-    VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
-
-    // Since depth load operation clears the depth image, the first operation
-    // is a write.
-    | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-  
-  rp_ci.dependencyCount = 1;
-  rp_ci.pDependencies = &subpass_dependency;
+  rp_ci.dependencyCount = 0;
+  rp_ci.pDependencies = nullptr;
 
-  if(vkCreateRenderPass(logical_device_, &rp_ci, nullptr, &render_pass_)
+  VkRenderPass render_pass;
+  if(vkCreateRenderPass(logical_device_, &rp_ci, nullptr, &render_pass)
     != VK_SUCCESS){
     throw std::runtime_error("Failed to create render pass");
   }
+  return render_pass;
 }
 
 void VulkanApp::createFrameBuffers(){
+  // Scene color is the swap chain image itself without upscaling, one set
+  // of frame buffers per image then
+  const bool upscale = upscaling();
+  const size_t sets = upscale ? 1 : swapchain_imgviews_.size();
+
+  // Scene targets are swap chain sized whatever the render scale
+  for(auto& level : render_levels_){
+    level.frame_buffers.resize(sets);
+    if(level.early_render_pass != VK_NULL_HANDLE)
+      level.early_frame_buffers.resize(sets);
+
+    for(size_t i = 0; i < sets; ++i){
+      const VkImageView scene_color = upscale
+        ? level.graph.view(level.scene_color_target) : swapchain_imgviews_[i];
+
+      // Same order as the attachments of createScenePass()
+      std::vector<VkImageView> attachments;
+      if(level.samples == VK_SAMPLE_COUNT_1_BIT){
+        attachments = {scene_color, level.graph.view(level.depth_target)};
+      }else{
+        attachments = {level.graph.view(level.msaa_color_target),
+          level.graph.view(level.depth_target), scene_color};
+      }
+
+      VkFramebufferCreateInfo fb_ci{};
+      fb_ci.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+      // Renderpass needs to be compatible with this frame buffer
+      // i.e. roughly same number and type of attachments
+      fb_ci.renderPass = level.render_pass;
+      fb_ci.attachmentCount = static_cast<uint32_t>(attachments.size());
+      fb_ci.pAttachments = attachments.data();
+      fb_ci.width = swapchain_img_extent_.width;
+      fb_ci.height = swapchain_img_extent_.height;
+      fb_ci.layers = 1; // # of layers in img arrays
+
+      if(vkCreateFramebuffer(logical_device_, &fb_ci, nullptr,
+        &level.frame_buffers[i]) != VK_SUCCESS){
+        throw std::runtime_error("Failed to create framebuffer.");
+      }
+
+      if(level.early_render_pass == VK_NULL_HANDLE) continue;
+      // Early phase doesn't resolve, same targets without the scene color
+      if(level.samples != VK_SAMPLE_COUNT_1_BIT) attachments.pop_back();
+      fb_ci.renderPass = level.early_render_pass;
+      fb_ci.attachmentCount = static_cast<uint32_t>(attachments.size());
+      fb_ci.pAttachments = attachments.data();
+      if(vkCreateFramebuffer(logical_device_, &fb_ci, nullptr,
+        &level.early_frame_buffers[i]) != VK_SUCCESS){
+        throw std::runtime_error("Failed to create framebuffer.");
+      }
+    }
+  }
+  if(!upscale) return;
+
   // Create one frame buffer per image view in the swap chain
-  swapchain_frame_buffers_.resize(swapchain_imgviews_.size());
+  upscale_frame_buffers_.resize(swapchain_imgviews_.size());
 
   for(size_t i = 0; i < swapchain_imgviews_.size(); ++i){
-    std::array<VkImageView,3> attachments{
-      color_image_view_, depth_image_view_, swapchain_imgviews_[i]
-    };
-
     VkFramebufferCreateInfo fb_ci{};
     fb_ci.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-    // Renderpass needs to be compatible with this frame buffer
-    // i.e. roughly same number and type of attachments
-    fb_ci.renderPass = render_pass_;
-    fb_ci.attachmentCount = static_cast<uint32_t>(attachments.size());
-    fb_ci.pAttachments = attachments.data();
+    fb_ci.renderPass = upscale_pass_;
+    fb_ci.attachmentCount = 1;
+    fb_ci.pAttachments = &swapchain_imgviews_[i];
     fb_ci.width = swapchain_img_extent_.width;
     fb_ci.height = swapchain_img_extent_.height;
-    fb_ci.layers = 1; // # of layers in img arrays
+    fb_ci.layers = 1;
 
     if(vkCreateFramebuffer(logical_device_, &fb_ci, nullptr,
-      &swapchain_frame_buffers_[i]) != VK_SUCCESS){
+      &upscale_frame_buffers_[i]) != VK_SUCCESS){
       throw std::runtime_error("Failed to create framebuffer.");
     }
   }
 }
 
+bool VulkanApp::upscaling() const{
+  if(settings_.target_frame_ms > 0.0) return renderScaleSteps() > 0;
+  return std::clamp(settings_.render_scale, MIN_RENDER_SCALE, 1.0f) < 1.0f;
+}
+
+uint32_t VulkanApp::renderScaleSteps() const{
+  if(settings_.target_frame_ms <= 0.0) return 0;
+  const float min_scale =
+    std::clamp(settings_.min_render_scale, MIN_RENDER_SCALE, 1.0f);
+  return static_cast<uint32_t>((1.0f - min_scale)/RENDER_SCALE_STEP + 0.5f);
+}
+
+void VulkanApp::createUpscaleLayout(){
+  if(!upscaling()) return;
+
+  VkDescriptorSetLayoutBinding scene_binding{};
+  scene_binding.binding = 0;
+  scene_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  scene_binding.descriptorCount = 1;
+  scene_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+  VkDescriptorSetLayoutCreateInfo layout_info{};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.bindingCount = 1;
+  layout_info.pBindings = &scene_binding;
+  upscale_set_layout_ =
+    descriptor_layout_cache_.createDescriptorLayout(layout_info);
+
+  // uv_scale, texel, sharpness
+  VkPushConstantRange push_range{};
+  push_range.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  push_range.offset = 0;
+  push_range.size = 5*sizeof(float);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_ci{};
+  pipeline_layout_ci.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_ci.setLayoutCount = 1;
+  pipeline_layout_ci.pSetLayouts = &upscale_set_layout_;
+  pipeline_layout_ci.pushConstantRangeCount = 1;
+  pipeline_layout_ci.pPushConstantRanges = &push_range;
+
+  if(vkCreatePipelineLayout(logical_device_, &pipeline_layout_ci, nullptr,
+    &upscale_pipeline_layout_) != VK_SUCCESS){
+    throw std::runtime_error("Failed to create upscale pipeline layout");
+  }
+
+  // Bilinear, the shader keeps to the rendered part of the image itself
+  VkSamplerCreateInfo sampler_ci{};
+  sampler_ci.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_ci.magFilter = VK_FILTER_LINEAR;
+  sampler_ci.minFilter = VK_FILTER_LINEAR;
+  sampler_ci.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_ci.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_ci.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_ci.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_ci.anisotropyEnable = VK_FALSE;
+  sampler_ci.maxLod = 0.0f;
+
+  if(vkCreateSampler(logical_device_, &sampler_ci, nullptr, &upscale_sampler_)
+    != VK_SUCCESS){
+    throw std::runtime_error("Failed to create upscale sampler.");
+  }
+}
+
+void VulkanApp::createUpscalePipeline(){
+  if(!upscaling()) return;
+
+  // Swap chain image is the only attachment, every pixel gets written so
+  // its old contents don't matter.
+  VkAttachmentDescription target{};
+  target.format = swapchain_img_format_;
+  target.samples = VK_SAMPLE_COUNT_1_BIT;
+  target.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  target.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  target.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  target.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  // The render graph transitions it before and to present after
+  target.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  target.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  VkAttachmentReference target_ref{};
+  target_ref.attachment = 0;
+  target_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  VkSubpassDescription subpass_desc{};
+  subpass_desc.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass_desc.colorAttachmentCount = 1;
+  subpass_desc.pColorAttachments = &target_ref;
+
+  VkRenderPassCreateInfo rp_ci{};
+  rp_ci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  rp_ci.attachmentCount = 1;
+  rp_ci.pAttachments = &target;
+  rp_ci.subpassCount = 1;
+  rp_ci.pSubpasses = &subpass_desc;
+
+  if(vkCreateRenderPass(logical_device_, &rp_ci, nullptr, &upscale_pass_)
+    != VK_SUCCESS){
+    throw std::runtime_error("Failed to create upscale render pass");
+  }
+
+  VkShaderModule vert_module = createShaderModule(upscale_vert_code_);
+  VkShaderModule frag_module = createShaderModule(upscale_frag_code_);
+
+  VkPipelineShaderStageCreateInfo shader_stages[2]{};
+  shader_stages[0].sType =
+    VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+  shader_stages[0].module = vert_module;
+  shader_stages[0].pName = "main";
+  shader_stages[1].sType =
+    VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  shader_stages[1].module = frag_module;
+  shader_stages[1].pName = "main";
+
+  // Full screen triangle made up in the vertex shader, no vertex input
+  VkPipelineVertexInputStateCreateInfo vertex_ci{};
+  vertex_ci.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+  VkPipelineInputAssemblyStateCreateInfo input_assembly_ci{};
+  input_assembly_ci.sType =
+    VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  input_assembly_ci.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+  // Always the whole swap chain image
+  VkViewport viewport{};
+  viewport.width = (float) swapchain_img_extent_.width;
+  viewport.height = (float) swapchain_img_extent_.height;
+  viewport.maxDepth = 1.0f;
+
+  VkRect2D scissor{};
+  scissor.extent = swapchain_img_extent_;
+
+  VkPipelineViewportStateCreateInfo viewport_state_ci{};
+  viewport_state_ci.sType =
+    VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  viewport_state_ci.viewportCount = 1;
+  viewport_state_ci.pViewports = &viewport;
+  viewport_state_ci.scissorCount = 1;
+  viewport_state_ci.pScissors = &scissor;
+
+  VkPipelineRasterizationStateCreateInfo rasterizer{};
+  rasterizer.sType =
+    VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+  rasterizer.lineWidth = 1.0f;
+  rasterizer.cullMode = VK_CULL_MODE_NONE;
+  rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+  VkPipelineMultisampleStateCreateInfo multisampling{};
+  multisampling.sType =
+    VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+  VkPipelineColorBlendAttachmentState colorblend_attach{};
+  colorblend_attach.colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
+    VK_COLOR_COMPONENT_G_BIT |
+    VK_COLOR_COMPONENT_B_BIT |
+    VK_COLOR_COMPONENT_A_BIT;
+  colorblend_attach.blendEnable = VK_FALSE;
+
+  VkPipelineColorBlendStateCreateInfo color_blending{};
+  color_blending.sType =
+    VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  color_blending.attachmentCount = 1;
+  color_blending.pAttachments = &colorblend_attach;
+
+  // No depth test, no depth attachment
+  VkPipelineDepthStencilStateCreateInfo depth_stencil{};
+  depth_stencil.sType =
+    VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+
+  VkGraphicsPipelineCreateInfo pipeline_ci{};
+  pipeline_ci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipeline_ci.stageCount = 2;
+  pipeline_ci.pStages = shader_stages;
+  pipeline_ci.pVertexInputState = &vertex_ci;
+  pipeline_ci.pInputAssemblyState = &input_assembly_ci;
+  pipeline_ci.pViewportState = &viewport_state_ci;
+  pipeline_ci.pRasterizationState = &rasterizer;
+  pipeline_ci.pMultisampleState = &multisampling;
+  pipeline_ci.pDepthStencilState = &depth_stencil;
+  pipeline_ci.pColorBlendState = &color_blending;
+  pipeline_ci.layout = upscale_pipeline_layout_;
+  pipeline_ci.renderPass = upscale_pass_;
+  pipeline_ci.subpass = 0;
+  pipeline_ci.basePipelineIndex = -1;
+
+  if(vkCreateGraphicsPipelines(logical_device_, VK_NULL_HANDLE, 1,
+    &pipeline_ci, nullptr, &upscale_pipeline_) != VK_SUCCESS){
+    throw std::runtime_error("Failed to create upscale pipeline");
+  }
+
+  vkDestroyShaderModule(logical_device_, vert_module, nullptr);
+  vkDestroyShaderModule(logical_device_, frag_module, nullptr);
+}
+
 void VulkanApp::createCommandPool(){
   QueueFamilyIndices queuefamilyindices = findQueueFamilies(physical_device_);
 
@@ -1100,7 +1860,8 @@ void VulkanApp::createCommandPool(){
 
   cp_ci.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
   cp_ci.queueFamilyIndex = queuefamilyindices.graphics_family.value();
-  cp_ci.flags = 0; // Optional
+  // Command buffers are re-recorded every frame
+  cp_ci.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 
   if(vkCreateCommandPool(logical_device_, &cp_ci, nullptr, &command_pool_) !=
     VK_SUCCESS){
@@ -1109,7 +1870,7 @@ void VulkanApp::createCommandPool(){
 }
 
 void VulkanApp::createCommandBuffers(){
-  command_buffers_.resize(swapchain_frame_buffers_.size());
+  command_buffers_.resize(settings_.frames_in_flight);
 
   VkCommandBufferAllocateInfo cb_alloc_info{};
   cb_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -1125,125 +1886,581 @@ void VulkanApp::createCommandBuffers(){
     command_buffers_.data()) != VK_SUCCESS){
     throw std::runtime_error("Failed to allocate command buffers");
   }
+}
 
-  for (size_t i = 0; i < command_buffers_.size(); ++i){
-    VkCommandBufferBeginInfo begin_info{};
-    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+void VulkanApp::recordCommandBuffer(VkCommandBuffer command_buffer,
+  uint32_t img_idx){
+  VA_TRACE_SCOPE("recordCommandBuffer");
+  VkCommandBufferBeginInfo begin_info{};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 
-    // How the command buffer will be used.
-    begin_info.flags = 0; // Optional
-    begin_info.pInheritanceInfo = nullptr; // Optional
+  // How the command buffer will be used. Recorded again every frame.
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  begin_info.pInheritanceInfo = nullptr; // Optional
 
-    if(vkBeginCommandBuffer(command_buffers_[i], &begin_info) != VK_SUCCESS){
-      throw std::runtime_error("Failed to begin recording command buffer");
-    }
+  if(vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS){
+    throw std::runtime_error("Failed to begin recording command buffer");
+  }
+
+  // Reads last results of this frame slot and resets its queries, has to
+  // be outside the render pass.
+  gpu_profiler_.beginFrame(command_buffer, frame_scheduler_.frameIndex());
+  // Just collected a frame's gpu time, may change the level drawn below
+  updateQualityLevel();
+  render_extent_ = scaledExtent(quality_controller_.current().render_scale);
+  pipeline_stats_.beginFrame(command_buffer, frame_scheduler_.frameIndex(),
+    static_cast<uint64_t>(render_extent_.width)*render_extent_.height);
+  auto frame_scope = gpu_profiler_.beginScope(command_buffer, "frame");
+
+  // Skinned vertices for this frame's draws, written on the compute queue.
+  // The submit waits for it at vertex input.
+  const uint32_t frame = frame_scheduler_.frameIndex();
+  if(settings_.skinned_instances > 0){
+    acquireBuffer(command_buffer, skinned_vertex_buffer_,
+      frame*skinned_slot_bytes_, skinned_slot_bytes_,
+      compute_queue_.family(), queue_families_.graphics_family.value(),
+      vertexReadStage(), vertexReadAccess());
+  }
 
-    // Starting a render pass
-    VkRenderPassBeginInfo renderpass_info{};
-    renderpass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    renderpass_info.renderPass = render_pass_;
-    renderpass_info.framebuffer = swapchain_frame_buffers_[i];
-    renderpass_info.renderArea.offset = { 0, 0 };
-    renderpass_info.renderArea.extent = swapchain_img_extent_;
-
-    std::array<VkClearValue,2> clear_values;
-    // Order should be identical to order of attachments in render pass def
-    clear_values[0].color = {0.0f, 0.0f, 0.0f, 1.0f};
-    clear_values[1].depthStencil = {1.0f, 0};
-    renderpass_info.clearValueCount = 
-      static_cast<uint32_t>(clear_values.size());
-    renderpass_info.pClearValues = clear_values.data();
-
-    // Start recording command to buffer, commands go to command buffer [i]
-    vkCmdBeginRenderPass(command_buffers_[i], &renderpass_info,
-      VK_SUBPASS_CONTENTS_INLINE);
-
-    // bind graphics pipeline with command buffer
-    vkCmdBindPipeline(command_buffers_[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
-      graphics_pipeline_);
-
-    VkBuffer vertex_buffers_[]={vertex_buffer_};
-    VkDeviceSize offsets[] = {0};
-    vkCmdBindVertexBuffers(command_buffers_[i], 0, 1, vertex_buffers_, offsets);
-    vkCmdBindIndexBuffer(command_buffers_[i], index_buffer_, 0,
-      VK_INDEX_TYPE_UINT32);
-
-    // Bind the right descriptor set
-    vkCmdBindDescriptorSets(command_buffers_[i],
-      VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, 0, 1,
-      &descriptor_sets_[i], 0, nullptr);
-
-    vkCmdDrawIndexed(
-      command_buffers_[i], static_cast<uint32_t>(indices_.size()),1,0,0,0);
-    vkCmdEndRenderPass(command_buffers_[i]);
-    if(vkEndCommandBuffer(command_buffers_[i])!=VK_SUCCESS){
-      throw std::runtime_error("Failed to record command buffer");
+  if(occlusion_culling_){
+    // What the slot's last frame drew, the gpu is done with it
+    cull_drawn_early_ = cull_stats_mapped_[2*frame];
+    cull_drawn_late_ = cull_stats_mapped_[2*frame + 1];
+    cull_stats_mapped_[2*frame] = 0;
+    cull_stats_mapped_[2*frame + 1] = 0;
+
+    // The graph expects the pyramid as the last frame left it. Nothing has
+    // built it yet, the early phase won't read it.
+    if(!hiz_valid_){
+      VkImageSubresourceRange range{VK_IMAGE_ASPECT_COLOR_BIT, 0,
+        VK_REMAINING_MIP_LEVELS, 0, 1};
+      BarrierBatch batch;
+      batch.add(hiz_image_, range, usageState(ImageUsage::Undefined),
+        usageState(ImageUsage::SampledCompute));
+      batch.flush(command_buffer);
     }
   }
-}
 
-void VulkanApp::drawFrame(){
-  vkWaitForFences(logical_device_, 1, &inflight_fences_[current_frame_],
-    VK_TRUE, UINT64_MAX);
+  // Barriers, layout transitions and the passes
+  frame_image_index_ = img_idx;
+  RenderLevel& level = currentRenderLevel();
+  level.graph.setImage(level.swapchain_target, swapchain_images_[img_idx]);
+  if(occlusion_culling_) level.graph.setImage(level.hiz_target, hiz_image_);
+  level.graph.execute(command_buffer);
+  state_tracker_.takeFrame();
+
+  // Hand the slot back for the next time it's skinned. Only an execution
+  // dependency, the vertices were only read.
+  if(settings_.skinned_instances > 0){
+    releaseBuffer(command_buffer, skinned_vertex_buffer_,
+      frame*skinned_slot_bytes_, skinned_slot_bytes_,
+      queue_families_.graphics_family.value(), compute_queue_.family(),
+      vertexReadStage(), 0);
+    skinned_slot_released_[frame] = true;
+  }
+  gpu_profiler_.endScope(command_buffer, frame_scope);
 
-  uint32_t img_idx;
-  // Acquire image from swap chain
-  VkResult acquire_result = 
-  vkAcquireNextImageKHR(logical_device_, swap_chain_, UINT64_MAX,
-    img_available_sems_[current_frame_], VK_NULL_HANDLE, &img_idx);
+  if(vkEndCommandBuffer(command_buffer)!=VK_SUCCESS){
+    throw std::runtime_error("Failed to record command buffer");
+  }
+}
 
-  if(acquire_result == VK_ERROR_OUT_OF_DATE_KHR){
-    recreateSwapChain();
-    return;
-  }else if (acquire_result != VK_SUCCESS
-    && acquire_result != VK_SUBOPTIMAL_KHR){
-    throw std::runtime_error("Failed to acquire swapchain image.");
+void VulkanApp::recordScenePass(VkCommandBuffer command_buffer,
+  const RenderLevel& level, ScenePhase phase){
+  const uint32_t frame = frame_scheduler_.frameIndex();
+  const bool early = phase == ScenePhase::Early;
+
+  // Starting a render pass
+  VkRenderPassBeginInfo renderpass_info{};
+  renderpass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  renderpass_info.renderPass =
+    early ? level.early_render_pass : level.render_pass;
+  // One per swap chain image when the scene goes straight into it
+  const size_t fb = level.frame_buffers.size() > 1 ? frame_image_index_ : 0;
+  renderpass_info.framebuffer =
+    early ? level.early_frame_buffers[fb] : level.frame_buffers[fb];
+  renderpass_info.renderArea.offset = { 0, 0 };
+  renderpass_info.renderArea.extent = render_extent_;
+
+  std::array<VkClearValue,2> clear_values;
+  // Order should be identical to order of attachments in render pass def
+  clear_values[0].color = {0.0f, 0.0f, 0.0f, 1.0f};
+  clear_values[1].depthStencil = {1.0f, 0};
+  renderpass_info.clearValueCount = 
+    static_cast<uint32_t>(clear_values.size());
+  renderpass_info.pClearValues = clear_values.data();
+
+  // Start recording command to buffer
+  pipeline_stats_.begin(command_buffer);
+  auto pass_scope = gpu_profiler_.beginScope(command_buffer,
+    early ? "early pass" : "render pass");
+  vkCmdBeginRenderPass(command_buffer, &renderpass_info,
+    VK_SUBPASS_CONTENTS_INLINE);
+  // Other passes may have bound anything
+  state_tracker_.reset(command_buffer);
+
+  // Pulled vertices. Set 1 stays bound while the tracker binds set 0.
+  if(settings_.vertex_pulling){
+    VkDescriptorSet stream_set = vertexStreamSet();
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+      pipeline_layout_, 1, 1, &stream_set, 0, nullptr);
   }
 
-  updateUniformBuffer(img_idx);
+  // Only the top left render_extent_ of the targets, the upscale pass
+  // stretches it over the swap chain image
+  VkViewport viewport{};
+  viewport.width = (float) render_extent_.width;
+  viewport.height = (float) render_extent_.height;
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+  vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+
+  VkRect2D scissor{};
+  scissor.extent = render_extent_;
+  vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+
+  // Draws the culling shader wrote for this phase, one per object
+  const VkDeviceSize draw_offset = sizeof(VkDrawIndexedIndirectCommand)
+    * (2*frame + (early ? 0 : 1)) * settings_.object_count;
+
+  const uint32_t skinned_vertex_count =
+    static_cast<uint32_t>(skinned_mesh_.vertices.size());
+  const uint32_t skinned_index_count =
+    static_cast<uint32_t>(skinned_mesh_.indices.size());
+
+  // Every draw of the phase in queue order, with the pipeline of its shader
+  // variant or the depth only one. Binds are asked for every draw, the
+  // tracker only records the ones that change.
+  const auto& pipelines = quality_controller_.current().sample_shading
+    ? level.sample_shading_pipelines : level.pipelines;
+  auto draw_scene = [&](bool depth_only){
+    for(const auto& draw : render_queue_.draws()){
+      const uint32_t obj = draw.object;
+      const bool skinned = obj >= settings_.object_count;
+      // Not culled, drawn with the first phase
+      if(skinned && phase == ScenePhase::Late) continue;
+
+      state_tracker_.bindPipeline(depth_only ? level.depth_pipeline
+        : pipelines[RenderQueue::pipeline(draw.key)]);
+      // Pulled vertices only need the indices bound
+      if(skinned){
+        // Output of the skinning shader, same layout as the static vertices
+        if(!settings_.vertex_pulling){
+          state_tracker_.bindVertexBuffer(skinned_vertex_buffer_,
+            frame*skinned_slot_bytes_);
+        }
+        state_tracker_.bindIndexBuffer(skin_index_buffer_,
+          VK_INDEX_TYPE_UINT32);
+      }else{
+        // Every mesh lives in the same two buffers
+        if(!settings_.vertex_pulling)
+          state_tracker_.bindVertexBuffer(vertex_buffer_, 0);
+        state_tracker_.bindIndexBuffer(index_buffer_, index_type_);
+      }
+      // Same set for every draw, only bound once
+      state_tracker_.bindDescriptorSet(pipeline_layout_,
+        descriptor_sets_[frame]);
+
+      DrawConstants constants{};
+      constants.model = transforms_.world(object_nodes_[obj]);
+      constants.material = RenderQueue::material(draw.key);
+      // Skinned vertices as the compute shader wrote them, from this
+      // frame's slot
+      constants.vertex_format = static_cast<uint32_t>(skinned
+        ? VertexFormat::Interleaved : VertexFormat::Compressed);
+      constants.vertex_base = skinned
+        ? static_cast<uint32_t>(frame*skinned_slot_bytes_/sizeof(float)) : 0;
+      vkCmdPushConstants(command_buffer, pipeline_layout_,
+        VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+        sizeof(constants), &constants);
+
+      if(skinned){
+        // Each instance has its own copy of the vertices
+        uint32_t instance = obj - settings_.object_count;
+        vkCmdDrawIndexed(command_buffer, skinned_index_count, 1, 0,
+          static_cast<int32_t>(instance*skinned_vertex_count), 0);
+      }else if(phase != ScenePhase::All){
+        // No instances when it's hidden, nothing reaches the vertex shader
+        vkCmdDrawIndexedIndirect(command_buffer, cull_draw_buffer_,
+          draw_offset + obj*sizeof(VkDrawIndexedIndirectCommand), 1,
+          sizeof(VkDrawIndexedIndirectCommand));
+      }else{
+        // Indices are mesh local, vertex offset moves them to the mesh's
+        // vertices
+        const MeshEntry& mesh = meshes_.mesh(object_meshes_[obj]);
+        vkCmdDrawIndexed(command_buffer, mesh.index_count, 1,
+          mesh.first_index, mesh.vertex_offset, 0);
+      }
+    }
+  };
 
-  // Check if previous frame is using this img
-  if(images_in_flight_[img_idx] != VK_NULL_HANDLE){
-    vkWaitForFences(logical_device_, 1, &images_in_flight_[img_idx],
-      VK_TRUE, UINT64_MAX);
+  // Depth of everything first, then shading only the visible fragments
+  if(settings_.depth_prepass){
+    auto prepass_scope = gpu_profiler_.beginScope(command_buffer,
+      "depth pre-pass");
+    draw_scene(true);
+    gpu_profiler_.endScope(command_buffer, prepass_scope);
   }
+  draw_scene(false);
 
-  // Mark image as in use by this frame
-  images_in_flight_[img_idx] = inflight_fences_[current_frame_];
+  if(early){
+    vkCmdEndRenderPass(command_buffer);
+    gpu_profiler_.endScope(command_buffer, pass_scope);
+    pipeline_stats_.end(command_buffer);
+    return;
+  }
 
-  // Submit command to command buffer
-  VkSubmitInfo submit_info{};
+  // The msaa resolve happens at the end of the subpass. Time from the last
+  // draw finishing to the end of the pass, which is the resolve plus stores.
+  auto resolve_scope = gpu_profiler_.beginScope(command_buffer, "msaa resolve",
+    VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+  vkCmdEndRenderPass(command_buffer);
+  gpu_profiler_.endScope(command_buffer, resolve_scope);
+  gpu_profiler_.endScope(command_buffer, pass_scope);
+  pipeline_stats_.end(command_buffer);
+}
+
+void VulkanApp::recordUpscalePass(VkCommandBuffer command_buffer,
+  const RenderLevel& level){
+  // The scene color of the level drawing this frame, a fresh set every
+  // frame since the level can change.
+  VkDescriptorSet set = allocateFrameDescriptorSet(upscale_set_layout_);
+
+  VkDescriptorImageInfo scene_info{};
+  scene_info.sampler = upscale_sampler_;
+  scene_info.imageView = level.graph.view(level.scene_color_target);
+  scene_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+  VkWriteDescriptorSet write{};
+  write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  write.dstSet = set;
+  write.dstBinding = 0;
+  write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  write.descriptorCount = 1;
+  write.pImageInfo = &scene_info;
+  vkUpdateDescriptorSets(logical_device_, 1, &write, 0, nullptr);
+
+  // Same layout as the shader's push constant block
+  struct {
+    float uv_scale[2];
+    float texel[2];
+    float sharpness;
+  } upscale;
+  const float width = static_cast<float>(swapchain_img_extent_.width);
+  const float height = static_cast<float>(swapchain_img_extent_.height);
+  upscale.uv_scale[0] = render_extent_.width/width;
+  upscale.uv_scale[1] = render_extent_.height/height;
+  upscale.texel[0] = 1.0f/width;
+  upscale.texel[1] = 1.0f/height;
+  // At full resolution every pixel samples a texel center, a plain copy
+  const bool native = render_extent_.width == swapchain_img_extent_.width
+    && render_extent_.height == swapchain_img_extent_.height;
+  upscale.sharpness = native ? 0.0f : settings_.upscale_sharpness;
+
+  VkRenderPassBeginInfo renderpass_info{};
+  renderpass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  renderpass_info.renderPass = upscale_pass_;
+  renderpass_info.framebuffer = upscale_frame_buffers_[frame_image_index_];
+  renderpass_info.renderArea.extent = swapchain_img_extent_;
+
+  auto scope = gpu_profiler_.beginScope(command_buffer, "upscale");
+  vkCmdBeginRenderPass(command_buffer, &renderpass_info,
+    VK_SUBPASS_CONTENTS_INLINE);
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+    upscale_pipeline_);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+    upscale_pipeline_layout_, 0, 1, &set, 0, nullptr);
+  vkCmdPushConstants(command_buffer, upscale_pipeline_layout_,
+    VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(upscale), &upscale);
+  vkCmdDraw(command_buffer, 3, 1, 0, 0);
+  vkCmdEndRenderPass(command_buffer);
+  gpu_profiler_.endScope(command_buffer, scope);
+}
+
+void VulkanApp::recordCullPass(VkCommandBuffer command_buffer,
+  uint32_t phase){
+  const uint32_t frame = frame_scheduler_.frameIndex();
+  VkDescriptorSet set = allocateFrameDescriptorSet(cull_set_layout_);
+
+  std::array<VkDescriptorBufferInfo, 3> buffer_infos{};
+  buffer_infos[0] = {cull_object_buffer_, 0, VK_WHOLE_SIZE};
+  buffer_infos[1] = {cull_draw_buffer_, 0, VK_WHOLE_SIZE};
+  buffer_infos[2] = {cull_stats_buffer_, 0, VK_WHOLE_SIZE};
+  VkDescriptorImageInfo hiz_info{hiz_sampler_, hiz_view_,
+    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+
+  std::array<VkWriteDescriptorSet, 4> writes{};
+  for(uint32_t i = 0; i < writes.size(); ++i){
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = set;
+    writes[i].dstBinding = i;
+    writes[i].descriptorCount = 1;
+    if(i < buffer_infos.size()){
+      writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      writes[i].pBufferInfo = &buffer_infos[i];
+    }else{
+      writes[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+      writes[i].pImageInfo = &hiz_info;
+    }
+  }
+  vkUpdateDescriptorSets(logical_device_,
+    static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+
+  // Same layout as the shader's push constant block. The early phase tests
+  // against what the last frame drew, the late one against this frame's
+  // early depth.
+  struct {
+    glm::mat4 view_proj;
+    int32_t hiz_size[2];
+    uint32_t object_count;
+    uint32_t phase;
+    uint32_t hiz_levels;
+    uint32_t frame;
+  } cull;
+  VkExtent2D hiz_size = render_extent_;
+  if(phase == 0) hiz_size = hiz_valid_ ? hiz_extent_ : VkExtent2D{0, 0};
+  cull.view_proj = view_proj_;
+  cull.hiz_size[0] = static_cast<int32_t>(hiz_size.width);
+  cull.hiz_size[1] = static_cast<int32_t>(hiz_size.height);
+  cull.object_count = settings_.object_count;
+  cull.phase = phase;
+  cull.hiz_levels = hiz_mips_;
+  cull.frame = frame;
+
+  auto scope = gpu_profiler_.beginScope(command_buffer,
+    phase == 0 ? "cull early" : "cull late");
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+    cull_pipeline_);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+    cull_pipeline_layout_, 0, 1, &set, 0, nullptr);
+  vkCmdPushConstants(command_buffer, cull_pipeline_layout_,
+    VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(cull), &cull);
+  vkCmdDispatch(command_buffer, (settings_.object_count + 63)/64, 1, 1);
+
+  // Draws are read as indirect arguments and by the late phase, the counts
+  // by the cpu once the frame is done
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+    | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+    | VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+    | VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+  gpu_profiler_.endScope(command_buffer, scope);
+}
+
+void VulkanApp::recordHiZPass(VkCommandBuffer command_buffer,
+  const RenderLevel& level){
+  // Same layout as the shaders' push constant block
+  struct {
+    int32_t src_size[2];
+    int32_t dst_size[2];
+    int32_t samples;
+  } reduce;
+  reduce.samples = static_cast<int32_t>(level.samples);
+
+  auto scope = gpu_profiler_.beginScope(command_buffer, "hi-z");
+  VkExtent2D src = render_extent_;
+  for(uint32_t mip = 0; mip < hiz_mips_; ++mip){
+    // Level 0 is the depth itself, every other level halves the one above
+    VkExtent2D dst = src;
+    if(mip > 0)
+      dst = {std::max(src.width/2, 1u), std::max(src.height/2, 1u)};
+
+    VkDescriptorSet set = allocateFrameDescriptorSet(hiz_set_layout_);
+    VkDescriptorImageInfo src_info{};
+    if(mip == 0){
+      src_info = {hiz_sampler_, level.graph.view(level.depth_target),
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+    }else{
+      src_info = {VK_NULL_HANDLE, hiz_mip_views_[mip - 1],
+        VK_IMAGE_LAYOUT_GENERAL};
+    }
+    VkDescriptorImageInfo dst_info{VK_NULL_HANDLE, hiz_mip_views_[mip],
+      VK_IMAGE_LAYOUT_GENERAL};
+
+    std::array<VkWriteDescriptorSet, 2> writes{};
+    writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[0].dstSet = set;
+    writes[0].dstBinding = mip == 0 ? 0 : 1;
+    writes[0].descriptorCount = 1;
+    writes[0].descriptorType = mip == 0
+      ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+      : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    writes[0].pImageInfo = &src_info;
+    writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[1].dstSet = set;
+    writes[1].dstBinding = 2;
+    writes[1].descriptorCount = 1;
+    writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    writes[1].pImageInfo = &dst_info;
+    vkUpdateDescriptorSets(logical_device_,
+      static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+
+    VkPipeline pipeline = hiz_reduce_pipeline_;
+    if(mip == 0){
+      pipeline = level.samples == VK_SAMPLE_COUNT_1_BIT
+        ? hiz_depth_pipeline_ : hiz_depth_ms_pipeline_;
+    }
+    reduce.src_size[0] = static_cast<int32_t>(src.width);
+    reduce.src_size[1] = static_cast<int32_t>(src.height);
+    reduce.dst_size[0] = static_cast<int32_t>(dst.width);
+    reduce.dst_size[1] = static_cast<int32_t>(dst.height);
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      hiz_pipeline_layout_, 0, 1, &set, 0, nullptr);
+    vkCmdPushConstants(command_buffer, hiz_pipeline_layout_,
+      VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(reduce), &reduce);
+    vkCmdDispatch(command_buffer, (dst.width + 7)/8, (dst.height + 7)/8, 1);
+
+    // The next level reads this one, the graph orders the last one
+    if(mip + 1 < hiz_mips_){
+      VkMemoryBarrier barrier{};
+      barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+      barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      vkCmdPipelineBarrier(command_buffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0,
+        nullptr);
+    }
+    src = dst;
+  }
+  gpu_profiler_.endScope(command_buffer, scope);
+
+  // The next frame's early phase tests against this
+  hiz_extent_ = render_extent_;
+  hiz_valid_ = true;
+}
+
+VkExtent2D VulkanApp::scaledExtent(float scale) const{
+  auto scaled = [scale](uint32_t size){
+    uint32_t s = static_cast<uint32_t>(size*scale + 0.5f);
+    return std::min(size, std::max(1u, s));
+  };
+  return {scaled(swapchain_img_extent_.width),
+    scaled(swapchain_img_extent_.height)};
+}
+
+bool VulkanApp::acquireFrame(){
+  // Wait until the GPU is done with the work last submitted from this frame
+  // slot. This single wait replaces the per frame and per image fences:
+  // nothing used by a frame is per swap chain image anymore.
+  {
+    VA_TRACE_SCOPE("wait frame slot");
+    frame_scheduler_.beginFrame();
+  }
+  const uint32_t frame = frame_scheduler_.frameIndex();
+
+  // GPU is done with this frame slot, its transient sets can be recycled.
+  frame_descriptor_allocators_[frame].resetPools();
+  if(!retired_buffers_.empty())
+    destroyRetiredBuffers(frame_scheduler_.completedValue());
+
+  // Acquire image from swap chain
+  VkResult acquire_result;
+  {
+    VA_TRACE_SCOPE("vkAcquireNextImageKHR");
+    acquire_result = vkAcquireNextImageKHR(logical_device_, swap_chain_,
+      UINT64_MAX, frame_scheduler_.imageAvailable(), VK_NULL_HANDLE,
+      &acquired_image_);
+  }
+
+  if(acquire_result == VK_ERROR_OUT_OF_DATE_KHR){
+    recreateSwapChain();
+    return false;
+  }else if (acquire_result != VK_SUCCESS
+    && acquire_result != VK_SUBOPTIMAL_KHR){
+    throw std::runtime_error("Failed to acquire swapchain image.");
+  }
+
+  // Blocking waits are done, the display cadence is known from here. Sleep
+  // off the slack then sample input right before it's used.
+  frame_pacer_.gpuCompleted(frame_scheduler_.completedValue());
+  frame_pacer_.frameStart();
+  {
+    VA_TRACE_SCOPE("late input wait");
+    frame_pacer_.waitForInputDeadline();
+  }
+  return true;
+}
+
+void VulkanApp::drawFrame(){
+  // The loop polled input since acquireFrame()
+  frame_pacer_.inputSampled();
+  const uint32_t frame = frame_scheduler_.frameIndex();
+  const uint32_t img_idx = acquired_image_;
+
+  updateUniformBuffer(frame);
+  updateVisibility();
+  updateCullObjects(frame);
+  updateLights(frame);
+  updateRenderQueue();
+  updateSkinPalette(frame);
+  const uint64_t skinning_value = submitSkinning(frame);
+
+  uint64_t submit_start_ns = CpuProfiler::instance().now();
+  recordCommandBuffer(command_buffers_[frame], img_idx);
+
+  // Submit command to command buffer
+  VkSubmitInfo submit_info{};
   submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-  // Idx of wait_semaphores correspond to wait_stages.
-  VkSemaphore wait_semaphores[] = {img_available_sems_[current_frame_]};
+  // Idx of wait_semaphores correspond to wait_stages. Skinned vertices are
+  // only needed once vertices are fetched.
+  VkSemaphore wait_semaphores[] = {frame_scheduler_.imageAvailable(),
+    compute_queue_.timeline()};
   VkPipelineStageFlags wait_stages[] = {
-  VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+  VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+  vertexReadStage()};
+  const uint32_t wait_count = skinning_value > 0 ? 2 : 1;
 
-  submit_info.waitSemaphoreCount = 1;
+  submit_info.waitSemaphoreCount = wait_count;
   submit_info.pWaitSemaphores = wait_semaphores;
   submit_info.pWaitDstStageMask = wait_stages;
 
   submit_info.commandBufferCount = 1;
-  submit_info.pCommandBuffers = &command_buffers_[img_idx];
-
-  // Which semaphore to signal once operation is complete
-  VkSemaphore signal_sem[] = {render_finish_sems_[current_frame_]};
-  submit_info.signalSemaphoreCount = 1;
-  submit_info.pSignalSemaphores = signal_sem;
-
-  vkResetFences(logical_device_, 1, &inflight_fences_[current_frame_]);
-  if(vkQueueSubmit(graphics_queue_, 1, &submit_info, 
-    inflight_fences_[current_frame_]) != VK_SUCCESS){
-
+  submit_info.pCommandBuffers = &command_buffers_[frame];
+
+  // Which semaphores to signal once operation is complete. The binary one
+  // is for present, the timeline value marks this frame as done for the CPU.
+  const uint64_t signal_value = frame_scheduler_.nextSignalValue();
+  VkSemaphore signal_sems[] = {
+    frame_scheduler_.renderFinished(), frame_scheduler_.timeline()};
+  submit_info.signalSemaphoreCount = 2;
+  submit_info.pSignalSemaphores = signal_sems;
+
+  // Values for binary semaphores are ignored
+  uint64_t wait_values[] = {0, skinning_value};
+  uint64_t signal_values[] = {0, signal_value};
+  VkTimelineSemaphoreSubmitInfo timeline_info{};
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.waitSemaphoreValueCount = wait_count;
+  timeline_info.pWaitSemaphoreValues = wait_values;
+  timeline_info.signalSemaphoreValueCount = 2;
+  timeline_info.pSignalSemaphoreValues = signal_values;
+  submit_info.pNext = &timeline_info;
+
+  VkResult submit_result;
+  {
+    VA_TRACE_SCOPE("vkQueueSubmit");
+    submit_result = vkQueueSubmit(graphics_queue_, 1, &submit_info,
+      VK_NULL_HANDLE);
+  }
+  if(submit_result != VK_SUCCESS){
     throw std::runtime_error("Failed to submit draw command buffer");
   }
+  last_submit_ms_ = (CpuProfiler::instance().now() - submit_start_ns) / 1e6;
 
   // Submit back to swap chain
   VkPresentInfoKHR present_info{};
   present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
   present_info.waitSemaphoreCount = 1;
-  present_info.pWaitSemaphores = signal_sem;
+  present_info.pWaitSemaphores = signal_sems;
 
   VkSwapchainKHR swap_chains[]={swap_chain_};
   present_info.swapchainCount = 1;
@@ -1251,7 +2468,16 @@ void VulkanApp::drawFrame(){
   present_info.pImageIndices = &img_idx;
   present_info.pResults = nullptr; // Optional
 
-  VkResult pres_result = vkQueuePresentKHR(present_queue_,&present_info);
+  // Moves on to the next frame slot
+  frame_scheduler_.endFrame(signal_value);
+
+  VkResult pres_result;
+  {
+    VA_TRACE_SCOPE("vkQueuePresentKHR");
+    pres_result = vkQueuePresentKHR(present_queue_,&present_info);
+  }
+  frame_pacer_.presented(signal_value);
+  ++frame_number_;
   if(pres_result == VK_ERROR_OUT_OF_DATE_KHR
     || pres_result == VK_SUBOPTIMAL_KHR 
     || frame_buffer_resized_){
@@ -1259,32 +2485,77 @@ void VulkanApp::drawFrame(){
   }else if(pres_result != VK_SUCCESS){
     throw std::runtime_error("Failed to present swap chain image");
   }
-  current_frame_ = (current_frame_+1)%MAX_FRAMES_IN_FLIGHT;
 }
 
 void VulkanApp::createSyncObjects(){
-  img_available_sems_.resize(MAX_FRAMES_IN_FLIGHT);
-  render_finish_sems_.resize(MAX_FRAMES_IN_FLIGHT);
-  inflight_fences_.resize(MAX_FRAMES_IN_FLIGHT);
-  images_in_flight_.resize(swapchain_images_.size(), VK_NULL_HANDLE);
-
-  VkSemaphoreCreateInfo sem_info{};
-  sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-
-  VkFenceCreateInfo fence_info{};
-  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-  fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-  for (size_t i = 0; i < img_available_sems_.size(); ++i) {
-    if (vkCreateSemaphore(logical_device_, &sem_info, nullptr,
-                          &img_available_sems_[i]) != VK_SUCCESS ||
-        vkCreateSemaphore(logical_device_, &sem_info, nullptr,
-                          &render_finish_sems_[i]) != VK_SUCCESS ||
-        vkCreateFence(logical_device_, &fence_info, nullptr, &inflight_fences_[i])
-      != VK_SUCCESS) {
-      throw std::runtime_error("Failed to create sync objects for frame");
-    }
+  frame_scheduler_.init(logical_device_, settings_.frames_in_flight);
+}
+
+void VulkanApp::createGpuProfiler(){
+  QueueFamilyIndices indices = findQueueFamilies(physical_device_);
+  gpu_profiler_.init(physical_device_, logical_device_,
+    indices.graphics_family.value(), settings_.frames_in_flight);
+  gpu_profiler_.setTraceCapture(!settings_.gpu_trace_path.empty());
+  pipeline_stats_.init(physical_device_, logical_device_,
+    settings_.frames_in_flight);
+}
+
+void VulkanApp::setFramesInFlight(uint32_t frames_in_flight){
+  if(frames_in_flight == settings_.frames_in_flight) return;
+
+  // Also waits for the GPU to drain
+  frame_scheduler_.setFramesInFlight(frames_in_flight);
+  gpu_profiler_.setFramesInFlight(frames_in_flight);
+  pipeline_stats_.setFramesInFlight(frames_in_flight);
+  cleanUpFrameResources();
+
+  settings_.frames_in_flight = frames_in_flight;
+  if(settings_.skinned_instances > 0){
+    destroySkinFrameResources();
+    createSkinFrameResources();
+  }
+  if(occlusion_culling_){
+    destroyCullFrameResources();
+    createCullFrameResources();
   }
+  createUniformBuffers();
+  createLightBuffers();
+  createDescriptorSets();
+  createCommandBuffers();
+}
+
+void VulkanApp::cleanUpFrameResources(){
+  for(size_t i = 0; i < uniform_buffers_.size(); ++i){
+    vkDestroyBuffer(logical_device_, uniform_buffers_[i], nullptr);
+    freeMemory(uniform_buffers_memory_[i]);
+  }
+  uniform_buffers_.clear();
+  uniform_buffers_memory_.clear();
+
+  for(size_t i = 0; i < light_buffers_.size(); ++i){
+    vkUnmapMemory(logical_device_, light_buffers_memory_[i]);
+    vkDestroyBuffer(logical_device_, light_buffers_[i], nullptr);
+    freeMemory(light_buffers_memory_[i]);
+    vkDestroyBuffer(logical_device_, cluster_buffers_[i], nullptr);
+    freeMemory(cluster_buffers_memory_[i]);
+  }
+  light_buffers_.clear();
+  light_buffers_memory_.clear();
+  light_buffers_mapped_.clear();
+  cluster_buffers_.clear();
+  cluster_buffers_memory_.clear();
+
+  for(auto& allocator : frame_descriptor_allocators_){
+    allocator.cleanUp();
+  }
+  frame_descriptor_allocators_.clear();
+
+  vkFreeCommandBuffers(
+    logical_device_,
+    command_pool_,
+    static_cast<uint32_t>(command_buffers_.size()),
+    command_buffers_.data());
+  command_buffers_.clear();
 }
 
 void VulkanApp::recreateSwapChain(){
@@ -1295,6 +2566,10 @@ void VulkanApp::recreateSwapChain(){
     glfwWaitEvents();
   }
   vkDeviceWaitIdle(logical_device_);
+  frame_buffer_resized_ = false;
+  // Refresh rate or image count may have changed
+  frame_pacer_.resetEstimates();
+
   // Clean up existing objects related to the swap chain.
   cleanUpSwapChain();
 
@@ -1302,46 +2577,47 @@ void VulkanApp::recreateSwapChain(){
   createImageViews();
   createRenderPass();
   createGraphicsPipeline();
-  createColorResources();
-  createDepthResources();
+  createUpscalePipeline();
+  createRenderGraph();
   createFrameBuffers();
-  createUniformBuffers();
-  createDescriptorPool();
-  createDescriptorSets();
-  createCommandBuffers();
 }
 
 void VulkanApp::cleanUpSwapChain(){
-  // Msaa color image
-  vkDestroyImageView(logical_device_, color_image_view_, nullptr);
-  vkDestroyImage(logical_device_, color_image_, nullptr);
-  vkFreeMemory(logical_device_, color_image_memory_, nullptr);
-
-  // Depth image
-  vkDestroyImageView(logical_device_, depth_image_view_, nullptr);
-  vkDestroyImage(logical_device_, depth_image_, nullptr);
-  vkFreeMemory(logical_device_, depth_image_memory_, nullptr);
-
-  for(auto framebuffer : swapchain_frame_buffers_){
-    vkDestroyFramebuffer(logical_device_, framebuffer, nullptr);
+  for(auto& level : render_levels_){
+    // Msaa color and depth images
+    level.graph.cleanUp();
+
+    for(auto framebuffer : level.frame_buffers)
+      vkDestroyFramebuffer(logical_device_, framebuffer, nullptr);
+    level.frame_buffers.clear();
+    for(auto pipeline : level.pipelines)
+      vkDestroyPipeline(logical_device_, pipeline, nullptr);
+    level.pipelines.clear();
+    for(auto pipeline : level.sample_shading_pipelines)
+      vkDestroyPipeline(logical_device_, pipeline, nullptr);
+    level.sample_shading_pipelines.clear();
+    vkDestroyPipeline(logical_device_, level.depth_pipeline, nullptr);
+    level.depth_pipeline = VK_NULL_HANDLE;
+    vkDestroyRenderPass(logical_device_, level.render_pass, nullptr);
+    if(level.early_render_pass != VK_NULL_HANDLE){
+      for(auto framebuffer : level.early_frame_buffers)
+        vkDestroyFramebuffer(logical_device_, framebuffer, nullptr);
+      vkDestroyRenderPass(logical_device_, level.early_render_pass, nullptr);
+      level.early_frame_buffers.clear();
+      level.early_render_pass = VK_NULL_HANDLE;
+    }
   }
+  destroyHiZImage();
+  vkDestroyPipelineLayout(logical_device_, pipeline_layout_, nullptr);
 
-  for(size_t i = 0; i < swapchain_images_.size(); ++i){
-    vkDestroyBuffer(logical_device_, uniform_buffers_[i], nullptr);
-    vkFreeMemory(logical_device_, uniform_buffers_memory_[i], nullptr);
+  for(auto framebuffer : upscale_frame_buffers_){
+    vkDestroyFramebuffer(logical_device_, framebuffer, nullptr);
   }
-
-  vkDestroyDescriptorPool(logical_device_, descriptor_pool_, nullptr);
-  
-  vkFreeCommandBuffers(
-    logical_device_,
-    command_pool_,
-    static_cast<uint32_t>(command_buffers_.size()),
-    command_buffers_.data());
-
-  vkDestroyPipeline(logical_device_, graphics_pipeline_, nullptr);
-  vkDestroyPipelineLayout(logical_device_, pipeline_layout_, nullptr);
-  vkDestroyRenderPass(logical_device_, render_pass_, nullptr);
+  upscale_frame_buffers_.clear();
+  vkDestroyPipeline(logical_device_, upscale_pipeline_, nullptr);
+  vkDestroyRenderPass(logical_device_, upscale_pass_, nullptr);
+  upscale_pipeline_ = VK_NULL_HANDLE;
+  upscale_pass_ = VK_NULL_HANDLE;
 
   for(auto imgview: swapchain_imgviews_){
     vkDestroyImageView(logical_device_, imgview, nullptr);
@@ -1359,36 +2635,351 @@ void VulkanApp::frameBufferResizeCallback(
   app->frame_buffer_resized_ = true;
 }
 
-void VulkanApp::createVertexBuffer(){
-  auto buff_size = sizeof(vertices_[0]) * vertices_.size();
+void VulkanApp::keyCallback(GLFWwindow* window, int key, int scancode,
+  int action, int mods){
+  if(action != GLFW_PRESS) return;
+
+  auto app = reinterpret_cast<VulkanApp*>(glfwGetWindowUserPointer(window));
+  switch(key){
+    case GLFW_KEY_F1:
+      app->requested_present_policy_ = PresentPolicy::LowLatency;
+      break;
+    case GLFW_KEY_F2:
+      app->requested_present_policy_ = PresentPolicy::PowerSaving;
+      break;
+    case GLFW_KEY_F3:
+      app->requested_present_policy_ = PresentPolicy::FifoRelaxed;
+      break;
+    default:
+      break;
+  }
+}
+
+void VulkanApp::mouseButtonCallback(GLFWwindow* window, int button,
+  int action, int mods){
+  if(button != GLFW_MOUSE_BUTTON_LEFT || action != GLFW_PRESS) return;
+
+  auto app = reinterpret_cast<VulkanApp*>(glfwGetWindowUserPointer(window));
+  double x = 0.0, y = 0.0;
+  glfwGetCursorPos(window, &x, &y);
+  app->requested_pick_ = glm::vec2(x, y);
+}
+
+void VulkanApp::pick(const glm::vec2& cursor){
+  int width = 0, height = 0;
+  glfwGetWindowSize(window_, &width, &height);
+  if(model_bvh_.empty() || width == 0 || height == 0) return;
+
+  // Cursor on the near and far planes. The projection flips y, so ndc y
+  // grows downward like the cursor's.
+  const glm::mat4 inv_view_proj = glm::inverse(proj_*view_);
+  const float x = 2.0f*cursor.x/width - 1.0f;
+  const float y = 2.0f*cursor.y/height - 1.0f;
+  glm::vec4 near_point = inv_view_proj*glm::vec4(x, y, 0.0f, 1.0f);
+  glm::vec4 far_point = inv_view_proj*glm::vec4(x, y, 1.0f, 1.0f);
+  const glm::vec3 origin = glm::vec3(near_point)/near_point.w;
+  const glm::vec3 direction = glm::vec3(far_point)/far_point.w - origin;
+
+  // Into each object's space without normalizing, t stays a fraction of
+  // the way to the far plane whatever the object's scale. Only the bvh of
+  // mesh 0 is built, objects drawn with another mesh are skipped.
+  uint32_t closest_obj = 0;
+  RayHit closest;
+  for(uint32_t obj : visible_objects_){
+    if(object_meshes_[obj] != 0) continue;
+    const glm::mat4 to_object = glm::inverse(
+      transforms_.world(object_nodes_[obj]));
+    Ray ray;
+    ray.origin = glm::vec3(to_object*glm::vec4(origin, 1.0f));
+    ray.direction = glm::vec3(to_object*glm::vec4(direction, 0.0f));
+    ray.t_max = closest.t;
+
+    RayHit hit = model_bvh_.intersect(ray);
+    if(hit.hit()){
+      closest = hit;
+      closest_obj = obj;
+    }
+  }
+
+  if(closest.hit()){
+    std::cout << "Picked object " << closest_obj << " triangle "
+      << closest.triangle << " at "
+      << glm::length(direction)*closest.t << " past the near plane"
+      << std::endl;
+  }else{
+    std::cout << "Picked nothing" << std::endl;
+  }
+}
 
-  // Create staging buffers for CPU side visiblity and a GPU buffer then
-  // transfer data from staging to GPU.
+void VulkanApp::applyPresentPolicy(PresentPolicy policy){
+  if(policy == settings_.present_policy) return;
+
+  settings_.present_policy = policy;
+  frame_pacer_.setPolicy(policy);
+
+  setFramesInFlight(policyFramesInFlight(policy, configured_frames_in_flight_));
+  recreateSwapChain();
+
+  std::cout << "Present policy: " << presentPolicyName(policy) << std::endl;
+}
+
+void VulkanApp::uploadMeshes(){
+  if(!meshes_.hasPending()) return;
+
+  // 16 bit indices while every mesh fits them
+  if(index_type_ == VK_INDEX_TYPE_UINT16 && !meshes_.fitsShortIndices()){
+    widenIndexBuffer();
+    index_type_ = VK_INDEX_TYPE_UINT32;
+  }
+  const VkDeviceSize index_size = index_type_ == VK_INDEX_TYPE_UINT16
+    ? sizeof(uint16_t) : sizeof(uint32_t);
+
+  const auto& pending = meshes_.pending();
+  const VkDeviceSize first_vertex = meshes_.pendingFirstVertex();
+  const VkDeviceSize first_index = meshes_.pendingFirstIndex();
+  const VkDeviceSize vertex_count = meshes_.pendingVertexCount();
+  const VkDeviceSize index_count = meshes_.pendingIndexCount();
+
+  // Ranges of the staging buffer, one after the other, and where they go.
+  // The new meshes go after everything already uploaded.
+  struct Upload {
+    VkDeviceSize bytes;
+    VkBuffer* buffer;
+    VkDeviceSize offset;
+  };
+  std::vector<Upload> uploads;
+  if(settings_.vertex_pulling){
+    // Compressed streams for the shader to fetch from, no vertex buffer
+    uploads.push_back({sizeof(glm::vec3) * vertex_count, &position_buffer_,
+      sizeof(glm::vec3) * first_vertex});
+    uploads.push_back({sizeof(PackedAttributes) * vertex_count,
+      &attribute_buffer_, sizeof(PackedAttributes) * first_vertex});
+    growGeometryBuffer(position_buffer_, position_buffer_memory_,
+      position_buffer_capacity_, uploads[0].offset + uploads[0].bytes,
+      uploads[0].offset, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    growGeometryBuffer(attribute_buffer_, attribute_buffer_memory_,
+      attribute_buffer_capacity_, uploads[1].offset + uploads[1].bytes,
+      uploads[1].offset, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  }else{
+    uploads.push_back({sizeof(Vertex) * vertex_count, &vertex_buffer_,
+      sizeof(Vertex) * first_vertex});
+    growGeometryBuffer(vertex_buffer_, vertex_buffer_memory_,
+      vertex_buffer_capacity_, uploads[0].offset + uploads[0].bytes,
+      uploads[0].offset, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+  }
+  const Upload index{index_size * index_count, &index_buffer_,
+    index_size * first_index};
+  growGeometryBuffer(index_buffer_, index_buffer_memory_,
+    index_buffer_capacity_, index.offset + index.bytes, index.offset,
+    VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+  uploads.push_back(index);
+
+  VkDeviceSize staging_bytes = 0;
+  for(const auto& upload : uploads) staging_bytes += upload.bytes;
+
+  // Create staging buffers for CPU side visiblity, one for every range,
+  // then transfer data from staging to GPU.
   VkBuffer staging_buffer;
   VkDeviceMemory staging_buffer_memory;
-  createBuffer(buff_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+  createBuffer(staging_bytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
     staging_buffer, staging_buffer_memory);
 
   void* data;
-  // Map vertex buffer memory on gpu to cpu accessible memory
-  vkMapMemory(logical_device_, staging_buffer_memory, 0, buff_size, 0, &data);
+  vkMapMemory(logical_device_, staging_buffer_memory, 0, staging_bytes, 0,
+    &data);
+  char* vertex_data = static_cast<char*>(data);
+  char* index_data = vertex_data + staging_bytes - index.bytes;
+
+  // Encoded meshes are decoded straight into the staging memory
+  VertexStreams streams;
+  std::vector<Vertex> decoded;
+  std::vector<Vertex> reloaded_vertices;
+  std::vector<uint32_t> reloaded_indices;
+  for(const auto& mesh : pending){
+    const MeshEntry& entry = meshes_.mesh(mesh.id);
+    const VkDeviceSize vertex = entry.vertex_offset - first_vertex;
+    const VkDeviceSize first = entry.first_index - first_index;
+    const std::vector<Vertex>* vertices = &mesh.vertices;
+    const std::vector<uint32_t>* indices = &mesh.indices;
+
+    if(mesh.encoded){
+      try{
+        Vertex* out = reinterpret_cast<Vertex*>(vertex_data) + vertex;
+        if(settings_.vertex_pulling){
+          decoded.resize(entry.vertex_count);
+          out = decoded.data();
+        }
+        decodeVertices(*mesh.encoded, out);
+        decodeIndices(*mesh.encoded, index_data + index_size*first,
+          static_cast<uint32_t>(index_size));
+        if(settings_.vertex_pulling) streams.append(decoded);
+        continue;
+      }catch(const std::exception& e){
+        // Only the model is kept encoded. Staged as given from here on.
+        std::cerr << e.what() << ", parsing the obj instead" << std::endl;
+        reloadModelObj(*mesh.encoded, reloaded_vertices, reloaded_indices);
+        vertices = &reloaded_vertices;
+        indices = &reloaded_indices;
+      }
+    }
 
-  // Copy vertex data to buffer
-  memcpy(data, vertices_.data(), (size_t)buff_size);
-  vkUnmapMemory(logical_device_, staging_buffer_memory);
+    if(settings_.vertex_pulling){
+      // Split into the streams, staged once they're all there
+      streams.append(*vertices);
+    }else{
+      memcpy(reinterpret_cast<Vertex*>(vertex_data) + vertex,
+        vertices->data(), sizeof(Vertex) * vertices->size());
+    }
 
-  // Vertex buffer local on the GPU. cannot use vkMapMemory on device memory
-  createBuffer(buff_size,
-    VK_BUFFER_USAGE_VERTEX_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-    vertex_buffer_, vertex_buffer_memory_);
+    if(index_type_ == VK_INDEX_TYPE_UINT16){
+      uint16_t* out = reinterpret_cast<uint16_t*>(index_data) + first;
+      for(uint32_t idx : *indices) *out++ = static_cast<uint16_t>(idx);
+    }else{
+      memcpy(reinterpret_cast<uint32_t*>(index_data) + first,
+        indices->data(), sizeof(uint32_t) * indices->size());
+    }
+  }
+  if(settings_.vertex_pulling){
+    memcpy(vertex_data, streams.positions.data(), (size_t)uploads[0].bytes);
+    memcpy(vertex_data + uploads[0].bytes, streams.attributes.data(),
+      (size_t)uploads[1].bytes);
+  }
+  vkUnmapMemory(logical_device_, staging_buffer_memory);
 
-  copyBuffer(staging_buffer, vertex_buffer_, buff_size);
+  // Buffers are grown by now, copy into the current ones
+  VkDeviceSize staging_offset = 0;
+  for(const auto& upload : uploads){
+    copyBuffer(staging_buffer, *upload.buffer, upload.bytes, staging_offset,
+      upload.offset);
+    staging_offset += upload.bytes;
+  }
 
   // clean up staging buffer
   vkDestroyBuffer(logical_device_, staging_buffer, nullptr);
-  vkFreeMemory(logical_device_, staging_buffer_memory, nullptr);
+  freeMemory(staging_buffer_memory);
+
+  meshes_.clearPending();
+}
+
+void VulkanApp::widenIndexBuffer(){
+  // Nothing uploaded yet, the next upload makes them 32 bit already
+  const VkDeviceSize count = meshes_.pendingFirstIndex();
+  if(index_buffer_ == VK_NULL_HANDLE || count == 0) return;
+
+  VkBuffer readback;
+  VkDeviceMemory readback_memory;
+  createBuffer(count*sizeof(uint32_t),
+    VK_BUFFER_USAGE_TRANSFER_SRC_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    readback, readback_memory);
+  copyBuffer(index_buffer_, readback, count*sizeof(uint16_t), 0, 0);
+
+  // In place, back to front so no index is overwritten before it's read
+  void* data;
+  vkMapMemory(logical_device_, readback_memory, 0, count*sizeof(uint32_t), 0,
+    &data);
+  char* bytes = static_cast<char*>(data);
+  for(VkDeviceSize i = count; i-- > 0;){
+    uint16_t narrow;
+    memcpy(&narrow, bytes + i*sizeof(uint16_t), sizeof(narrow));
+    uint32_t wide = narrow;
+    memcpy(bytes + i*sizeof(uint32_t), &wide, sizeof(wide));
+  }
+  vkUnmapMemory(logical_device_, readback_memory);
+
+  // A fresh buffer, the old capacity was counted in 16 bit indices
+  retireBuffer(index_buffer_, index_buffer_memory_);
+  index_buffer_ = VK_NULL_HANDLE;
+  index_buffer_capacity_ = 0;
+  growGeometryBuffer(index_buffer_, index_buffer_memory_,
+    index_buffer_capacity_, count*sizeof(uint32_t), 0,
+    VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+  copyBuffer(readback, index_buffer_, count*sizeof(uint32_t), 0, 0);
+
+  vkDestroyBuffer(logical_device_, readback, nullptr);
+  freeMemory(readback_memory);
+}
+
+void VulkanApp::growGeometryBuffer(VkBuffer& buffer, VkDeviceMemory& memory,
+  VkDeviceSize& capacity, VkDeviceSize required, VkDeviceSize used,
+  VkBufferUsageFlags usage){
+  if(required <= capacity) return;
+
+  // Double so appending meshes one by one doesn't reallocate every time
+  VkDeviceSize new_capacity = std::max({required, capacity*2,
+    MIN_GEOMETRY_BUFFER_SIZE});
+
+  // Buffer local on the GPU. Transfer src so it can be copied when it grows
+  VkBuffer new_buffer;
+  VkDeviceMemory new_memory;
+  createBuffer(new_capacity,
+    usage|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, new_buffer, new_memory);
+
+  if(buffer != VK_NULL_HANDLE){
+    if(used > 0) copyBuffer(buffer, new_buffer, used);
+    // Frames in flight may still be drawing from the old one
+    retireBuffer(buffer, memory);
+  }
+
+  buffer = new_buffer;
+  memory = new_memory;
+  capacity = new_capacity;
+}
+
+void VulkanApp::retireBuffer(VkBuffer buffer, VkDeviceMemory memory){
+  retired_buffers_.push_back({frame_scheduler_.lastSignalValue(), buffer,
+    memory});
+}
+
+void VulkanApp::destroyRetiredBuffers(uint64_t completed_value){
+  size_t kept = 0;
+  for(const auto& retired : retired_buffers_){
+    if(retired.value <= completed_value){
+      vkDestroyBuffer(logical_device_, retired.buffer, nullptr);
+      freeMemory(retired.memory);
+    }else{
+      retired_buffers_[kept++] = retired;
+    }
+  }
+  retired_buffers_.resize(kept);
+}
+
+VkDescriptorSet VulkanApp::vertexStreamSet(){
+  VkDescriptorSet set = allocateFrameDescriptorSet(vertex_stream_layout_);
+
+  // Without skinned instances nothing reads binding 2, it still needs a
+  // buffer
+  VkBuffer interleaved = skinned_vertex_buffer_ != VK_NULL_HANDLE
+    ? skinned_vertex_buffer_ : position_buffer_;
+  std::array<VkDescriptorBufferInfo, 3> buffer_infos{};
+  buffer_infos[0] = {position_buffer_, 0, VK_WHOLE_SIZE};
+  buffer_infos[1] = {attribute_buffer_, 0, VK_WHOLE_SIZE};
+  buffer_infos[2] = {interleaved, 0, VK_WHOLE_SIZE};
+
+  std::array<VkWriteDescriptorSet, 3> writes{};
+  for(uint32_t i = 0; i < writes.size(); ++i){
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = set;
+    writes[i].dstBinding = i;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[i].pBufferInfo = &buffer_infos[i];
+  }
+  vkUpdateDescriptorSets(logical_device_,
+    static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+  return set;
+}
+
+VkPipelineStageFlags VulkanApp::vertexReadStage() const{
+  return settings_.vertex_pulling ? VK_PIPELINE_STAGE_VERTEX_SHADER_BIT
+    : VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+}
+
+VkAccessFlags VulkanApp::vertexReadAccess() const{
+  return settings_.vertex_pulling ? VK_ACCESS_SHADER_READ_BIT
+    : VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
 }
 
 uint32_t VulkanApp::findMemoryType(
@@ -1430,8 +3021,7 @@ void VulkanApp::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage_flags,
   mem_alloc_info.memoryTypeIndex =
     findMemoryType(mem_req.memoryTypeBits, mem_prop_flags);
   
-  if(vkAllocateMemory(logical_device_, &mem_alloc_info, nullptr, &buffer_memory) 
-    != VK_SUCCESS){
+  if(allocateMemory(mem_alloc_info, buffer_memory) != VK_SUCCESS){
     throw std::runtime_error("Failed to allocate vertex buffer memory");
   }
 
@@ -1439,50 +3029,756 @@ void VulkanApp::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage_flags,
   vkBindBufferMemory(logical_device_, buffer, buffer_memory, 0);
 }
 
+VkResult VulkanApp::allocateMemory(const VkMemoryAllocateInfo& alloc_info,
+  VkDeviceMemory& memory){
+  VkResult result = vkAllocateMemory(logical_device_, &alloc_info, nullptr,
+    &memory);
+  if(result == VK_SUCCESS){
+    allocation_sizes_[memory] = alloc_info.allocationSize;
+    allocated_bytes_ += alloc_info.allocationSize;
+    peak_allocated_bytes_ = std::max(peak_allocated_bytes_, allocated_bytes_);
+  }
+  return result;
+}
+
+void VulkanApp::freeMemory(VkDeviceMemory memory){
+  auto it = allocation_sizes_.find(memory);
+  if(it != allocation_sizes_.end()){
+    allocated_bytes_ -= it->second;
+    allocation_sizes_.erase(it);
+  }
+  vkFreeMemory(logical_device_, memory, nullptr);
+}
+
 void VulkanApp::copyBuffer(VkBuffer src_buff, VkBuffer dst_buff,
-    VkDeviceSize size){
+    VkDeviceSize size, VkDeviceSize src_offset, VkDeviceSize dst_offset){
   // Data transfer between memory buffers go through command buffers.
   // Create transient command pool for this purpose.
-  VkCommandBuffer command_buffer =  beginSingleTimeCommands();
+  VkCommandBuffer command_buffer =  beginSingleTimeCommands("copy buffer");
 
   VkBufferCopy copy_region{};
-  copy_region.srcOffset = 0;
-  copy_region.dstOffset = 0;
+  copy_region.srcOffset = src_offset;
+  copy_region.dstOffset = dst_offset;
   copy_region.size = size;
   vkCmdCopyBuffer(command_buffer, src_buff, dst_buff, 1, &copy_region);
 
   endSingleTimeCommands(command_buffer);
 }
 
-void VulkanApp::createIndexBuffer(){
-  VkDeviceSize buff_size = sizeof(indices_[0]) * indices_.size();
-
-  // Create staging buffer
+void VulkanApp::createDeviceLocalBuffer(const void* data, VkDeviceSize size,
+  VkBufferUsageFlags usage, VkBuffer& buffer, VkDeviceMemory& memory,
+  AsyncQueue* consumer){
   VkBuffer staging_buffer;
   VkDeviceMemory staging_buffer_memory;
-  createBuffer(buff_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+  createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
     staging_buffer, staging_buffer_memory);
 
-  void *data;
-  vkMapMemory(logical_device_, staging_buffer_memory, 0, buff_size, 0, &data);
-  memcpy(data, indices_.data(), (size_t)buff_size);
+  void* mapped;
+  vkMapMemory(logical_device_, staging_buffer_memory, 0, size, 0, &mapped);
+  memcpy(mapped, data, (size_t)size);
   vkUnmapMemory(logical_device_, staging_buffer_memory);
 
-  createBuffer(buff_size,
-    VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, index_buffer_, index_buffer_memory_);
+  createBuffer(size, usage|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, memory);
+
+  // Copy on the transfer queue, then give the buffer to its user. Exclusive
+  // sharing, so across families it takes a release and an acquire.
+  const uint32_t dst_family = consumer != nullptr ? consumer->family()
+    : queue_families_.graphics_family.value();
 
-  copyBuffer(staging_buffer, index_buffer_, buff_size);
+  VkCommandBuffer transfer_cb = transfer_queue_.beginCommands();
+  VkBufferCopy copy_region{};
+  copy_region.size = size;
+  vkCmdCopyBuffer(transfer_cb, staging_buffer, buffer, 1, &copy_region);
+  releaseBuffer(transfer_cb, buffer, 0, size, transfer_queue_.family(),
+    dst_family, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+  const uint64_t copied = transfer_queue_.submit(transfer_cb);
+
+  // The acquire makes the copy visible to every later use of the buffer
+  VkPipelineStageFlags use_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+  VkAccessFlags use_access = VK_ACCESS_MEMORY_READ_BIT;
+  if(dst_family == transfer_queue_.family()){
+    transfer_queue_.wait(copied);
+  }else if(consumer != nullptr){
+    VkCommandBuffer acquire_cb = consumer->beginCommands();
+    acquireBuffer(acquire_cb, buffer, 0, size, transfer_queue_.family(),
+      dst_family, use_stage, use_access);
+    consumer->wait(consumer->submit(acquire_cb,
+      {transfer_queue_.after(copied, use_stage)}));
+  }else{
+    VkCommandBuffer acquire_cb = beginSingleTimeCommands("acquire buffer");
+    acquireBuffer(acquire_cb, buffer, 0, size, transfer_queue_.family(),
+      dst_family, use_stage, use_access);
+    endSingleTimeCommands(acquire_cb,
+      {transfer_queue_.after(copied, use_stage)});
+  }
 
   vkDestroyBuffer(logical_device_, staging_buffer, nullptr);
-  vkFreeMemory(logical_device_, staging_buffer_memory, nullptr);
+  freeMemory(staging_buffer_memory);
+}
+
+void VulkanApp::createSkinnedMesh(){
+  if(settings_.skinned_instances == 0) return;
+  skinned_mesh_ = createSkinnedTube(std::max(2u, settings_.skinned_joints),
+    SKINNED_RINGS_PER_JOINT, SKINNED_SEGMENTS);
+}
+
+void VulkanApp::createSkinningResources(){
+  if(settings_.skinned_instances == 0) return;
+  const auto& mesh = skinned_mesh_;
+
+  // Static inputs, read by the shader every frame on the compute queue
+  createDeviceLocalBuffer(mesh.vertices.data(),
+    sizeof(mesh.vertices[0])*mesh.vertices.size(),
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, skin_bind_pose_buffer_,
+    skin_bind_pose_memory_, &compute_queue_);
+  createDeviceLocalBuffer(mesh.skin.data(),
+    sizeof(mesh.skin[0])*mesh.skin.size(),
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, skin_weights_buffer_,
+    skin_weights_memory_, &compute_queue_);
+  createDeviceLocalBuffer(mesh.indices.data(),
+    sizeof(mesh.indices[0])*mesh.indices.size(),
+    VK_BUFFER_USAGE_INDEX_BUFFER_BIT, skin_index_buffer_, skin_index_memory_);
+
+  // Bind pose, weights, palette, skinned output
+  std::array<VkDescriptorSetLayoutBinding, 4> bindings{};
+  for(uint32_t i = 0; i < bindings.size(); ++i){
+    bindings[i].binding = i;
+    bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[i].descriptorCount = 1;
+    bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+
+  VkDescriptorSetLayoutCreateInfo layout_info{};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.bindingCount = static_cast<uint32_t>(bindings.size());
+  layout_info.pBindings = bindings.data();
+  skinning_set_layout_ =
+    descriptor_layout_cache_.createDescriptorLayout(layout_info);
+
+  if(!descriptor_allocator_.allocate(skinning_set_layout_, skinning_set_)){
+    throw std::runtime_error("Failed to create skinning descriptor set");
+  }
+
+  std::array<VkDescriptorBufferInfo, 2> buffer_infos{};
+  buffer_infos[0] = {skin_bind_pose_buffer_, 0, VK_WHOLE_SIZE};
+  buffer_infos[1] = {skin_weights_buffer_, 0, VK_WHOLE_SIZE};
+
+  std::array<VkWriteDescriptorSet, 2> writes{};
+  for(uint32_t i = 0; i < writes.size(); ++i){
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = skinning_set_;
+    writes[i].dstBinding = i;
+    writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[i].descriptorCount = 1;
+    writes[i].pBufferInfo = &buffer_infos[i];
+  }
+  vkUpdateDescriptorSets(logical_device_,
+    static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+
+  // Palette and skinned vertex bindings are written here
+  createSkinFrameResources();
+
+  // vertex_count, joint_count, instance_count, first_joint, first_vertex
+  VkPushConstantRange push_range{};
+  push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_range.offset = 0;
+  push_range.size = 5*sizeof(uint32_t);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_ci{};
+  pipeline_layout_ci.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_ci.setLayoutCount = 1;
+  pipeline_layout_ci.pSetLayouts = &skinning_set_layout_;
+  pipeline_layout_ci.pushConstantRangeCount = 1;
+  pipeline_layout_ci.pPushConstantRanges = &push_range;
+
+  if(vkCreatePipelineLayout(logical_device_, &pipeline_layout_ci, nullptr,
+    &skinning_pipeline_layout_) != VK_SUCCESS){
+    throw std::runtime_error("Failed to create skinning pipeline layout");
+  }
+
+  VkShaderModule shader_module = createShaderModule(skinning_shader_code_);
+
+  VkComputePipelineCreateInfo pipeline_ci{};
+  pipeline_ci.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_ci.stage.sType =
+    VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_ci.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_ci.stage.module = shader_module;
+  pipeline_ci.stage.pName = "main";
+  pipeline_ci.layout = skinning_pipeline_layout_;
+
+  if(vkCreateComputePipelines(logical_device_, VK_NULL_HANDLE, 1,
+    &pipeline_ci, nullptr, &skinning_pipeline_) != VK_SUCCESS){
+    throw std::runtime_error("Failed to create skinning pipeline");
+  }
+
+  vkDestroyShaderModule(logical_device_, shader_module, nullptr);
+}
+
+void VulkanApp::createSkinFrameResources(){
+  VkDeviceSize size = sizeof(glm::mat4)
+    * skinned_mesh_.skeleton.jointCount() * settings_.skinned_instances
+    * settings_.frames_in_flight;
+
+  // Written by the cpu every frame, mapped for as long as it lives
+  createBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    skin_palette_buffer_, skin_palette_memory_);
+
+  void* data;
+  vkMapMemory(logical_device_, skin_palette_memory_, 0, size, 0, &data);
+  skin_palette_mapped_ = static_cast<glm::mat4*>(data);
+
+  // Written by the shader, read as vertices (or pulled). A copy of the
+  // mesh per instance in every slot.
+  skinned_slot_bytes_ = sizeof(Vertex) * skinned_mesh_.vertices.size()
+    * settings_.skinned_instances;
+  createBuffer(skinned_slot_bytes_*settings_.frames_in_flight,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, skinned_vertex_buffer_,
+    skinned_vertex_memory_);
+  // New buffer, no queue owns it yet
+  skinned_slot_released_.assign(settings_.frames_in_flight, false);
+
+  std::array<VkDescriptorBufferInfo, 2> buffer_infos{};
+  buffer_infos[0] = {skin_palette_buffer_, 0, VK_WHOLE_SIZE};
+  buffer_infos[1] = {skinned_vertex_buffer_, 0, VK_WHOLE_SIZE};
+
+  std::array<VkWriteDescriptorSet, 2> writes{};
+  for(uint32_t i = 0; i < writes.size(); ++i){
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = skinning_set_;
+    writes[i].dstBinding = 2 + i;
+    writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[i].descriptorCount = 1;
+    writes[i].pBufferInfo = &buffer_infos[i];
+  }
+  vkUpdateDescriptorSets(logical_device_,
+    static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+}
+
+void VulkanApp::destroySkinFrameResources(){
+  if(skin_palette_buffer_ == VK_NULL_HANDLE) return;
+
+  vkUnmapMemory(logical_device_, skin_palette_memory_);
+  vkDestroyBuffer(logical_device_, skin_palette_buffer_, nullptr);
+  freeMemory(skin_palette_memory_);
+  skin_palette_buffer_ = VK_NULL_HANDLE;
+  skin_palette_mapped_ = nullptr;
+
+  vkDestroyBuffer(logical_device_, skinned_vertex_buffer_, nullptr);
+  freeMemory(skinned_vertex_memory_);
+  skinned_vertex_buffer_ = VK_NULL_HANDLE;
+}
+
+void VulkanApp::cleanUpSkinning(){
+  if(settings_.skinned_instances == 0) return;
+
+  vkDestroyPipeline(logical_device_, skinning_pipeline_, nullptr);
+  vkDestroyPipelineLayout(logical_device_, skinning_pipeline_layout_, nullptr);
+
+  destroySkinFrameResources();
+
+  // Set layout is owned by the cache, the set by the allocator
+  std::pair<VkBuffer, VkDeviceMemory> buffers[] = {
+    {skin_bind_pose_buffer_, skin_bind_pose_memory_},
+    {skin_weights_buffer_, skin_weights_memory_},
+    {skin_index_buffer_, skin_index_memory_}};
+  for(auto& buffer : buffers){
+    vkDestroyBuffer(logical_device_, buffer.first, nullptr);
+    freeMemory(buffer.second);
+  }
+}
+
+void VulkanApp::updateSkinPalette(uint32_t frame){
+  if(settings_.skinned_instances == 0) return;
+  VA_TRACE_SCOPE("updateSkinPalette");
+
+  const Skeleton& skeleton = skinned_mesh_.skeleton;
+  const uint32_t joints = skeleton.jointCount();
+  glm::mat4* slot = skin_palette_mapped_
+    + static_cast<size_t>(frame)*settings_.skinned_instances*joints;
+  const float time = animationTime();
+
+  thread_pool_.parallelFor(settings_.skinned_instances, 256,
+    [&](size_t begin, size_t end){
+      // Posing reads parents back, don't do that from mapped
+      // (uncached, write combined) memory.
+      std::vector<glm::mat4> pose(joints);
+      for(size_t i = begin; i < end; ++i){
+        poseSway(skeleton, time, 0.7f*i, pose.data());
+        memcpy(slot + i*joints, pose.data(), sizeof(glm::mat4)*joints);
+      }
+    });
+}
+
+uint64_t VulkanApp::submitSkinning(uint32_t frame){
+  if(settings_.skinned_instances == 0) return 0;
+  VA_TRACE_SCOPE("skinning");
+
+  const uint32_t graphics_family = queue_families_.graphics_family.value();
+  const VkDeviceSize slot_offset = frame*skinned_slot_bytes_;
+  VkCommandBuffer command_buffer = compute_queue_.beginCommands();
+
+  // Graphics gave the slot back after its last draws. The submit waits for
+  // them, the vertices are only overwritten, so no access to make visible.
+  if(skinned_slot_released_[frame]){
+    acquireBuffer(command_buffer, skinned_vertex_buffer_, slot_offset,
+      skinned_slot_bytes_, graphics_family, compute_queue_.family(),
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0);
+  }
+
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+    skinning_pipeline_);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+    skinning_pipeline_layout_, 0, 1, &skinning_set_, 0, nullptr);
+
+  const uint32_t vertex_count =
+    static_cast<uint32_t>(skinned_mesh_.vertices.size());
+  const uint32_t joint_count = skinned_mesh_.skeleton.jointCount();
+  const uint32_t params[5] = {vertex_count, joint_count,
+    settings_.skinned_instances,
+    frame*settings_.skinned_instances*joint_count,
+    frame*settings_.skinned_instances*vertex_count};
+  vkCmdPushConstants(command_buffer, skinning_pipeline_layout_,
+    VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), params);
+
+  // 64 wide workgroups along the vertices, one row per instance
+  vkCmdDispatch(command_buffer, (vertex_count + 63)/64,
+    settings_.skinned_instances, 1);
+
+  // Over to graphics, which acquires it before the frame's draws
+  releaseBuffer(command_buffer, skinned_vertex_buffer_, slot_offset,
+    skinned_slot_bytes_, compute_queue_.family(), graphics_family,
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+
+  // Last frame drawn from this slot. Already waited for on the cpu, but the
+  // acquire has to come after the release on the gpu too.
+  std::vector<QueueWait> waits;
+  if(frame_scheduler_.slotValue() > 0){
+    waits.push_back({frame_scheduler_.timeline(), frame_scheduler_.slotValue(),
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT});
+  }
+  return compute_queue_.submit(command_buffer, waits);
+}
+
+void VulkanApp::createCullResources(){
+  if(!occlusion_culling_) return;
+
+  // Objects, draws, stats, then the hi-z pyramid
+  std::array<VkDescriptorSetLayoutBinding, 4> cull_bindings{};
+  for(uint32_t i = 0; i < cull_bindings.size(); ++i){
+    cull_bindings[i].binding = i;
+    cull_bindings[i].descriptorType = i < 3
+      ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+      : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    cull_bindings[i].descriptorCount = 1;
+    cull_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+
+  VkDescriptorSetLayoutCreateInfo layout_info{};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.bindingCount = static_cast<uint32_t>(cull_bindings.size());
+  layout_info.pBindings = cull_bindings.data();
+  cull_set_layout_ =
+    descriptor_layout_cache_.createDescriptorLayout(layout_info);
+
+  // Depth (level 0 only) or the level above, then the level written
+  std::array<VkDescriptorSetLayoutBinding, 3> hiz_bindings{};
+  for(uint32_t i = 0; i < hiz_bindings.size(); ++i){
+    hiz_bindings[i].binding = i;
+    hiz_bindings[i].descriptorType = i == 0
+      ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+      : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    hiz_bindings[i].descriptorCount = 1;
+    hiz_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+  layout_info.bindingCount = static_cast<uint32_t>(hiz_bindings.size());
+  layout_info.pBindings = hiz_bindings.data();
+  hiz_set_layout_ =
+    descriptor_layout_cache_.createDescriptorLayout(layout_info);
+
+  // view_proj, hiz_size, object_count, phase, hiz_levels, frame
+  VkPushConstantRange cull_range{};
+  cull_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  cull_range.offset = 0;
+  cull_range.size = sizeof(glm::mat4) + 6*sizeof(uint32_t);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_ci{};
+  pipeline_layout_ci.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_ci.setLayoutCount = 1;
+  pipeline_layout_ci.pSetLayouts = &cull_set_layout_;
+  pipeline_layout_ci.pushConstantRangeCount = 1;
+  pipeline_layout_ci.pPushConstantRanges = &cull_range;
+  if(vkCreatePipelineLayout(logical_device_, &pipeline_layout_ci, nullptr,
+    &cull_pipeline_layout_) != VK_SUCCESS){
+    throw std::runtime_error("Failed to create cull pipeline layout");
+  }
+
+  // src_size, dst_size, samples
+  VkPushConstantRange hiz_range{};
+  hiz_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  hiz_range.offset = 0;
+  hiz_range.size = 5*sizeof(int32_t);
+
+  pipeline_layout_ci.pSetLayouts = &hiz_set_layout_;
+  pipeline_layout_ci.pPushConstantRanges = &hiz_range;
+  if(vkCreatePipelineLayout(logical_device_, &pipeline_layout_ci, nullptr,
+    &hiz_pipeline_layout_) != VK_SUCCESS){
+    throw std::runtime_error("Failed to create hi-z pipeline layout");
+  }
+
+  // All four in one call
+  const std::vector<char>* codes[] = {&cull_shader_code_, &hiz_depth_code_,
+    &hiz_depth_ms_code_, &hiz_reduce_code_};
+  std::array<VkShaderModule, 4> modules{};
+  std::array<VkComputePipelineCreateInfo, 4> pipeline_cis{};
+  for(uint32_t i = 0; i < pipeline_cis.size(); ++i){
+    modules[i] = createShaderModule(*codes[i]);
+    pipeline_cis[i].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_cis[i].stage.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_cis[i].stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_cis[i].stage.module = modules[i];
+    pipeline_cis[i].stage.pName = "main";
+    pipeline_cis[i].layout = i == 0 ? cull_pipeline_layout_
+      : hiz_pipeline_layout_;
+  }
+
+  std::array<VkPipeline, 4> pipelines{};
+  if(vkCreateComputePipelines(logical_device_, VK_NULL_HANDLE,
+    static_cast<uint32_t>(pipeline_cis.size()), pipeline_cis.data(), nullptr,
+    pipelines.data()) != VK_SUCCESS){
+    throw std::runtime_error("Failed to create culling pipelines");
+  }
+  cull_pipeline_ = pipelines[0];
+  hiz_depth_pipeline_ = pipelines[1];
+  hiz_depth_ms_pipeline_ = pipelines[2];
+  hiz_reduce_pipeline_ = pipelines[3];
+  for(auto module : modules)
+    vkDestroyShaderModule(logical_device_, module, nullptr);
+
+  // Shaders only texelFetch, filtering never applies
+  VkSamplerCreateInfo sampler_ci{};
+  sampler_ci.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_ci.magFilter = VK_FILTER_NEAREST;
+  sampler_ci.minFilter = VK_FILTER_NEAREST;
+  sampler_ci.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_ci.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_ci.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_ci.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_ci.maxLod = VK_LOD_CLAMP_NONE;
+  if(vkCreateSampler(logical_device_, &sampler_ci, nullptr, &hiz_sampler_)
+    != VK_SUCCESS){
+    throw std::runtime_error("Failed to create hi-z sampler.");
+  }
+
+  createCullFrameResources();
+}
+
+void VulkanApp::createCullFrameResources(){
+  const VkDeviceSize objects = std::max(settings_.object_count, 1u);
+  const VkDeviceSize frames = settings_.frames_in_flight;
+
+  // Written by the cpu every frame, mapped for as long as it lives
+  VkDeviceSize size = sizeof(CullObject)*objects*frames;
+  createBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    cull_object_buffer_, cull_object_memory_);
+  void* data;
+  vkMapMemory(logical_device_, cull_object_memory_, 0, size, 0, &data);
+  cull_objects_mapped_ = static_cast<CullObject*>(data);
+
+  // Written and read only by the gpu, an early and a late draw per object
+  createBuffer(sizeof(VkDrawIndexedIndirectCommand)*2*objects*frames,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, cull_draw_buffer_,
+    cull_draw_memory_);
+
+  // Counted by the gpu, read and reset by the cpu
+  size = sizeof(uint32_t)*2*frames;
+  createBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    cull_stats_buffer_, cull_stats_memory_);
+  vkMapMemory(logical_device_, cull_stats_memory_, 0, size, 0, &data);
+  cull_stats_mapped_ = static_cast<uint32_t*>(data);
+  std::memset(cull_stats_mapped_, 0, size);
+}
+
+void VulkanApp::destroyCullFrameResources(){
+  if(cull_object_buffer_ == VK_NULL_HANDLE) return;
+
+  vkUnmapMemory(logical_device_, cull_object_memory_);
+  vkDestroyBuffer(logical_device_, cull_object_buffer_, nullptr);
+  freeMemory(cull_object_memory_);
+  cull_object_buffer_ = VK_NULL_HANDLE;
+  cull_objects_mapped_ = nullptr;
+
+  vkDestroyBuffer(logical_device_, cull_draw_buffer_, nullptr);
+  freeMemory(cull_draw_memory_);
+  cull_draw_buffer_ = VK_NULL_HANDLE;
+
+  vkUnmapMemory(logical_device_, cull_stats_memory_);
+  vkDestroyBuffer(logical_device_, cull_stats_buffer_, nullptr);
+  freeMemory(cull_stats_memory_);
+  cull_stats_buffer_ = VK_NULL_HANDLE;
+  cull_stats_mapped_ = nullptr;
+}
+
+void VulkanApp::cleanUpCulling(){
+  if(!occlusion_culling_) return;
+
+  // Set layouts are owned by the cache
+  for(auto pipeline : {cull_pipeline_, hiz_depth_pipeline_,
+    hiz_depth_ms_pipeline_, hiz_reduce_pipeline_}){
+    vkDestroyPipeline(logical_device_, pipeline, nullptr);
+  }
+  vkDestroyPipelineLayout(logical_device_, cull_pipeline_layout_, nullptr);
+  vkDestroyPipelineLayout(logical_device_, hiz_pipeline_layout_, nullptr);
+  vkDestroySampler(logical_device_, hiz_sampler_, nullptr);
+
+  destroyCullFrameResources();
+}
+
+void VulkanApp::createHiZImage(){
+  const VkExtent2D extent = swapchain_img_extent_;
+  hiz_mips_ = static_cast<uint32_t>(
+    std::floor(std::log2(std::max(extent.width, extent.height)))) + 1;
+
+  createImage(extent.width, extent.height, VK_FORMAT_R32_SFLOAT,
+    VK_IMAGE_TILING_OPTIMAL,
+    VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, hiz_image_, hiz_memory_, hiz_mips_,
+    VK_SAMPLE_COUNT_1_BIT);
+
+  // Every level for culling, one at a time for building it
+  hiz_view_ = createImageView(hiz_image_, VK_FORMAT_R32_SFLOAT,
+    VK_IMAGE_ASPECT_COLOR_BIT, hiz_mips_);
+  hiz_mip_views_.resize(hiz_mips_);
+  for(uint32_t mip = 0; mip < hiz_mips_; ++mip){
+    VkImageViewCreateInfo ci{};
+    ci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    ci.image = hiz_image_;
+    ci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    ci.format = VK_FORMAT_R32_SFLOAT;
+    ci.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, mip, 1, 0, 1};
+    if(vkCreateImageView(logical_device_, &ci, nullptr, &hiz_mip_views_[mip])
+      != VK_SUCCESS){
+      throw std::runtime_error("Failed to create image view.");
+    }
+  }
+
+  // New image, nothing drawn into it yet
+  hiz_valid_ = false;
+}
+
+void VulkanApp::destroyHiZImage(){
+  if(hiz_image_ == VK_NULL_HANDLE) return;
+
+  for(auto view : hiz_mip_views_)
+    vkDestroyImageView(logical_device_, view, nullptr);
+  hiz_mip_views_.clear();
+  vkDestroyImageView(logical_device_, hiz_view_, nullptr);
+  vkDestroyImage(logical_device_, hiz_image_, nullptr);
+  freeMemory(hiz_memory_);
+  hiz_image_ = VK_NULL_HANDLE;
+  hiz_valid_ = false;
+}
+
+void VulkanApp::updateCullObjects(uint32_t frame){
+  if(!occlusion_culling_) return;
+  VA_TRACE_SCOPE("updateCullObjects");
+
+  CullObject* objects = cull_objects_mapped_ + frame*settings_.object_count;
+  for(uint32_t obj = 0; obj < settings_.object_count; ++obj){
+    const MeshEntry& mesh = meshes_.mesh(object_meshes_[obj]);
+    const glm::mat4& world = transforms_.world(object_nodes_[obj]);
+
+    // Sphere through the largest scale of the transform
+    float scale = std::max({glm::length(glm::vec3(world[0])),
+      glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2]))});
+    glm::vec3 center = glm::vec3(world*glm::vec4(mesh.center, 1.0f));
+    objects[obj] = {glm::vec4(center, mesh.radius*scale), mesh.index_count,
+      mesh.first_index, mesh.vertex_offset, 0};
+  }
+}
+
+void VulkanApp::createLights(){
+  light_paths_.clear();
+  if(settings_.light_count == 0) return;
+
+  // Seeded, every run lights the scene the same way
+  std::mt19937 rng(4321);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+  // Over the whole object grid and a little past its edge
+  const float half_extent = std::abs(objectPosition(0).x) + 1.5f;
+  const float pi = glm::radians(180.0f);
+
+  light_paths_.reserve(settings_.light_count);
+  for(uint32_t i = 0; i < settings_.light_count; ++i){
+    LightPath path;
+    path.center = glm::vec3((2.0f*unit(rng) - 1.0f)*half_extent,
+      (2.0f*unit(rng) - 1.0f)*half_extent, 0.2f + 1.3f*unit(rng));
+    path.orbit = 0.3f + 1.2f*unit(rng);
+    path.speed = (0.5f + unit(rng))*(unit(rng) < 0.5f ? -1.0f : 1.0f);
+    path.phase = 2.0f*pi*unit(rng);
+    path.radius = 1.0f + 1.5f*unit(rng);
+
+    // Saturated color from a random hue
+    const float hue = unit(rng);
+    auto channel = [hue](float shift){
+      float h = std::fmod(hue + shift, 1.0f);
+      return std::clamp(std::abs(h*6.0f - 3.0f) - 1.0f, 0.0f, 1.0f);
+    };
+    path.color = 1.5f*glm::vec3(channel(0.0f), channel(2.0f/3.0f),
+      channel(1.0f/3.0f));
+    light_paths_.push_back(path);
+  }
+}
+
+void VulkanApp::createLightBuffers(){
+  // Without lights the header alone, saying there are none, and the counts
+  const VkDeviceSize light_size = sizeof(LightHeader)
+    + sizeof(PointLight)*settings_.light_count;
+  const VkDeviceSize cluster_size = sizeof(uint32_t)*CLUSTER_COUNT
+    *(settings_.light_count > 0 ? 1 + MAX_CLUSTER_LIGHTS : 1);
+
+  light_buffers_.resize(settings_.frames_in_flight);
+  light_buffers_memory_.resize(settings_.frames_in_flight);
+  light_buffers_mapped_.resize(settings_.frames_in_flight);
+  cluster_buffers_.resize(settings_.frames_in_flight);
+  cluster_buffers_memory_.resize(settings_.frames_in_flight);
+
+  for(size_t i = 0; i < light_buffers_.size(); ++i){
+    // Written by the cpu every frame, mapped for as long as it lives
+    createBuffer(light_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+      light_buffers_[i], light_buffers_memory_[i]);
+    void* data;
+    vkMapMemory(logical_device_, light_buffers_memory_[i], 0, light_size, 0,
+      &data);
+    std::memset(data, 0, light_size);
+    light_buffers_mapped_[i] = static_cast<LightHeader*>(data);
+
+    createBuffer(cluster_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, cluster_buffers_[i],
+      cluster_buffers_memory_[i]);
+  }
+}
+
+void VulkanApp::createClusterPipeline(){
+  if(settings_.light_count == 0) return;
+
+  // The scene's set
+  VkPipelineLayoutCreateInfo pipeline_layout_ci{};
+  pipeline_layout_ci.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_ci.setLayoutCount = 1;
+  pipeline_layout_ci.pSetLayouts = &descriptor_layout_;
+  if(vkCreatePipelineLayout(logical_device_, &pipeline_layout_ci, nullptr,
+    &cluster_pipeline_layout_) != VK_SUCCESS){
+    throw std::runtime_error("Failed to create cluster pipeline layout");
+  }
+
+  VkShaderModule module = createShaderModule(cluster_shader_code_);
+  VkComputePipelineCreateInfo pipeline_ci{};
+  pipeline_ci.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_ci.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_ci.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_ci.stage.module = module;
+  pipeline_ci.stage.pName = "main";
+  pipeline_ci.layout = cluster_pipeline_layout_;
+
+  VkResult result = vkCreateComputePipelines(logical_device_, VK_NULL_HANDLE,
+    1, &pipeline_ci, nullptr, &cluster_pipeline_);
+  vkDestroyShaderModule(logical_device_, module, nullptr);
+  if(result != VK_SUCCESS){
+    throw std::runtime_error("Failed to create cluster pipeline");
+  }
+}
+
+void VulkanApp::updateLights(uint32_t frame){
+  if(settings_.light_count == 0) return;
+  VA_TRACE_SCOPE("updateLights");
+
+  const float time = animationTime();
+  PointLight* lights =
+    reinterpret_cast<PointLight*>(light_buffers_mapped_[frame] + 1);
+  for(uint32_t i = 0; i < settings_.light_count; ++i){
+    const LightPath& path = light_paths_[i];
+    float angle = path.phase + path.speed*time;
+    glm::vec3 world = path.center
+      + path.orbit*glm::vec3(std::cos(angle), std::sin(angle), 0.0f);
+    lights[i] = {glm::vec4(glm::vec3(view_*glm::vec4(world, 1.0f)),
+      path.radius), glm::vec4(path.color, 1.0f)};
+  }
+}
+
+void VulkanApp::recordLightBinning(VkCommandBuffer command_buffer){
+  const uint32_t frame = frame_scheduler_.frameIndex();
+
+  // Clusters follow the part of the targets drawn this frame
+  const float width = static_cast<float>(render_extent_.width);
+  const float height = static_cast<float>(render_extent_.height);
+  LightHeader* header = light_buffers_mapped_[frame];
+  header->inv_proj = glm::inverse(proj_);
+  header->grid = glm::uvec4(CLUSTERS_X, CLUSTERS_Y, CLUSTERS_Z,
+    settings_.light_count);
+  header->tile = glm::vec4(std::ceil(width/CLUSTERS_X),
+    std::ceil(height/CLUSTERS_Y), width, height);
+  header->depth = glm::vec4(near_plane_, far_plane_,
+    std::log(far_plane_/near_plane_), 0.0f);
+
+  auto scope = gpu_profiler_.beginScope(command_buffer, "light binning");
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+    cluster_pipeline_);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+    cluster_pipeline_layout_, 0, 1, &descriptor_sets_[frame], 0, nullptr);
+  vkCmdDispatch(command_buffer, (CLUSTER_COUNT + 127)/128, 1, 1);
+
+  // Light lists are read while shading the scene
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0,
+    nullptr);
+  gpu_profiler_.endScope(command_buffer, scope);
+}
+
+void VulkanApp::updateRenderQueue(){
+  VA_TRACE_SCOPE("updateRenderQueue");
+  render_queue_.clear();
+
+  // Pipeline by the material's shader variant. Skinned instances share a
+  // mesh id past the registry's.
+  const uint32_t skinned_mesh = static_cast<uint32_t>(meshes_.meshCount());
+  auto add = [&](uint32_t obj){
+    const bool skinned = obj >= settings_.object_count;
+    uint32_t mesh = skinned ? skinned_mesh : object_meshes_[obj];
+    glm::vec3 center = skinned ? glm::vec3(0.0f) : meshes_.mesh(mesh).center;
+    glm::vec4 view_pos = view_*transforms_.world(object_nodes_[obj])
+      *glm::vec4(center, 1.0f);
+    uint32_t material = skinned ? MATERIAL_VERTEX_COLOR : MATERIAL_TEXTURED;
+    render_queue_.add(RenderQueue::makeKey(material_variants_[material],
+      material, mesh, -view_pos.z/far_plane_), obj);
+  };
+  // Static objects outside the frustum never get a draw. Skinned instances
+  // aren't in the index.
+  for(uint32_t obj : visible_objects_) add(obj);
+  for(uint32_t obj = settings_.object_count; obj < sceneObjectCount(); ++obj)
+    add(obj);
+  render_queue_.sort(&thread_pool_);
 }
 
 void VulkanApp::createDescriptorSetLayout(){
   VkDescriptorSetLayoutBinding ubo_layout_binding{};
   // There can be an array of buffers, eg. one for each tf for model bones
   ubo_layout_binding.binding = 0;
+  // Camera only, per object data is pushed with each draw
   ubo_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
   ubo_layout_binding.descriptorCount = 1;
 
@@ -1499,8 +3795,20 @@ void VulkanApp::createDescriptorSetLayout(){
   sampler_layout_binding.pImmutableSamplers = nullptr;
   sampler_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
-  std::array<VkDescriptorSetLayoutBinding, 2> bindings = {
-    ubo_layout_binding, sampler_layout_binding
+  // Lights and their cluster lists, written by the binning pass
+  VkDescriptorSetLayoutBinding light_layout_binding{};
+  light_layout_binding.binding = 2;
+  light_layout_binding.descriptorCount = 1;
+  light_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  light_layout_binding.stageFlags =
+    VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+
+  VkDescriptorSetLayoutBinding cluster_layout_binding = light_layout_binding;
+  cluster_layout_binding.binding = 3;
+
+  std::array<VkDescriptorSetLayoutBinding, 4> bindings = {
+    ubo_layout_binding, sampler_layout_binding, light_layout_binding,
+    cluster_layout_binding
   };
 
   VkDescriptorSetLayoutCreateInfo layout_info{};
@@ -1508,17 +3816,31 @@ void VulkanApp::createDescriptorSetLayout(){
   layout_info.bindingCount = static_cast<uint32_t>(bindings.size());
   layout_info.pBindings = bindings.data();
 
-  if (vkCreateDescriptorSetLayout(logical_device_, &layout_info, nullptr,
-                                  &descriptor_layout_) != VK_SUCCESS) {
-    throw std::runtime_error("Failed to create descriptor set layout");
+  // Layout is owned by the cache, identical layouts get the same handle.
+  descriptor_layout_ =
+    descriptor_layout_cache_.createDescriptorLayout(layout_info);
+
+  if(!settings_.vertex_pulling) return;
+
+  // Positions, packed attributes, interleaved vertices
+  std::array<VkDescriptorSetLayoutBinding, 3> stream_bindings{};
+  for(uint32_t i = 0; i < stream_bindings.size(); ++i){
+    stream_bindings[i].binding = i;
+    stream_bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    stream_bindings[i].descriptorCount = 1;
+    stream_bindings[i].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
   }
+  layout_info.bindingCount = static_cast<uint32_t>(stream_bindings.size());
+  layout_info.pBindings = stream_bindings.data();
+  vertex_stream_layout_ =
+    descriptor_layout_cache_.createDescriptorLayout(layout_info);
 }
 
 void VulkanApp::createUniformBuffers(){
   auto buff_size = sizeof(UniformBufferObject);
 
-  uniform_buffers_.resize(swapchain_images_.size());
-  uniform_buffers_memory_.resize(swapchain_images_.size());
+  uniform_buffers_.resize(settings_.frames_in_flight);
+  uniform_buffers_memory_.resize(settings_.frames_in_flight);
 
   for (size_t i = 0; i < uniform_buffers_.size(); ++i) {
     createBuffer(buff_size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
@@ -1529,24 +3851,33 @@ void VulkanApp::createUniformBuffers(){
 }
 
 void VulkanApp::updateUniformBuffer(uint32_t uniform_buffer_idx){
-  static auto start_time = std::chrono::high_resolution_clock::now(); 
+  VA_TRACE_SCOPE("updateUniformBuffer");
+  const float scale = sceneScale();
 
-  auto current_time = std::chrono::high_resolution_clock::now();
-  float time = std::chrono::duration<float, std::chrono::seconds::period>(
-    current_time - start_time).count();
+  updateTransforms();
 
   UniformBufferObject ubo{};
-  ubo.model = glm::rotate(glm::mat4(1.0f), time*glm::radians(90.0f),
-    glm::vec3(0.0f, 0.0f, 1.0f));
-  ubo.view = glm::lookAt(glm::vec3(2.0f,2.0f,2.0f), glm::vec3(0.0f,0.0f,0.0f),
-    glm::vec3(0.0f,0.0f,1.0f));
-  // 45 deg vertical fov, 0.1 near plane, 10 far plane.
+  if(settings_.scripted_camera){
+    // Same frames every run, independent of how fast they render
+    ubo.view = ScriptedCamera::view(frame_number_, scale);
+  }else{
+    ubo.view = glm::lookAt(glm::vec3(2.0f,2.0f,2.0f)*scale,
+      glm::vec3(0.0f,0.0f,0.0f), glm::vec3(0.0f,0.0f,1.0f));
+  }
+  // 45 deg vertical fov, 0.1 near plane, 10 far plane (more for big grids).
+  near_plane_ = 0.1f;
+  far_plane_ = 10.0f*scale;
   ubo.proj = glm::perspective(glm::radians(45.0f),
-    swapchain_img_extent_.width/(float)swapchain_img_extent_.height, 0.1f, 10.0f);
+    swapchain_img_extent_.width/(float)swapchain_img_extent_.height,
+    near_plane_, far_plane_);
 
   // positive y downward on screen.
   ubo.proj[1][1] *= -1;
+  view_ = ubo.view;
+  proj_ = ubo.proj;
+  view_proj_ = ubo.proj*ubo.view;
 
+  // Model matrices are pushed with each draw
   void *data;
   vkMapMemory(logical_device_, uniform_buffers_memory_[uniform_buffer_idx],
     0, sizeof(ubo), 0, &data);
@@ -1554,46 +3885,64 @@ void VulkanApp::updateUniformBuffer(uint32_t uniform_buffer_idx){
   vkUnmapMemory(logical_device_, uniform_buffers_memory_[uniform_buffer_idx]);
 }
 
-void VulkanApp::createDescriptorPool(){
-  // What types of descriptors will be contained in descriptor set
-  // How many there will be
-  std::array<VkDescriptorPoolSize,2> dp_sizes{};
+void VulkanApp::updateTransforms(){
+  glm::quat rotation;
+  if(settings_.scripted_camera){
+    rotation = ScriptedCamera::model(frame_number_);
+  }else{
+    rotation = glm::angleAxis(animationTime()*glm::radians(90.0f),
+      glm::vec3(0.0f, 0.0f, 1.0f));
+  }
+
+  // Skinned instances stand still, only their joints move
+  for(uint32_t obj = 0; obj < settings_.object_count; ++obj)
+    transforms_.setRotation(object_nodes_[obj], rotation);
+  transforms_.update(&thread_pool_);
+}
+
+float VulkanApp::animationTime() const{
+  if(settings_.scripted_camera)
+    return frame_number_ / ScriptedCamera::FRAMES_PER_SECOND;
 
-  // 1 for each swap chain image
-  dp_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  dp_sizes[0].descriptorCount = static_cast<uint32_t>(swapchain_images_.size());
-  dp_sizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-  dp_sizes[1].descriptorCount = static_cast<uint32_t>(swapchain_images_.size());
+  static auto start_time = std::chrono::high_resolution_clock::now(); 
 
-  VkDescriptorPoolCreateInfo dp_info{};
-  dp_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  dp_info.poolSizeCount = static_cast<uint32_t>(dp_sizes.size());
-  dp_info.pPoolSizes = dp_sizes.data();
+  auto current_time = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<float, std::chrono::seconds::period>(
+    current_time - start_time).count();
+}
 
-  // Maximum # of descriptor sets that may be allocated
-  dp_info.maxSets = static_cast<uint32_t>(swapchain_images_.size());
+void VulkanApp::createDescriptorAllocators(){
+  descriptor_layout_cache_.init(logical_device_);
 
-  if(vkCreateDescriptorPool(logical_device_, &dp_info, nullptr,
-    &descriptor_pool_) != VK_SUCCESS){
-    throw std::runtime_error("Failed to create descriptor pool");
+  // Pools start small and grow, no need to know the swap chain image count.
+  descriptor_allocator_.init(logical_device_, 8);
+}
+
+VkDescriptorSet VulkanApp::allocateFrameDescriptorSet(
+  VkDescriptorSetLayout layout){
+  VkDescriptorSet set;
+  auto& allocator = frame_descriptor_allocators_[frame_scheduler_.frameIndex()];
+  if(!allocator.allocate(layout, set)){
+    throw std::runtime_error("Failed to allocate transient descriptor set");
   }
+  return set;
 }
 
 void VulkanApp::createDescriptorSets(){
-  std::vector<VkDescriptorSetLayout> layouts(swapchain_images_.size(),
-    descriptor_layout_);
-
-  VkDescriptorSetAllocateInfo alloc_info{};
-  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-  alloc_info.descriptorPool = descriptor_pool_;
-  alloc_info.descriptorSetCount = 
-    static_cast<uint32_t>(swapchain_images_.size());
-  alloc_info.pSetLayouts = layouts.data();
+  // Transient allocator for each frame slot
+  frame_descriptor_allocators_.resize(settings_.frames_in_flight);
+  for(auto& allocator : frame_descriptor_allocators_){
+    allocator.init(logical_device_, 16);
+  }
 
-  descriptor_sets_.resize(swapchain_images_.size());
-  if(vkAllocateDescriptorSets(logical_device_, &alloc_info,
-    descriptor_sets_.data()) != VK_SUCCESS){
-    throw std::runtime_error("Failed to create descriptor sets");
+  // Persistent sets are only ever added, sets from a previous (larger)
+  // frames in flight count are left unused.
+  while(descriptor_sets_.size() < settings_.frames_in_flight){
+    VkDescriptorSet set;
+    if(!descriptor_allocator_.allocate(descriptor_layout_, set)){
+      throw std::runtime_error("Failed to create descriptor sets");
+    }
+    descriptor_sets_.push_back(set);
   }
 
   // Bind sampler and texture image to descriptor sets
@@ -1604,13 +3953,17 @@ void VulkanApp::createDescriptorSets(){
 
   // Descriptor sets created, but empty. populate them.
   // Link up resources of descriptors to descriptor sets.
-  for(size_t i = 0; i < descriptor_sets_.size(); ++i){
+  for(size_t i = 0; i < settings_.frames_in_flight; ++i){
     VkDescriptorBufferInfo buffer_info{};
     buffer_info.buffer = uniform_buffers_[i];
     buffer_info.offset = 0;
     buffer_info.range = sizeof(UniformBufferObject);
 
-    std::array<VkWriteDescriptorSet,2> writes{};
+    VkDescriptorBufferInfo light_info{light_buffers_[i], 0, VK_WHOLE_SIZE};
+    VkDescriptorBufferInfo cluster_info{cluster_buffers_[i], 0,
+      VK_WHOLE_SIZE};
+
+    std::array<VkWriteDescriptorSet,4> writes{};
     
     VkWriteDescriptorSet write{};
     writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
@@ -1628,27 +3981,61 @@ void VulkanApp::createDescriptorSets(){
     writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
     writes[1].descriptorCount = 1;
     writes[1].pImageInfo = &imageinfo;
-    
+
+    writes[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[2].dstSet = descriptor_sets_[i];
+    writes[2].dstBinding = 2;
+    writes[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[2].descriptorCount = 1;
+    writes[2].pBufferInfo = &light_info;
+
+    writes[3] = writes[2];
+    writes[3].dstBinding = 3;
+    writes[3].pBufferInfo = &cluster_info;
+
     vkUpdateDescriptorSets(logical_device_, 
       static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
   }
 }
 
-void VulkanApp::createTextureImage(){
-  // Load image
-  int t_width, t_height, t_channels;
+void VulkanApp::decodeTexture(){
+  auto& tex = decoded_texture_;
+
+  if(settings_.texture_size > 0){
+    // 16x16 checkerboard, mips still have something to average
+    tex.width = tex.height = static_cast<int>(settings_.texture_size);
+    int cell = std::max(1, tex.width/16);
+    tex.generated.resize(static_cast<size_t>(tex.width)*tex.height*4);
+    for(int y = 0; y < tex.height; ++y){
+      for(int x = 0; x < tex.width; ++x){
+        stbi_uc v = ((x/cell + y/cell) % 2) ? 230 : 40;
+        stbi_uc* texel =
+          &tex.generated[(static_cast<size_t>(y)*tex.width + x)*4];
+        texel[0] = v; texel[1] = v; texel[2] = v; texel[3] = 255;
+      }
+    }
+    tex.pixels = tex.generated.data();
+  }else{
+    int t_channels;
+    tex.pixels = stbi_load(TEXTURE_PATH.c_str(), &tex.width, &tex.height,
+      &t_channels, STBI_rgb_alpha);
+  }
 
-  stbi_uc* pixels = stbi_load(TEXTURE_PATH.c_str(), &t_width, &t_height,
-    &t_channels, STBI_rgb_alpha);
+  if(!tex.pixels){
+    throw std::runtime_error("Failed to load texture image");
+  }
+}
+
+void VulkanApp::createTextureImage(){
+  // Decoded by decodeTexture()
+  int t_width = decoded_texture_.width;
+  int t_height = decoded_texture_.height;
+  stbi_uc* pixels = decoded_texture_.pixels;
 
   texture_miplevels_ = static_cast<uint32_t>(
     std::floor(std::log2(std::max(t_height,t_width)))+1);
 
-  VkDeviceSize image_size = t_width*t_height*4;
-
-  if(!pixels){
-    throw std::runtime_error("Failed to load texture image");
-  }
+  VkDeviceSize image_size = static_cast<VkDeviceSize>(t_width)*t_height*4;
 
   // Image staging buffer
   VkBuffer staging_buffer;
@@ -1664,7 +4051,8 @@ void VulkanApp::createTextureImage(){
   vkMapMemory(logical_device_, staging_buffer_memory, 0, image_size, 0, &data);
   memcpy(data, pixels, image_size);
   vkUnmapMemory(logical_device_, staging_buffer_memory);
-  stbi_image_free(pixels);
+  if(decoded_texture_.generated.empty()) stbi_image_free(pixels);
+  decoded_texture_ = DecodedTexture{};
 
   // Shader can read image from the buffer, but it's better to move to Image
   createImage(t_width,t_height,VK_FORMAT_R8G8B8A8_SRGB,
@@ -1678,8 +4066,8 @@ void VulkanApp::createTextureImage(){
 
   // Transition image to proper layout for copying
   transitionImageLayout(texture_image_,
-    VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED,
-    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, texture_miplevels_);
+    VK_FORMAT_R8G8B8A8_SRGB, ImageUsage::Undefined,
+    ImageUsage::TransferDst, texture_miplevels_);
 
   copyBufferToImage(staging_buffer, texture_image_,
     static_cast<uint32_t>(t_width), static_cast<uint32_t>(t_height));
@@ -1692,7 +4080,7 @@ void VulkanApp::createTextureImage(){
     texture_miplevels_);
 
   vkDestroyBuffer(logical_device_, staging_buffer, nullptr);
-  vkFreeMemory(logical_device_, staging_buffer_memory, nullptr);
+  freeMemory(staging_buffer_memory);
 }
 
 void VulkanApp::createImage(uint32_t width, uint32_t height, VkFormat format,
@@ -1730,15 +4118,14 @@ void VulkanApp::createImage(uint32_t width, uint32_t height, VkFormat format,
   memalloc.allocationSize = mem_req.size;
   memalloc.memoryTypeIndex = findMemoryType(mem_req.memoryTypeBits, properties);
 
-  if (vkAllocateMemory(logical_device_, &memalloc, nullptr,
-                       &image_mem) != VK_SUCCESS) {
+  if (allocateMemory(memalloc, image_mem) != VK_SUCCESS) {
     throw std::runtime_error("Failed to allocate image memory");
   }
 
   vkBindImageMemory(logical_device_, image, image_mem, 0);
 }
 
-VkCommandBuffer VulkanApp::beginSingleTimeCommands(){
+VkCommandBuffer VulkanApp::beginSingleTimeCommands(const char* label){
   VkCommandBufferAllocateInfo allocinfo{};
   allocinfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   allocinfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
@@ -1753,11 +4140,14 @@ VkCommandBuffer VulkanApp::beginSingleTimeCommands(){
   begininfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
   vkBeginCommandBuffer(command_buffer, &begininfo);
+  gpu_profiler_.beginImmediate(command_buffer, label);
 
   return command_buffer;
 }
 
-void VulkanApp::endSingleTimeCommands(VkCommandBuffer command_buffer){
+void VulkanApp::endSingleTimeCommands(VkCommandBuffer command_buffer,
+  const std::vector<QueueWait>& waits){
+  gpu_profiler_.endImmediate(command_buffer);
   vkEndCommandBuffer(command_buffer);
 
   VkSubmitInfo si{};
@@ -1765,88 +4155,77 @@ void VulkanApp::endSingleTimeCommands(VkCommandBuffer command_buffer){
   si.commandBufferCount = 1;
   si.pCommandBuffers = &command_buffer;
 
+  // Eg. on another queue's timeline, for buffers it hands over
+  std::vector<VkSemaphore> wait_semaphores;
+  std::vector<uint64_t> wait_values;
+  std::vector<VkPipelineStageFlags> wait_stages;
+  for(const auto& wait : waits){
+    wait_semaphores.push_back(wait.semaphore);
+    wait_values.push_back(wait.value);
+    wait_stages.push_back(wait.stage);
+  }
+  si.waitSemaphoreCount = static_cast<uint32_t>(wait_semaphores.size());
+  si.pWaitSemaphores = wait_semaphores.data();
+  si.pWaitDstStageMask = wait_stages.data();
+
+  // Uploads share the frame timeline, wait only for this submission
+  // instead of idling the whole queue.
+  const uint64_t signal_value = frame_scheduler_.nextSignalValue();
+  VkSemaphore timeline = frame_scheduler_.timeline();
+
+  VkTimelineSemaphoreSubmitInfo timeline_info{};
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.waitSemaphoreValueCount =
+    static_cast<uint32_t>(wait_values.size());
+  timeline_info.pWaitSemaphoreValues = wait_values.data();
+  timeline_info.signalSemaphoreValueCount = 1;
+  timeline_info.pSignalSemaphoreValues = &signal_value;
+  si.pNext = &timeline_info;
+  si.signalSemaphoreCount = 1;
+  si.pSignalSemaphores = &timeline;
+
   vkQueueSubmit(graphics_queue_, 1, &si, VK_NULL_HANDLE);
-  vkQueueWaitIdle(graphics_queue_);
+  frame_scheduler_.wait(signal_value);
+
+  // Already waited, reading the timestamps doesn't stall
+  gpu_profiler_.collectImmediate();
 
   vkFreeCommandBuffers(logical_device_, command_pool_, 1, &command_buffer);
 }
 
 void VulkanApp::transitionImageLayout(VkImage image, VkFormat format, 
-    VkImageLayout old_layout, VkImageLayout new_layout, uint32_t miplevels){
-  VkCommandBuffer cb = beginSingleTimeCommands();
-
-  VkImageMemoryBarrier barrier{};
-  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  barrier.oldLayout = old_layout;
-  barrier.newLayout = new_layout;
+    ImageUsage old_usage, ImageUsage new_usage, uint32_t miplevels){
+  VkCommandBuffer cb = beginSingleTimeCommands("layout transition");
 
-  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-  barrier.image = image;
-
-  if(new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL){
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+  VkImageSubresourceRange range{};
+  ImageState new_state = usageState(new_usage);
+  if(new_state.layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+    || new_state.layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL){
+    range.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
 
     // Turn on stencil bit as well.
     if(hasStencilComponent(format))
-      barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+      range.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
 
   }else{
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  }
-  barrier.subresourceRange.baseMipLevel = 0;
-  barrier.subresourceRange.levelCount = miplevels;
-  barrier.subresourceRange.baseArrayLayer = 0;
-  barrier.subresourceRange.layerCount = 1;
-
-  VkPipelineStageFlags srcstage;
-  VkPipelineStageFlags dststage;
-
-  if(old_layout == VK_IMAGE_LAYOUT_UNDEFINED
-    && new_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL){
-    barrier.srcAccessMask = 0;
-    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-    // earliest possible pipeline stage, wait for top of pipeline.
-    srcstage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-    // pseudo stage
-    dststage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-  }else if(old_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
-    && new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL){
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-    srcstage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    dststage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-  }else if(old_layout == VK_IMAGE_LAYOUT_UNDEFINED
-    && new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL){
-    barrier.srcAccessMask = 0;
-    barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
-      | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-    
-    srcstage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-    dststage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-
-  }else{
-    throw std::invalid_argument("Unsupported image layout transition");
+    range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
   }
+  range.baseMipLevel = 0;
+  range.levelCount = miplevels;
+  range.baseArrayLayer = 0;
+  range.layerCount = 1;
 
-  vkCmdPipelineBarrier(
-    cb,
-    srcstage,dststage,
-    0,
-    0, nullptr,
-    0, nullptr,
-    1, &barrier
-  );
+  // Stages and access masks follow from the usages
+  BarrierBatch batch;
+  batch.add(image, range, usageState(old_usage), new_state);
+  batch.flush(cb);
 
   endSingleTimeCommands(cb);
 }
 
 void VulkanApp::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width,
   uint32_t height){
-  VkCommandBuffer cb = beginSingleTimeCommands();
+  VkCommandBuffer cb = beginSingleTimeCommands("copy buffer to image");
 
   VkBufferImageCopy region{};
   region.bufferOffset = 0;
@@ -1942,20 +4321,6 @@ void VulkanApp::createTextureSampler(){
   }
 }
 
-void VulkanApp::createDepthResources(){
-  VkFormat format = findDepthFormat();
-  createImage(swapchain_img_extent_.width, swapchain_img_extent_.height,
-   format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depth_image_, depth_image_memory_, 1,
-    msaa_samples_); 
-
-  depth_image_view_ = createImageView(depth_image_, format,
-    VK_IMAGE_ASPECT_DEPTH_BIT, 1);
-
-  transitionImageLayout(depth_image_, format, VK_IMAGE_LAYOUT_UNDEFINED,
-    VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 1);
-}
-
 VkFormat VulkanApp::findSupportedImageFormat(
   const std::vector<VkFormat> &candidates, VkImageTiling tiling,
     VkFormatFeatureFlags features){
@@ -1991,6 +4356,35 @@ bool VulkanApp::hasStencilComponent(VkFormat format){
 }
 
 void VulkanApp::loadModel(){
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;
+
+  if(settings_.mesh_triangles > 0){
+    createProceduralMesh(settings_.mesh_triangles, vertices, indices);
+    meshes_.add(vertices, indices);
+    buildModelBvh(vertices, indices);
+  }else{
+    // Decoded into staging memory when it's uploaded
+    EncodedGeometry geometry = loadModelGeometry();
+    loadModelBvh(geometry);
+    meshes_.add(std::move(geometry));
+  }
+
+  // Lower detail spheres so the scene mixes meshes
+  uint32_t triangles = settings_.mesh_triangles > 0 ?
+    settings_.mesh_triangles : DEFAULT_VARIANT_TRIANGLES;
+  for(uint32_t i = 1; i < settings_.mesh_variants; ++i){
+    triangles = std::max(16u, triangles/2);
+    createProceduralMesh(triangles, vertices, indices);
+    meshes_.add(vertices, indices);
+  }
+}
+
+void VulkanApp::loadObj(std::vector<Vertex>& vertices,
+  std::vector<uint32_t>& indices){
+  vertices.clear();
+  indices.clear();
+
   tinyobj::attrib_t attrib;
   std::vector<tinyobj::shape_t> shapes;
   std::vector<tinyobj::material_t> materials;
@@ -2015,17 +4409,250 @@ void VulkanApp::loadModel(){
         1.0f-attrib.texcoords[2*idx.texcoord_index+1]
       };
       vertex.color = {1.0f, 1.0f, 1.0f};
+      if(idx.normal_index >= 0){
+        vertex.normal = {
+          attrib.normals[3*idx.normal_index],
+          attrib.normals[3*idx.normal_index+1],
+          attrib.normals[3*idx.normal_index+2]
+        };
+      }
 
       if(vertex_2_idx.find(vertex) != vertex_2_idx.end()){
-        indices_.push_back(vertex_2_idx.at(vertex));
+        indices.push_back(vertex_2_idx.at(vertex));
       }else{
-        vertices_.push_back(vertex);
+        vertices.push_back(vertex);
         vertex_2_idx.emplace(vertex, idx_count);
-        indices_.push_back(idx_count);
+        indices.push_back(idx_count);
         ++idx_count;
       }
     }
   }
+
+  // Files without normals get the area weighted average of their faces
+  if(attrib.normals.empty()){
+    for(size_t i = 0; i + 2 < indices.size(); i += 3){
+      Vertex& a = vertices[indices[i]];
+      Vertex& b = vertices[indices[i+1]];
+      Vertex& c = vertices[indices[i+2]];
+      glm::vec3 face = glm::cross(b.pos - a.pos, c.pos - a.pos);
+      a.normal += face;
+      b.normal += face;
+      c.normal += face;
+    }
+    for(auto& vertex : vertices){
+      if(glm::dot(vertex.normal, vertex.normal) > 0.0f)
+        vertex.normal = glm::normalize(vertex.normal);
+    }
+  }
+}
+
+EncodedGeometry VulkanApp::loadModelGeometry(){
+  const std::string path = MODEL_PATH + ".geo";
+  std::error_code cache_error, model_error;
+  auto cache_time = std::filesystem::last_write_time(path, cache_error);
+  auto model_time = std::filesystem::last_write_time(MODEL_PATH, model_error);
+
+  // Shipped without the obj, or at least as new as it
+  if(!cache_error && (model_error || cache_time >= model_time)){
+    try{
+      return readGeometryFile(path);
+    }catch(const std::exception& e){
+      std::cerr << e.what() << ", parsing the obj instead" << std::endl;
+    }
+  }
+
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;
+  loadObj(vertices, indices);
+  EncodedGeometry geometry = encodeGeometry(vertices, indices);
+  std::cout << "Model encoded from "
+    << sizeof(Vertex)*vertices.size() + sizeof(uint32_t)*indices.size()
+    << " to " << geometry.vertices.size() + geometry.indices.size()
+    << " bytes" << std::endl;
+
+  // Without the copy the next run only loads slower
+  try{
+    writeGeometryFile(path, geometry);
+  }catch(const std::exception& e){
+    std::cerr << e.what() << std::endl;
+  }
+  return geometry;
+}
+
+void VulkanApp::loadModelBvh(const EncodedGeometry& geometry){
+  const std::string path = MODEL_PATH + ".bvh";
+  std::error_code cache_error, geometry_error;
+  auto cache_time = std::filesystem::last_write_time(path, cache_error);
+  auto geometry_time = std::filesystem::last_write_time(MODEL_PATH + ".geo",
+    geometry_error);
+
+  if(!cache_error && !geometry_error && cache_time >= geometry_time){
+    try{
+      model_bvh_.load(path);
+      if(model_bvh_.triangleCount() == geometry.index_count/3) return;
+      std::cerr << path << " is of another mesh, rebuilding" << std::endl;
+    }catch(const std::exception& e){
+      std::cerr << e.what() << ", rebuilding" << std::endl;
+    }
+  }
+
+  std::vector<Vertex> vertices(geometry.vertex_count);
+  std::vector<uint32_t> indices(geometry.index_count);
+  try{
+    decodeVertices(geometry, vertices.data());
+    decodeIndices(geometry, indices.data(), sizeof(uint32_t));
+  }catch(const std::exception& e){
+    std::cerr << e.what() << ", parsing the obj instead" << std::endl;
+    reloadModelObj(geometry, vertices, indices);
+  }
+  buildModelBvh(vertices, indices);
+
+  try{
+    model_bvh_.save(path);
+  }catch(const std::exception& e){
+    std::cerr << e.what() << std::endl;
+  }
+}
+
+void VulkanApp::reloadModelObj(const EncodedGeometry& geometry,
+  std::vector<Vertex>& vertices, std::vector<uint32_t>& indices){
+  loadObj(vertices, indices);
+  if(vertices.size() != geometry.vertex_count
+    || indices.size() != geometry.index_count){
+    throw std::runtime_error("Failed to reload " + MODEL_PATH
+      + ", it changed since it was loaded");
+  }
+
+  try{
+    writeGeometryFile(MODEL_PATH + ".geo", encodeGeometry(vertices, indices));
+  }catch(const std::exception& e){
+    std::cerr << e.what() << std::endl;
+  }
+}
+
+void VulkanApp::buildModelBvh(const std::vector<Vertex>& vertices,
+  const std::vector<uint32_t>& indices){
+  std::vector<glm::vec3> positions(vertices.size());
+  for(size_t i = 0; i < vertices.size(); ++i) positions[i] = vertices[i].pos;
+
+  const uint64_t start_ns = CpuProfiler::instance().now();
+  model_bvh_.build(positions, indices, &thread_pool_);
+  std::cout << "Model bvh built in "
+    << (CpuProfiler::instance().now() - start_ns) / 1e6 << " ms, "
+    << model_bvh_.nodeCount() << " nodes" << std::endl;
+}
+
+void VulkanApp::createProceduralMesh(uint32_t triangle_count,
+  std::vector<Vertex>& vertices, std::vector<uint32_t>& indices){
+  // rings x segments quads of 2 triangles, segments = 2*rings
+  const uint32_t rings = std::max(2u, static_cast<uint32_t>(
+    std::round(std::sqrt(triangle_count/4.0))));
+  const uint32_t segments = 2*rings;
+  const float radius = 0.8f;
+  const float pi = glm::radians(180.0f);
+
+  vertices.clear();
+  indices.clear();
+  vertices.reserve((rings+1)*(segments+1));
+  indices.reserve(rings*segments*6);
+
+  for(uint32_t r = 0; r <= rings; ++r){
+    float phi = pi*r/rings;
+    for(uint32_t s = 0; s <= segments; ++s){
+      float theta = 2.0f*pi*s/segments;
+      Vertex vertex{};
+      vertex.pos = radius*glm::vec3(std::sin(phi)*std::cos(theta),
+        std::sin(phi)*std::sin(theta), std::cos(phi));
+      vertex.texCoord = {s/(float)segments, r/(float)rings};
+      vertex.color = {1.0f, 1.0f, 1.0f};
+      vertex.normal = vertex.pos/radius;
+      vertices.push_back(vertex);
+    }
+  }
+
+  // Counter clockwise seen from outside
+  for(uint32_t r = 0; r < rings; ++r){
+    for(uint32_t s = 0; s < segments; ++s){
+      uint32_t a = r*(segments+1) + s;
+      uint32_t b = a + segments + 1;
+      indices.insert(indices.end(), {a, b, a+1, a+1, b, b+1});
+    }
+  }
+}
+
+glm::vec3 VulkanApp::objectPosition(uint32_t idx) const{
+  // Square grid centered on the origin
+  const float spacing = 2.5f;
+  uint32_t side = static_cast<uint32_t>(
+    std::ceil(std::sqrt(static_cast<float>(sceneObjectCount()))));
+  float center = (side-1)/2.0f;
+  return glm::vec3(((idx % side) - center)*spacing,
+    ((idx / side) - center)*spacing, 0.0f);
+}
+
+void VulkanApp::createScene(){
+  transforms_.clear();
+  object_nodes_.clear();
+
+  scene_root_ = transforms_.add(TransformHierarchy::NO_PARENT);
+  object_nodes_.reserve(sceneObjectCount());
+  for(uint32_t obj = 0; obj < sceneObjectCount(); ++obj)
+    object_nodes_.push_back(transforms_.add(scene_root_, objectPosition(obj)));
+}
+
+void VulkanApp::createSceneIndex(){
+  float radius = 0.0f;
+  for(uint32_t m = 0; m < meshes_.meshCount(); ++m){
+    const MeshEntry& mesh = meshes_.mesh(m);
+    radius = std::max(radius, glm::length(mesh.center) + mesh.radius);
+  }
+
+  // Objects hang off the root at the origin, their local translations are
+  // their world positions
+  float half_extent = radius;
+  for(uint32_t obj = 0; obj < settings_.object_count; ++obj){
+    glm::vec3 p = glm::abs(transforms_.translation(object_nodes_[obj]));
+    half_extent = std::max({half_extent, p.x + radius, p.y + radius,
+      p.z + radius});
+  }
+
+  scene_index_.reset(glm::vec3(0.0f), half_extent);
+  object_meshes_.resize(settings_.object_count);
+  for(uint32_t obj = 0; obj < settings_.object_count; ++obj){
+    object_meshes_[obj] = obj % meshes_.meshCount();
+    scene_index_.insert(transforms_.translation(object_nodes_[obj]), radius,
+      obj);
+  }
+}
+
+void VulkanApp::updateVisibility(){
+  VA_TRACE_SCOPE("updateVisibility");
+  visible_objects_.clear();
+  frustum_cells_visited_ = scene_index_.queryFrustum(view_proj_,
+    visible_objects_);
+
+  // Only the sphere variants of a procedural mesh are its levels of detail
+  if(!settings_.lod || settings_.mesh_triangles == 0) return;
+
+  // Radius over distance, scaled to half the screen height
+  const glm::vec3 eye = glm::vec3(glm::inverse(view_)[3]);
+  const float focal = std::abs(proj_[1][1]);
+  const float radius = meshes_.mesh(0).radius;
+  const float last = static_cast<float>(meshes_.meshCount() - 1);
+  for(uint32_t obj : visible_objects_){
+    glm::vec3 position = glm::vec3(transforms_.world(object_nodes_[obj])[3]);
+    float distance = std::max(glm::length(position - eye), near_plane_);
+    float level = std::floor(std::log2(LOD_FULL_DETAIL_SIZE*distance
+      /(radius*focal)));
+    object_meshes_[obj] = static_cast<uint32_t>(
+      std::min(std::max(level, 0.0f), last));
+  }
+}
+
+float VulkanApp::sceneScale() const{
+  uint32_t side = static_cast<uint32_t>(
+    std::ceil(std::sqrt(static_cast<float>(sceneObjectCount()))));
+  return std::max(1.0f, 0.9f*(side-1) + 0.7f);
 }
 
 void VulkanApp::generateMipmaps(VkImage image, VkFormat format, int32_t width, 
@@ -2040,33 +4667,33 @@ void VulkanApp::generateMipmaps(VkImage image, VkFormat format, int32_t width,
       "Texture image format does not support linear blitting. Cannot create mipmaps.");
   }
 
-  if(cb == VK_NULL_HANDLE) cb = beginSingleTimeCommands();
+  if(cb == VK_NULL_HANDLE) cb = beginSingleTimeCommands("generate mipmaps");
+
+  VkImageSubresourceRange range{};
+  range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  range.baseArrayLayer = 0;
+  range.layerCount = 1;
+  range.levelCount = 1;
+  auto level = [&](uint32_t mip){
+    range.baseMipLevel = mip;
+    return range;
+  };
+
+  const ImageState transfer_dst = usageState(ImageUsage::TransferDst);
+  const ImageState transfer_src = usageState(ImageUsage::TransferSrc);
+  const ImageState sampled = usageState(ImageUsage::SampledFragment);
 
-  VkImageMemoryBarrier barr{};
-  barr.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  barr.image = image;
-  barr.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barr.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barr.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  barr.subresourceRange.baseArrayLayer = 0;
-  barr.subresourceRange.layerCount = 1;
-  barr.subresourceRange.levelCount = 1;
+  // Level i-1 becomes the blit source in the same barrier command that
+  // hands level i-2, done being a source, over to the shader.
+  BarrierBatch batch;
 
   int32_t mipwidth = width;
   int32_t mipheight = height;
 
   for(uint32_t i = 1; i < miplevels; ++i){
-    barr.subresourceRange.baseMipLevel = i-1;
-    barr.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    barr.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-    barr.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barr.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-
-    vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT,
-      VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-      0, nullptr,
-      0, nullptr,
-      1, &barr);
+    batch.add(image, level(i-1), transfer_dst, transfer_src);
+    if(i > 1) batch.add(image, level(i-2), transfer_src, sampled);
+    batch.flush(cb);
 
     VkImageBlit blit{};
     blit.srcOffsets[0] = {0,0,0};
@@ -2086,35 +4713,16 @@ void VulkanApp::generateMipmaps(VkImage image, VkFormat format, int32_t width,
     vkCmdBlitImage(cb, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
       image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
 
-    // Transition mip level i-1 to shader read
-    barr.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-    barr.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    barr.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-    barr.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-    vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT,
-      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-      0, nullptr,
-      0, nullptr,
-      1, &barr);
-
     if(mipwidth > 1) mipwidth/=2;
     if(mipheight > 1) mipheight/=2;
 
   }
 
-  // Transition last mip level to transfer src
-  barr.subresourceRange.baseMipLevel = miplevels-1;
-  barr.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-  barr.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-  barr.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-  barr.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-  vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT,
-    VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-    0, nullptr,
-    0, nullptr,
-    1, &barr);
+  // Last source level and the last level, only ever blitted to
+  if(miplevels > 1)
+    batch.add(image, level(miplevels-2), transfer_src, sampled);
+  batch.add(image, level(miplevels-1), transfer_dst, sampled);
+  batch.flush(cb);
 
   endSingleTimeCommands(cb);
 }
@@ -2138,21 +4746,276 @@ VkSampleCountFlagBits VulkanApp::getMaxUsableSampleCount(){
   else return VK_SAMPLE_COUNT_1_BIT;
 }
 
-void VulkanApp::createColorResources(){
-  VkFormat color_format = swapchain_img_format_;
+VkSampleCountFlagBits VulkanApp::chooseSampleCount(){
+  VkSampleCountFlagBits max_samples = getMaxUsableSampleCount();
+  if(settings_.msaa_samples == 0) return max_samples;
 
-  createImage(swapchain_img_extent_.width, swapchain_img_extent_.height,
-    color_format, VK_IMAGE_TILING_OPTIMAL,
-      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
-    | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
-    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-    color_image_, color_image_memory_,
-    1,
-    msaa_samples_);
+  // Sample counts are single bits, walk down from the request.
+  uint32_t samples = std::min<uint32_t>(settings_.msaa_samples, max_samples);
+  uint32_t bit = 1;
+  while(bit*2 <= samples) bit *= 2;
+  return static_cast<VkSampleCountFlagBits>(bit);
+}
+
+void VulkanApp::createRenderGraph(){
+  const VkExtent2D extent = swapchain_img_extent_;
+  const VkFormat depth_format = findDepthFormat();
+  VkImageAspectFlags depth_aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+  if(hasStencilComponent(depth_format))
+    depth_aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+
+  // Tile based gpus have a lazily allocated type, desktop ones usually
+  // don't and get plain device local memory.
+  auto allocate = [this](const VkMemoryRequirements& requirements,
+    bool lazy){
+    VkMemoryAllocateInfo alloc_info{};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = requirements.size;
+
+    RenderGraph::Allocation allocation{VK_NULL_HANDLE, false};
+    if(lazy){
+      try{
+        alloc_info.memoryTypeIndex = findMemoryType(
+          requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+          | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+        allocation.lazy = true;
+      }catch(const std::runtime_error&){
+        allocation.lazy = false;
+      }
+    }
+    if(!allocation.lazy){
+      alloc_info.memoryTypeIndex = findMemoryType(
+        requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    }
+
+    if(allocateMemory(alloc_info, allocation.memory) != VK_SUCCESS){
+      throw std::runtime_error("Failed to allocate render target memory");
+    }
+    return allocation;
+  };
+
+  // Both only live inside the scene pass, resolved or thrown away at its
+  // end, so they can be lazily allocated. Not with occlusion culling: they
+  // are kept between the two scene phases and depth is sampled for hi-z.
+  const bool culling = occlusion_culling_;
+  const bool upscale = upscaling();
+  const bool lazy = settings_.lazy_attachments && !culling;
+  const VkImageUsageFlags pass_only = culling ? 0
+    : static_cast<VkImageUsageFlags>(VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT);
+  // Depth is read back for the hi-z pyramid
+  const VkImageUsageFlags depth_sampled = culling
+    ? static_cast<VkImageUsageFlags>(VK_IMAGE_USAGE_SAMPLED_BIT) : 0;
+  if(culling) createHiZImage();
+
+  for(auto& level : render_levels_){
+    RenderGraph& graph = level.graph;
+
+    // Only touches buffers, ordered before the scene by its own barrier
+    if(settings_.light_count > 0){
+      graph.addPass("light binning", {},
+        [this](VkCommandBuffer cb){ recordLightBinning(cb); });
+    }
+
+    level.depth_target = graph.addTransient({"depth", depth_format, extent,
+      level.samples, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | pass_only
+      | depth_sampled, depth_aspect, lazy});
+
+    // Acquired image, the submit waits for it at color attachment output
+    level.swapchain_target = graph.addImported("swap chain",
+      ImageUsage::Undefined, ImageUsage::Present, VK_IMAGE_ASPECT_COLOR_BIT,
+      VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+
+    // Resolved scene, read by the upscale pass so it's kept in memory.
+    // Drawn straight into the swap chain image at full resolution.
+    if(upscale){
+      level.scene_color_target = graph.addTransient({"scene color",
+        swapchain_img_format_, extent, VK_SAMPLE_COUNT_1_BIT,
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        VK_IMAGE_ASPECT_COLOR_BIT});
+    }else{
+      level.scene_color_target = level.swapchain_target;
+    }
+
+    if(level.samples != VK_SAMPLE_COUNT_1_BIT){
+      level.msaa_color_target = graph.addTransient({"msaa color",
+        swapchain_img_format_, extent, level.samples,
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | pass_only,
+        VK_IMAGE_ASPECT_COLOR_BIT, lazy});
+    }
+
+    // The scene, or its last phase with occlusion culling
+    auto add_scene_pass = [this, &level, &graph](const char* name,
+      ScenePhase phase){
+      auto record = [this, &level, phase](VkCommandBuffer cb){
+        recordScenePass(cb, level, phase);
+      };
+      if(level.samples == VK_SAMPLE_COUNT_1_BIT){
+        graph.addPass(name, {
+            {level.depth_target, ImageUsage::DepthAttachment},
+            {level.scene_color_target, ImageUsage::ColorAttachment}}, record);
+      }else{
+        graph.addPass(name, {
+            {level.msaa_color_target, ImageUsage::ColorAttachment},
+            {level.depth_target, ImageUsage::DepthAttachment},
+            {level.scene_color_target, ImageUsage::ColorAttachment}}, record);
+      }
+    };
+
+    if(!culling){
+      add_scene_pass("scene", ScenePhase::All);
+    }else{
+      // Kept from frame to frame, left readable for the next early phase
+      level.hiz_target = graph.addImported("hi-z", ImageUsage::SampledCompute,
+        ImageUsage::SampledCompute, VK_IMAGE_ASPECT_COLOR_BIT);
+
+      graph.addPass("cull early", {
+          {level.hiz_target, ImageUsage::SampledCompute}},
+        [this](VkCommandBuffer cb){ recordCullPass(cb, 0); });
+
+      auto record_early = [this, &level](VkCommandBuffer cb){
+        recordScenePass(cb, level, ScenePhase::Early);
+      };
+      if(level.samples == VK_SAMPLE_COUNT_1_BIT){
+        graph.addPass("scene early", {
+            {level.depth_target, ImageUsage::DepthAttachment},
+            {level.scene_color_target, ImageUsage::ColorAttachment}},
+          record_early);
+      }else{
+        graph.addPass("scene early", {
+            {level.msaa_color_target, ImageUsage::ColorAttachment},
+            {level.depth_target, ImageUsage::DepthAttachment}},
+          record_early);
+      }
+
+      graph.addPass("hi-z", {
+          {level.depth_target, ImageUsage::SampledCompute},
+          {level.hiz_target, ImageUsage::StorageCompute}},
+        [this, &level](VkCommandBuffer cb){ recordHiZPass(cb, level); });
+
+      graph.addPass("cull late", {
+          {level.hiz_target, ImageUsage::SampledCompute}},
+        [this](VkCommandBuffer cb){ recordCullPass(cb, 1); });
+
+      add_scene_pass("scene late", ScenePhase::Late);
+    }
+
+    if(upscale){
+      graph.addPass("upscale", {
+          {level.scene_color_target, ImageUsage::SampledFragment},
+          {level.swapchain_target, ImageUsage::ColorAttachment}},
+        [this, &level](VkCommandBuffer cb){ recordUpscalePass(cb, level); });
+    }
+
+    graph.compile(logical_device_, allocate,
+      [this](VkDeviceMemory memory){ freeMemory(memory); });
+
+    if(!render_graphs_reported_){
+      std::cout << "Render graph, " << qualityLevelName(level.quality)
+                << "\n" << graph.report();
+    }
+  }
+  render_graphs_reported_ = true;
+}
+
+void VulkanApp::createQualityLevels(){
+  const uint32_t start_samples = chooseSampleCount();
+
+  // One render level for each msaa setting
+  std::vector<QualityLevel> msaa_levels;
+  // The controller's steps, each drawn by one of the render levels
+  std::vector<QualityLevel> levels;
+  quality_render_levels_.clear();
+  uint32_t start_level = 0;
+  bool sample_shading = false;
+  if(settings_.target_frame_ms <= 0.0){
+    msaa_levels.push_back({start_samples, false});
+    levels.push_back({start_samples, false,
+      std::clamp(settings_.render_scale, MIN_RENDER_SCALE, 1.0f)});
+    quality_render_levels_.push_back(0);
+  }else{
+    // Every count the device has up to 8x, more costs a lot for little
+    const uint32_t max_samples =
+      std::min<uint32_t>(getMaxUsableSampleCount(), VK_SAMPLE_COUNT_8_BIT);
+    for(uint32_t samples = 1; samples <= max_samples; samples *= 2)
+      msaa_levels.push_back({samples, false});
+
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(physical_device_, &features);
+    sample_shading = features.sampleRateShading && max_samples > 1;
+
+    // Resolution goes before anti aliasing, below full resolution there's
+    // no msaa at all
+    const float min_scale =
+      std::clamp(settings_.min_render_scale, MIN_RENDER_SCALE, 1.0f);
+    const uint32_t scale_steps = renderScaleSteps();
+    for(uint32_t i = 0; i < scale_steps; ++i){
+      levels.push_back({1, false, min_scale + i*RENDER_SCALE_STEP});
+      quality_render_levels_.push_back(0);
+    }
 
-  color_image_view_ = 
-  createImageView(color_image_, color_format, VK_IMAGE_ASPECT_COLOR_BIT, 1);
+    for(uint32_t i = 0; i < msaa_levels.size(); ++i){
+      const QualityLevel& msaa = msaa_levels[i];
+      if(msaa.msaa_samples <= start_samples)
+        start_level = static_cast<uint32_t>(levels.size());
+      levels.push_back(msaa);
+      quality_render_levels_.push_back(i);
+    }
+
+    // Same targets as the top msaa level, only the pipelines differ
+    if(sample_shading){
+      levels.push_back({max_samples, true});
+      quality_render_levels_.push_back(
+        static_cast<uint32_t>(msaa_levels.size() - 1));
+    }
+  }
 
+  render_levels_.clear();
+  render_levels_.resize(msaa_levels.size());
+  for(size_t i = 0; i < msaa_levels.size(); ++i){
+    render_levels_[i].quality = msaa_levels[i];
+    render_levels_[i].samples =
+      static_cast<VkSampleCountFlagBits>(msaa_levels[i].msaa_samples);
+  }
+  render_levels_.back().sample_shading = sample_shading;
+  quality_controller_.init(std::move(levels), start_level,
+    settings_.target_frame_ms);
+  quality_samples_seen_ = 0;
+}
+
+bool VulkanApp::supportsOcclusionCulling(){
+  // Depth is sampled as is, a stencil aspect would need views of its own
+  const VkFormat depth_format = findDepthFormat();
+  if(hasStencilComponent(depth_format)) return false;
+
+  VkFormatProperties format_props;
+  vkGetPhysicalDeviceFormatProperties(physical_device_, depth_format,
+    &format_props);
+  if(!(format_props.optimalTilingFeatures
+    & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)){
+    return false;
+  }
 
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(physical_device_, &props);
+  for(const auto& level : render_levels_){
+    if(!(props.limits.sampledImageDepthSampleCounts & level.samples))
+      return false;
+  }
+  return true;
+}
+
+void VulkanApp::updateQualityLevel(){
+  if(!quality_controller_.enabled()) return;
+
+  // Only frames the profiler resolved since the last call, each once
+  GpuProfiler::ScopeStats frame = gpu_profiler_.stats("frame");
+  if(frame.total == quality_samples_seen_) return;
+  quality_samples_seen_ = frame.total;
+
+  if(quality_controller_.addSample(frame.last_ms)){
+    std::cout << "Quality " << qualityLevelName(quality_controller_.current())
+              << " (gpu " << quality_controller_.smoothedMs() << " ms)"
+              << std::endl;
+  }
 }
 }// namespace va
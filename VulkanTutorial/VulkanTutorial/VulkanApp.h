@@ -3,6 +3,7 @@
 #include <array>
 #include <fstream>
 #include <optional>
+#include <unordered_map>
 #include <vector>
 
 #define GLFW_INCLUDE_VULKAN
@@ -16,59 +17,60 @@
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/hash.hpp>
 
+#include "AsyncQueue.h"
+#include "Benchmark.h"
+#include "Bvh.h"
+#include "CpuProfiler.h"
+#include "DescriptorAllocator.h"
+#include "FramePacer.h"
+#include "FrameScheduler.h"
+#include "GpuProfiler.h"
+#include "InitGraph.h"
+#include "LooseOctree.h"
+#include "MeshRegistry.h"
+#include "PipelineStats.h"
+#include "QualityController.h"
+#include "RenderGraph.h"
+#include "RenderQueue.h"
+#include "RenderSettings.h"
+#include "ShaderVariant.h"
+#include "Skinning.h"
+#include "ThreadPool.h"
+#include "TransformHierarchy.h"
+#include "VertexStreams.h"
+
 namespace va {
 
+// Camera of a frame, one per frame in flight
 struct UniformBufferObject {
-  glm::mat4 model;
   glm::mat4 view;
   glm::mat4 proj;
 };
 
-struct Vertex {
-  glm::vec3 pos;
-  glm::vec3 color;
-  glm::vec2 texCoord;
-
-  bool operator==(const Vertex&other) const{
-    return pos == other.pos
-      && color == other.color
-      && texCoord == other.texCoord;
-  }
-
-  static VkVertexInputBindingDescription getBindingDescription() {
-    VkVertexInputBindingDescription bd{};
-
-    bd.binding = 0;
-    bd.stride = sizeof(Vertex);
-    bd.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-    return bd;
-  }
-
-  static std::array<VkVertexInputAttributeDescription, 3>
-  getAttributeDescription() {
-    std::array<VkVertexInputAttributeDescription, 3> ads{};
-    ads[0].binding = 0;   // from which binding does vertex data come from?
-    ads[0].location = 0;  // location directive in vertex shader
-    ads[0].format = VK_FORMAT_R32G32B32_SFLOAT;  // bytesize of attribute data
-    ads[0].offset = offsetof(Vertex, pos);    // # bytes from start of vertex
-
-    ads[1].binding = 0;
-    ads[1].location = 1;
-    ads[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-    ads[1].offset = offsetof(Vertex, color);
-
-    ads[2].binding = 0;
-    ads[2].location = 2;
-    ads[2].format = VK_FORMAT_R32G32_SFLOAT;
-    ads[2].offset = offsetof(Vertex, texCoord);
-    return ads;
-  }
+// Per draw data, pushed right before each draw. Same layout as the push
+// constant block of pull.vert, shader.vert and depth.vert only read the
+// start of it.
+struct DrawConstants {
+  glm::mat4 model;
+  uint32_t material;
+  // Vertex pulling only: a VertexFormat, and where the draw's interleaved
+  // vertices start in floats
+  uint32_t vertex_format;
+  uint32_t vertex_base;
+  uint32_t pad;
 };
 
 struct QueueFamilyIndices {
   std::optional<uint32_t> graphics_family;
   std::optional<uint32_t> present_family;
 
+  // Async queues. A dedicated family if there is one, otherwise a second
+  // queue of the graphics family, otherwise the graphics queue itself.
+  std::optional<uint32_t> compute_family;
+  std::optional<uint32_t> transfer_family;
+  uint32_t compute_queue_index = 0;
+  uint32_t transfer_queue_index = 0;
+
   bool isComplete() {
     return graphics_family.has_value() && present_family.has_value();
   }
@@ -83,11 +85,29 @@ struct SwapChainSupportDetails {
 
 class VulkanApp {
  public:
+  explicit VulkanApp(RenderSettings settings = {});
+
   void run();
 
+  /* Render warmup_frames, then measured_frames recording frame times, CPU
+   * submit cost and memory use. Creates and destroys everything like run().
+   */
+  BenchmarkResult runBenchmark(uint32_t warmup_frames,
+    uint32_t measured_frames);
+
  private:
-  const int MAX_FRAMES_IN_FLIGHT = 2;
+  RenderSettings settings_;
+  // frames_in_flight as configured, settings_ holds the one in use
+  uint32_t configured_frames_in_flight_;
   GLFWwindow* window_;
+
+  // Startup steps, later any parallel cpu work
+  ThreadPool thread_pool_;
+
+  // When run() started and how long init took, for time to first frame
+  uint64_t run_start_ns_ = 0;
+  double init_ms_ = 0.0;
+  double time_to_first_frame_ms_ = 0.0;
   const uint32_t WIDTH = 800;
   const uint32_t HEIGHT = 600;
 
@@ -114,6 +134,14 @@ class VulkanApp {
   VkQueue graphics_queue_;
   VkQueue present_queue_;
 
+  // Families the queues were created from
+  QueueFamilyIndices queue_families_;
+
+  // Skinning runs on compute_queue_, static buffer uploads on
+  // transfer_queue_. Both hand buffers over to the family using them.
+  AsyncQueue compute_queue_;
+  AsyncQueue transfer_queue_;
+
   VkSwapchainKHR swap_chain_;
   std::vector<VkImage> swapchain_images_;
   VkFormat swapchain_img_format_;
@@ -122,42 +150,178 @@ class VulkanApp {
   std::vector<VkImageView> swapchain_imgviews_;
 
   // Commonly used to pass transformation matrices to vertex shader
-  VkRenderPass render_pass_;
   VkDescriptorSetLayout descriptor_layout_;
   VkPipelineLayout pipeline_layout_;
-  VkPipeline graphics_pipeline_;
-
-  // One for each image in swap chain
-  std::vector<VkFramebuffer> swapchain_frame_buffers_;
 
   VkCommandPool command_pool_;
 
-  // One for each frame buffer
+  // One for each frame in flight, re-recorded every frame
   std::vector<VkCommandBuffer> command_buffers_;
 
-  std::vector<VkSemaphore> img_available_sems_;
-  std::vector<VkSemaphore> render_finish_sems_;
-  std::vector<VkFence> inflight_fences_;   // per frame
-  std::vector<VkFence> images_in_flight_;  // per image in swap chain
-  size_t current_frame_ = 0;
+  // Timeline semaphore pacing for frames and uploads
+  FrameScheduler frame_scheduler_;
 
-  bool frame_buffer_resized_ = false;
+  // Late input sampling and latency measurement
+  FramePacer frame_pacer_;
+
+  // Timestamp queries around render pass, msaa resolve and uploads
+  GpuProfiler gpu_profiler_;
+
+  // Vertex and fragment shader invocations of the scene passes
+  PipelineStats pipeline_stats_;
 
-  std::vector<Vertex> vertices_;
-  std::vector<uint32_t> indices_;
+  // Scene draws of this frame sorted by state then depth, and the binds
+  // recording them skipped
+  RenderQueue render_queue_;
+  StateTracker state_tracker_;
 
-  VkBuffer vertex_buffer_;
-  VkDeviceMemory vertex_buffer_memory_;
+  // Policy picked with a key press, applied between frames
+  std::optional<PresentPolicy> requested_present_policy_;
 
-  VkBuffer index_buffer_;
-  VkDeviceMemory index_buffer_memory_;
+  // Cursor position of a left click, picked between frames
+  std::optional<glm::vec2> requested_pick_;
+
+  bool frame_buffer_resized_ = false;
 
+  // Frames presented so far, drives the scripted camera
+  uint64_t frame_number_ = 0;
+
+  // Time spent recording and submitting the last frame
+  double last_submit_ms_ = 0.0;
+
+  // Device memory currently allocated, by allocation
+  std::unordered_map<VkDeviceMemory, VkDeviceSize> allocation_sizes_;
+  VkDeviceSize allocated_bytes_ = 0;
+  VkDeviceSize peak_allocated_bytes_ = 0;
+
+  // Every mesh, packed into the shared vertex and index buffers below
+  MeshRegistry meshes_;
+
+  // Triangles of mesh 0, the model, in its own space. For picking.
+  Bvh model_bvh_;
+
+  // Object transforms, one child of scene_root_ per object. Skinned
+  // instances come after the static objects.
+  TransformHierarchy transforms_;
+  TransformHierarchy::NodeId scene_root_ = TransformHierarchy::NO_PARENT;
+  std::vector<TransformHierarchy::NodeId> object_nodes_;
+
+  // Bounding spheres of the static objects, value is the object
+  LooseOctree scene_index_;
+  // Static objects in this frame's frustum, in no particular order
+  std::vector<uint32_t> visible_objects_;
+  size_t frustum_cells_visited_ = 0;
+  // Mesh of each static object, a level of detail with settings_.lod
+  std::vector<uint32_t> object_meshes_;
+  // Objects get the full detail mesh while their radius covers at least
+  // this much of half the screen height, one variant down per halving
+  static constexpr float LOD_FULL_DETAIL_SIZE = 0.125f;
+
+  // Grown by doubling, sizes in bytes
+  static constexpr VkDeviceSize MIN_GEOMETRY_BUFFER_SIZE = 1 << 20;
+  VkBuffer vertex_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory vertex_buffer_memory_ = VK_NULL_HANDLE;
+  VkDeviceSize vertex_buffer_capacity_ = 0;
+
+  VkBuffer index_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory index_buffer_memory_ = VK_NULL_HANDLE;
+  VkDeviceSize index_buffer_capacity_ = 0;
+  // 16 bit until a mesh has too many vertices for it
+  VkIndexType index_type_ = VK_INDEX_TYPE_UINT16;
+
+  // Geometry buffers replaced by bigger ones while submitted frames may
+  // still read them, destroyed once the frame timeline reaches value
+  struct RetiredBuffer {
+    uint64_t value;
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+  };
+  std::vector<RetiredBuffer> retired_buffers_;
+
+  /* Vertex pulling. The meshes go into the position and attribute streams
+   * instead of vertex_buffer_, read by pull.vert through set 1 along with
+   * the skinned vertices. The set is written every frame, so buffers
+   * growing never leaves it stale.
+   */
+  VkBuffer position_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory position_buffer_memory_ = VK_NULL_HANDLE;
+  VkDeviceSize position_buffer_capacity_ = 0;
+  VkBuffer attribute_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory attribute_buffer_memory_ = VK_NULL_HANDLE;
+  VkDeviceSize attribute_buffer_capacity_ = 0;
+  VkDescriptorSetLayout vertex_stream_layout_ = VK_NULL_HANDLE;
+
+  /* Compute skinning. Bind pose, weights and indices are static. The
+   * palette and the skinned vertices are rings with one slot per frame in
+   * flight: the palette persistently mapped, the skinned vertices written
+   * on the compute queue, one copy per instance, then drawn with the
+   * graphics pipeline as a vertex buffer. A frame's skinning overlaps the
+   * previous frame's rendering.
+   */
+  SkinnedMesh skinned_mesh_;
+  std::vector<char> skinning_shader_code_;
+  std::vector<char> upscale_vert_code_;
+  std::vector<char> upscale_frag_code_;
+  VkBuffer skin_bind_pose_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory skin_bind_pose_memory_ = VK_NULL_HANDLE;
+  VkBuffer skin_weights_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory skin_weights_memory_ = VK_NULL_HANDLE;
+  VkBuffer skin_index_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory skin_index_memory_ = VK_NULL_HANDLE;
+  VkBuffer skin_palette_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory skin_palette_memory_ = VK_NULL_HANDLE;
+  glm::mat4* skin_palette_mapped_ = nullptr;
+  VkBuffer skinned_vertex_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory skinned_vertex_memory_ = VK_NULL_HANDLE;
+  VkDeviceSize skinned_slot_bytes_ = 0;
+  // Graphics released the slot back to the compute family after drawing it
+  std::vector<bool> skinned_slot_released_;
+  VkDescriptorSetLayout skinning_set_layout_ = VK_NULL_HANDLE;
+  VkDescriptorSet skinning_set_ = VK_NULL_HANDLE;
+  VkPipelineLayout skinning_pipeline_layout_ = VK_NULL_HANDLE;
+  VkPipeline skinning_pipeline_ = VK_NULL_HANDLE;
+
+  // One for each frame in flight, holding the frame's camera
   std::vector<VkBuffer> uniform_buffers_;
   std::vector<VkDeviceMemory> uniform_buffers_memory_;
 
-  VkDescriptorPool descriptor_pool_;
+  // Layouts are shared by binding signature
+  DescriptorLayoutCache descriptor_layout_cache_;
+
+  // Long lived sets, never reset
+  DescriptorAllocator descriptor_allocator_;
+
+  // Transient sets, one allocator per frame in flight reset at frame start
+  std::vector<DescriptorAllocator> frame_descriptor_allocators_;
+
+  // One for each frame in flight
   std::vector<VkDescriptorSet> descriptor_sets_;
 
+  // Decoded off the main thread during init, released once uploaded
+  struct DecodedTexture {
+    int width = 0;
+    int height = 0;
+    unsigned char* pixels = nullptr;  // stbi_load'ed, or generated's data
+    std::vector<unsigned char> generated;
+  };
+  DecodedTexture decoded_texture_;
+
+  /* Materials the scene draws with, the material part of the sort keys.
+   * Each picks a shader variant, every level has a pipeline for each
+   * distinct one.
+   */
+  static constexpr uint32_t MATERIAL_TEXTURED = 0;
+  static constexpr uint32_t MATERIAL_VERTEX_COLOR = 1;  // skinned tubes
+  std::vector<uint32_t> material_variants_;
+  ShaderVariantCache shader_variants_;
+
+  // Spir-v read once, reused when the pipeline is rebuilt
+  std::vector<char> vert_shader_code_;
+  std::vector<char> frag_shader_code_;
+  std::vector<char> depth_vert_code_;
+  // Replaces both vertex shaders when vertices are pulled
+  std::vector<char> pull_vert_code_;
+
   uint32_t texture_miplevels_;
   VkImage texture_image_;
   VkDeviceMemory texture_image_memory_;
@@ -166,16 +330,202 @@ class VulkanApp {
 
   VkSampler texture_sampler_;
 
-  VkImage depth_image_;
-  VkImageView depth_image_view_;
-  VkDeviceMemory depth_image_memory_;
-
-  VkSampleCountFlagBits msaa_samples_ = VK_SAMPLE_COUNT_1_BIT;
-
-  // Add a render target for use in msaa
-  VkImage color_image_;
-  VkDeviceMemory color_image_memory_;
-  VkImageView color_image_view_;
+  /* Everything drawing the scene with one msaa setting. Every level is
+   * built up front, and again with the swap chain, so switching levels is
+   * just drawing with another one from the next frame on.
+   *
+   * The render graph holds the passes of a frame and their render targets.
+   * The scene pass resolves (or at 1 sample draws directly) into the scene
+   * color target, the upscale pass then fills the swap chain image from
+   * it. Every target is swap chain sized, a lower render scale only draws
+   * into their top left corner so it never reallocates. Without any level
+   * below full resolution there's no upscale pass and the scene color
+   * target is the swap chain image.
+   */
+  struct RenderLevel {
+    QualityLevel quality;
+    VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+    // The whole scene, or its late phase with occlusion culling
+    VkRenderPass render_pass = VK_NULL_HANDLE;
+    // Early phase of the scene with occlusion culling, its depth is kept
+    // for the hi-z pyramid
+    VkRenderPass early_render_pass = VK_NULL_HANDLE;
+    // One per shader variant, by index in shader_variants_
+    std::vector<VkPipeline> pipelines;
+    // The same shading every sample, when the level is also drawn with
+    // sample shading. Everything else, targets included, is shared.
+    bool sample_shading = false;
+    std::vector<VkPipeline> sample_shading_pipelines;
+    // Depth only, with the depth pre-pass
+    VkPipeline depth_pipeline = VK_NULL_HANDLE;
+    RenderGraph graph;
+    RenderGraph::ResourceId msaa_color_target = 0;
+    RenderGraph::ResourceId depth_target = 0;
+    RenderGraph::ResourceId scene_color_target = 0;
+    RenderGraph::ResourceId swapchain_target = 0;
+    RenderGraph::ResourceId hiz_target = 0;
+    // One, or one per swap chain image when drawing straight into it
+    std::vector<VkFramebuffer> frame_buffers;
+    std::vector<VkFramebuffer> early_frame_buffers;
+  };
+
+  // Scene render pass variants, the culled scene is drawn in two phases
+  enum class ScenePhase { All, Early, Late };
+
+  // Cheapest first, one per msaa setting
+  std::vector<RenderLevel> render_levels_;
+  // Render level drawing each of the quality controller's levels, those
+  // only differing in render scale share one
+  std::vector<uint32_t> quality_render_levels_;
+  QualityController quality_controller_;
+  // Part of the scene targets drawn this frame
+  VkExtent2D render_extent_{};
+  // Lowest render scale allowed, and the controller's steps up to 1
+  static constexpr float MIN_RENDER_SCALE = 0.25f;
+  static constexpr float RENDER_SCALE_STEP = 0.125f;
+
+  /* Upscale and sharpen the scene color into the swap chain image. Set
+   * layout, pipeline layout and sampler live as long as the device, the
+   * rest is rebuilt with the swap chain. None of it exists unless
+   * upscaling().
+   */
+  VkDescriptorSetLayout upscale_set_layout_ = VK_NULL_HANDLE;
+  VkPipelineLayout upscale_pipeline_layout_ = VK_NULL_HANDLE;
+  VkSampler upscale_sampler_ = VK_NULL_HANDLE;
+  VkRenderPass upscale_pass_ = VK_NULL_HANDLE;
+  VkPipeline upscale_pipeline_ = VK_NULL_HANDLE;
+  // One for each image in swap chain
+  std::vector<VkFramebuffer> upscale_frame_buffers_;
+  // Frame total of the gpu profiler's "frame" scope already fed to the
+  // quality controller
+  uint64_t quality_samples_seen_ = 0;
+
+  // Swap chain image the graph is recording into
+  uint32_t frame_image_index_ = 0;
+  // Swap chain image acquireFrame() got for drawFrame()
+  uint32_t acquired_image_ = 0;
+  // The graphs are reported for the first swap chain only, resizes rebuild
+  // them with the same passes
+  bool render_graphs_reported_ = false;
+
+  /* Two phase hi-z occlusion culling of the static objects, on the gpu.
+   * Early phase: every object is tested against the hi-z pyramid of the
+   * previous frame and the visible ones are drawn. The pyramid is rebuilt
+   * from that depth (the farthest depth of each texel's footprint, msaa
+   * samples included). Late phase: objects the early test rejected are
+   * tested again against the new pyramid, anything that came into view is
+   * drawn on top. Each phase writes one indirect draw per object, hidden
+   * ones with no instances so they never reach the vertex shader.
+   */
+  bool occlusion_culling_ = false;
+  std::vector<char> cull_shader_code_;
+  std::vector<char> hiz_depth_code_;
+  std::vector<char> hiz_depth_ms_code_;
+  std::vector<char> hiz_reduce_code_;
+
+  // Same layout as CullObject in cull.comp
+  struct CullObject {
+    glm::vec4 sphere;  // world space center, radius
+    uint32_t index_count;
+    uint32_t first_index;
+    int32_t vertex_offset;
+    uint32_t pad;
+  };
+
+  /* One slot per frame in flight: the objects (mapped), an early and a
+   * late draw per object, and how many of each were drawn (mapped).
+   */
+  VkBuffer cull_object_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory cull_object_memory_ = VK_NULL_HANDLE;
+  CullObject* cull_objects_mapped_ = nullptr;
+  VkBuffer cull_draw_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory cull_draw_memory_ = VK_NULL_HANDLE;
+  VkBuffer cull_stats_buffer_ = VK_NULL_HANDLE;
+  VkDeviceMemory cull_stats_memory_ = VK_NULL_HANDLE;
+  uint32_t* cull_stats_mapped_ = nullptr;
+
+  VkDescriptorSetLayout cull_set_layout_ = VK_NULL_HANDLE;
+  VkPipelineLayout cull_pipeline_layout_ = VK_NULL_HANDLE;
+  VkPipeline cull_pipeline_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout hiz_set_layout_ = VK_NULL_HANDLE;
+  VkPipelineLayout hiz_pipeline_layout_ = VK_NULL_HANDLE;
+  // Level 0 from single sampled and from msaa depth, the levels below it
+  VkPipeline hiz_depth_pipeline_ = VK_NULL_HANDLE;
+  VkPipeline hiz_depth_ms_pipeline_ = VK_NULL_HANDLE;
+  VkPipeline hiz_reduce_pipeline_ = VK_NULL_HANDLE;
+  VkSampler hiz_sampler_ = VK_NULL_HANDLE;
+
+  /* Swap chain sized with a full mip chain, rebuilt with the swap chain.
+   * Only the top left hiz_extent_ of level 0 (and the matching part of the
+   * levels below) holds depth.
+   */
+  VkImage hiz_image_ = VK_NULL_HANDLE;
+  VkDeviceMemory hiz_memory_ = VK_NULL_HANDLE;
+  VkImageView hiz_view_ = VK_NULL_HANDLE;
+  std::vector<VkImageView> hiz_mip_views_;
+  uint32_t hiz_mips_ = 0;
+  VkExtent2D hiz_extent_{};
+  // False until a frame built the pyramid, the early phase draws everything
+  bool hiz_valid_ = false;
+
+  // Camera of this frame, for the culling shader
+  glm::mat4 view_proj_{1.0f};
+  // Objects drawn in each phase of the last finished frame
+  uint32_t cull_drawn_early_ = 0;
+  uint32_t cull_drawn_late_ = 0;
+
+  /* Clustered forward lighting. Every frame a compute pass splits the view
+   * frustum into froxels (screen tiles x exponential depth slices) and
+   * lists the lights touching each one, the fragment shader then only
+   * shades with the lights of its cluster. Lights and their lists are per
+   * frame in flight, in the scene's descriptor set (bindings 2 and 3).
+   */
+  // Same as cluster.comp and shader.frag
+  static constexpr uint32_t CLUSTERS_X = 16;
+  static constexpr uint32_t CLUSTERS_Y = 9;
+  static constexpr uint32_t CLUSTERS_Z = 24;
+  static constexpr uint32_t CLUSTER_COUNT = CLUSTERS_X*CLUSTERS_Y*CLUSTERS_Z;
+  static constexpr uint32_t MAX_CLUSTER_LIGHTS = 128;
+
+  // Same layout as the Lights buffer of the shaders, followed by the lights
+  struct LightHeader {
+    glm::mat4 inv_proj;
+    glm::uvec4 grid;   // clusters in x, y, z, light count
+    glm::vec4 tile;    // tile size in pixels, rendered width and height
+    glm::vec4 depth;   // near, far, log(far/near)
+  };
+  struct PointLight {
+    glm::vec4 position_radius;  // view space
+    glm::vec4 color;
+  };
+
+  // Where a light circles around, cpu only
+  struct LightPath {
+    glm::vec3 center;
+    float orbit;
+    float speed;
+    float phase;
+    float radius;
+    glm::vec3 color;
+  };
+  std::vector<LightPath> light_paths_;
+
+  std::vector<char> cluster_shader_code_;
+  VkPipelineLayout cluster_pipeline_layout_ = VK_NULL_HANDLE;
+  VkPipeline cluster_pipeline_ = VK_NULL_HANDLE;
+
+  // One for each frame in flight. Lights mapped, clusters gpu only.
+  std::vector<VkBuffer> light_buffers_;
+  std::vector<VkDeviceMemory> light_buffers_memory_;
+  std::vector<LightHeader*> light_buffers_mapped_;
+  std::vector<VkBuffer> cluster_buffers_;
+  std::vector<VkDeviceMemory> cluster_buffers_memory_;
+
+  // Camera of this frame, the clusters are built from its projection
+  glm::mat4 view_{1.0f};
+  glm::mat4 proj_{1.0f};
+  float near_plane_ = 0.1f;
+  float far_plane_ = 10.0f;
 
 #ifdef NDEBUG
   const bool enable_valid_layers_ = false;
@@ -186,7 +536,10 @@ class VulkanApp {
   // Initialize glfw window
   void initWindow();
 
-  // Main init function, creates instance and subobjects
+  /* Main init function, creates instance and subobjects. Steps run as an
+   * InitGraph: file loading and decoding run on workers while the device
+   * and swap chain are created.
+   */
   void initVulkan();
 
   // Main loop for drawing
@@ -295,6 +648,14 @@ class VulkanApp {
 
   void createGraphicsPipeline();
 
+  /* Shader variant of every material, for the settings in use. Lighting
+  * is compiled in only with lights.
+  */
+  void createMaterials();
+
+  // Read the spir-v the pipeline is built from.
+  void loadShaders();
+
   static std::vector<char> readFile(const std::string& filename);
 
   VkShaderModule createShaderModule(const std::vector<char>& shader_bytecode);
@@ -305,20 +666,89 @@ class VulkanApp {
    */
   void createRenderPass();
 
-  /* Wraps image views in the swap chain for rendering.
+  /* Scene render pass drawing with samples, one per quality level. The
+   * early phase clears and keeps msaa color and depth for the late phase,
+   * which loads them and resolves.
+   */
+  VkRenderPass createScenePass(VkSampleCountFlagBits samples,
+    ScenePhase phase = ScenePhase::All);
+
+  /* Wraps image views in the swap chain for rendering, and every level's
+   * scene targets.
    */
   void createFrameBuffers();
 
+  /* Whether any quality level renders below full resolution, fixed or
+   * the controller's steps. Only then is there an upscale pass, otherwise
+   * the scene is drawn straight into the swap chain image.
+   */
+  bool upscaling() const;
+  // Render scale steps of the controller below 1, 0 without a target.
+  uint32_t renderScaleSteps() const;
+
+  // Sampler and layouts of the upscale pass.
+  void createUpscaleLayout();
+
+  // Upscale render pass and pipeline, they depend on the swap chain.
+  void createUpscalePipeline();
+
   /* Handles memory used to store command buffers. Command buffers
    * are allocated by the command pool.
    */
   void createCommandPool();
 
   /* Allocate command buffers from the command pool, one for each
-   * frame buffer.
+   * frame in flight.
    */
   void createCommandBuffers();
 
+  /* Record the draw commands rendering into swap chain image img_idx.
+   * Called every frame on the current frame slot's command buffer.
+   */
+  void recordCommandBuffer(VkCommandBuffer command_buffer, uint32_t img_idx);
+
+  /* The scene render pass of level into render_extent_ of its targets,
+  * recorded by the level's render graph after it transitioned the targets.
+  */
+  void recordScenePass(VkCommandBuffer command_buffer,
+    const RenderLevel& level, ScenePhase phase = ScenePhase::All);
+
+  /* Test every static object for this phase of the frame and write its
+  * indirect draw. The early phase tests against the pyramid of the
+  * previous frame.
+  */
+  void recordCullPass(VkCommandBuffer command_buffer, uint32_t phase);
+
+  /* Build the hi-z pyramid from level's depth, render_extent_ of it.
+  */
+  void recordHiZPass(VkCommandBuffer command_buffer,
+    const RenderLevel& level);
+
+  /* Level's scene color stretched over frame_image_index_'s swap chain
+  * image.
+  */
+  void recordUpscalePass(VkCommandBuffer command_buffer,
+    const RenderLevel& level);
+
+  RenderLevel& currentRenderLevel(){
+    return render_levels_[quality_render_levels_[quality_controller_.level()]];
+  }
+
+  // Swap chain extent times scale, at least a pixel.
+  VkExtent2D scaledExtent(float scale) const;
+
+  /* Feed the gpu time of the last finished frame to the quality controller.
+  * A new level takes effect with the frame recorded next.
+  */
+  void updateQualityLevel();
+
+  /* First half of a frame: waits for the frame slot, acquires a swap chain
+   * image and sleeps until the input deadline. The loops poll input between
+   * this and drawFrame(). False when the swap chain was out of date and got
+   * recreated instead, then there is nothing to draw.
+   */
+  bool acquireFrame();
+
   /*
    * Uses everything above to draw something on screen.
    * Acquire image from swapchain,
@@ -332,12 +762,25 @@ class VulkanApp {
    */
   void drawFrame();
 
-  /* Initialize semaphores and fences for synchronizing drawing.
-   * Semaphores for gpu-gpu synchronization
-   * Fences for cpu-gpu sync
+  /* Initialize the timeline semaphore used for all cpu-gpu sync, and the
+   * binary semaphores the swap chain needs for gpu-gpu sync.
    */
   void createSyncObjects();
 
+  /* Timestamp and pipeline statistics query pools, one per frame in
+   * flight. Each does nothing when the device doesn't support it.
+   */
+  void createGpuProfiler();
+
+  /* Change the number of frames in flight at runtime. Rebuilds the per
+   * frame uniform buffers, descriptor sets and command buffers.
+   */
+  void setFramesInFlight(uint32_t frames_in_flight);
+
+  /* Destroy resources there is one of per frame in flight.
+   */
+  void cleanUpFrameResources();
+
   /*
    * Before recreating the swap chain, clean up current resources like
    * swapchain images, frame buffers, etc.
@@ -353,9 +796,56 @@ class VulkanApp {
                                         int height);
 
   /*
-   * Create vertex buffer, allocating memory for it and such.
+   * F1: low latency, F2: power saving fifo, F3: fifo relaxed
    */
-  void createVertexBuffer();
+  static void keyCallback(GLFWwindow* window, int key, int scancode,
+                          int action, int mods);
+
+  /*
+   * Left click: pick the model under the cursor
+   */
+  static void mouseButtonCallback(GLFWwindow* window, int button, int action,
+                                  int mods);
+
+  /* Cast a ray from the camera through the cursor (window coordinates)
+   * into every object showing the model, print the closest hit.
+   */
+  void pick(const glm::vec2& cursor);
+
+  /* Switch present mode, swap chain image count and frames in flight.
+   */
+  void applyPresentPolicy(PresentPolicy policy);
+
+  /*
+   * Copy meshes added to the registry since the last call into the shared
+   * vertex and index buffers, growing them if they're full.
+   */
+  void uploadMeshes();
+
+  /* Make buffer hold at least required bytes. A bigger buffer replaces it,
+   * keeping the first used bytes.
+   */
+  void growGeometryBuffer(VkBuffer& buffer, VkDeviceMemory& memory,
+    VkDeviceSize& capacity, VkDeviceSize required, VkDeviceSize used,
+    VkBufferUsageFlags usage);
+
+  // Destroy buffer once everything submitted so far is done
+  void retireBuffer(VkBuffer buffer, VkDeviceMemory memory);
+  // Destroy the retired buffers the timeline has passed
+  void destroyRetiredBuffers(uint64_t completed_value);
+
+  /* Turn the uploaded 16 bit indices into 32 bit ones, in a new buffer.
+   * Read back and widened on the cpu, only ever happens once.
+   */
+  void widenIndexBuffer();
+
+  // Set 1 of the scene pipelines when vertices are pulled, this frame only
+  VkDescriptorSet vertexStreamSet();
+
+  // Where the scene's vertex shader reads vertices: vertex input, or the
+  // shader itself when pulling
+  VkPipelineStageFlags vertexReadStage() const;
+  VkAccessFlags vertexReadAccess() const;
 
   /* Gpus have different memory types with different performance, allowed
    * operations. Find the memory type that is available and suits our needs
@@ -363,25 +853,70 @@ class VulkanApp {
   uint32_t findMemoryType(uint32_t type_filter,
                           VkMemoryPropertyFlags properties);
 
+  /* vkAllocateMemory and vkFreeMemory, keeping track of how much device
+   * memory is in use.
+   */
+  VkResult allocateMemory(const VkMemoryAllocateInfo& alloc_info,
+    VkDeviceMemory& memory);
+  void freeMemory(VkDeviceMemory memory);
+
   /* Helper function to create buffers
    */
   void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage_flags,
                     VkMemoryPropertyFlags mem_prop_flags, VkBuffer& buffer,
                     VkDeviceMemory& buffer_memory);
 
-  void copyBuffer(VkBuffer src_buff, VkBuffer dst_buff, VkDeviceSize size);
+  void copyBuffer(VkBuffer src_buff, VkBuffer dst_buff, VkDeviceSize size,
+    VkDeviceSize src_offset = 0, VkDeviceSize dst_offset = 0);
 
-  /* Create the index buffer that indicates which vertices to use
-   * from the vertex buffer and in what order.
+  /* Device local buffer filled with data through a staging buffer, copied
+   * on the transfer queue and handed over to consumer (the graphics queue
+   * when null). TRANSFER_DST is added to usage.
    */
-  void createIndexBuffer();
+  void createDeviceLocalBuffer(const void* data, VkDeviceSize size,
+    VkBufferUsageFlags usage, VkBuffer& buffer, VkDeviceMemory& memory,
+    AsyncQueue* consumer = nullptr);
+
+  /* Build the skinned tube, cpu only. Does nothing without skinned
+  * instances.
+  */
+  void createSkinnedMesh();
+
+  // Tessellation of the skinned tube
+  static constexpr uint32_t SKINNED_RINGS_PER_JOINT = 4;
+  static constexpr uint32_t SKINNED_SEGMENTS = 16;
+
+  /* Upload the skinned mesh, create the rings and the compute pipeline.
+  */
+  void createSkinningResources();
+
+  /* Palette and skinned vertex rings with a slot per frame in flight,
+  * (re)written into the skinning descriptor set.
+  */
+  void createSkinFrameResources();
+  void destroySkinFrameResources();
+
+  void cleanUpSkinning();
+
+  /* Pose every skinned instance into this frame slot of the palette ring.
+  */
+  void updateSkinPalette(uint32_t frame);
+
+  /* Skin every instance into this frame's slot on the compute queue.
+  * Returns the compute timeline value the frame's draws wait for, 0 when
+  * there's nothing to skin.
+  */
+  uint64_t submitSkinning(uint32_t frame);
+
+  // Seconds the scene has been animating, frame based with scripted camera
+  float animationTime() const;
 
   /* Create details about descriptor layout used in shaders
    * Descriptor sets is how we pass global information to shaders
    */
   void createDescriptorSetLayout();
 
-  /* Create uniform buffers, 1 for each swap chain image.
+  /* Create uniform buffers, 1 for each frame in flight.
    */
   void createUniformBuffers();
 
@@ -389,10 +924,25 @@ class VulkanApp {
   */
   void updateUniformBuffer(uint32_t uniform_buffer_idx);
 
-  void createDescriptorPool();
+  /* Set up descriptor allocators. Pools are created on demand and grow as
+  * more sets are allocated, they aren't tied to the swap chain image count.
+  */
+  void createDescriptorAllocators();
 
   void createDescriptorSets();
 
+  /* Allocate a set that is only valid for the current frame. Recycled in
+  * bulk when this frame slot comes around again.
+  */
+  VkDescriptorSet allocateFrameDescriptorSet(VkDescriptorSetLayout layout);
+
+  /* Decode the texture file (or generate one) into decoded_texture_, cpu
+  * only.
+  */
+  void decodeTexture();
+
+  /* Upload decoded_texture_ and generate its mipmaps.
+  */
   void createTextureImage();
 
   void createImage(uint32_t width, uint32_t height, VkFormat format,
@@ -400,17 +950,19 @@ class VulkanApp {
   VkMemoryPropertyFlags properties, VkImage &image, VkDeviceMemory &image_mem,
     uint32_t miplevels, VkSampleCountFlagBits msaa_samples);
 
-  /* Start a command buffer
+  /* Start a command buffer, label names it in the gpu profiler.
   */
-  VkCommandBuffer beginSingleTimeCommands();
+  VkCommandBuffer beginSingleTimeCommands(const char* label = "upload");
   /* End recording of a single time command buffer
   */
-  void endSingleTimeCommands(VkCommandBuffer command_buffer);
+  void endSingleTimeCommands(VkCommandBuffer command_buffer,
+    const std::vector<QueueWait>& waits = {});
 
-  /* Handle image layout transitions
+  /* Handle image layout transitions, the barrier follows from how the image
+  * was and will be used.
   */
   void transitionImageLayout(VkImage image, VkFormat format, 
-    VkImageLayout old_layout, VkImageLayout new_layout, uint32_t miplevels);
+    ImageUsage old_usage, ImageUsage new_usage, uint32_t miplevels);
 
   void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width,
     uint32_t height);
@@ -426,10 +978,6 @@ class VulkanApp {
 
   void createTextureSampler();
 
-  /* Depth buffer
-  */
-  void createDepthResources();
-
   /* Find supported image formats
   * Format depends on tiling mode and usage.
   */
@@ -444,10 +992,69 @@ class VulkanApp {
   */
   bool hasStencilComponent(VkFormat format);
 
-  /* Load obj model with tinyobjloader
+  /* Load obj model with tinyobjloader, or generate a sphere when the
+  * settings ask for a triangle count, and register it in meshes_. Extra
+  * sphere meshes are registered for mesh_variants > 1.
   */
   void loadModel();
 
+  // Vertices of MODEL_PATH, deduplicated
+  void loadObj(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+
+  /* MODEL_PATH encoded. Read from the encoded copy next to it, unless the
+  * obj is newer, otherwise parsed and encoded and the copy (re)written.
+  */
+  EncodedGeometry loadModelGeometry();
+
+  /* model_bvh_ over geometry. Read from the copy next to MODEL_PATH's
+  * encoded copy unless that's newer, otherwise built and written.
+  */
+  void loadModelBvh(const EncodedGeometry& geometry);
+
+  /* MODEL_PATH parsed again for when its encoded copy fails to decode, and
+  * the copy rewritten. The mesh was registered with geometry's counts,
+  * throws if the obj has changed since.
+  */
+  void reloadModelObj(const EncodedGeometry& geometry,
+    std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+  void buildModelBvh(const std::vector<Vertex>& vertices,
+    const std::vector<uint32_t>& indices);
+
+  // Starting size of the extra sphere meshes when the main one is an obj
+  static constexpr uint32_t DEFAULT_VARIANT_TRIANGLES = 20000;
+
+  /* Uv sphere with about triangle_count triangles.
+  */
+  void createProceduralMesh(uint32_t triangle_count,
+    std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+
+  /* Where object idx of the grid sits, and how far the camera has to back
+  * off to see the whole grid.
+  */
+  glm::vec3 objectPosition(uint32_t idx) const;
+  float sceneScale() const;
+
+  // Static objects plus skinned instances
+  uint32_t sceneObjectCount() const {
+    return settings_.object_count + settings_.skinned_instances;
+  }
+
+  // Transform node of every object, placed on the grid.
+  void createScene();
+
+  /* scene_index_ over the static objects, with spheres around their
+  * origin holding any rotation of any mesh, so they never move in it.
+  */
+  void createSceneIndex();
+
+  /* This frame's visible_objects_ from scene_index_, and with settings_.lod
+  * each one's mesh by its size on screen.
+  */
+  void updateVisibility();
+
+  // Spin the objects and bring their world matrices up to date.
+  void updateTransforms();
+
   /* Generate mipmap using Blit (transfer operations and img mem barrier)
   * Requires linear filtering interpolation. GPU needs to support that format.
   */
@@ -459,9 +1066,72 @@ class VulkanApp {
   */
   VkSampleCountFlagBits getMaxUsableSampleCount();
 
-  /* Create msaa color buffer
+  /* Sample count from the settings, clamped to what the device supports.
+  */
+  VkSampleCountFlagBits chooseSampleCount();
+
+  /* Quality levels the device supports. Just chooseSampleCount() at the
+  * set render scale unless there's a target frame time. Then render scales
+  * below 1 without msaa, every sample count up to 8 and 8x with sample
+  * shading, starting at chooseSampleCount(). Sample shading draws into the
+  * top msaa level's targets.
+  */
+  void createQualityLevels();
+
+  /* Msaa color, depth and scene color targets and the passes using them,
+  * compiled into every level's render graph. Prints what aliasing saved
+  * the first time.
+  */
+  void createRenderGraph();
+
+  /* Whether the device can do occlusion culling with every quality level:
+  * depth without stencil that can be sampled at every sample count.
+  */
+  bool supportsOcclusionCulling();
+
+  /* Culling and hi-z pipelines, and the buffers. Does nothing without
+  * occlusion culling.
+  */
+  void createCullResources();
+
+  // Object, draw and stats rings with a slot per frame in flight.
+  void createCullFrameResources();
+  void destroyCullFrameResources();
+
+  void cleanUpCulling();
+
+  // The hi-z pyramid image and a view of every level, swap chain sized.
+  void createHiZImage();
+  void destroyHiZImage();
+
+  // Bounding spheres of this frame's objects into their slot.
+  void updateCullObjects(uint32_t frame);
+
+  /* Random lights wandering over the object grid, cpu only. Does nothing
+  * without lights.
+  */
+  void createLights();
+
+  /* Light and cluster buffers, 1 for each frame in flight. Created even
+  * without lights, the scene's descriptor sets point at them.
+  */
+  void createLightBuffers();
+
+  /* Compute pipeline binning the lights into clusters. Does nothing
+  * without lights.
+  */
+  void createClusterPipeline();
+
+  // Every object's draw, sorted into render_queue_.
+  void updateRenderQueue();
+
+  // This frame's lights, moved to view space, into their slot.
+  void updateLights(uint32_t frame);
+
+  /* Rebuild the cluster light lists of this frame for render_extent_, read
+  * by the scene's fragment shader.
   */
-  void createColorResources();
+  void recordLightBinning(VkCommandBuffer command_buffer);
 
 };
 
@@ -1,2 +1,19 @@
-/home/user/VulkanSDK/1.2.162.0/Bin32/glslc.exe shader.vert -o vert.spv
-/home/user/VulkanSDK/1.2.162.0/Bin32/glslc.exe shader.frag -o frag.spv
\ No newline at end of file
+#!/bin/sh
+# Compiles every shader into shader/, wherever this is run from. glslc
+# comes from $VULKAN_SDK/bin when that is set, otherwise from the PATH.
+set -e
+cd "$(dirname "$0")/shader"
+GLSLC="${VULKAN_SDK:+$VULKAN_SDK/bin/}glslc"
+
+"$GLSLC" shader.vert -o vert.spv
+"$GLSLC" shader.frag -o frag.spv
+"$GLSLC" skinning.comp -o skinning.spv
+"$GLSLC" upscale.vert -o upscale_vert.spv
+"$GLSLC" upscale.frag -o upscale_frag.spv
+"$GLSLC" hiz_depth.comp -o hiz_depth.spv
+"$GLSLC" -DMSAA hiz_depth.comp -o hiz_depth_ms.spv
+"$GLSLC" hiz_reduce.comp -o hiz_reduce.spv
+"$GLSLC" cull.comp -o cull.spv
+"$GLSLC" depth.vert -o depth_vert.spv
+"$GLSLC" cluster.comp -o cluster.spv
+"$GLSLC" pull.vert -o pull_vert.spv
@@ -1,11 +1,146 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 
 #include "VulkanApp.h"
 
-int main() {
-  va::VulkanApp app;
+namespace {
+int runBenchmarks(const va::RenderSettings& base, uint32_t frames,
+                  const std::string& output_path) {
+  std::vector<va::BenchmarkResult> results;
 
+  for (const auto& config : va::defaultBenchmarkSuite(base, frames)) {
+    std::cout << "Benchmark " << config.name << std::endl;
+
+    // Fresh app for every run so nothing carries over between them
+    va::VulkanApp app(config.settings);
+    auto result = app.runBenchmark(config.warmup_frames,
+                                   config.measured_frames);
+    result.config = config;
+    results.push_back(std::move(result));
+  }
+
+  va::writeBenchmarkJson(output_path, results);
+  std::cout << "Benchmark results written to " << output_path << std::endl;
+  return EXIT_SUCCESS;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  va::RenderSettings settings;
+  std::string benchmark_path;
+  uint32_t benchmark_frames = 600;
+  size_t transform_bench_nodes = 0;
+  uint32_t bvh_bench_triangles = 0;
+
+  // Numbers go through stoul/stof, which throw on anything else
+  int i = 1;
   try {
+    for (; i < argc; ++i) {
+      if (std::strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc) {
+        settings.frames_in_flight =
+            static_cast<uint32_t>(std::stoul(argv[++i]));
+      } else if (std::strcmp(argv[i], "--present-policy") == 0 &&
+                 i + 1 < argc) {
+        std::string policy = argv[++i];
+        if (policy == "low-latency")
+          settings.present_policy = va::PresentPolicy::LowLatency;
+        else if (policy == "fifo")
+          settings.present_policy = va::PresentPolicy::PowerSaving;
+        else if (policy == "fifo-relaxed")
+          settings.present_policy = va::PresentPolicy::FifoRelaxed;
+        else
+          std::cerr << "Unknown present policy " << policy << std::endl;
+      } else if (std::strcmp(argv[i], "--no-late-input") == 0) {
+        settings.late_input_sampling = false;
+      } else if (std::strcmp(argv[i], "--gpu-trace") == 0 && i + 1 < argc) {
+        settings.gpu_trace_path = argv[++i];
+      } else if (std::strcmp(argv[i], "--cpu-trace") == 0 && i + 1 < argc) {
+        settings.cpu_trace_path = argv[++i];
+      } else if (std::strcmp(argv[i], "--capture-spikes") == 0 &&
+                 i + 1 < argc) {
+        settings.spike_trace_prefix = argv[++i];
+      } else if (std::strcmp(argv[i], "--spike-threshold") == 0 &&
+                 i + 1 < argc) {
+        settings.spike_threshold_ms = std::stod(argv[++i]);
+      } else if (std::strcmp(argv[i], "--objects") == 0 && i + 1 < argc) {
+        settings.object_count = static_cast<uint32_t>(std::stoul(argv[++i]));
+      } else if (std::strcmp(argv[i], "--triangles") == 0 && i + 1 < argc) {
+        settings.mesh_triangles = static_cast<uint32_t>(std::stoul(argv[++i]));
+      } else if (std::strcmp(argv[i], "--mesh-variants") == 0 && i + 1 < argc) {
+        settings.mesh_variants = std::max(1u,
+          static_cast<uint32_t>(std::stoul(argv[++i])));
+      } else if (std::strcmp(argv[i], "--skinned") == 0 && i + 1 < argc) {
+        settings.skinned_instances =
+            static_cast<uint32_t>(std::stoul(argv[++i]));
+      } else if (std::strcmp(argv[i], "--skinned-joints") == 0 &&
+                 i + 1 < argc) {
+        settings.skinned_joints = static_cast<uint32_t>(std::stoul(argv[++i]));
+      } else if (std::strcmp(argv[i], "--no-async-compute") == 0) {
+        settings.async_compute = false;
+      } else if (std::strcmp(argv[i], "--texture-size") == 0 && i + 1 < argc) {
+        settings.texture_size = static_cast<uint32_t>(std::stoul(argv[++i]));
+      } else if (std::strcmp(argv[i], "--msaa") == 0 && i + 1 < argc) {
+        settings.msaa_samples = static_cast<uint32_t>(std::stoul(argv[++i]));
+      } else if (std::strcmp(argv[i], "--no-lazy-attachments") == 0) {
+        settings.lazy_attachments = false;
+      } else if (std::strcmp(argv[i], "--target-fps") == 0 && i + 1 < argc) {
+        double fps = std::stod(argv[++i]);
+        settings.target_frame_ms = fps > 0.0 ? 1000.0 / fps : 0.0;
+      } else if (std::strcmp(argv[i], "--render-scale") == 0 && i + 1 < argc) {
+        settings.render_scale = std::stof(argv[++i]);
+      } else if (std::strcmp(argv[i], "--min-render-scale") == 0 &&
+                 i + 1 < argc) {
+        settings.min_render_scale = std::stof(argv[++i]);
+      } else if (std::strcmp(argv[i], "--sharpness") == 0 && i + 1 < argc) {
+        settings.upscale_sharpness = std::stof(argv[++i]);
+      } else if (std::strcmp(argv[i], "--occlusion-culling") == 0) {
+        settings.occlusion_culling = true;
+      } else if (std::strcmp(argv[i], "--depth-prepass") == 0) {
+        settings.depth_prepass = true;
+      } else if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc) {
+        settings.light_count = static_cast<uint32_t>(std::stoul(argv[++i]));
+      } else if (std::strcmp(argv[i], "--vertex-pulling") == 0) {
+        settings.vertex_pulling = true;
+      } else if (std::strcmp(argv[i], "--lod") == 0) {
+        settings.lod = true;
+      } else if (std::strcmp(argv[i], "--serial-init") == 0) {
+        settings.parallel_init = false;
+      } else if (std::strcmp(argv[i], "--scripted-camera") == 0) {
+        settings.scripted_camera = true;
+      } else if (std::strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc) {
+        benchmark_path = argv[++i];
+      } else if (std::strcmp(argv[i], "--benchmark-frames") == 0 &&
+                 i + 1 < argc) {
+        benchmark_frames = static_cast<uint32_t>(std::stoul(argv[++i]));
+      } else if (std::strcmp(argv[i], "--transform-bench") == 0 &&
+                 i + 1 < argc) {
+        transform_bench_nodes = std::stoul(argv[++i]);
+      } else if (std::strcmp(argv[i], "--bvh-bench") == 0 && i + 1 < argc) {
+        bvh_bench_triangles = static_cast<uint32_t>(std::stoul(argv[++i]));
+      }
+    }
+  } catch (const std::logic_error&) {
+    std::cerr << "Invalid value for " << argv[i - 1] << ": " << argv[i]
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    if (transform_bench_nodes > 0) {
+      std::cout << va::benchmarkTransforms(transform_bench_nodes, 100);
+      return EXIT_SUCCESS;
+    }
+    if (bvh_bench_triangles > 0) {
+      std::cout << va::benchmarkBvh(bvh_bench_triangles, 1000000);
+      return EXIT_SUCCESS;
+    }
+    if (!benchmark_path.empty())
+      return runBenchmarks(settings, benchmark_frames, benchmark_path);
+
+    va::VulkanApp app(settings);
     app.run();
   } catch (const std::exception& e) {
     std::cerr << e.what() << std::endl;
@@ -0,0 +1,23 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Depth pre-pass, position only. Must compute gl_Position exactly like
+// shader.vert, the main pass then tests for equal depth.
+layout(location=0) in vec3 in_position;
+
+layout(binding=0) uniform UniformBufferObject{
+  mat4 view;
+  mat4 proj;
+} ubo;
+
+// Per draw, same layout as va::DrawConstants
+layout(push_constant) uniform DrawConstants{
+  mat4 model;
+  uint material;
+} draw;
+
+invariant gl_Position;
+
+void main(){
+  gl_Position = ubo.proj*ubo.view*draw.model*vec4(in_position, 1.0);
+}
@@ -0,0 +1,91 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Vertex pulling: no vertex input, vertices are fetched from storage
+// buffers by gl_VertexIndex (vertex offset included) in whichever format
+// the draw says. One pipeline for every mesh format, same outputs as
+// shader.vert.
+
+layout(location=0) out vec3 fragColor;
+layout(location=1) out vec2 frag_tex_coord;
+layout(location=2) out vec3 frag_view_pos;
+layout(location=3) out vec3 frag_view_normal;
+
+layout(binding=0) uniform UniformBufferObject{
+  mat4 view;
+  mat4 proj;
+} ubo;
+
+// va::VertexFormat
+const uint FORMAT_INTERLEAVED = 0;
+const uint FORMAT_COMPRESSED = 1;
+
+// Compressed, same layout as va::VertexStreams
+layout(std430, set=1, binding=0) readonly buffer Positions{
+  float positions[];
+};
+layout(std430, set=1, binding=1) readonly buffer Attributes{
+  uint attributes[];  // color, tex coord, normal
+};
+// Interleaved, same layout as va::Vertex
+const uint VERTEX_FLOATS = 11;
+layout(std430, set=1, binding=2) readonly buffer Interleaved{
+  float interleaved[];
+};
+
+// Per draw, same layout as va::DrawConstants
+layout(push_constant) uniform DrawConstants{
+  mat4 model;
+  uint material;
+  uint vertex_format;
+  uint vertex_base;  // in floats, where the draw's interleaved data starts
+} draw;
+
+// Depth pre-pass, only the position is fetched
+layout(constant_id=0) const bool POSITION_ONLY = false;
+
+// Same depth in the pre-pass and the main pass, bit for bit
+invariant gl_Position;
+
+vec3 octahedralNormal(uint packed){
+  vec2 e = unpackSnorm2x16(packed);
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  float t = max(-n.z, 0.0);
+  n.x += n.x >= 0.0 ? -t : t;
+  n.y += n.y >= 0.0 ? -t : t;
+  return normalize(n);
+}
+
+void main(){
+  uint v = uint(gl_VertexIndex);
+  bool compressed = draw.vertex_format == FORMAT_COMPRESSED;
+  uint base = draw.vertex_base + v*VERTEX_FLOATS;
+
+  vec3 position = compressed
+    ? vec3(positions[3*v], positions[3*v + 1], positions[3*v + 2])
+    : vec3(interleaved[base], interleaved[base + 1], interleaved[base + 2]);
+  gl_Position = ubo.proj*ubo.view*draw.model*vec4(position, 1.0);
+  if(POSITION_ONLY) return;
+
+  vec3 color;
+  vec2 tex_coord;
+  vec3 normal;
+  if(compressed){
+    color = unpackUnorm4x8(attributes[3*v]).rgb;
+    tex_coord = unpackHalf2x16(attributes[3*v + 1]);
+    normal = octahedralNormal(attributes[3*v + 2]);
+  }else{
+    color = vec3(interleaved[base + 3], interleaved[base + 4],
+      interleaved[base + 5]);
+    tex_coord = vec2(interleaved[base + 6], interleaved[base + 7]);
+    normal = vec3(interleaved[base + 8], interleaved[base + 9],
+      interleaved[base + 10]);
+  }
+
+  vec4 view_pos = ubo.view*draw.model*vec4(position, 1.0);
+  fragColor = color;
+  frag_tex_coord = tex_coord;
+  frag_view_pos = view_pos.xyz;
+  // Objects are only rotated and moved, no inverse transpose needed
+  frag_view_normal = mat3(ubo.view*draw.model)*normal;
+}
@@ -4,9 +4,72 @@
 layout(location=0) out vec4 outColor;
 layout(location=0) in vec3 fragColor;
 layout(location=1) in vec2 frag_tex_coord;
+layout(location=2) in vec3 frag_view_pos;
+layout(location=3) in vec3 frag_view_normal;
 
 layout(binding=1) uniform sampler2D tex_sampler;
 
+// Features of the variant, set by va::ShaderSpecialization. Branches on
+// them are resolved when the pipeline is compiled.
+layout(constant_id=0) const bool USE_TEXTURE = true;
+layout(constant_id=1) const bool LIGHTING = false;
+
+// Same as cluster.comp
+const uint CLUSTERS_X = 16;
+const uint CLUSTERS_Y = 9;
+const uint CLUSTERS_Z = 24;
+const uint CLUSTER_COUNT = CLUSTERS_X*CLUSTERS_Y*CLUSTERS_Z;
+const uint MAX_CLUSTER_LIGHTS = 128;
+
+const float AMBIENT = 0.1;
+
+struct PointLight {
+  vec4 position_radius;  // view space
+  vec4 color;
+};
+
+layout(std430, binding=2) readonly buffer Lights {
+  mat4 inv_proj;
+  uvec4 grid;        // clusters in x, y, z, light count
+  vec4 tile;         // tile size in pixels, rendered width and height
+  vec4 depth;        // near, far, log(far/near)
+  PointLight lights[];
+};
+
+layout(std430, binding=3) readonly buffer Clusters {
+  uint cluster_light_count[CLUSTER_COUNT];
+  uint cluster_lights[];  // MAX_CLUSTER_LIGHTS per cluster
+};
+
 void main(){
-  outColor = texture(tex_sampler, frag_tex_coord);
-}
\ No newline at end of file
+  vec4 albedo = USE_TEXTURE ? texture(tex_sampler, frag_tex_coord)
+    : vec4(fragColor, 1.0);
+
+  // Unlit, the color as is
+  if(!LIGHTING){
+    outColor = albedo;
+    return;
+  }
+
+  // Tile from the pixel, slice from the view depth on the same exponential
+  // scale the clusters were built with
+  uvec2 xy = min(uvec2(gl_FragCoord.xy/tile.xy),
+    uvec2(CLUSTERS_X-1, CLUSTERS_Y-1));
+  float z = max(-frag_view_pos.z, depth.x);
+  uint slice = min(uint(log(z/depth.x)/depth.z*CLUSTERS_Z), CLUSTERS_Z-1);
+  uint cluster = xy.x + CLUSTERS_X*(xy.y + CLUSTERS_Y*slice);
+
+  vec3 n = normalize(frag_view_normal);
+  vec3 light = vec3(AMBIENT);
+  uint count = cluster_light_count[cluster];
+  for(uint i = 0; i < count; ++i){
+    PointLight l = lights[cluster_lights[cluster*MAX_CLUSTER_LIGHTS + i]];
+    vec3 to_light = l.position_radius.xyz - frag_view_pos;
+    float dist = length(to_light);
+    // Smooth falloff reaching 0 at the radius the light was binned with
+    float falloff = clamp(1.0 - dist/l.position_radius.w, 0.0, 1.0);
+    light += l.color.rgb*max(dot(n, to_light/max(dist, 1e-4)), 0.0)
+      *falloff*falloff;
+  }
+  outColor = vec4(albedo.rgb*light, albedo.a);
+}
@@ -4,18 +4,34 @@
 layout(location=0) in vec3 in_position;
 layout(location=1) in vec3 in_color;
 layout(location=2) in vec2 in_tex_coord;
+layout(location=3) in vec3 in_normal;
 
 layout(location=0) out vec3 fragColor;
 layout(location=1) out vec2 frag_tex_coord;
+// View space, lights are binned in view space
+layout(location=2) out vec3 frag_view_pos;
+layout(location=3) out vec3 frag_view_normal;
 
 layout(binding=0) uniform UniformBufferObject{
-  mat4 model;
   mat4 view;
   mat4 proj;
 } ubo;
 
+// Per draw, same layout as va::DrawConstants
+layout(push_constant) uniform DrawConstants{
+  mat4 model;
+  uint material;
+} draw;
+
+// Same depth as depth.vert's pre-pass, bit for bit
+invariant gl_Position;
+
 void main(){
-  gl_Position = ubo.proj*ubo.view*ubo.model*vec4(in_position, 1.0);
+  vec4 view_pos = ubo.view*draw.model*vec4(in_position, 1.0);
+  gl_Position = ubo.proj*ubo.view*draw.model*vec4(in_position, 1.0);
   fragColor = in_color;
   frag_tex_coord = in_tex_coord;
+  frag_view_pos = view_pos.xyz;
+  // Objects are only rotated and moved, no inverse transpose needed
+  frag_view_normal = mat3(ubo.view*draw.model)*in_normal;
 }
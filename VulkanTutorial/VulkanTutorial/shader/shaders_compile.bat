@@ -1,3 +1,14 @@
-C:/VulkanSDK/1.2.162.0/Bin32/glslc.exe shader.vert -o vert.spv
-C:/VulkanSDK/1.2.162.0/Bin32/glslc.exe shader.frag -o frag.spv
+cd /d "%~dp0"
+"%VULKAN_SDK%\Bin\glslc.exe" shader.vert -o vert.spv
+"%VULKAN_SDK%\Bin\glslc.exe" shader.frag -o frag.spv
+"%VULKAN_SDK%\Bin\glslc.exe" skinning.comp -o skinning.spv
+"%VULKAN_SDK%\Bin\glslc.exe" upscale.vert -o upscale_vert.spv
+"%VULKAN_SDK%\Bin\glslc.exe" upscale.frag -o upscale_frag.spv
+"%VULKAN_SDK%\Bin\glslc.exe" hiz_depth.comp -o hiz_depth.spv
+"%VULKAN_SDK%\Bin\glslc.exe" -DMSAA hiz_depth.comp -o hiz_depth_ms.spv
+"%VULKAN_SDK%\Bin\glslc.exe" hiz_reduce.comp -o hiz_reduce.spv
+"%VULKAN_SDK%\Bin\glslc.exe" cull.comp -o cull.spv
+"%VULKAN_SDK%\Bin\glslc.exe" depth.vert -o depth_vert.spv
+"%VULKAN_SDK%\Bin\glslc.exe" cluster.comp -o cluster.spv
+"%VULKAN_SDK%\Bin\glslc.exe" pull.vert -o pull_vert.spv
 pause
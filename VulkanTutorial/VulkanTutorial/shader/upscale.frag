@@ -0,0 +1,37 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(location=0) out vec4 outColor;
+layout(location=0) in vec2 frag_uv;
+
+// Scene rendered at reduced resolution into the top left of the image
+layout(binding=0) uniform sampler2D scene;
+
+layout(push_constant) uniform Upscale{
+  vec2 uv_scale;    // rendered part of the scene image, in uv
+  vec2 texel;       // one scene texel, in uv
+  float sharpness;  // 0 is plain bilinear
+} pc;
+
+// Texels outside the rendered part are stale, never filter them in
+vec3 fetch(vec2 uv){
+  uv = clamp(uv, 0.5*pc.texel, pc.uv_scale - 0.5*pc.texel);
+  return texture(scene, uv).rgb;
+}
+
+void main(){
+  vec2 uv = frag_uv*pc.uv_scale;
+  vec3 center = fetch(uv);
+  vec3 north = fetch(uv - vec2(0.0, pc.texel.y));
+  vec3 south = fetch(uv + vec2(0.0, pc.texel.y));
+  vec3 west = fetch(uv - vec2(pc.texel.x, 0.0));
+  vec3 east = fetch(uv + vec2(pc.texel.x, 0.0));
+
+  // Unsharp mask against the neighbours, limited to their range so edges
+  // don't ring
+  vec3 blurred = 0.25*(north + south + west + east);
+  vec3 sharpened = center + pc.sharpness*(center - blurred);
+  vec3 lo = min(center, min(min(north, south), min(west, east)));
+  vec3 hi = max(center, max(max(north, south), max(west, east)));
+  outColor = vec4(clamp(sharpened, lo, hi), 1.0);
+}
@@ -0,0 +1,11 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// 0..1 across the screen
+layout(location=0) out vec2 frag_uv;
+
+void main(){
+  // One triangle covering the screen, no vertex buffer
+  frag_uv = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+  gl_Position = vec4(frag_uv*2.0 - 1.0, 0.0, 1.0);
+}